@@ -0,0 +1,29 @@
+//
+//  helpers.hpp
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for VoodooI2C's Dependencies/helpers.hpp, the power states and naming helper its drivers share.
+//
+
+#ifndef Shim_helpers_hpp
+#define Shim_helpers_hpp
+
+#include <IOKit/IOService.h>
+
+typedef enum {
+    kVoodooI2CStateOff = 0,
+    kVoodooI2CStateOn = 1
+} VoodooI2CState;
+
+#define kVoodooI2CIOPMNumberPowerStates 2
+
+[[maybe_unused]] static IOPMPowerState VoodooI2CIOPMPowerStates[kVoodooI2CIOPMNumberPowerStates] = {
+    {kIOPMPowerStateVersion1, kIOPMPowerOff, kIOPMPowerOff, kIOPMPowerOff, 0, 0, 0, 0, 0, 0, 0, 0},
+    {kIOPMPowerStateVersion1, kIOPMPowerOn | kIOPMDeviceUsable, kIOPMPowerOn, kIOPMPowerOn, 0, 0, 0, 0, 0, 0, 0, 0}
+};
+
+static inline const char* getMatchedName(IOService* provider) {
+    return provider->getName();
+}
+
+#endif /* Shim_helpers_hpp */
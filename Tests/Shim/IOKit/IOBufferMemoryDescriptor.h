@@ -0,0 +1,65 @@
+//
+//  IOBufferMemoryDescriptor.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOBufferMemoryDescriptor>. The buffer comes from <IOMalloc> so that it is counted like any other
+//  allocation.
+//
+
+#ifndef Shim_IOBufferMemoryDescriptor_h
+#define Shim_IOBufferMemoryDescriptor_h
+
+#include <IOKit/IOMemoryDescriptor.h>
+
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor {
+ public:
+    static IOBufferMemoryDescriptor* inTaskWithOptions(task_t inTask, IOOptionBits options, vm_size_t capacity, vm_offset_t alignment = 1) {
+        IOBufferMemoryDescriptor* descriptor = new IOBufferMemoryDescriptor;
+
+        descriptor->buffer = static_cast<UInt8*>(IOMalloc(capacity));
+        if (!descriptor->buffer) {
+            descriptor->release();
+            return NULL;
+        }
+
+        memset(descriptor->buffer, 0, capacity);
+        descriptor->capacity = capacity;
+        descriptor->length = capacity;
+
+        return descriptor;
+    }
+
+    static IOBufferMemoryDescriptor* withBytes(const void* bytes, vm_size_t length, IOOptionBits direction = 0) {
+        IOBufferMemoryDescriptor* descriptor = inTaskWithOptions(kernel_task, direction, length);
+
+        if (descriptor)
+            memcpy(descriptor->buffer, bytes, length);
+
+        return descriptor;
+    }
+
+    void setLength(vm_size_t length) {
+        this->length = length < capacity ? length : capacity;
+    }
+
+    vm_size_t getCapacity() const {
+        return capacity;
+    }
+
+    void* getBytesNoCopy() {
+        return buffer;
+    }
+
+ protected:
+    void free() override {
+        IOFree(buffer, capacity);
+        buffer = NULL;
+
+        IOMemoryDescriptor::free();
+    }
+
+ private:
+    vm_size_t capacity = 0;
+};
+
+#endif /* Shim_IOBufferMemoryDescriptor_h */
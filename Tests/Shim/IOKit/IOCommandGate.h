@@ -0,0 +1,54 @@
+//
+//  IOCommandGate.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOCommandGate>. Actions run on the caller's thread with the work loop's gate closed, and a
+//  disabled gate refuses them rather than blocking.
+//
+
+#ifndef Shim_IOCommandGate_h
+#define Shim_IOCommandGate_h
+
+#include <IOKit/IOWorkLoop.h>
+
+class IOCommandGate : public IOEventSource {
+ public:
+    typedef IOReturn (*Action)(OSObject* owner, void* arg0, void* arg1, void* arg2, void* arg3);
+
+    static IOCommandGate* commandGate(OSObject* owner, Action action = 0) {
+        IOCommandGate* gate = new IOCommandGate;
+        gate->init(owner, (void*)action);
+        return gate;
+    }
+
+    virtual IOReturn runAction(Action action, void* arg0 = 0, void* arg1 = 0, void* arg2 = 0, void* arg3 = 0) {
+        IOWorkLoop* loop = work_loop;
+
+        if (!action)
+            return kIOReturnBadArgument;
+
+        if (!loop)
+            return kIOReturnNotReady;
+
+        loop->closeGate();
+        IOReturn result = isEnabled() || loop->onThread() ? action(owner, arg0, arg1, arg2, arg3) : kIOReturnNotPermitted;
+        loop->openGate();
+
+        return result;
+    }
+
+    virtual IOReturn commandSleep(void* event, UInt32 interruptible = THREAD_ABORTSAFE) {
+        return work_loop->sleepGate(event, 0);
+    }
+
+    virtual IOReturn commandSleep(void* event, AbsoluteTime deadline, UInt32 interruptible) {
+        return work_loop->sleepGate(event, deadline);
+    }
+
+    virtual void commandWakeup(void* event, bool oneThread = false) {
+        if (work_loop)
+            work_loop->wakeupGate(event, oneThread);
+    }
+};
+
+#endif /* Shim_IOCommandGate_h */
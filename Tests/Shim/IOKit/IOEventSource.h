@@ -0,0 +1,13 @@
+//
+//  IOEventSource.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOEventSource>, which lives alongside the work loop in IOWorkLoop.h.
+//
+
+#ifndef Shim_IOEventSource_h
+#define Shim_IOEventSource_h
+
+#include <IOKit/IOWorkLoop.h>
+
+#endif /* Shim_IOEventSource_h */
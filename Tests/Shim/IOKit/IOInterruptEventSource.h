@@ -0,0 +1,55 @@
+//
+//  IOInterruptEventSource.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOInterruptEventSource>. Interrupts may be signalled from any thread, those that arrive before
+//  the work loop gets round to the source are collapsed into one call of its action.
+//
+
+#ifndef Shim_IOInterruptEventSource_h
+#define Shim_IOInterruptEventSource_h
+
+#include <IOKit/IOService.h>
+#include <IOKit/IOWorkLoop.h>
+
+class IOInterruptEventSource : public IOEventSource {
+ public:
+    typedef void (*Action)(OSObject* owner, IOInterruptEventSource* sender, int count);
+
+    static IOInterruptEventSource* interruptEventSource(OSObject* owner, Action action, IOService* provider = 0, int intIndex = 0) {
+        IOInterruptEventSource* source = new IOInterruptEventSource;
+        source->init(owner, (void*)action);
+        return source;
+    }
+
+    virtual void interruptOccurred(void* refcon, IOService* nub, int source) {
+        __atomic_fetch_add(&producer_count, 1, __ATOMIC_ACQ_REL);
+        signalWorkAvailable();
+    }
+
+ protected:
+    bool hasWork() const override {
+        return __atomic_load_n(&producer_count, __ATOMIC_ACQUIRE) != consumer_count;
+    }
+
+    bool checkForWork() override {
+        UInt32 produced = __atomic_load_n(&producer_count, __ATOMIC_ACQUIRE);
+
+        if (produced == consumer_count)
+            return false;
+
+        int count = (int)(produced - consumer_count);
+        consumer_count = produced;
+
+        if (isEnabled() && action)
+            ((Action)action)(owner, this, count);
+
+        return true;
+    }
+
+ private:
+    UInt32 producer_count = 0;
+    UInt32 consumer_count = 0;
+};
+
+#endif /* Shim_IOInterruptEventSource_h */
@@ -0,0 +1,14 @@
+//
+//  IOKitKeys.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOKit/IOKitKeys.h>, only the keys the sources under test use.
+//
+
+#ifndef Shim_IOKitKeys_h
+#define Shim_IOKitKeys_h
+
+#define kIOProviderClassKey     "IOProviderClass"
+#define kIONameMatchKey         "IONameMatch"
+
+#endif /* Shim_IOKitKeys_h */
@@ -0,0 +1,136 @@
+//
+//  IOLib.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOKit/IOLib.h>. Allocations are counted so that tests can check nothing leaked, locks are
+//  pthread mutexes with a single condition variable that every <IOLockWakeup> broadcasts on. Sleeping advances the
+//  simulated uptime rather than waiting.
+//
+
+#ifndef Shim_IOLib_h
+#define Shim_IOLib_h
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <IOKit/IOTypes.h>
+#include <kern/clock.h>
+#include <libkern/c++/OSObject.h>
+
+#define THREAD_UNINT            0
+#define THREAD_INTERRUPTIBLE    1
+#define THREAD_ABORTSAFE        2
+
+#define THREAD_AWAKENED         0
+#define THREAD_TIMED_OUT        1
+
+inline long shim_outstanding_allocations = 0;
+inline long shim_total_allocations = 0;
+inline bool shim_quiet_log = true;
+
+static inline void* IOMalloc(vm_size_t size) {
+    void* address = malloc(size ? size : 1);
+
+    if (address) {
+        __atomic_fetch_add(&shim_outstanding_allocations, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&shim_total_allocations, 1, __ATOMIC_RELAXED);
+    }
+
+    return address;
+}
+
+static inline void IOFree(void* address, vm_size_t size) {
+    if (!address)
+        return;
+
+    __atomic_fetch_sub(&shim_outstanding_allocations, 1, __ATOMIC_RELAXED);
+    free(address);
+}
+
+static inline void* IOMallocAligned(vm_size_t size, vm_size_t alignment) {
+    void* address = NULL;
+
+    if (posix_memalign(&address, alignment < sizeof(void*) ? sizeof(void*) : alignment, size ? size : 1))
+        return NULL;
+
+    __atomic_fetch_add(&shim_outstanding_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shim_total_allocations, 1, __ATOMIC_RELAXED);
+
+    return address;
+}
+
+static inline void IOFreeAligned(void* address, vm_size_t size) {
+    IOFree(address, size);
+}
+
+static inline void IOLog(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+static inline void IOLog(const char* format, ...) {
+    if (shim_quiet_log)
+        return;
+
+    va_list arguments;
+    va_start(arguments, format);
+    vfprintf(stderr, format, arguments);
+    va_end(arguments);
+}
+
+static inline void IOSleep(unsigned milliseconds) {
+    shimAdvanceUptime((uint64_t)milliseconds * kMillisecondScale);
+    sched_yield();
+}
+
+static inline void IODelay(unsigned microseconds) {
+    shimAdvanceUptime((uint64_t)microseconds * kMicrosecondScale);
+}
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+} IOLock;
+
+static inline IOLock* IOLockAlloc() {
+    IOLock* lock = new IOLock;
+
+    pthread_mutex_init(&lock->mutex, NULL);
+    pthread_cond_init(&lock->condition, NULL);
+
+    return lock;
+}
+
+static inline void IOLockFree(IOLock* lock) {
+    pthread_cond_destroy(&lock->condition);
+    pthread_mutex_destroy(&lock->mutex);
+    delete lock;
+}
+
+static inline void IOLockLock(IOLock* lock) {
+    pthread_mutex_lock(&lock->mutex);
+}
+
+static inline void IOLockUnlock(IOLock* lock) {
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+static inline bool IOLockTryLock(IOLock* lock) {
+    return pthread_mutex_trylock(&lock->mutex) == 0;
+}
+
+#define IOUnlock(lock)  IOLockUnlock(lock)
+
+// Sleepers wake on any wakeup and are expected to recheck their condition, as they must in the kernel
+
+static inline int IOLockSleep(IOLock* lock, void* event, UInt32 interruptible) {
+    pthread_cond_wait(&lock->condition, &lock->mutex);
+    return 0;
+}
+
+static inline void IOLockWakeup(IOLock* lock, void* event, bool oneThread) {
+    pthread_cond_broadcast(&lock->condition);
+}
+
+#endif /* Shim_IOLib_h */
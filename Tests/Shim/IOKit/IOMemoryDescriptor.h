@@ -0,0 +1,42 @@
+//
+//  IOMemoryDescriptor.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOMemoryDescriptor>, a length and a pointer to bytes some subclass owns.
+//
+
+#ifndef Shim_IOMemoryDescriptor_h
+#define Shim_IOMemoryDescriptor_h
+
+#include <IOKit/IOLib.h>
+
+class IOMemoryDescriptor : public OSObject {
+ public:
+    virtual IOByteCount getLength() const {
+        return length;
+    }
+
+    virtual IOByteCount readBytes(IOByteCount offset, void* bytes, IOByteCount withLength) {
+        if (offset >= length)
+            return 0;
+
+        IOByteCount count = withLength < length - offset ? withLength : length - offset;
+        memcpy(bytes, buffer + offset, count);
+        return count;
+    }
+
+    virtual IOByteCount writeBytes(IOByteCount offset, const void* bytes, IOByteCount withLength) {
+        if (offset >= length)
+            return 0;
+
+        IOByteCount count = withLength < length - offset ? withLength : length - offset;
+        memcpy(buffer + offset, bytes, count);
+        return count;
+    }
+
+ protected:
+    UInt8* buffer = NULL;
+    IOByteCount length = 0;
+};
+
+#endif /* Shim_IOMemoryDescriptor_h */
@@ -0,0 +1,196 @@
+//
+//  IOService.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOService>. Services keep a property table and their provider, and the lifecycle and power
+//  management calls succeed without doing anything, which is all a driver sees of them when a test starts it by hand.
+//
+
+#ifndef Shim_IOService_h
+#define Shim_IOService_h
+
+#include <mutex>
+
+#include <IOKit/IOLib.h>
+
+class IOService;
+class IOWorkLoop;
+
+typedef void (*IOInterruptAction)(OSObject* target, void* refCon, IOService* nub, int source);
+
+typedef struct {
+    unsigned long version;
+    unsigned long capabilityFlags;
+    unsigned long outputPowerCharacter;
+    unsigned long inputPowerRequirement;
+    unsigned long staticPower;
+    unsigned long unbudgetedPower;
+    unsigned long powerToAttain;
+    unsigned long timeToAttain;
+    unsigned long settleUpTime;
+    unsigned long timeToLower;
+    unsigned long settleDownTime;
+    unsigned long powerDomainBudget;
+} IOPMPowerState;
+
+#define kIOPMPowerStateVersion1     1
+#define kIOPMPowerOff               0
+#define kIOPMPowerOn                0x00000002
+#define kIOPMDeviceUsable           0x00008000
+#define kIOPMAckImplied             0
+
+class IOService : public OSObject {
+ public:
+    virtual bool init(OSDictionary* dictionary = 0) {
+        return true;
+    }
+
+    virtual IOService* probe(IOService* provider, SInt32* score) {
+        return this;
+    }
+
+    virtual bool start(IOService* provider) {
+        return true;
+    }
+
+    virtual void stop(IOService* provider) {}
+
+    virtual bool attach(IOService* provider) {
+        this->provider = provider;
+        return true;
+    }
+
+    virtual void detach(IOService* provider) {
+        this->provider = NULL;
+    }
+
+    virtual bool open(IOService* forClient, IOOptionBits options = 0, void* arg = 0) {
+        std::lock_guard<std::mutex> guard(property_mutex);
+
+        if (client && client != forClient)
+            return false;
+
+        client = forClient;
+        return true;
+    }
+
+    virtual void close(IOService* forClient, IOOptionBits options = 0) {
+        std::lock_guard<std::mutex> guard(property_mutex);
+
+        if (client == forClient)
+            client = NULL;
+    }
+
+    virtual bool isOpen(const IOService* forClient = 0) const {
+        std::lock_guard<std::mutex> guard(property_mutex);
+
+        return forClient ? client == forClient : client != NULL;
+    }
+
+    virtual IOWorkLoop* getWorkLoop() const {
+        return NULL;
+    }
+
+    virtual IOReturn setProperties(OSObject* properties) {
+        return kIOReturnUnsupported;
+    }
+
+    virtual IOReturn setPowerState(unsigned long powerStateOrdinal, IOService* whatDevice) {
+        return kIOPMAckImplied;
+    }
+
+    IOService* getProvider() const {
+        return provider;
+    }
+
+    const char* getName() const {
+        return name.c_str();
+    }
+
+    void setName(const char* name) {
+        this->name = name;
+    }
+
+    OSObject* getProperty(const char* key) const {
+        std::lock_guard<std::mutex> guard(property_mutex);
+
+        return properties ? properties->getObject(key) : NULL;
+    }
+
+    /* Returns the property with a reference the caller must release, safe against it being replaced meanwhile */
+
+    OSObject* copyProperty(const char* key) const {
+        std::lock_guard<std::mutex> guard(property_mutex);
+
+        OSObject* property = properties ? properties->getObject(key) : NULL;
+        if (property)
+            property->retain();
+
+        return property;
+    }
+
+    bool setProperty(const char* key, OSObject* object) {
+        std::lock_guard<std::mutex> guard(property_mutex);
+
+        if (!properties)
+            properties = OSDictionary::withCapacity(16);
+
+        return properties->setObject(key, object);
+    }
+
+    bool setProperty(const char* key, unsigned long long number, unsigned int numberOfBits) {
+        OSNumber* value = OSNumber::withNumber(number, numberOfBits);
+        bool result = setProperty(key, value);
+        value->release();
+        return result;
+    }
+
+    bool setProperty(const char* key, const char* string) {
+        OSString* value = OSString::withCString(string);
+        bool result = setProperty(key, value);
+        value->release();
+        return result;
+    }
+
+    bool setProperty(const char* key, bool value) {
+        return setProperty(key, value ? kOSBooleanTrue : kOSBooleanFalse);
+    }
+
+    void removeProperty(const char* key) {
+        std::lock_guard<std::mutex> guard(property_mutex);
+
+        if (properties)
+            properties->removeObject(key);
+    }
+
+    void registerService(IOOptionBits options = 0) {}
+
+    bool terminate(IOOptionBits options = 0) {
+        return true;
+    }
+
+    void PMinit() {}
+
+    void PMstop() {}
+
+    void joinPMtree(IOService* driver) {}
+
+    IOReturn registerPowerDriver(IOService* controllingDriver, IOPMPowerState* powerStates, unsigned long numberOfStates) {
+        return kIOReturnSuccess;
+    }
+
+ protected:
+    void free() override {
+        OSSafeReleaseNULL(properties);
+        OSObject::free();
+    }
+
+ private:
+    mutable std::mutex property_mutex;
+    OSDictionary* properties = NULL;
+    IOService* provider = NULL;
+    const IOService* client = NULL;
+    std::string name = "IOService";
+};
+
+#endif /* Shim_IOService_h */
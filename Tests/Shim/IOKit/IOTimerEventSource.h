@@ -0,0 +1,90 @@
+//
+//  IOTimerEventSource.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOTimerEventSource>. Deadlines are in simulated uptime, a timer fires on the work loop once a
+//  test has advanced the uptime past it.
+//
+
+#ifndef Shim_IOTimerEventSource_h
+#define Shim_IOTimerEventSource_h
+
+#include <IOKit/IOWorkLoop.h>
+
+class IOTimerEventSource : public IOEventSource {
+ public:
+    typedef void (*Action)(OSObject* owner, IOTimerEventSource* sender);
+
+    static IOTimerEventSource* timerEventSource(OSObject* owner, Action action = 0) {
+        IOTimerEventSource* timer = new IOTimerEventSource;
+        timer->init(owner, (void*)action);
+        return timer;
+    }
+
+    IOReturn setTimeoutMS(UInt32 milliseconds) {
+        return setTimeout(milliseconds, kMillisecondScale);
+    }
+
+    IOReturn setTimeoutUS(UInt32 microseconds) {
+        return setTimeout(microseconds, kMicrosecondScale);
+    }
+
+    IOReturn setTimeout(UInt32 interval, UInt32 scale_factor = kNanosecondScale) {
+        AbsoluteTime deadline;
+        clock_interval_to_deadline(interval, scale_factor, &deadline);
+        return wakeAtTime(deadline);
+    }
+
+    IOReturn wakeAtTime(AbsoluteTime deadline) {
+        __atomic_store_n(&this->deadline, deadline ? deadline : 1, __ATOMIC_RELEASE);
+        signalWorkAvailable();
+        return kIOReturnSuccess;
+    }
+
+    void cancelTimeout() {
+        __atomic_store_n(&deadline, 0, __ATOMIC_RELEASE);
+    }
+
+    void disable() override {
+        cancelTimeout();
+        IOEventSource::disable();
+    }
+
+    /* Test helper, when the timer is next due or zero if it is not armed */
+
+    AbsoluteTime getDeadline() const {
+        return __atomic_load_n(&deadline, __ATOMIC_ACQUIRE);
+    }
+
+ protected:
+    bool hasWork() const override {
+        AbsoluteTime due = getDeadline();
+        AbsoluteTime now;
+        clock_get_uptime(&now);
+
+        return due && now >= due;
+    }
+
+    bool checkForWork() override {
+        AbsoluteTime due = getDeadline();
+        AbsoluteTime now;
+        clock_get_uptime(&now);
+
+        if (!due || now < due)
+            return false;
+
+        // Rearmed meanwhile, the new deadline is checked next time round
+        if (!__atomic_compare_exchange_n(&deadline, &due, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return true;
+
+        if (isEnabled() && action)
+            ((Action)action)(owner, this);
+
+        return true;
+    }
+
+ private:
+    AbsoluteTime deadline = 0;
+};
+
+#endif /* Shim_IOTimerEventSource_h */
@@ -0,0 +1,54 @@
+//
+//  IOTypes.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for the kernel's basic IOKit types, only what the sources under test use.
+//
+
+#ifndef Shim_IOTypes_h
+#define Shim_IOTypes_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t UInt8;
+typedef int8_t SInt8;
+typedef uint16_t UInt16;
+typedef int16_t SInt16;
+typedef uint32_t UInt32;
+typedef int32_t SInt32;
+typedef uint64_t UInt64;
+typedef int64_t SInt64;
+
+typedef UInt64 AbsoluteTime;
+typedef SInt32 IOReturn;
+typedef UInt32 IOOptionBits;
+typedef size_t IOByteCount;
+typedef size_t vm_size_t;
+typedef UInt32 IOItemCount;
+typedef SInt32 IOFixed;
+typedef size_t vm_offset_t;
+typedef void* task_t;
+
+inline task_t kernel_task = NULL;
+
+#define iokit_common_err(return)    ((IOReturn)(0xe0000000 | (return)))
+
+#define kIOReturnSuccess            0
+#define kIOReturnError              iokit_common_err(0x2bc)
+#define kIOReturnNoMemory           iokit_common_err(0x2bd)
+#define kIOReturnNoResources        iokit_common_err(0x2be)
+#define kIOReturnBadArgument        iokit_common_err(0x2c2)
+#define kIOReturnUnsupported        iokit_common_err(0x2c7)
+#define kIOReturnIOError            iokit_common_err(0x2ca)
+#define kIOReturnBusy               iokit_common_err(0x2d5)
+#define kIOReturnTimeout            iokit_common_err(0x2d6)
+#define kIOReturnNotReady           iokit_common_err(0x2d8)
+#define kIOReturnNoSpace            iokit_common_err(0x2db)
+#define kIOReturnNotPermitted       iokit_common_err(0x2e2)
+#define kIOReturnDeviceError        iokit_common_err(0x2e9)
+#define kIOReturnAborted            iokit_common_err(0x2eb)
+#define kIOReturnNotFound           iokit_common_err(0x2f0)
+#define kIOReturnInvalid            iokit_common_err(0x1)
+
+#endif /* Shim_IOTypes_h */
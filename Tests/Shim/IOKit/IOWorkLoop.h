@@ -0,0 +1,327 @@
+//
+//  IOWorkLoop.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOWorkLoop> and <IOEventSource>. The work loop is a real thread that checks its event sources
+//  for work with the gate closed, and the gate is a recursive lock that sleepers give up entirely until woken.
+//  Timed waits are measured against the simulated uptime, so tests control when they expire.
+//
+
+#ifndef Shim_IOWorkLoop_h
+#define Shim_IOWorkLoop_h
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <vector>
+
+#include <IOKit/IOLib.h>
+
+class IOWorkLoop;
+
+class IOEventSource : public OSObject {
+    friend class IOWorkLoop;
+
+ public:
+    virtual void enable() {
+        __atomic_store_n(&enabled, true, __ATOMIC_RELEASE);
+        signalWorkAvailable();
+    }
+
+    virtual void disable() {
+        __atomic_store_n(&enabled, false, __ATOMIC_RELEASE);
+    }
+
+    bool isEnabled() const {
+        return __atomic_load_n(&enabled, __ATOMIC_ACQUIRE);
+    }
+
+    IOWorkLoop* getWorkLoop() const {
+        return work_loop;
+    }
+
+ protected:
+    bool init(OSObject* owner, void* action) {
+        this->owner = owner;
+        this->action = action;
+        return true;
+    }
+
+    /* Runs whatever is due, called by the work loop with the gate closed
+     *
+     * @return Whether there was anything to run
+     */
+
+    virtual bool checkForWork() {
+        return false;
+    }
+
+    /* Whether <checkForWork> would find anything to run */
+
+    virtual bool hasWork() const {
+        return false;
+    }
+
+    inline void signalWorkAvailable();
+
+    OSObject* owner = NULL;
+    void* action = NULL;
+    IOWorkLoop* work_loop = NULL;
+
+ private:
+    bool enabled = true;
+};
+
+class IOWorkLoop : public OSObject {
+ public:
+    static IOWorkLoop* workLoop() {
+        IOWorkLoop* loop = new IOWorkLoop;
+
+        pthread_mutex_init(&loop->mutex, NULL);
+        pthread_cond_init(&loop->gate_condition, NULL);
+        pthread_cond_init(&loop->work_condition, NULL);
+
+        loop->running = true;
+
+        if (pthread_create(&loop->thread, NULL, threadMain, loop)) {
+            loop->running = false;
+            loop->release();
+            return NULL;
+        }
+
+        return loop;
+    }
+
+    IOReturn addEventSource(IOEventSource* source) {
+        if (!source || source->work_loop)
+            return kIOReturnBadArgument;
+
+        closeGate();
+        source->retain();
+        source->work_loop = this;
+        sources.push_back(source);
+        openGate();
+
+        signalWorkAvailable();
+
+        return kIOReturnSuccess;
+    }
+
+    IOReturn removeEventSource(IOEventSource* source) {
+        IOReturn result = kIOReturnNotFound;
+
+        closeGate();
+        for (size_t i = 0; i < sources.size(); i++) {
+            if (sources[i] != source)
+                continue;
+
+            sources.erase(sources.begin() + i);
+            source->work_loop = NULL;
+            source->release();
+            result = kIOReturnSuccess;
+            break;
+        }
+        openGate();
+
+        return result;
+    }
+
+    bool onThread() const {
+        return pthread_equal(pthread_self(), thread);
+    }
+
+    bool inGate() {
+        pthread_mutex_lock(&mutex);
+        bool owned = gate_depth && pthread_equal(gate_owner, pthread_self());
+        pthread_mutex_unlock(&mutex);
+
+        return owned;
+    }
+
+    void closeGate() {
+        pthread_mutex_lock(&mutex);
+
+        while (gate_depth && !pthread_equal(gate_owner, pthread_self()))
+            pthread_cond_wait(&gate_condition, &mutex);
+
+        gate_owner = pthread_self();
+        gate_depth++;
+
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void openGate() {
+        pthread_mutex_lock(&mutex);
+
+        if (--gate_depth == 0)
+            pthread_cond_broadcast(&gate_condition);
+
+        pthread_mutex_unlock(&mutex);
+    }
+
+    /* Gives up the gate until any wakeup, or until the uptime reaches <deadline> if it is not zero
+     *
+     * Sleepers are not told apart by their event, they wake on any wakeup and are expected to recheck their condition.
+     *
+     * @return THREAD_AWAKENED or THREAD_TIMED_OUT
+     */
+
+    int sleepGate(void* event, AbsoluteTime deadline) {
+        pthread_mutex_lock(&mutex);
+
+        unsigned int depth = gate_depth;
+        UInt64 generation = wakeups;
+        int result = THREAD_AWAKENED;
+
+        gate_depth = 0;
+        pthread_cond_broadcast(&gate_condition);
+
+        while (wakeups == generation) {
+            AbsoluteTime now;
+            clock_get_uptime(&now);
+
+            if (deadline && now >= deadline) {
+                result = THREAD_TIMED_OUT;
+                break;
+            }
+
+            waitForMillisecond(&gate_condition);
+        }
+
+        while (gate_depth)
+            pthread_cond_wait(&gate_condition, &mutex);
+
+        gate_owner = pthread_self();
+        gate_depth = depth;
+
+        pthread_mutex_unlock(&mutex);
+
+        return result;
+    }
+
+    void wakeupGate(void* event, bool oneThread) {
+        pthread_mutex_lock(&mutex);
+        wakeups++;
+        pthread_cond_broadcast(&gate_condition);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void signalWorkAvailable() {
+        pthread_mutex_lock(&mutex);
+        work_signaled = true;
+        pthread_cond_broadcast(&work_condition);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    /* Test helper, returns once no event source has anything left to run
+     *
+     * Only work that is already due counts, a timer armed for later is idle until the uptime is advanced past it.
+     */
+
+    void runUntilIdle() {
+        for (;;) {
+            bool pending = false;
+
+            closeGate();
+            for (IOEventSource* source : sources)
+                pending |= source->hasWork();
+            openGate();
+
+            if (!pending)
+                return;
+
+            signalWorkAvailable();
+
+            struct timespec pause = {0, 50000};
+            nanosleep(&pause, NULL);
+        }
+    }
+
+ protected:
+    void free() override {
+        pthread_mutex_lock(&mutex);
+        running = false;
+        pthread_cond_broadcast(&work_condition);
+        pthread_mutex_unlock(&mutex);
+
+        pthread_join(thread, NULL);
+
+        for (IOEventSource* source : sources) {
+            source->work_loop = NULL;
+            source->release();
+        }
+        sources.clear();
+
+        pthread_cond_destroy(&work_condition);
+        pthread_cond_destroy(&gate_condition);
+        pthread_mutex_destroy(&mutex);
+
+        OSObject::free();
+    }
+
+ private:
+    static void* threadMain(void* argument) {
+        IOWorkLoop* loop = static_cast<IOWorkLoop*>(argument);
+
+        for (;;) {
+            pthread_mutex_lock(&loop->mutex);
+            bool running = loop->running;
+            loop->work_signaled = false;
+            pthread_mutex_unlock(&loop->mutex);
+
+            if (!running)
+                break;
+
+            bool worked = false;
+
+            loop->closeGate();
+            for (size_t i = 0; i < loop->sources.size(); i++)
+                worked |= loop->sources[i]->checkForWork();
+            loop->openGate();
+
+            if (worked)
+                continue;
+
+            pthread_mutex_lock(&loop->mutex);
+            if (loop->running && !loop->work_signaled)
+                loop->waitForMillisecond(&loop->work_condition);
+            pthread_mutex_unlock(&loop->mutex);
+        }
+
+        return NULL;
+    }
+
+    /* Waits on <condition> for at most a millisecond of real time, timers and deadlines are polled at that rate */
+
+    void waitForMillisecond(pthread_cond_t* condition) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+
+        until.tv_nsec += 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(condition, &mutex, &until);
+    }
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t gate_condition;
+    pthread_cond_t work_condition;
+    pthread_t gate_owner;
+    unsigned int gate_depth = 0;
+    UInt64 wakeups = 0;
+    bool work_signaled = false;
+    bool running = false;
+    std::vector<IOEventSource*> sources;
+};
+
+inline void IOEventSource::signalWorkAvailable() {
+    if (work_loop)
+        work_loop->signalWorkAvailable();
+}
+
+#endif /* Shim_IOWorkLoop_h */
@@ -0,0 +1,21 @@
+//
+//  IOACPIPlatformDevice.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOACPIPlatformDevice>. There are no ACPI tables on the host, every method evaluates to nothing
+//  unless a test subclass answers it.
+//
+
+#ifndef Shim_IOACPIPlatformDevice_h
+#define Shim_IOACPIPlatformDevice_h
+
+#include <IOKit/IOService.h>
+
+class IOACPIPlatformDevice : public IOService {
+ public:
+    virtual IOReturn evaluateObject(const char* objectName, OSObject** result = 0, OSObject* params[] = 0, IOItemCount paramCount = 0, IOOptionBits options = 0) {
+        return kIOReturnNotFound;
+    }
+};
+
+#endif /* Shim_IOACPIPlatformDevice_h */
@@ -0,0 +1,120 @@
+//
+//  IOHIDDevice.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOHIDDevice>. Starting a device calls <handleStart> and publishes the report descriptor it hands
+//  back, reports it delivers go to <handleReportWithTime>, which test subclasses override to see them.
+//
+
+#ifndef Shim_IOHIDDevice_h
+#define Shim_IOHIDDevice_h
+
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOService.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/hid/IOHIDUsageTables.h>
+
+#define kIOHIDReportDescriptorKey   "ReportDescriptor"
+#define kIOHIDPrimaryUsagePageKey   "PrimaryUsagePage"
+#define kIOHIDPrimaryUsageKey       "PrimaryUsage"
+
+typedef enum {
+    kIOHIDReportTypeInput = 0,
+    kIOHIDReportTypeOutput,
+    kIOHIDReportTypeFeature,
+    kIOHIDReportTypeCount
+} IOHIDReportType;
+
+typedef void (*IOHIDCompletionAction)(void* target, void* parameter, IOReturn status, UInt32 bufferSizeRemaining);
+
+typedef struct IOHIDCompletion {
+    void* target;
+    IOHIDCompletionAction action;
+    void* parameter;
+} IOHIDCompletion;
+
+class IOHIDDevice : public IOService {
+ public:
+    bool start(IOService* provider) override {
+        if (!handleStart(provider))
+            return false;
+
+        IOMemoryDescriptor* descriptor = NULL;
+        if (newReportDescriptor(&descriptor) != kIOReturnSuccess || !descriptor)
+            return false;
+
+        UInt8* bytes = static_cast<UInt8*>(IOMalloc(descriptor->getLength()));
+        descriptor->readBytes(0, bytes, descriptor->getLength());
+
+        OSData* data = OSData::withBytes(bytes, (unsigned int)descriptor->getLength());
+        setProperty(kIOHIDReportDescriptorKey, data);
+        data->release();
+
+        IOFree(bytes, descriptor->getLength());
+        descriptor->release();
+
+        return true;
+    }
+
+    void stop(IOService* provider) override {
+        handleStop(provider);
+    }
+
+    virtual bool handleStart(IOService* provider) {
+        return true;
+    }
+
+    virtual void handleStop(IOService* provider) {}
+
+    virtual IOReturn newReportDescriptor(IOMemoryDescriptor** descriptor) const = 0;
+
+    virtual OSNumber* newVendorIDNumber() const {
+        return NULL;
+    }
+
+    virtual OSNumber* newProductIDNumber() const {
+        return NULL;
+    }
+
+    virtual OSNumber* newVersionNumber() const {
+        return NULL;
+    }
+
+    virtual OSString* newTransportString() const {
+        return NULL;
+    }
+
+    virtual OSString* newManufacturerString() const {
+        return NULL;
+    }
+
+    virtual IOReturn handleReport(IOMemoryDescriptor* report, IOHIDReportType reportType = kIOHIDReportTypeInput, IOOptionBits options = 0) {
+        AbsoluteTime now;
+        clock_get_uptime(&now);
+
+        return handleReportWithTime(now, report, reportType, options);
+    }
+
+    virtual IOReturn handleReportWithTime(AbsoluteTime timeStamp, IOMemoryDescriptor* report, IOHIDReportType reportType = kIOHIDReportTypeInput, IOOptionBits options = 0) {
+        return kIOReturnSuccess;
+    }
+
+    virtual IOReturn getReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options) {
+        return kIOReturnUnsupported;
+    }
+
+    virtual IOReturn setReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options) {
+        return kIOReturnUnsupported;
+    }
+
+    virtual IOReturn getReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options, UInt32 completionTimeout, IOHIDCompletion* completion = 0) {
+        return getReport(report, reportType, options);
+    }
+
+    virtual IOReturn setReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options, UInt32 completionTimeout, IOHIDCompletion* completion = 0) {
+        return setReport(report, reportType, options);
+    }
+};
+
+#endif /* Shim_IOHIDDevice_h */
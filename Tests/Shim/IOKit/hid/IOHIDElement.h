@@ -0,0 +1,129 @@
+//
+//  IOHIDElement.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <IOHIDElement>. Tests build the element tree <IOHIDDevice> would have parsed out of a report
+//  descriptor by hand, with <withUsage> and <addChild>, and stand in for <IOHIDDevice> updating them from a report
+//  with <setValue>.
+//
+
+#ifndef Shim_IOHIDElement_h
+#define Shim_IOHIDElement_h
+
+#include <IOKit/IOLib.h>
+#include <kern/clock.h>
+
+typedef enum {
+    kIOHIDElementTypeInput_Misc = 1,
+    kIOHIDElementTypeInput_Button = 2,
+    kIOHIDElementTypeInput_Axis = 3,
+    kIOHIDElementTypeInput_ScanCodes = 4,
+    kIOHIDElementTypeOutput = 129,
+    kIOHIDElementTypeFeature = 257,
+    kIOHIDElementTypeCollection = 513
+} IOHIDElementType;
+
+typedef enum {
+    kIOHIDValueScaleTypeCalibrated = 0,
+    kIOHIDValueScaleTypePhysical = 1
+} IOHIDValueScaleType;
+
+class IOHIDElement : public OSObject {
+ public:
+    static IOHIDElement* withUsage(IOHIDElementType type, UInt32 usage_page, UInt32 usage, UInt32 report_id = 0, UInt32 report_size = 0, UInt32 logical_max = 0, UInt32 physical_max = 0) {
+        IOHIDElement* element = new IOHIDElement;
+
+        element->type = type;
+        element->usage_page = usage_page;
+        element->usage = usage;
+        element->report_id = report_id;
+        element->report_size = report_size;
+        element->logical_max = logical_max;
+        element->physical_max = physical_max;
+
+        return element;
+    }
+
+    /* Adds a child element, consuming the caller's reference */
+
+    void addChild(IOHIDElement* child) {
+        if (!children)
+            children = OSArray::withCapacity(8);
+
+        children->setObject(child);
+        child->release();
+    }
+
+    OSArray* getChildElements() {
+        return children;
+    }
+
+    IOHIDElementType getType() {
+        return type;
+    }
+
+    UInt32 getUsagePage() {
+        return usage_page;
+    }
+
+    UInt32 getUsage() {
+        return usage;
+    }
+
+    UInt32 getReportID() {
+        return report_id;
+    }
+
+    UInt32 getReportSize() {
+        return report_size;
+    }
+
+    UInt32 getLogicalMax() {
+        return logical_max;
+    }
+
+    UInt32 getPhysicalMax() {
+        return physical_max;
+    }
+
+    UInt32 getValue() {
+        return value;
+    }
+
+    /* Stamps the element with the current uptime, as <IOHIDDevice> does for the elements of a report it handles */
+
+    void setValue(UInt32 value) {
+        this->value = value;
+        clock_get_uptime(&timestamp);
+    }
+
+    // Scaling is the identity, both scale types return the value as a fixed point number
+
+    IOFixed getScaledFixedValue(IOHIDValueScaleType type) {
+        return (IOFixed)(value << 16);
+    }
+
+    AbsoluteTime getTimeStamp() {
+        return timestamp;
+    }
+
+ protected:
+    void free() override {
+        OSSafeReleaseNULL(children);
+        OSObject::free();
+    }
+
+ private:
+    OSArray* children = NULL;
+    IOHIDElementType type = kIOHIDElementTypeCollection;
+    UInt32 usage_page = 0;
+    UInt32 usage = 0;
+    UInt32 report_id = 0;
+    UInt32 report_size = 0;
+    UInt32 logical_max = 0;
+    UInt32 physical_max = 0;
+    UInt32 value = 0;
+    AbsoluteTime timestamp = 0;
+};
+
+#endif /* Shim_IOHIDElement_h */
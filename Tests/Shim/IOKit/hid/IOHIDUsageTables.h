@@ -0,0 +1,53 @@
+//
+//  IOHIDUsageTables.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for the HID usage tables, only the pages and usages the sources under test refer to.
+//
+
+#ifndef Shim_IOHIDUsageTables_h
+#define Shim_IOHIDUsageTables_h
+
+enum {
+    kHIDPage_GenericDesktop = 0x01,
+    kHIDPage_Button = 0x09,
+    kHIDPage_Digitizer = 0x0D,
+    kHIDPage_Sensor = 0x20
+};
+
+enum {
+    kHIDUsage_GD_X = 0x30,
+    kHIDUsage_GD_Y = 0x31,
+    kHIDUsage_GD_Z = 0x32
+};
+
+enum {
+    kHIDUsage_Dig_Pen = 0x02,
+    kHIDUsage_Dig_TouchScreen = 0x04,
+    kHIDUsage_Dig_TouchPad = 0x05,
+    kHIDUsage_Dig_Finger = 0x22,
+    kHIDUsage_Dig_TipPressure = 0x30,
+    kHIDUsage_Dig_BarrelPressure = 0x31,
+    kHIDUsage_Dig_InRange = 0x32,
+    kHIDUsage_Dig_Touch = 0x33,
+    kHIDUsage_Dig_Quality = 0x36,
+    kHIDUsage_Dig_DataValid = 0x37,
+    kHIDUsage_Dig_TransducerIndex = 0x38,
+    kHIDUsage_Dig_BatteryStrength = 0x3B,
+    kHIDUsage_Dig_Invert = 0x3C,
+    kHIDUsage_Dig_XTilt = 0x3D,
+    kHIDUsage_Dig_YTilt = 0x3E,
+    kHIDUsage_Dig_Azimuth = 0x3F,
+    kHIDUsage_Dig_Altitude = 0x40,
+    kHIDUsage_Dig_Twist = 0x41,
+    kHIDUsage_Dig_TipSwitch = 0x42,
+    kHIDUsage_Dig_SecondaryTipSwitch = 0x43,
+    kHIDUsage_Dig_BarrelSwitch = 0x44,
+    kHIDUsage_Dig_Eraser = 0x45,
+    kHIDUsage_Dig_TouchValid = 0x47,
+    kHIDUsage_Dig_Width = 0x48,
+    kHIDUsage_Dig_Height = 0x49,
+    kHIDUsage_Dig_ContactIdentifier = 0x51
+};
+
+#endif /* Shim_IOHIDUsageTables_h */
@@ -0,0 +1,34 @@
+//
+//  VoodooI2CDigitiserStylus.hpp
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for VoodooI2C's Multitouch Support/VoodooI2CDigitiserStylus.hpp, only the members the sources under
+//  test read and write.
+//
+
+#ifndef Shim_VoodooI2CDigitiserStylus_hpp
+#define Shim_VoodooI2CDigitiserStylus_hpp
+
+#include "VoodooI2CDigitiserTransducer.hpp"
+
+class EXPORT VoodooI2CDigitiserStylus : public VoodooI2CDigitiserTransducer {
+  OSDeclareDefaultStructors(VoodooI2CDigitiserStylus);
+
+ public:
+    DigitiserTransducerState<IOFixed> barrel_pressure;
+    DigitiserTransducerButtonState barrel_switch;
+    DigitiserTransducerButtonState eraser;
+
+    UInt32 battery_strength = 0;
+    bool invert = false;
+
+    static VoodooI2CDigitiserStylus* stylus(DigitiserTransducerType transducer_type, IOHIDElement* digitizer_collection) {
+        VoodooI2CDigitiserStylus* stylus = OSTypeAlloc(VoodooI2CDigitiserStylus);
+
+        stylus->setCollection(transducer_type, digitizer_collection);
+
+        return stylus;
+    }
+};
+
+#endif /* Shim_VoodooI2CDigitiserStylus_hpp */
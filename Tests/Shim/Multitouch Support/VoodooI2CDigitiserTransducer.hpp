@@ -0,0 +1,114 @@
+//
+//  VoodooI2CDigitiserTransducer.hpp
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for VoodooI2C's Multitouch Support/VoodooI2CDigitiserTransducer.hpp, only the members the sources
+//  under test read and write.
+//
+
+#ifndef Shim_VoodooI2CDigitiserTransducer_hpp
+#define Shim_VoodooI2CDigitiserTransducer_hpp
+
+#include <IOKit/IOLib.h>
+#include <IOKit/hid/IOHIDElement.h>
+
+#ifndef EXPORT
+#define EXPORT __attribute__((visibility("default")))
+#endif
+
+typedef enum {
+    kDigitiserTransducerFinger = 0,
+    kDigitiserTransducerStylus,
+    kDigitiserTransducerPuck
+} DigitiserTransducerType;
+
+/* A value together with the one it replaced */
+
+template <typename T>
+struct DigitiserTransducerState {
+    struct {
+        T value = 0;
+        AbsoluteTime timestamp = 0;
+    } current, last;
+
+    void update(T value, AbsoluteTime timestamp) {
+        last = current;
+        current.value = value;
+        current.timestamp = timestamp;
+    }
+
+    T value() {
+        return current.value;
+    }
+};
+
+typedef DigitiserTransducerState<UInt32> DigitiserTransducerButtonState;
+
+class EXPORT VoodooI2CDigitiserTransducer : public OSObject {
+  OSDeclareDefaultStructors(VoodooI2CDigitiserTransducer);
+
+ public:
+    struct {
+        DigitiserTransducerState<UInt32> x;
+        DigitiserTransducerState<UInt32> y;
+        DigitiserTransducerState<UInt32> z;
+    } coordinates;
+
+    struct {
+        DigitiserTransducerState<IOFixed> x_tilt;
+        DigitiserTransducerState<IOFixed> y_tilt;
+    } tilt_orientation;
+
+    struct {
+        DigitiserTransducerState<UInt32> azimuth;
+        DigitiserTransducerState<UInt32> altitude;
+        DigitiserTransducerState<IOFixed> twist;
+    } azi_alti_orientation;
+
+    struct {
+        DigitiserTransducerState<UInt32> width;
+        DigitiserTransducerState<UInt32> height;
+    } dimensions;
+
+    DigitiserTransducerButtonState physical_button;
+    DigitiserTransducerButtonState tip_switch;
+    DigitiserTransducerState<UInt32> tip_pressure;
+
+    IOHIDElement* collection = NULL;
+    DigitiserTransducerType type = kDigitiserTransducerFinger;
+
+    UInt32 id = 0;
+    UInt32 secondary_id = 0;
+    AbsoluteTime timestamp = 0;
+    bool in_range = false;
+    bool is_valid = false;
+
+    UInt32 logical_max_x = 0;
+    UInt32 logical_max_y = 0;
+    UInt32 logical_max_z = 0;
+    UInt32 pressure_physical_max = 0;
+
+    static VoodooI2CDigitiserTransducer* transducer(DigitiserTransducerType transducer_type, IOHIDElement* digitizer_collection) {
+        VoodooI2CDigitiserTransducer* transducer = OSTypeAlloc(VoodooI2CDigitiserTransducer);
+
+        transducer->setCollection(transducer_type, digitizer_collection);
+
+        return transducer;
+    }
+
+ protected:
+    void setCollection(DigitiserTransducerType transducer_type, IOHIDElement* digitizer_collection) {
+        type = transducer_type;
+        collection = digitizer_collection;
+
+        if (collection)
+            collection->retain();
+    }
+
+    void free() override {
+        OSSafeReleaseNULL(collection);
+        OSObject::free();
+    }
+};
+
+#endif /* Shim_VoodooI2CDigitiserTransducer_hpp */
@@ -0,0 +1,443 @@
+//
+//  VoodooI2CDeviceNub.hpp
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for VoodooI2C's device nub, with a simulated I2C-HID device on the other end of it.
+//
+//  The simulated device answers reads of its HID descriptor and report descriptor, takes commands written to its
+//  command register and hands out queued input reports from its input register. Its interrupt line is level
+//  triggered: it stays asserted while input is queued, or for good once a test makes it stuck, and a line thread
+//  keeps calling the registered handler while it is asserted and enabled, like a GPIO controller would. Tests that
+//  want to deliver interrupts themselves turn the line thread off and call <interrupt>.
+//
+
+#ifndef Shim_VoodooI2CDeviceNub_hpp
+#define Shim_VoodooI2CDeviceNub_hpp
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <IOKit/IOService.h>
+
+#define I2C_HID_OPCODE_RESET        0x01
+#define I2C_HID_OPCODE_GET_REPORT   0x02
+#define I2C_HID_OPCODE_SET_REPORT   0x03
+#define I2C_HID_OPCODE_SET_POWER    0x08
+
+class VoodooI2CDeviceNub : public IOService {
+ public:
+    /* Creates a nub whose device describes itself with <hid_descriptor>, read from <hid_descriptor_register>
+     * @hid_descriptor The raw HID descriptor, registers are taken from it at the offsets the specification defines
+     */
+
+    static VoodooI2CDeviceNub* withDevice(UInt16 hid_descriptor_register, const void* hid_descriptor, size_t hid_descriptor_length, const void* report_descriptor, size_t report_descriptor_length) {
+        VoodooI2CDeviceNub* nub = new VoodooI2CDeviceNub;
+
+        nub->hid_descriptor_register = hid_descriptor_register;
+        nub->setHIDDescriptor(hid_descriptor, hid_descriptor_length);
+        nub->setReportDescriptor(report_descriptor, report_descriptor_length);
+
+        nub->line_thread = std::thread([nub] { nub->lineMain(); });
+
+        return nub;
+    }
+
+    // Device API
+
+    IOReturn readI2C(UInt8* values, UInt16 length) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        transfers++;
+        if (failTransfer())
+            return kIOReturnIOError;
+
+        memset(values, 0, length);
+
+        if (!input.empty()) {
+            std::vector<UInt8> report = input.front();
+            input.pop_front();
+
+            // A short read loses the rest of the report, it is not read again
+
+            memcpy(values, report.data(), report.size() < length ? report.size() : length);
+        }
+
+        line_changed.notify_all();
+
+        return kIOReturnSuccess;
+    }
+
+    IOReturn writeI2C(UInt8* values, UInt16 length) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        transfers++;
+        if (failTransfer())
+            return kIOReturnIOError;
+
+        writes.push_back(std::vector<UInt8>(values, values + length));
+
+        if (length >= 4 && registerAt(values) == command_register) {
+            switch (values[3] & 0x0F) {
+                case I2C_HID_OPCODE_RESET:
+                    resets++;
+                    input.push_back(std::vector<UInt8>(2, 0));
+                    break;
+                case I2C_HID_OPCODE_SET_POWER:
+                    power_state = values[2] & 0x03;
+                    break;
+                case I2C_HID_OPCODE_SET_REPORT:
+                    set_reports.push_back(std::vector<UInt8>(values, values + length));
+                    break;
+            }
+        }
+
+        line_changed.notify_all();
+
+        return kIOReturnSuccess;
+    }
+
+    IOReturn writeReadI2C(UInt8* write_buffer, UInt16 write_length, UInt8* read_buffer, UInt16 read_length) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        transfers++;
+        if (failTransfer())
+            return kIOReturnIOError;
+
+        memset(read_buffer, 0, read_length);
+
+        if (write_length < 2)
+            return kIOReturnSuccess;
+
+        UInt16 reg = registerAt(write_buffer);
+        const std::vector<UInt8>* response = NULL;
+        std::vector<UInt8> report;
+
+        if (reg == hid_descriptor_register) {
+            response = &hid_descriptor;
+        } else if (reg == report_descriptor_register) {
+            response = &report_descriptor;
+        } else if (reg == command_register && write_length >= 4 && (write_buffer[3] & 0x0F) == I2C_HID_OPCODE_GET_REPORT) {
+            UInt8 report_id = write_buffer[2] & 0x0F;
+
+            if (report_id == 0x0F && write_length >= 5)
+                report_id = write_buffer[4];
+
+            get_reports.push_back(std::vector<UInt8>(write_buffer, write_buffer + write_length));
+
+            auto feature = feature_reports.find(report_id);
+            if (feature != feature_reports.end()) {
+                UInt16 size = (UInt16)(feature->second.size() + 2);
+                report.push_back(size & 0xFF);
+                report.push_back(size >> 8);
+                report.insert(report.end(), feature->second.begin(), feature->second.end());
+                response = &report;
+            }
+        }
+
+        if (response)
+            memcpy(read_buffer, response->data(), response->size() < read_length ? response->size() : read_length);
+
+        return kIOReturnSuccess;
+    }
+
+    IOReturn registerInterrupt(int source, OSObject* target, IOInterruptAction handler, void* refcon) {
+        std::lock_guard<std::mutex> guard(handler_mutex);
+
+        if (this->handler)
+            return kIOReturnNoResources;
+
+        this->target = target;
+        this->handler = handler;
+        this->refcon = refcon;
+
+        return kIOReturnSuccess;
+    }
+
+    IOReturn unregisterInterrupt(int source) {
+        std::lock_guard<std::mutex> guard(handler_mutex);
+
+        handler = NULL;
+        target = NULL;
+
+        return kIOReturnSuccess;
+    }
+
+    IOReturn enableInterrupt(int source) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        interrupt_enabled = true;
+        line_changed.notify_all();
+
+        return kIOReturnSuccess;
+    }
+
+    IOReturn disableInterrupt(int source) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        interrupt_enabled = false;
+
+        return kIOReturnSuccess;
+    }
+
+    IOReturn getInterruptType(int source, int* interrupt_type) {
+        *interrupt_type = 0;
+        return kIOReturnSuccess;
+    }
+
+    // Simulated device
+
+    void setHIDDescriptor(const void* descriptor, size_t length) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        const UInt8* bytes = static_cast<const UInt8*>(descriptor);
+        hid_descriptor.assign(bytes, bytes + length);
+
+        if (length >= 20) {
+            report_descriptor_register = registerAt(bytes + 6);
+            input_register = registerAt(bytes + 8);
+            command_register = registerAt(bytes + 16);
+            data_register = registerAt(bytes + 18);
+        }
+    }
+
+    void setReportDescriptor(const void* descriptor, size_t length) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        const UInt8* bytes = static_cast<const UInt8*>(descriptor);
+        report_descriptor.assign(bytes, bytes + length);
+    }
+
+    void setFeatureReport(UInt8 report_id, std::vector<UInt8> report) {
+        std::lock_guard<std::mutex> guard(mutex);
+        feature_reports[report_id] = report;
+    }
+
+    /* Queues an input report, which asserts the interrupt line until it is read
+     * @payload The report without its length prefix, which is added here
+     */
+
+    void pushInput(std::vector<UInt8> payload) {
+        std::vector<UInt8> report;
+        UInt16 size = (UInt16)(payload.size() + 2);
+
+        report.push_back(size & 0xFF);
+        report.push_back(size >> 8);
+        report.insert(report.end(), payload.begin(), payload.end());
+
+        pushRaw(report);
+    }
+
+    /* Queues raw bytes for the input register, length prefix included, whether or not they make sense */
+
+    void pushRaw(std::vector<UInt8> report) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        input.push_back(report);
+        line_changed.notify_all();
+    }
+
+    void clearInput() {
+        std::lock_guard<std::mutex> guard(mutex);
+        input.clear();
+    }
+
+    size_t pendingInput() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return input.size();
+    }
+
+    /* Fails the next <count> transfers, or every transfer from now on if <count> is negative */
+
+    void failTransfers(int count) {
+        std::lock_guard<std::mutex> guard(mutex);
+        fail_count = count;
+    }
+
+    /* Holds the interrupt line asserted whether or not there is anything to read */
+
+    void setStuck(bool stuck) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        this->stuck = stuck;
+        line_changed.notify_all();
+    }
+
+    /* Turns the line thread on or off, with it off interrupts are only delivered by <interrupt>
+     *
+     * Returns once any interrupt the line thread was delivering has been handled.
+     */
+
+    void setAutoInterrupt(bool automatic) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+
+            auto_interrupt = automatic;
+            line_changed.notify_all();
+        }
+
+        std::lock_guard<std::mutex> guard(handler_mutex);
+    }
+
+    /* Delivers one interrupt to the registered handler, as long as it is enabled
+     *
+     * @return Whether the handler was called
+     */
+
+    bool interrupt() {
+        std::lock_guard<std::mutex> guard(handler_mutex);
+
+        {
+            std::lock_guard<std::mutex> state_guard(mutex);
+
+            if (!handler || !interrupt_enabled)
+                return false;
+
+            interrupts++;
+        }
+
+        handler(target, refcon, this, 0);
+
+        return true;
+    }
+
+    bool isInterruptEnabled() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return interrupt_enabled;
+    }
+
+    bool isInterruptRegistered() {
+        std::lock_guard<std::mutex> guard(handler_mutex);
+        return handler != NULL;
+    }
+
+    std::vector<std::vector<UInt8>> copyWrites() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return writes;
+    }
+
+    std::vector<std::vector<UInt8>> copySetReports() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return set_reports;
+    }
+
+    std::vector<std::vector<UInt8>> copyGetReports() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return get_reports;
+    }
+
+    UInt64 getTransfers() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return transfers;
+    }
+
+    UInt64 getInterrupts() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return interrupts;
+    }
+
+    UInt32 getResets() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return resets;
+    }
+
+    int getPowerState() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return power_state;
+    }
+
+ protected:
+    void free() override {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+            line_changed.notify_all();
+        }
+
+        if (line_thread.joinable())
+            line_thread.join();
+
+        IOService::free();
+    }
+
+ private:
+    static UInt16 registerAt(const UInt8* bytes) {
+        return (UInt16)(bytes[0] | bytes[1] << 8);
+    }
+
+    bool asserted() const {
+        return stuck || !input.empty();
+    }
+
+    bool failTransfer() {
+        if (!fail_count)
+            return false;
+
+        if (fail_count > 0)
+            fail_count--;
+
+        return true;
+    }
+
+    void lineMain() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (!stopping) {
+            if (!auto_interrupt || !interrupt_enabled || !asserted()) {
+                line_changed.wait_for(lock, std::chrono::milliseconds(1));
+                continue;
+            }
+
+            UInt64 transfers_before = transfers;
+
+            lock.unlock();
+            interrupt();
+            lock.lock();
+
+            // Nothing was read, so the handler left the interrupt to someone else. Don't spin on it meanwhile.
+
+            if (transfers == transfers_before && !stopping)
+                line_changed.wait_for(lock, std::chrono::microseconds(200));
+        }
+    }
+
+    std::mutex mutex;
+    std::mutex handler_mutex;
+    std::condition_variable line_changed;
+    std::thread line_thread;
+
+    OSObject* target = NULL;
+    IOInterruptAction handler = NULL;
+    void* refcon = NULL;
+    bool interrupt_enabled = false;
+    bool auto_interrupt = true;
+    bool stuck = false;
+    bool stopping = false;
+
+    UInt16 hid_descriptor_register = 0;
+    UInt16 report_descriptor_register = 0;
+    UInt16 input_register = 0;
+    UInt16 command_register = 0;
+    UInt16 data_register = 0;
+
+    std::vector<UInt8> hid_descriptor;
+    std::vector<UInt8> report_descriptor;
+    std::map<UInt8, std::vector<UInt8>> feature_reports;
+    std::deque<std::vector<UInt8>> input;
+
+    std::vector<std::vector<UInt8>> writes;
+    std::vector<std::vector<UInt8>> set_reports;
+    std::vector<std::vector<UInt8>> get_reports;
+
+    int fail_count = 0;
+    UInt64 transfers = 0;
+    UInt64 interrupts = 0;
+    UInt32 resets = 0;
+    int power_state = -1;
+};
+
+#endif /* Shim_VoodooI2CDeviceNub_hpp */
@@ -0,0 +1,46 @@
+//
+//  clock.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for the kernel clock. Uptime is a counter the tests advance by hand, in nanoseconds, so that
+//  anything timed by the sources under test is deterministic.
+//
+
+#ifndef Shim_clock_h
+#define Shim_clock_h
+
+#include <IOKit/IOTypes.h>
+
+inline AbsoluteTime shim_uptime = 1;
+
+static inline void shimAdvanceUptime(uint64_t nanoseconds) {
+    __atomic_fetch_add(&shim_uptime, nanoseconds, __ATOMIC_SEQ_CST);
+}
+
+static inline void clock_get_uptime(AbsoluteTime* result) {
+    *result = __atomic_load_n(&shim_uptime, __ATOMIC_SEQ_CST);
+}
+
+static inline void absolutetime_to_nanoseconds(AbsoluteTime abstime, uint64_t* result) {
+    *result = abstime;
+}
+
+static inline void nanoseconds_to_absolutetime(uint64_t nanoseconds, AbsoluteTime* result) {
+    *result = nanoseconds;
+}
+
+enum {
+    kNanosecondScale = 1,
+    kMicrosecondScale = 1000,
+    kMillisecondScale = 1000 * 1000,
+    kSecondScale = 1000 * 1000 * 1000
+};
+
+static inline void clock_interval_to_deadline(uint32_t interval, uint32_t scale_factor, uint64_t* result) {
+    *result = __atomic_load_n(&shim_uptime, __ATOMIC_SEQ_CST) + (uint64_t)interval * scale_factor;
+}
+
+#define SUB_ABSOLUTETIME(t1, t2)    (*(t1) -= *(t2))
+#define ADD_ABSOLUTETIME(t1, t2)    (*(t1) += *(t2))
+
+#endif /* Shim_clock_h */
@@ -0,0 +1,13 @@
+//
+//  locks.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for <kern/locks.h>. The locks the sources under test use come from IOLib.h.
+//
+
+#ifndef Shim_locks_h
+#define Shim_locks_h
+
+#include <IOKit/IOLib.h>
+
+#endif /* Shim_locks_h */
@@ -0,0 +1,345 @@
+//
+//  OSObject.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for the libkern container classes. Objects are reference counted and deleted by <OSObject::free>
+//  once the last reference goes, containers retain what they hold. Runtime type information replaces the metaclass
+//  system, which is enough for <OSDynamicCast> and <OSTypeAlloc>. Every object constructed is counted so that tests can
+//  check a path allocates none.
+//
+
+#ifndef Shim_OSObject_h
+#define Shim_OSObject_h
+
+#include <string.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#include <IOKit/IOTypes.h>
+
+inline long shim_object_constructions = 0;
+
+// Only carries the class name, which is all the sources ask a metaclass for
+
+class OSMetaClass {
+ public:
+    explicit OSMetaClass(const char* name) : name(name) {}
+
+    const char* getClassName() const {
+        return name;
+    }
+
+ private:
+    const char* name;
+};
+
+class OSObject {
+ public:
+    OSObject() {
+        __atomic_fetch_add(&shim_object_constructions, 1, __ATOMIC_RELAXED);
+    }
+
+    OSObject(const OSObject&) = delete;
+    OSObject& operator=(const OSObject&) = delete;
+
+    virtual bool init() {
+        return true;
+    }
+
+    void retain() const {
+        __atomic_fetch_add(&retain_count, 1, __ATOMIC_RELAXED);
+    }
+
+    void release() const {
+        if (__atomic_sub_fetch(&retain_count, 1, __ATOMIC_ACQ_REL) == 0)
+            const_cast<OSObject*>(this)->free();
+    }
+
+    int getRetainCount() const {
+        return __atomic_load_n(&retain_count, __ATOMIC_RELAXED);
+    }
+
+    const OSMetaClass* getMetaClass() const {
+        static std::mutex lock;
+        static std::map<const std::type_info*, OSMetaClass> classes;
+        std::lock_guard<std::mutex> guard(lock);
+
+        return &classes.emplace(&typeid(*this), OSMetaClass(typeid(*this).name())).first->second;
+    }
+
+ protected:
+    virtual ~OSObject() = default;
+
+    virtual void free() {
+        delete this;
+    }
+
+ private:
+    mutable int retain_count = 1;
+};
+
+#define OSDeclareDefaultStructors(className)    \
+ public:                                        \
+    className() = default;                      \
+ private:
+
+#define OSDefineMetaClassAndStructors(className, superclassName)
+
+#define OSTypeAlloc(type)   (new type)
+
+#define OSDynamicCast(type, inst)   (dynamic_cast<type*>(static_cast<OSObject*>(const_cast<OSObject*>(static_cast<const OSObject*>(inst)))))
+
+#define OSSafeReleaseNULL(inst)     do { if (inst) (inst)->release(); (inst) = NULL; } while (0)
+
+// Binds a member function to <self> the way the kernel's does, which GCC supports as an extension
+
+#define OSMemberFunctionCast(cptrtype, self, func)  ((cptrtype)((self)->*(func)))
+
+static inline bool OSCompareAndSwapPtr(void* oldValue, void* newValue, void* volatile* address) {
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+template <typename T>
+static inline bool OSCompareAndSwapPtr(void* oldValue, void* newValue, T* volatile* address) {
+    return __sync_bool_compare_and_swap(address, static_cast<T*>(oldValue), static_cast<T*>(newValue));
+}
+
+class OSNumber : public OSObject {
+ public:
+    static OSNumber* withNumber(unsigned long long value, unsigned int numberOfBits) {
+        OSNumber* number = new OSNumber;
+        number->value = numberOfBits < 64 ? value & ((1ULL << numberOfBits) - 1) : value;
+        return number;
+    }
+
+    UInt8 unsigned8BitValue() const {
+        return (UInt8)value;
+    }
+
+    UInt16 unsigned16BitValue() const {
+        return (UInt16)value;
+    }
+
+    UInt32 unsigned32BitValue() const {
+        return (UInt32)value;
+    }
+
+    UInt64 unsigned64BitValue() const {
+        return value;
+    }
+
+ private:
+    UInt64 value = 0;
+};
+
+class OSBoolean : public OSObject {
+ public:
+    explicit OSBoolean(bool value) : value(value) {}
+
+    bool isTrue() const {
+        return value;
+    }
+
+    bool isFalse() const {
+        return !value;
+    }
+
+ private:
+    bool value;
+};
+
+inline OSBoolean* const kOSBooleanTrue = new OSBoolean(true);
+inline OSBoolean* const kOSBooleanFalse = new OSBoolean(false);
+
+class OSString : public OSObject {
+ public:
+    static OSString* withCString(const char* string) {
+        OSString* object = new OSString;
+        object->string = string ? string : "";
+        return object;
+    }
+
+    const char* getCStringNoCopy() const {
+        return string.c_str();
+    }
+
+    unsigned int getLength() const {
+        return (unsigned int)string.size();
+    }
+
+    bool isEqualTo(const char* other) const {
+        return other && string == other;
+    }
+
+ protected:
+    std::string string;
+};
+
+// Symbols are not uniqued, they are only ever compared by their contents
+
+class OSSymbol : public OSString {
+ public:
+    static const OSSymbol* withCString(const char* string) {
+        OSSymbol* symbol = new OSSymbol;
+        symbol->string = string ? string : "";
+        return symbol;
+    }
+};
+
+class OSData : public OSObject {
+ public:
+    static OSData* withCapacity(unsigned int capacity) {
+        OSData* data = new OSData;
+        data->bytes.reserve(capacity);
+        return data;
+    }
+
+    static OSData* withBytes(const void* bytes, unsigned int length) {
+        OSData* data = new OSData;
+        data->appendBytes(bytes, length);
+        return data;
+    }
+
+    bool appendBytes(const void* bytes, unsigned int length) {
+        if (length && !bytes)
+            return false;
+
+        const UInt8* data = static_cast<const UInt8*>(bytes);
+        this->bytes.insert(this->bytes.end(), data, data + length);
+        return true;
+    }
+
+    const void* getBytesNoCopy() const {
+        return bytes.empty() ? NULL : bytes.data();
+    }
+
+    unsigned int getLength() const {
+        return (unsigned int)bytes.size();
+    }
+
+    bool isEqualTo(const OSData* other) const {
+        return other && bytes == other->bytes;
+    }
+
+ private:
+    std::vector<UInt8> bytes;
+};
+
+class OSArray : public OSObject {
+ public:
+    static OSArray* withCapacity(unsigned int capacity) {
+        OSArray* array = new OSArray;
+        array->objects.reserve(capacity);
+        return array;
+    }
+
+    bool setObject(const OSObject* object) {
+        if (!object)
+            return false;
+
+        object->retain();
+        objects.push_back(object);
+        return true;
+    }
+
+    OSObject* getObject(unsigned int index) const {
+        return index < objects.size() ? const_cast<OSObject*>(objects[index]) : NULL;
+    }
+
+    unsigned int getCount() const {
+        return (unsigned int)objects.size();
+    }
+
+    void removeObject(unsigned int index) {
+        if (index >= objects.size())
+            return;
+
+        objects[index]->release();
+        objects.erase(objects.begin() + index);
+    }
+
+ protected:
+    void free() override {
+        for (const OSObject* object : objects)
+            object->release();
+        objects.clear();
+
+        OSObject::free();
+    }
+
+ private:
+    std::vector<const OSObject*> objects;
+};
+
+class OSDictionary : public OSObject {
+ public:
+    static OSDictionary* withCapacity(unsigned int capacity) {
+        return new OSDictionary;
+    }
+
+    bool setObject(const char* key, const OSObject* object) {
+        if (!key || !object)
+            return false;
+
+        object->retain();
+
+        auto existing = objects.find(key);
+        if (existing != objects.end()) {
+            existing->second->release();
+            existing->second = object;
+        } else {
+            objects[key] = object;
+        }
+
+        return true;
+    }
+
+    bool setObject(const OSString* key, const OSObject* object) {
+        return key && setObject(key->getCStringNoCopy(), object);
+    }
+
+    OSObject* getObject(const char* key) const {
+        auto existing = objects.find(key);
+        return existing != objects.end() ? const_cast<OSObject*>(existing->second) : NULL;
+    }
+
+    OSObject* getObject(const OSString* key) const {
+        return key ? getObject(key->getCStringNoCopy()) : NULL;
+    }
+
+    void removeObject(const char* key) {
+        auto existing = objects.find(key);
+        if (existing == objects.end())
+            return;
+
+        existing->second->release();
+        objects.erase(existing);
+    }
+
+    void removeObject(const OSString* key) {
+        if (key)
+            removeObject(key->getCStringNoCopy());
+    }
+
+    unsigned int getCount() const {
+        return (unsigned int)objects.size();
+    }
+
+ protected:
+    void free() override {
+        for (auto& entry : objects)
+            entry.second->release();
+        objects.clear();
+
+        OSObject::free();
+    }
+
+ private:
+    std::map<std::string, const OSObject*> objects;
+};
+
+#endif /* Shim_OSObject_h */
@@ -0,0 +1,20 @@
+//
+//  mach_types.h
+//  VoodooI2CHID Tests
+//
+//  Host stand-in for the kmod types the kext's entry points are declared with.
+//
+
+#ifndef Shim_mach_types_h
+#define Shim_mach_types_h
+
+typedef int kern_return_t;
+
+#define KERN_SUCCESS 0
+
+typedef struct kmod_info {
+    const char* name;
+    const char* version;
+} kmod_info_t;
+
+#endif /* Shim_mach_types_h */
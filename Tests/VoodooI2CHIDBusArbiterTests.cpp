@@ -0,0 +1,290 @@
+//
+//  VoodooI2CHIDBusArbiterTests.cpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include <sched.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "VoodooI2CHIDBusArbiter.hpp"
+#include "VoodooI2CHIDTest.hpp"
+
+#define MS  1000000ULL
+
+/* Records the order in which clients are granted the bus */
+
+class GrantLog {
+ public:
+    void add(int client) {
+        std::lock_guard<std::mutex> guard(mutex);
+        order.push_back(client);
+    }
+
+    std::vector<int> order;
+
+ private:
+    std::mutex mutex;
+};
+
+static void waitUntilWaiting(VoodooI2CHIDBusClient* client) {
+    while (!__atomic_load_n(&client->waiting, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+/* Queues clients behind a holder one at a time, then releases the bus and returns the order they got it in
+ * @clients The clients to queue, in the order they start waiting
+ * @bytes What each of them transfers once granted the bus
+ */
+
+static std::vector<int> grantOrder(VoodooI2CHIDBusArbiter* arbiter, VoodooI2CHIDBusClient* holder, std::vector<VoodooI2CHIDBusClient*> clients, UInt32 bytes) {
+    GrantLog log;
+    std::vector<std::thread> threads;
+
+    arbiter->acquireBus(holder);
+
+    for (size_t i = 0; i < clients.size(); i++) {
+        threads.emplace_back([arbiter, &clients, &log, i, bytes] {
+            arbiter->acquireBus(clients[i]);
+            log.add((int)i);
+            arbiter->releaseBus(clients[i], bytes);
+        });
+
+        waitUntilWaiting(clients[i]);
+    }
+
+    arbiter->releaseBus(holder, 0);
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    return log.order;
+}
+
+/* Runs a client on its own so that it transfers <bytes> within the current budget window */
+
+static void transfer(VoodooI2CHIDBusArbiter* arbiter, VoodooI2CHIDBusClient* client, UInt32 bytes) {
+    arbiter->acquireBus(client);
+    arbiter->releaseBus(client, bytes);
+}
+
+static void testArbiterPerController() {
+    IOService* first = new IOService;
+    IOService* second = new IOService;
+
+    VoodooI2CHIDBusArbiter* a = VoodooI2CHIDBusArbiter::arbiterForController(first);
+    VoodooI2CHIDBusArbiter* b = VoodooI2CHIDBusArbiter::arbiterForController(first);
+    VoodooI2CHIDBusArbiter* c = VoodooI2CHIDBusArbiter::arbiterForController(second);
+
+    CHECK(a != NULL && c != NULL);
+    CHECK(a == b);
+    CHECK(a != c);
+
+    a->release();
+    b->release();
+    c->release();
+    first->release();
+    second->release();
+}
+
+/* Waiting clients are granted the bus by priority, whatever order they queued in */
+
+static void testPriorityOrder() {
+    IOService* controller = new IOService;
+    VoodooI2CHIDBusArbiter* arbiter = VoodooI2CHIDBusArbiter::arbiterForController(controller);
+    VoodooI2CHIDBusClient holder, touch, pen, other, sensor;
+
+    arbiter->registerClient(&holder, kVoodooI2CHIDBusPriorityTouch, 0);
+    arbiter->registerClient(&sensor, kVoodooI2CHIDBusPrioritySensor, I2C_HID_BUS_BUDGET_SENSOR);
+    arbiter->registerClient(&other, kVoodooI2CHIDBusPriorityOther, I2C_HID_BUS_BUDGET_OTHER);
+    arbiter->registerClient(&pen, kVoodooI2CHIDBusPriorityPen, 0);
+    arbiter->registerClient(&touch, kVoodooI2CHIDBusPriorityTouch, 0);
+
+    std::vector<int> order = grantOrder(arbiter, &holder, {&sensor, &other, &pen, &touch}, 16);
+
+    CHECK_EQUAL(order.size(), 4);
+    CHECK(order == std::vector<int>({3, 2, 1, 0}));
+
+    CHECK_EQUAL(sensor.contended, 1);
+    CHECK_EQUAL(touch.grants, 1);
+    CHECK_EQUAL(holder.contended, 0);
+
+    arbiter->unregisterClient(&touch);
+    arbiter->unregisterClient(&pen);
+    arbiter->unregisterClient(&other);
+    arbiter->unregisterClient(&sensor);
+    arbiter->unregisterClient(&holder);
+    arbiter->release();
+    controller->release();
+}
+
+/* Within a priority, the client that transferred the least goes first */
+
+static void testFairQueuing() {
+    IOService* controller = new IOService;
+    VoodooI2CHIDBusArbiter* arbiter = VoodooI2CHIDBusArbiter::arbiterForController(controller);
+    VoodooI2CHIDBusClient holder, busy, quiet;
+
+    arbiter->registerClient(&holder, kVoodooI2CHIDBusPriorityTouch, 0);
+    arbiter->registerClient(&busy, kVoodooI2CHIDBusPriorityOther, 0);
+    arbiter->registerClient(&quiet, kVoodooI2CHIDBusPriorityOther, 0);
+
+    transfer(arbiter, &busy, 4096);
+    transfer(arbiter, &quiet, 64);
+
+    std::vector<int> order = grantOrder(arbiter, &holder, {&busy, &quiet}, 64);
+
+    CHECK(order == std::vector<int>({1, 0}));
+
+    // A client registering late starts at the virtual clock, which last followed <busy>, rather than being owed
+    // everything the others transferred. Neither does <quiet> bank what it left unused while not waiting.
+
+    VoodooI2CHIDBusClient late;
+    arbiter->registerClient(&late, kVoodooI2CHIDBusPriorityOther, 0);
+
+    CHECK_EQUAL(late.virtual_time, 4096);
+
+    order = grantOrder(arbiter, &holder, {&late, &quiet}, 64);
+
+    CHECK_EQUAL(order.size(), 2);
+    CHECK_EQUAL(late.virtual_time, 4096 + 64);
+    CHECK_EQUAL(quiet.virtual_time, 4096 + 64);
+
+    arbiter->unregisterClient(&late);
+    arbiter->unregisterClient(&quiet);
+    arbiter->unregisterClient(&busy);
+    arbiter->unregisterClient(&holder);
+    arbiter->release();
+    controller->release();
+}
+
+/* A client over its budget yields to anyone within theirs, even of a lower priority, until its window ends */
+
+static void testBudget() {
+    IOService* controller = new IOService;
+    VoodooI2CHIDBusArbiter* arbiter = VoodooI2CHIDBusArbiter::arbiterForController(controller);
+    VoodooI2CHIDBusClient holder, other, sensor;
+    UInt32 window_budget = I2C_HID_BUS_BUDGET_OTHER * I2C_HID_BUS_WINDOW_MS / 1000;
+
+    arbiter->registerClient(&holder, kVoodooI2CHIDBusPriorityTouch, 0);
+    arbiter->registerClient(&other, kVoodooI2CHIDBusPriorityOther, I2C_HID_BUS_BUDGET_OTHER);
+    arbiter->registerClient(&sensor, kVoodooI2CHIDBusPrioritySensor, I2C_HID_BUS_BUDGET_SENSOR);
+
+    transfer(arbiter, &other, window_budget + 1);
+
+    std::vector<int> order = grantOrder(arbiter, &holder, {&other, &sensor}, 1);
+
+    CHECK(order == std::vector<int>({1, 0}));
+    CHECK_EQUAL(other.over_budget, 1);
+    CHECK_EQUAL(sensor.over_budget, 0);
+
+    // Over budget, but nobody else is waiting
+
+    order = grantOrder(arbiter, &holder, {&other}, 1);
+    CHECK(order == std::vector<int>({0}));
+
+    // A new window restores the priority order
+
+    shimAdvanceUptime(I2C_HID_BUS_WINDOW_MS * MS);
+
+    order = grantOrder(arbiter, &holder, {&sensor, &other}, 1);
+    CHECK(order == std::vector<int>({1, 0}));
+
+    arbiter->unregisterClient(&sensor);
+    arbiter->unregisterClient(&other);
+    arbiter->unregisterClient(&holder);
+    arbiter->release();
+    controller->release();
+}
+
+/* Several devices hammering one controller: the bus is never held twice, nobody starves and the accounting adds up */
+
+static void testSimulation() {
+    const int client_count = 6;
+    const int transfers = 2000;
+
+    IOService* controller = new IOService;
+    VoodooI2CHIDBusArbiter* arbiter = VoodooI2CHIDBusArbiter::arbiterForController(controller);
+    VoodooI2CHIDBusClient clients[client_count];
+    UInt64 expected_bytes[client_count] = {};
+    std::atomic<int> holders(0);
+    std::atomic<int> overlaps(0);
+    std::vector<std::thread> threads;
+
+    const VoodooI2CHIDBusPriority priorities[client_count] = {
+        kVoodooI2CHIDBusPriorityTouch, kVoodooI2CHIDBusPriorityTouch, kVoodooI2CHIDBusPriorityPen,
+        kVoodooI2CHIDBusPriorityOther, kVoodooI2CHIDBusPrioritySensor, kVoodooI2CHIDBusPrioritySensor
+    };
+
+    for (int i = 0; i < client_count; i++) {
+        UInt32 budget = priorities[i] == kVoodooI2CHIDBusPrioritySensor ? I2C_HID_BUS_BUDGET_SENSOR : 0;
+        arbiter->registerClient(&clients[i], priorities[i], budget);
+    }
+
+    for (int i = 0; i < client_count; i++) {
+        threads.emplace_back([&, i] {
+            TestRandom random(0xB05 + i);
+
+            for (int j = 0; j < transfers; j++) {
+                UInt32 bytes = 1 + random.below(priorities[i] == kVoodooI2CHIDBusPrioritySensor ? 512 : 64);
+
+                arbiter->acquireBus(&clients[i]);
+
+                if (holders.fetch_add(1) != 0)
+                    overlaps++;
+
+                if (random.below(8) == 0)
+                    sched_yield();
+
+                holders.fetch_sub(1);
+
+                arbiter->releaseBus(&clients[i], bytes);
+                expected_bytes[i] += bytes;
+
+                if (random.below(16) == 0)
+                    shimAdvanceUptime(MS);
+            }
+        });
+    }
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    CHECK_EQUAL(overlaps.load(), 0);
+
+    for (int i = 0; i < client_count; i++) {
+        CHECK_EQUAL(clients[i].grants, transfers);
+        CHECK_EQUAL(clients[i].bytes, expected_bytes[i]);
+        CHECK_EQUAL(clients[i].wait.count, transfers);
+        CHECK(!clients[i].waiting);
+    }
+
+    for (int i = 0; i < client_count; i++)
+        arbiter->unregisterClient(&clients[i]);
+
+    // With everyone gone the bus is free again
+
+    VoodooI2CHIDBusClient last;
+    arbiter->registerClient(&last, kVoodooI2CHIDBusPriorityOther, 0);
+    transfer(arbiter, &last, 1);
+    CHECK_EQUAL(last.contended, 0);
+    arbiter->unregisterClient(&last);
+
+    arbiter->release();
+    controller->release();
+}
+
+int main() {
+    testArbiterPerController();
+    testPriorityOrder();
+    testFairQueuing();
+    testBudget();
+    testSimulation();
+
+    return testResult("VoodooI2CHIDBusArbiterTests");
+}
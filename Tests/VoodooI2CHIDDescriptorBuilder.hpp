@@ -0,0 +1,147 @@
+//
+//  VoodooI2CHIDDescriptorBuilder.hpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDDescriptorBuilder_hpp
+#define VoodooI2CHIDDescriptorBuilder_hpp
+
+#include <vector>
+
+#include <IOKit/hid/IOHIDElement.h>
+#include <IOKit/hid/IOHIDUsageTables.h>
+
+#include "VoodooI2CHIDReportLayout.hpp"
+#include "VoodooI2CHIDTest.hpp"
+
+// Describes digitisers both as report descriptors and as the element trees <IOHIDDevice> builds out of them
+
+#define REPORT_BYTES    I2C_HID_LAYOUT_MAX_REPORT_LENGTH
+
+/* Reads a field one bit at a time, the way the HID specification describes it, as a reference for the decoders */
+
+static UInt32 referenceValue(const UInt8* report, UInt32 bit_offset, UInt32 bit_size, bool is_signed) {
+    uint64_t value = 0;
+
+    for (UInt32 i = 0; i < bit_size; i++) {
+        UInt32 bit = bit_offset + i;
+        value |= (uint64_t)((report[bit / 8] >> (bit % 8)) & 1) << i;
+    }
+
+    if (is_signed && (value >> (bit_size - 1)) & 1) {
+        for (UInt32 i = bit_size; i < 64; i++)
+            value |= 1ULL << i;
+    }
+
+    return (UInt32)value;
+}
+
+static void fillReport(TestRandom* random, UInt8* report, UInt32 length) {
+    for (UInt32 i = 0; i < length; i++)
+        report[i] = (UInt8)random->next();
+}
+
+/* Builds report descriptors item by item */
+
+class DescriptorBuilder {
+ public:
+    void item(UInt8 prefix, UInt32 data, UInt32 size) {
+        bytes.push_back(prefix | (size == 4 ? 3 : size));
+
+        for (UInt32 i = 0; i < size; i++)
+            bytes.push_back((UInt8)(data >> (8 * i)));
+    }
+
+    void usagePage(UInt32 page) { item(0x04, page, 1); }
+    void usage(UInt32 usage) { item(0x08, usage, 1); }
+    void logicalMinimum(SInt32 minimum) { item(0x14, (UInt32)minimum, minimum < -128 || minimum > 127 ? 2 : 1); }
+    void logicalMaximum(UInt32 maximum) { item(0x24, maximum, maximum > 127 ? 2 : 1); }
+    void reportSize(UInt32 size) { item(0x74, size, 1); }
+    void reportCount(UInt32 count) { item(0x94, count, 1); }
+    void reportID(UInt32 id) { item(0x84, id, 1); }
+    void input(UInt32 flags) { item(0x80, flags, 1); }
+    void collection(UInt32 type) { item(0xA0, type, 1); }
+    void endCollection() { item(0xC0, 0, 0); }
+
+    std::vector<UInt8> bytes;
+};
+
+/* A finger field as both the descriptor and the element tree describe it */
+
+typedef struct {
+    UInt16 usage_page;
+    UInt16 usage;
+    UInt8 bit_size;
+    SInt32 logical_min;
+    UInt32 logical_max;
+} FingerField;
+
+#define FIELD_PADDING   0
+
+/* Describes a touchpad whose report <report_id> holds <fingers> identical finger collections, followed by a
+ * contact count, and the elements <IOHIDDevice> would build for it
+ */
+
+static void buildTouchpad(DescriptorBuilder* descriptor, OSArray* fingers, UInt32 report_id, UInt32 finger_count, const FingerField* fields, UInt32 field_count) {
+    descriptor->usagePage(kHIDPage_Digitizer);
+    descriptor->usage(kHIDUsage_Dig_TouchPad);
+    descriptor->collection(0x01);
+    descriptor->reportID(report_id);
+
+    for (UInt32 finger = 0; finger < finger_count; finger++) {
+        IOHIDElement* collection = IOHIDElement::withUsage(kIOHIDElementTypeCollection, kHIDPage_Digitizer, kHIDUsage_Dig_Finger);
+
+        descriptor->usagePage(kHIDPage_Digitizer);
+        descriptor->usage(kHIDUsage_Dig_Finger);
+        descriptor->collection(0x02);
+
+        for (UInt32 i = 0; i < field_count; i++) {
+            const FingerField* field = &fields[i];
+
+            descriptor->reportSize(field->bit_size);
+            descriptor->reportCount(1);
+
+            if (field->usage == FIELD_PADDING) {
+                descriptor->input(0x03);
+                continue;
+            }
+
+            descriptor->usagePage(field->usage_page);
+            descriptor->logicalMinimum(field->logical_min);
+            descriptor->logicalMaximum(field->logical_max);
+            descriptor->usage(field->usage);
+            descriptor->input(0x02);
+
+            IOHIDElementType type = field->bit_size == 1 ? kIOHIDElementTypeInput_Button : kIOHIDElementTypeInput_Misc;
+            collection->addChild(IOHIDElement::withUsage(type, field->usage_page, field->usage, report_id, field->bit_size, field->logical_max, field->logical_max));
+        }
+
+        descriptor->usagePage(kHIDPage_Digitizer);
+        descriptor->endCollection();
+
+        fingers->setObject(collection);
+        collection->release();
+    }
+
+    descriptor->usagePage(kHIDPage_Digitizer);
+    descriptor->logicalMinimum(0);
+    descriptor->logicalMaximum(127);
+    descriptor->reportSize(8);
+    descriptor->reportCount(1);
+    descriptor->usage(0x54);
+    descriptor->input(0x02);
+    descriptor->endCollection();
+}
+
+static UInt32 fingerBits(const FingerField* fields, UInt32 field_count) {
+    UInt32 bits = 0;
+
+    for (UInt32 i = 0; i < field_count; i++)
+        bits += fields[i].bit_size;
+
+    return bits;
+}
+
+#endif /* VoodooI2CHIDDescriptorBuilder_hpp */
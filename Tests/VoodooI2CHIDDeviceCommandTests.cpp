@@ -0,0 +1,482 @@
+//
+//  VoodooI2CHIDDeviceCommandTests.cpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include <mach/mach_types.h>
+
+#include <atomic>
+#include <thread>
+
+#include "VoodooI2CHIDDeviceHarness.hpp"
+#include "VoodooI2CHIDTraceDecoder.hpp"
+
+extern "C" kern_return_t VoodooI2CHID_stop(kmod_info_t* info, void* data);
+
+/* Checks a command left the bus as it found it */
+
+static void checkUnlocked(VoodooI2CHIDDevice* device) {
+    CHECK(!device->read_in_progress);
+
+    bool locked = IOLockTryLock(device->read_in_progress_mutex);
+    CHECK(locked);
+    if (locked)
+        IOLockUnlock(device->read_in_progress_mutex);
+}
+
+/* Every command built in the transfer arena gives up cleanly when the arena has nothing to hand out */
+
+static void testArenaExhaustion() {
+    TestDeviceFixture fixture;
+    CHECK(fixture.start());
+
+    VoodooI2CHIDDevice* device = fixture.device;
+
+    fixture.nub->setAutoInterrupt(false);
+    fixture.settle();
+
+    UInt64 transfers = fixture.nub->getTransfers();
+    UInt64 failures = device->transfer_arena.failures;
+
+    device->transfer_arena.free();
+
+    CHECK_EQUAL(device->getHIDDescriptor(), kIOReturnNoSpace);
+    checkUnlocked(device);
+
+    CHECK_EQUAL(device->refetchHIDDescriptor(), kIOReturnNoSpace);
+    checkUnlocked(device);
+
+    CHECK_EQUAL(device->setHIDPowerState(kVoodooI2CStateOn), kIOReturnNoSpace);
+    checkUnlocked(device);
+
+    IOReturn ret = device->command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, device, &VoodooI2CHIDDevice::startResetGated));
+    CHECK_EQUAL(ret, kIOReturnNoSpace);
+    checkUnlocked(device);
+
+    // The reset was never sent, so it isn't waited for either
+
+    CHECK_EQUAL(device->reset_state, kVoodooI2CHIDResetIdle);
+    CHECK_EQUAL(device->reset_timer->getDeadline(), 0);
+
+    CHECK_EQUAL(fixture.nub->getTransfers(), transfers);
+    CHECK(device->transfer_arena.failures >= failures + 5);
+
+    // With the arena back the device resets as usual
+
+    CHECK(device->transfer_arena.init(I2C_MAX_BUF_SIZE));
+    fixture.nub->setAutoInterrupt(true);
+
+    UInt32 resets = fixture.nub->getResets();
+
+    CHECK_EQUAL(device->resetHIDDevice(), kIOReturnSuccess);
+    CHECK_EQUAL(fixture.nub->getResets(), resets + 1);
+    CHECK_EQUAL(device->reset_state, kVoodooI2CHIDResetAcknowledged);
+
+    fixture.nub->setAutoInterrupt(false);
+    fixture.settle();
+    checkUnlocked(device);
+}
+
+/* The trace of the bus transactions of a start can be dumped and decoded */
+
+static void testTransactionTrace() {
+    TestDeviceFixture fixture;
+    CHECK(fixture.start());
+
+    VoodooI2CHIDDevice* device = fixture.device;
+
+    fixture.nub->setAutoInterrupt(false);
+    fixture.settle();
+
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    properties->setObject("DumpTransactionTrace", kOSBooleanTrue);
+    CHECK_EQUAL(device->setProperties(properties), kIOReturnSuccess);
+    properties->release();
+
+    OSData* trace = OSDynamicCast(OSData, device->getProperty("TransactionTrace"));
+    CHECK(trace);
+    if (!trace)
+        return;
+
+    CHECK(trace->getLength());
+    CHECK_EQUAL(trace->getLength() % sizeof(VoodooI2CHIDDeviceTraceRecord), 0);
+
+    std::string timeline = decodeTransactionTrace(trace->getBytesNoCopy(), trace->getLength());
+
+    // The HID descriptor, power and reset commands, the acknowledgement and then the report descriptor
+
+    size_t hid_descriptor = timeline.find("write-read reg 0x0001");
+    size_t commands = timeline.find("write      reg 0x0005");
+    size_t acknowledgement = timeline.find("read       reg 0x0003");
+    size_t report_descriptor = timeline.find("write-read reg 0x0002");
+
+    CHECK(hid_descriptor < commands);
+    CHECK(commands < acknowledgement);
+    CHECK(acknowledgement < report_descriptor && report_descriptor != std::string::npos);
+    CHECK(timeline.find("missing") == std::string::npos);
+    CHECK(timeline.find("error") == std::string::npos);
+}
+
+/* Makes <fixture> the same device as <product_id> as far as the descriptor cache is concerned */
+
+static void shareProductID(TestDeviceFixture& fixture, UInt16 product_id) {
+    fixture.hid_descriptor.wProductID = product_id;
+    fixture.nub->setHIDDescriptor(&fixture.hid_descriptor, sizeof(fixture.hid_descriptor));
+}
+
+/* A cached report descriptor the device no longer reports is dropped, the device carries on with the new one */
+
+static void testDescriptorCacheMismatch() {
+    UInt16 product_id;
+
+    {
+        TestDeviceFixture first;
+        CHECK(first.start());
+        CHECK(!first.device->descriptor_cache_hit);
+
+        product_id = first.hid_descriptor.wProductID;
+    }
+
+    TestDeviceFixture fixture;
+    shareProductID(fixture, product_id);
+    CHECK(fixture.start());
+
+    TestHIDDevice* device = fixture.device;
+
+    CHECK(device->descriptor_cache_hit);
+    CHECK(device->descriptor_verifier->getDeadline());
+
+    // Same length, different usage
+
+    std::vector<UInt8> changed = testReportDescriptor(6);
+    changed[17] = 0x03;
+    fixture.nub->setReportDescriptor(changed.data(), changed.size());
+
+    fixture.advance(I2C_HID_DESCRIPTOR_VERIFY_DELAY_MS * MS);
+
+    CHECK(device->descriptor_cache_verified);
+    CHECK_EQUAL(device->descriptor_cache_mismatches, 1);
+
+    OSData* published = OSDynamicCast(OSData, device->getProperty(kIOHIDReportDescriptorKey));
+    CHECK(published && published->getLength() == changed.size() && !memcmp(published->getBytesNoCopy(), changed.data(), changed.size()));
+
+    // The device was neither terminated nor stopped
+
+    fixture.nub->pushInput({1, 2, 3, 4, 5, 6});
+    CHECK(fixture.waitUntil([&] { return device->reportCount() == 1; }));
+
+    // The next start reads the descriptor over the bus again
+
+    TestDeviceFixture next;
+    shareProductID(next, product_id);
+    next.nub->setReportDescriptor(changed.data(), changed.size());
+    CHECK(next.start());
+    CHECK(!next.device->descriptor_cache_hit);
+}
+
+/* Unloading the kext releases the cache, which is set up again on the next start */
+
+static void testDescriptorCacheRelease() {
+    CHECK_EQUAL(VoodooI2CHID_stop(NULL, NULL), KERN_SUCCESS);
+    CHECK_EQUAL(VoodooI2CHID_stop(NULL, NULL), KERN_SUCCESS);
+
+    TestDeviceFixture fixture;
+    CHECK(fixture.start());
+
+    TestDeviceFixture again;
+    shareProductID(again, fixture.hid_descriptor.wProductID);
+    CHECK(again.start());
+    CHECK(again.device->descriptor_cache_hit);
+
+    CHECK_EQUAL(VoodooI2CHID_stop(NULL, NULL), KERN_SUCCESS);
+}
+
+/* Holds queued commands back, the way a set report does, for <milliseconds> of simulated time */
+
+static void quietBus(TestDeviceFixture& fixture, UInt32 milliseconds) {
+    fixture.loop->closeGate();
+    clock_interval_to_deadline(milliseconds, kMillisecondScale, &fixture.device->bus_quiet_until);
+    fixture.loop->openGate();
+}
+
+/* Issues a get report for <report_id> on another thread, which blocks until it completes */
+
+static std::thread getReportSynchronously(TestHIDDevice* device, UInt8 report_id, UInt32 timeout, std::atomic<IOReturn>* status) {
+    return std::thread([device, report_id, timeout, status] {
+        IOBufferMemoryDescriptor* report = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, 8);
+
+        *status = device->getReport(report, kIOHIDReportTypeFeature, report_id, timeout, NULL);
+        report->release();
+    });
+}
+
+static void getReportAsynchronously(TestHIDDevice* device, UInt8 report_id, std::atomic<int>* completed) {
+    IOBufferMemoryDescriptor* report = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, 8);
+    IOHIDCompletion completion;
+
+    completion.target = completed;
+    completion.parameter = NULL;
+    completion.action = [](void* target, void* parameter, IOReturn status, UInt32 remaining) {
+        if (status == kIOReturnSuccess)
+            (*reinterpret_cast<std::atomic<int>*>(target))++;
+    };
+
+    CHECK_EQUAL(device->getReport(report, kIOHIDReportTypeFeature, report_id, 0, &completion), kIOReturnSuccess);
+    report->release();
+}
+
+/* The report IDs of the get reports that went out on the bus, in order */
+
+static std::vector<UInt8> sentReportIDs(TestDeviceFixture& fixture) {
+    std::vector<UInt8> ids;
+
+    for (const std::vector<UInt8>& command : fixture.nub->copyGetReports())
+        ids.push_back(command[2] & 0x0F);
+
+    return ids;
+}
+
+/* Blocked callers go ahead of asynchronous commands, commands of the same priority run in the order they were queued */
+
+static void testCommandOrdering() {
+    TestDeviceFixture fixture;
+    CHECK(fixture.start());
+
+    TestHIDDevice* device = fixture.device;
+    std::atomic<int> completed(0);
+    std::atomic<IOReturn> first(kIOReturnError);
+    std::atomic<IOReturn> second(kIOReturnError);
+
+    fixture.nub->setAutoInterrupt(false);
+    fixture.settle();
+
+    quietBus(fixture, 100);
+
+    getReportAsynchronously(device, 1, &completed);
+    getReportAsynchronously(device, 2, &completed);
+
+    std::thread blocked = getReportSynchronously(device, 3, 0, &first);
+    CHECK(fixture.waitUntil([&] { return device->command_queue_depth == 3; }));
+
+    std::thread blocked_too = getReportSynchronously(device, 4, 0, &second);
+    CHECK(fixture.waitUntil([&] { return device->command_queue_depth == 4; }));
+
+    getReportAsynchronously(device, 5, &completed);
+
+    CHECK(sentReportIDs(fixture).empty());
+
+    fixture.advance(100 * MS);
+
+    blocked.join();
+    blocked_too.join();
+
+    CHECK(fixture.waitUntil([&] { return completed == 3; }));
+    CHECK_EQUAL(first.load(), kIOReturnSuccess);
+    CHECK_EQUAL(second.load(), kIOReturnSuccess);
+    CHECK(sentReportIDs(fixture) == std::vector<UInt8>({3, 4, 1, 2, 5}));
+    CHECK_EQUAL(device->command_queue_depth, 0);
+}
+
+/* A blocked caller whose timeout expires before its command ran gets its command back, the others still run */
+
+static void testCommandTimeout() {
+    TestDeviceFixture fixture;
+    CHECK(fixture.start());
+
+    TestHIDDevice* device = fixture.device;
+    std::atomic<IOReturn> patient(kIOReturnError);
+    std::atomic<IOReturn> impatient(kIOReturnError);
+    std::atomic<IOReturn> late(kIOReturnError);
+
+    fixture.nub->setAutoInterrupt(false);
+    fixture.settle();
+
+    quietBus(fixture, 1000);
+
+    std::thread first = getReportSynchronously(device, 1, 0, &patient);
+    CHECK(fixture.waitUntil([&] { return device->command_queue_depth == 1; }));
+
+    std::thread second = getReportSynchronously(device, 2, 20, &impatient);
+    CHECK(fixture.waitUntil([&] { return device->command_queue_depth == 2; }));
+
+    fixture.advance(20 * MS);
+    second.join();
+
+    CHECK_EQUAL(impatient.load(), kIOReturnTimeout);
+    CHECK_EQUAL(device->command_queue_depth, 1);
+    CHECK_EQUAL(device->commands_timed_out, 1);
+
+    // It was the last one queued, the next one goes behind the one left
+
+    std::thread third = getReportSynchronously(device, 3, 0, &late);
+    CHECK(fixture.waitUntil([&] { return device->command_queue_depth == 2; }));
+
+    fixture.advance(1000 * MS);
+
+    first.join();
+    third.join();
+
+    CHECK_EQUAL(patient.load(), kIOReturnSuccess);
+    CHECK_EQUAL(late.load(), kIOReturnSuccess);
+    CHECK(sentReportIDs(fixture) == std::vector<UInt8>({1, 3}));
+    CHECK_EQUAL(device->command_queue_depth, 0);
+}
+
+/* A HID descriptor that changed by the time recovery fetches it again is applied, input buffers grow to match */
+
+static void testDescriptorRefetch() {
+    TestDeviceFixture fixture;
+    CHECK(fixture.start());
+
+    TestHIDDevice* device = fixture.device;
+    bool changed = true;
+
+    fixture.nub->setAutoInterrupt(false);
+    fixture.settle();
+
+    CHECK_EQUAL(device->refetchHIDDescriptor(&changed), kIOReturnSuccess);
+    CHECK(!changed);
+
+    // Reports already in the ring were read at the old size, they are dropped
+
+    UInt64 lost = device->lost_reports;
+
+    fixture.loop->closeGate();
+
+    fixture.nub->pushInput({1, 2, 3, 4, 5, 6});
+    CHECK(fixture.nub->interrupt());
+    fixture.nub->pushInput({1, 2, 3, 4, 5, 6});
+    CHECK(fixture.nub->interrupt());
+
+    CHECK_EQUAL(device->report_ring_head - device->report_ring_tail, 2);
+
+    fixture.hid_descriptor.wMaxInputLength = 32;
+    fixture.nub->setHIDDescriptor(&fixture.hid_descriptor, sizeof(fixture.hid_descriptor));
+
+    CHECK_EQUAL(device->refetchHIDDescriptor(&changed), kIOReturnSuccess);
+    CHECK(changed);
+
+    fixture.loop->openGate();
+
+    CHECK_EQUAL(device->report_ring_head, device->report_ring_tail);
+    CHECK_EQUAL(device->lost_reports, lost + 2);
+    CHECK_EQUAL(device->hid_descriptor.wMaxInputLength, 32);
+    CHECK_EQUAL(device->report_ring_slot_size, 32);
+    CHECK(device->input_report_buffer->getCapacity() >= 32);
+    checkUnlocked(device);
+
+    OSDictionary* published = OSDynamicCast(OSDictionary, device->getProperty("HIDDescriptor"));
+    OSNumber* max_input_length = published ? OSDynamicCast(OSNumber, published->getObject("MaxInputLength")) : NULL;
+    CHECK(max_input_length && max_input_length->unsigned32BitValue() == 32);
+
+    // A report longer than the old maximum now makes it through whole
+
+    std::vector<UInt8> longer(28);
+    for (size_t i = 0; i < longer.size(); i++)
+        longer[i] = (UInt8)i;
+
+    fixture.nub->pushInput(longer);
+    CHECK(fixture.nub->interrupt());
+    CHECK(fixture.waitUntil([&] { return device->reportCount() == 1; }));
+    CHECK(device->copyReports()[0] == longer);
+
+    // Shorter reports fit the slots as they are
+
+    fixture.hid_descriptor.wMaxInputLength = 16;
+    fixture.nub->setHIDDescriptor(&fixture.hid_descriptor, sizeof(fixture.hid_descriptor));
+
+    fixture.loop->closeGate();
+    CHECK_EQUAL(device->refetchHIDDescriptor(&changed), kIOReturnSuccess);
+    fixture.loop->openGate();
+
+    CHECK(changed);
+    CHECK_EQUAL(device->hid_descriptor.wMaxInputLength, 16);
+    CHECK_EQUAL(device->report_ring_slot_size, 32);
+
+    // A malformed descriptor is not applied
+
+    fixture.hid_descriptor.bcdVersion = 0x0200;
+    fixture.nub->setHIDDescriptor(&fixture.hid_descriptor, sizeof(fixture.hid_descriptor));
+
+    fixture.loop->closeGate();
+    CHECK_EQUAL(device->refetchHIDDescriptor(&changed), kIOReturnInvalid);
+    fixture.loop->openGate();
+
+    CHECK(!changed);
+    CHECK_EQUAL(device->hid_descriptor.bcdVersion, 0x0100);
+    checkUnlocked(device);
+}
+
+/* Sends a feature report of 3 bytes with <report_id> and returns what went out on the bus */
+
+static std::vector<UInt8> sendSetReport(TestDeviceFixture& fixture, UInt8 report_id) {
+    const UInt8 bytes[] = {0xAA, 0xBB, 0xCC};
+    IOBufferMemoryDescriptor* report = IOBufferMemoryDescriptor::withBytes(bytes, sizeof(bytes));
+    size_t sent = fixture.nub->copySetReports().size();
+
+    // Past the quiet period of the previous one
+
+    shimAdvanceUptime(I2C_HID_SET_REPORT_QUIET_MS * MS);
+
+    CHECK_EQUAL(fixture.device->setReport(report, kIOHIDReportTypeFeature, report_id), kIOReturnSuccess);
+    report->release();
+
+    std::vector<std::vector<UInt8>> reports = fixture.nub->copySetReports();
+    CHECK_EQUAL(reports.size(), sent + 1);
+
+    return reports.size() == sent + 1 ? reports.back() : std::vector<UInt8>();
+}
+
+/* Report IDs from 15 up are sent as an extra byte after the opcode, and in full ahead of the report */
+
+static void testSetReportHeader() {
+    TestDeviceFixture fixture;
+    CHECK(fixture.start());
+
+    TestHIDDevice* device = fixture.device;
+    UInt8 header[sizeof(VoodooI2CHIDDeviceCommand) + I2C_HID_SET_REPORT_MAX_HEADER];
+
+    fixture.nub->setAutoInterrupt(false);
+    fixture.settle();
+
+    // Command register, type and ID, opcode, data register, length, report ID
+
+    CHECK_EQUAL(device->encodeSetReportHeader(header, 0x03, 0x00, 3), 8);
+    CHECK(std::vector<UInt8>(header, header + 8) == std::vector<UInt8>({0x05, 0x00, 0x30, 0x03, 0x06, 0x00, 0x05, 0x00}));
+
+    CHECK_EQUAL(device->encodeSetReportHeader(header, 0x03, 0x05, 3), 9);
+    CHECK(std::vector<UInt8>(header, header + 9) == std::vector<UInt8>({0x05, 0x00, 0x35, 0x03, 0x06, 0x00, 0x06, 0x00, 0x05}));
+
+    CHECK_EQUAL(device->encodeSetReportHeader(header, 0x03, 0x0E, 3), 9);
+    CHECK(std::vector<UInt8>(header, header + 9) == std::vector<UInt8>({0x05, 0x00, 0x3E, 0x03, 0x06, 0x00, 0x06, 0x00, 0x0E}));
+
+    CHECK_EQUAL(device->encodeSetReportHeader(header, 0x03, 0x0F, 3), 10);
+    CHECK(std::vector<UInt8>(header, header + 10) == std::vector<UInt8>({0x05, 0x00, 0x3F, 0x03, 0x0F, 0x06, 0x00, 0x06, 0x00, 0x0F}));
+
+    CHECK_EQUAL(device->encodeSetReportHeader(header, 0x02, 0x42, 3), 10);
+    CHECK(std::vector<UInt8>(header, header + 10) == std::vector<UInt8>({0x05, 0x00, 0x2F, 0x03, 0x42, 0x06, 0x00, 0x06, 0x00, 0x42}));
+
+    CHECK_EQUAL(device->encodeSetReportHeader(header, 0x03, 0xFF, 0x1234), 10);
+    CHECK(std::vector<UInt8>(header, header + 10) == std::vector<UInt8>({0x05, 0x00, 0x3F, 0x03, 0xFF, 0x06, 0x00, 0x37, 0x12, 0xFF}));
+
+    // And as sent, with the report right behind the header
+
+    CHECK(sendSetReport(fixture, 0x05) == std::vector<UInt8>({0x05, 0x00, 0x35, 0x03, 0x06, 0x00, 0x06, 0x00, 0x05, 0xAA, 0xBB, 0xCC}));
+    CHECK(sendSetReport(fixture, 0x0F) == std::vector<UInt8>({0x05, 0x00, 0x3F, 0x03, 0x0F, 0x06, 0x00, 0x06, 0x00, 0x0F, 0xAA, 0xBB, 0xCC}));
+    CHECK(sendSetReport(fixture, 0x80) == std::vector<UInt8>({0x05, 0x00, 0x3F, 0x03, 0x80, 0x06, 0x00, 0x06, 0x00, 0x80, 0xAA, 0xBB, 0xCC}));
+}
+
+int main() {
+    testArenaExhaustion();
+    testTransactionTrace();
+    testDescriptorCacheMismatch();
+    testDescriptorCacheRelease();
+    testCommandOrdering();
+    testCommandTimeout();
+    testDescriptorRefetch();
+    testSetReportHeader();
+
+    return testResult("VoodooI2CHIDDeviceCommandTests");
+}
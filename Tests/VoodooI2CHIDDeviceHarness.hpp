@@ -0,0 +1,225 @@
+//
+//  VoodooI2CHIDDeviceHarness.hpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDDeviceHarness_hpp
+#define VoodooI2CHIDDeviceHarness_hpp
+
+#include <time.h>
+
+#include <mutex>
+#include <vector>
+
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/acpi/IOACPIPlatformDevice.h>
+#include <IOKit/hid/IOHIDDevice.h>
+#include "VoodooI2CDeviceNub.hpp"
+
+// The tests poke at the device's state directly, everything the device pulls in was included above
+
+#define private public
+#define protected public
+#include "VoodooI2CHIDDevice.hpp"
+#undef protected
+#undef private
+
+#include "VoodooI2CHIDTest.hpp"
+
+#define MS  1000000ULL
+
+#define TEST_HID_DESCRIPTOR_REGISTER    0x0001
+#define TEST_REPORT_DESCRIPTOR_REGISTER 0x0002
+#define TEST_INPUT_REGISTER             0x0003
+#define TEST_OUTPUT_REGISTER            0x0004
+#define TEST_COMMAND_REGISTER           0x0005
+#define TEST_DATA_REGISTER              0x0006
+
+/* The work loop <VoodooI2CHIDDevice::getWorkLoop> hands out, the provider's in the kernel */
+
+inline IOWorkLoop* test_work_loop = NULL;
+
+IOWorkLoop* VoodooI2CHIDDevice::getWorkLoop() const {
+    return test_work_loop;
+}
+
+/* A vendor defined collection with a single input report of <length> bytes and no report ID */
+
+static inline std::vector<UInt8> testReportDescriptor(UInt8 length) {
+    return {
+        0x06, 0x00, 0xFF,       // Usage Page (Vendor Defined)
+        0x09, 0x01,             // Usage (1)
+        0xA1, 0x01,             // Collection (Application)
+        0x15, 0x00,             //   Logical Minimum (0)
+        0x26, 0xFF, 0x00,       //   Logical Maximum (255)
+        0x75, 0x08,             //   Report Size (8)
+        0x95, length,           //   Report Count (length)
+        0x09, 0x02,             //   Usage (2)
+        0x81, 0x02,             //   Input (Data, Variable, Absolute)
+        0xC0                    // End Collection
+    };
+}
+
+/* The device as seen by IOHIDDevice, which records every report it is handed */
+
+class TestHIDDevice : public VoodooI2CHIDDevice {
+ public:
+    IOReturn handleReportWithTime(AbsoluteTime timeStamp, IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options) override {
+        std::vector<UInt8> bytes(report->getLength());
+        report->readBytes(0, bytes.data(), bytes.size());
+
+        std::lock_guard<std::mutex> guard(report_mutex);
+        reports.push_back(bytes);
+        report_times.push_back(timeStamp);
+
+        return kIOReturnSuccess;
+    }
+
+    size_t reportCount() {
+        std::lock_guard<std::mutex> guard(report_mutex);
+        return reports.size();
+    }
+
+    std::vector<std::vector<UInt8>> copyReports() {
+        std::lock_guard<std::mutex> guard(report_mutex);
+        return reports;
+    }
+
+ private:
+    std::mutex report_mutex;
+    std::vector<std::vector<UInt8>> reports;
+    std::vector<AbsoluteTime> report_times;
+};
+
+/* Answers _DSM with the HID descriptor register like an I2C-HID device's ACPI node does */
+
+class TestACPIDevice : public IOACPIPlatformDevice {
+ public:
+    IOReturn evaluateObject(const char* objectName, OSObject** result = 0, OSObject* params[] = 0, IOItemCount paramCount = 0, IOOptionBits options = 0) override {
+        if (strcmp(objectName, "_DSM") || !result)
+            return kIOReturnNotFound;
+
+        *result = OSNumber::withNumber(TEST_HID_DESCRIPTOR_REGISTER, 16);
+        return kIOReturnSuccess;
+    }
+};
+
+/* A device on a simulated bus, started the way IOKit would start it
+ *
+ * Each fixture has its own product ID so that the descriptor cache, which outlives devices, never hits by accident.
+ */
+
+class TestDeviceFixture {
+ public:
+    explicit TestDeviceFixture(std::vector<UInt8> report_descriptor = testReportDescriptor(6), UInt16 max_input_length = 8) {
+        static UInt16 next_product_id = 0x1000;
+
+        memset(&hid_descriptor, 0, sizeof(hid_descriptor));
+        hid_descriptor.wHIDDescLength = sizeof(hid_descriptor);
+        hid_descriptor.bcdVersion = 0x0100;
+        hid_descriptor.wReportDescLength = (UInt16)report_descriptor.size();
+        hid_descriptor.wReportDescRegister = TEST_REPORT_DESCRIPTOR_REGISTER;
+        hid_descriptor.wInputRegister = TEST_INPUT_REGISTER;
+        hid_descriptor.wMaxInputLength = max_input_length;
+        hid_descriptor.wOutputRegister = TEST_OUTPUT_REGISTER;
+        hid_descriptor.wMaxOutputLength = max_input_length;
+        hid_descriptor.wCommandRegister = TEST_COMMAND_REGISTER;
+        hid_descriptor.wDataRegister = TEST_DATA_REGISTER;
+        hid_descriptor.wVendorID = 0x04F3;
+        hid_descriptor.wProductID = next_product_id++;
+        hid_descriptor.wVersionID = 0x0001;
+
+        loop = IOWorkLoop::workLoop();
+        controller = new IOService;
+        acpi = new TestACPIDevice;
+
+        nub = VoodooI2CDeviceNub::withDevice(TEST_HID_DESCRIPTOR_REGISTER, &hid_descriptor, sizeof(hid_descriptor), report_descriptor.data(), report_descriptor.size());
+        nub->setName("TPD0");
+        nub->attach(controller);
+        nub->setProperty("acpi-device", acpi);
+
+        device = new TestHIDDevice;
+    }
+
+    ~TestDeviceFixture() {
+        stop();
+
+        device->release();
+        nub->release();
+        acpi->release();
+        controller->release();
+        loop->release();
+
+        test_work_loop = NULL;
+    }
+
+    /* Probes and starts the device, which returns once it has acknowledged its reset */
+
+    bool start() {
+        SInt32 score = 0;
+
+        test_work_loop = loop;
+
+        if (!device->init(NULL) || !device->attach(nub) || !device->probe(nub, &score) || !device->start(nub))
+            return false;
+
+        started = true;
+        return true;
+    }
+
+    void stop() {
+        if (!started)
+            return;
+
+        device->stop(nub);
+        device->detach(nub);
+        started = false;
+    }
+
+    /* Runs the work loop until it has nothing left to do that is already due */
+
+    void settle() {
+        loop->runUntilIdle();
+    }
+
+    /* Lets the device run until <condition> holds, which is expected to take well under a second of real time */
+
+    template <typename Condition>
+    bool waitUntil(Condition condition) {
+        for (int i = 0; i < 20000; i++) {
+            if (condition())
+                return true;
+
+            loop->runUntilIdle();
+
+            struct timespec pause = {0, 100000};
+            nanosleep(&pause, NULL);
+        }
+
+        return condition();
+    }
+
+    /* Moves the simulated clock on and runs whatever fell due */
+
+    void advance(UInt64 nanoseconds) {
+        shimAdvanceUptime(nanoseconds);
+        settle();
+    }
+
+    VoodooI2CHIDDeviceHIDDescriptor hid_descriptor;
+    IOWorkLoop* loop;
+    IOService* controller;
+    TestACPIDevice* acpi;
+    VoodooI2CDeviceNub* nub;
+    TestHIDDevice* device;
+
+ private:
+    bool started = false;
+};
+
+#endif /* VoodooI2CHIDDeviceHarness_hpp */
@@ -0,0 +1,387 @@
+//
+//  VoodooI2CHIDDeviceInputTests.cpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include <thread>
+
+#include "VoodooI2CHIDDeviceHarness.hpp"
+
+/* Starts <fixture> with interrupts left to the test to deliver */
+
+static bool startManual(TestDeviceFixture& fixture) {
+    if (!fixture.start())
+        return false;
+
+    fixture.nub->setAutoInterrupt(false);
+    fixture.settle();
+
+    return true;
+}
+
+/* A zero-length read only acknowledges a reset that is pending, and never when it replaces a report cut short */
+
+static void testZeroLengthReports() {
+    TestDeviceFixture fixture(testReportDescriptor(30), 32);
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+
+    // Keep whatever the reads flag for the consumer where the test can see it
+
+    device->report_consumer->disable();
+
+    // Read at 4 bytes, the report is longer and nothing follows it
+
+    device->learned_read_sizing = true;
+    device->learned_length = 4;
+
+    fixture.nub->pushInput(std::vector<UInt8>(8, 0xAB));
+    CHECK(fixture.nub->interrupt());
+
+    CHECK_EQUAL(device->read_size_mispredictions, 1);
+    CHECK_EQUAL(device->lost_reports, 1);
+    CHECK(!device->reset_response_pending);
+
+    device->learned_read_sizing = false;
+
+    // Without a reset pending an empty input register is just that
+
+    device->reset_state = kVoodooI2CHIDResetIdle;
+
+    fixture.nub->pushRaw({0, 0});
+    CHECK(fixture.nub->interrupt());
+    CHECK(!device->reset_response_pending);
+
+    // With one pending it is the acknowledgement
+
+    device->reset_state = kVoodooI2CHIDResetPending;
+
+    fixture.nub->pushRaw({0, 0});
+    CHECK(fixture.nub->interrupt());
+    CHECK(device->reset_response_pending);
+
+    device->report_consumer->enable();
+    device->report_consumer->interruptOccurred(NULL, NULL, 0);
+
+    CHECK(fixture.waitUntil([&] { return device->reset_state == kVoodooI2CHIDResetAcknowledged; }));
+    CHECK_EQUAL(device->lost_reports, 1);
+    CHECK_EQUAL(fixture.device->reportCount(), 0);
+}
+
+static IOReturn startReset(VoodooI2CHIDDevice* device) {
+    return device->command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, device, &VoodooI2CHIDDevice::startResetGated));
+}
+
+/* Reports read before the reset command are dropped and don't acknowledge it, only those read after it do */
+
+static void testResetAcknowledgement() {
+    TestDeviceFixture fixture;
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+    UInt64 lost = device->lost_reports;
+
+    device->report_consumer->disable();
+
+    fixture.nub->pushInput({1, 2, 3, 4, 5, 6});
+    CHECK(fixture.nub->interrupt());
+    CHECK_EQUAL(device->report_ring_head - device->report_ring_tail, 1);
+
+    CHECK_EQUAL(startReset(device), kIOReturnSuccess);
+    CHECK_EQUAL(device->reset_state, kVoodooI2CHIDResetPending);
+    CHECK_EQUAL(device->report_ring_head, device->report_ring_tail);
+    CHECK_EQUAL(device->lost_reports, lost + 1);
+
+    device->report_consumer->enable();
+    device->report_consumer->interruptOccurred(NULL, NULL, 0);
+    fixture.settle();
+
+    CHECK_EQUAL(device->reset_state, kVoodooI2CHIDResetPending);
+    CHECK_EQUAL(device->reportCount(), 0);
+
+    // This device never sends the zero-length acknowledgement, its first report is as good
+
+    fixture.nub->clearInput();
+    fixture.nub->pushInput({7, 8, 9, 10, 11, 12});
+    CHECK(fixture.nub->interrupt());
+
+    CHECK(fixture.waitUntil([&] { return device->reset_state == kVoodooI2CHIDResetAcknowledged; }));
+    CHECK_EQUAL(device->reportCount(), 1);
+}
+
+/* The reset wait ends at its deadline even if the reset timer never fires */
+
+static void testResetDeadline() {
+    TestDeviceFixture fixture;
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+
+    device->reset_timer->disable();
+
+    std::thread clock([device] {
+        while (__atomic_load_n(&device->reset_state, __ATOMIC_ACQUIRE) != kVoodooI2CHIDResetPending)
+            sched_yield();
+
+        shimAdvanceUptime((I2C_HID_RESET_TIMEOUT_MS + 1) * MS);
+    });
+
+    CHECK_EQUAL(device->resetHIDDevice(), kIOReturnTimeout);
+    CHECK_EQUAL(device->reset_state, kVoodooI2CHIDResetTimedOut);
+    CHECK_EQUAL(device->reset_timing.timeouts, 1);
+
+    clock.join();
+
+    device->reset_timer->enable();
+}
+
+/* A report of 6 bytes that tells which of a sequence it is */
+
+static std::vector<UInt8> numberedReport(UInt32 number) {
+    return {(UInt8)number, (UInt8)(number >> 8), (UInt8)(number >> 16), 0x5A, 0xA5, 0x00};
+}
+
+/* Reads <count> numbered reports starting at <first> while the consumer is held off */
+
+static void readNumbered(TestDeviceFixture& fixture, UInt32 first, UInt32 count) {
+    for (UInt32 number = first; number < first + count; number++) {
+        fixture.nub->pushInput(numberedReport(number));
+        CHECK(fixture.nub->interrupt());
+    }
+}
+
+/* Checks the device handed up exactly the numbered reports <first> to <first> + <count> - 1, in order */
+
+static void checkNumbered(TestHIDDevice* device, UInt32 first, UInt32 count) {
+    std::vector<std::vector<UInt8>> reports = device->copyReports();
+
+    CHECK_EQUAL(reports.size(), count);
+    for (UInt32 i = 0; i < count && i < reports.size(); i++)
+        CHECK(reports[i] == numberedReport(first + i));
+}
+
+/* A read report is published by advancing the head, and only the consumer advances the tail */
+
+static void testRingPublish() {
+    TestDeviceFixture fixture;
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+    UInt32 tail = device->report_ring_tail;
+
+    device->report_consumer->disable();
+
+    readNumbered(fixture, 0, 1);
+
+    CHECK_EQUAL(device->report_ring_head, tail + 1);
+    CHECK_EQUAL(device->report_ring_tail, tail);
+
+    VoodooI2CHIDDeviceReportSlot* slot = &device->report_ring[tail % I2C_HID_REPORT_RING_SIZE];
+    CHECK_EQUAL(slot->length, 8);
+    CHECK(std::vector<UInt8>(slot->data + 2, slot->data + 8) == numberedReport(0));
+
+    device->report_consumer->enable();
+    device->report_consumer->interruptOccurred(NULL, NULL, 0);
+
+    CHECK(fixture.waitUntil([&] { return device->report_ring_tail == tail + 1; }));
+    checkNumbered(device, 0, 1);
+}
+
+/* Reports read while the ring is full are counted and dropped, the ones already in it are kept */
+
+static void testRingOverflow() {
+    TestDeviceFixture fixture;
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+
+    device->report_consumer->disable();
+
+    readNumbered(fixture, 0, I2C_HID_REPORT_RING_SIZE + 3);
+
+    CHECK_EQUAL(device->report_ring_head - device->report_ring_tail, I2C_HID_REPORT_RING_SIZE);
+    CHECK_EQUAL(device->report_ring_overflows, 3);
+    CHECK_EQUAL(fixture.nub->pendingInput(), 0);
+
+    device->report_consumer->enable();
+    device->report_consumer->interruptOccurred(NULL, NULL, 0);
+
+    CHECK(fixture.waitUntil([&] { return device->report_ring_tail == device->report_ring_head; }));
+    checkNumbered(device, 0, I2C_HID_REPORT_RING_SIZE);
+    CHECK_EQUAL(device->report_ring_max_depth, I2C_HID_REPORT_RING_SIZE);
+
+    // There is room again
+
+    readNumbered(fixture, I2C_HID_REPORT_RING_SIZE + 3, 1);
+
+    CHECK(fixture.waitUntil([&] { return device->reportCount() == I2C_HID_REPORT_RING_SIZE + 1; }));
+    CHECK_EQUAL(device->report_ring_overflows, 3);
+}
+
+/* The indices run through the ring and past the end of their type without losing or reordering anything */
+
+static void testRingWraparound() {
+    TestDeviceFixture fixture;
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+    UInt32 start = 0xFFFFFFFF - I2C_HID_REPORT_RING_SIZE / 2;
+
+    device->report_consumer->disable();
+    device->report_ring_head = device->report_ring_tail = device->reset_ring_mark = start;
+
+    readNumbered(fixture, 0, I2C_HID_REPORT_RING_SIZE);
+
+    CHECK_EQUAL(device->report_ring_head, start + I2C_HID_REPORT_RING_SIZE);
+    CHECK(device->report_ring_head < device->report_ring_tail);
+    CHECK_EQUAL(device->report_ring_head - device->report_ring_tail, I2C_HID_REPORT_RING_SIZE);
+    CHECK_EQUAL(device->report_ring_overflows, 0);
+
+    device->report_consumer->enable();
+    device->report_consumer->interruptOccurred(NULL, NULL, 0);
+
+    CHECK(fixture.waitUntil([&] { return device->report_ring_tail == start + I2C_HID_REPORT_RING_SIZE; }));
+
+    // Twice more around the ring, a ring's worth at a time
+
+    for (UInt32 lap = 1; lap <= 2; lap++) {
+        readNumbered(fixture, lap * I2C_HID_REPORT_RING_SIZE, I2C_HID_REPORT_RING_SIZE);
+        CHECK(fixture.waitUntil([&] { return device->reportCount() == (lap + 1) * I2C_HID_REPORT_RING_SIZE; }));
+    }
+
+    checkNumbered(device, 0, 3 * I2C_HID_REPORT_RING_SIZE);
+    CHECK_EQUAL(device->report_ring_overflows, 0);
+}
+
+/* Reports arriving well above 1 kHz on the interrupt line all make it to the HID stack, in order */
+
+static void testRingHighRate() {
+    TestDeviceFixture fixture;
+    CHECK(fixture.start());
+
+    TestHIDDevice* device = fixture.device;
+    const UInt32 count = 2000;
+    const UInt32 burst = 4;
+    UInt64 lost = device->lost_reports;
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    for (UInt32 number = 0; number < count; number += burst) {
+        for (UInt32 i = 0; i < burst; i++)
+            fixture.nub->pushInput(numberedReport(number + i));
+
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    CHECK(fixture.waitUntil([&] { return device->reportCount() == count; }));
+
+    double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    CHECK(count / seconds > 1000);
+
+    checkNumbered(device, 0, count);
+    CHECK_EQUAL(device->report_ring_overflows, 0);
+    CHECK_EQUAL(device->lost_reports, lost);
+    CHECK_EQUAL(device->invalid_reports, 0);
+}
+
+/* Reading and dispatching a report neither allocates memory nor creates objects once the device is running */
+
+static void testDispatchAllocations() {
+    TestDeviceFixture fixture;
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+    const UInt32 count = 1000;
+
+    // Consumed from here instead of the work loop, and with the statistics just published so that they aren't again
+
+    device->report_consumer->disable();
+    device->publishStatistics(true);
+
+    long allocations = shim_total_allocations;
+    long constructions = shim_object_constructions;
+
+    for (UInt32 number = 0; number < count; number++) {
+        fixture.nub->pushInput(numberedReport(number));
+        CHECK(fixture.nub->interrupt());
+
+        fixture.loop->closeGate();
+        device->consumeInputReports(device, device->report_consumer, 1);
+        fixture.loop->openGate();
+    }
+
+    CHECK_EQUAL(shim_total_allocations - allocations, 0);
+    CHECK_EQUAL(shim_object_constructions - constructions, 0);
+
+    checkNumbered(device, 0, count);
+
+    device->report_consumer->enable();
+}
+
+/* One interrupt drains the input register until it is empty, but never more than the budget at once */
+
+static void testDrainBudget() {
+    TestDeviceFixture fixture;
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+    UInt64 histogram[I2C_HID_DRAIN_BUDGET + 1];
+
+    device->report_consumer->disable();
+    memcpy(histogram, device->drain_histogram, sizeof(histogram));
+
+    // A burst stops at the empty read that follows it
+
+    for (UInt32 number = 0; number < 2; number++)
+        fixture.nub->pushInput(numberedReport(number));
+
+    CHECK(fixture.nub->interrupt());
+
+    CHECK_EQUAL(device->report_ring_head - device->report_ring_tail, 2);
+    CHECK_EQUAL(fixture.nub->pendingInput(), 0);
+    CHECK_EQUAL(device->drain_histogram[2], histogram[2] + 1);
+
+    // A longer one leaves the rest for the next assertion of the line
+
+    for (UInt32 number = 2; number < I2C_HID_DRAIN_BUDGET + 5; number++)
+        fixture.nub->pushInput(numberedReport(number));
+
+    CHECK(fixture.nub->interrupt());
+
+    CHECK_EQUAL(device->report_ring_head - device->report_ring_tail, I2C_HID_DRAIN_BUDGET + 2);
+    CHECK_EQUAL(fixture.nub->pendingInput(), 3);
+    CHECK_EQUAL(device->drain_histogram[I2C_HID_DRAIN_BUDGET], histogram[I2C_HID_DRAIN_BUDGET] + 1);
+
+    CHECK(fixture.nub->interrupt());
+
+    CHECK_EQUAL(device->report_ring_head - device->report_ring_tail, I2C_HID_DRAIN_BUDGET + 5);
+    CHECK_EQUAL(fixture.nub->pendingInput(), 0);
+    CHECK_EQUAL(device->drain_histogram[3], histogram[3] + 1);
+
+    device->report_consumer->enable();
+    device->report_consumer->interruptOccurred(NULL, NULL, 0);
+
+    CHECK(fixture.waitUntil([&] { return device->reportCount() == I2C_HID_DRAIN_BUDGET + 5; }));
+    checkNumbered(device, 0, I2C_HID_DRAIN_BUDGET + 5);
+}
+
+int main() {
+    testZeroLengthReports();
+    testResetAcknowledgement();
+    testResetDeadline();
+    testRingPublish();
+    testRingOverflow();
+    testRingWraparound();
+    testRingHighRate();
+    testDispatchAllocations();
+    testDrainBudget();
+
+    return testResult("VoodooI2CHIDDeviceInputTests");
+}
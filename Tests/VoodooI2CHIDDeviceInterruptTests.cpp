@@ -0,0 +1,415 @@
+//
+//  VoodooI2CHIDDeviceInterruptTests.cpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include <atomic>
+#include <thread>
+
+#include "VoodooI2CHIDDeviceHarness.hpp"
+
+/* Starts <fixture> with interrupts left to the test to deliver */
+
+static bool startManual(TestDeviceFixture& fixture) {
+    if (!fixture.start())
+        return false;
+
+    fixture.nub->setAutoInterrupt(false);
+    fixture.settle();
+
+    return true;
+}
+
+/* Holds the line asserted with nothing to read for a full detection window and lets the work loop react */
+
+static void stormFor(TestDeviceFixture& fixture) {
+    TestHIDDevice* device = fixture.device;
+
+    device->storm.window_start = 0;
+    fixture.nub->setStuck(true);
+
+    // The first interrupt opens the window, the one after it has expired judges it
+
+    for (int i = 0; i <= I2C_HID_STORM_MIN_INTERRUPTS; i++)
+        CHECK(fixture.nub->interrupt());
+
+    shimAdvanceUptime(I2C_HID_STORM_WINDOW_MS * MS);
+    CHECK(fixture.nub->interrupt());
+
+    fixture.settle();
+}
+
+/* Acknowledges the reset the storm recovery issued */
+
+static void acknowledgeReset(TestDeviceFixture& fixture) {
+    TestHIDDevice* device = fixture.device;
+
+    CHECK(fixture.waitUntil([&] {
+        fixture.nub->interrupt();
+        return device->reset_state == kVoodooI2CHIDResetAcknowledged;
+    }));
+}
+
+/* A stuck line is masked and polled, then unmasked after a reset once the backoff expires */
+
+static void testStormMitigation() {
+    TestDeviceFixture fixture;
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+
+    stormFor(fixture);
+
+    CHECK(device->storm.active);
+    CHECK_EQUAL(device->storm.storms, 1);
+    CHECK_EQUAL(device->storm.masks, 1);
+    CHECK_EQUAL(device->storm.backoff_ms, I2C_HID_STORM_BACKOFF_MIN_MS);
+    CHECK(!fixture.nub->isInterruptEnabled());
+    CHECK(!fixture.nub->interrupt());
+    CHECK(device->interrupt_simulator->getDeadline());
+    CHECK(device->storm_timer->getDeadline());
+
+    // Anything that slipped through before the mask is ignored
+
+    device->interruptOccured(device, NULL, 0);
+    CHECK_EQUAL(device->storm.ignored_interrupts, 1);
+
+    // Input keeps arriving through polling meanwhile
+
+    fixture.nub->setStuck(false);
+    fixture.nub->pushInput({1, 2, 3, 4, 5, 6});
+    fixture.advance(I2C_HID_POLL_INTERVAL_MIN_US * 1000ULL);
+
+    CHECK(fixture.waitUntil([&] { return device->reportCount() == 1; }));
+    CHECK(!fixture.nub->isInterruptEnabled());
+
+    fixture.advance(I2C_HID_STORM_BACKOFF_MIN_MS * MS);
+
+    CHECK(!device->storm.active);
+    CHECK_EQUAL(device->storm.resets, 1);
+    CHECK_EQUAL(device->storm.unmasks, 1);
+    CHECK_EQUAL(fixture.nub->getResets(), 2);
+    CHECK(fixture.nub->isInterruptEnabled());
+    CHECK(!device->interrupt_simulator->getDeadline());
+
+    acknowledgeReset(fixture);
+
+    // Another storm within the probation period polls for twice as long
+
+    stormFor(fixture);
+
+    CHECK(device->storm.active);
+    CHECK_EQUAL(device->storm.storms, 2);
+    CHECK_EQUAL(device->storm.backoff_ms, 2 * I2C_HID_STORM_BACKOFF_MIN_MS);
+
+    fixture.nub->setStuck(false);
+    fixture.advance(2 * I2C_HID_STORM_BACKOFF_MIN_MS * MS);
+
+    CHECK(!device->storm.active);
+    CHECK(fixture.nub->isInterruptEnabled());
+
+    acknowledgeReset(fixture);
+}
+
+/* A backoff that expires while the device is asleep leaves the interrupt masked until it has woken up again */
+
+static void testStormAcrossSleep() {
+    TestDeviceFixture fixture;
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+
+    stormFor(fixture);
+    CHECK(device->storm.active);
+
+    CHECK_EQUAL(device->setPowerState(0, device), kIOPMAckImplied);
+    fixture.nub->setStuck(false);
+
+    fixture.advance(I2C_HID_STORM_BACKOFF_MIN_MS * MS);
+
+    CHECK(device->storm.active);
+    CHECK_EQUAL(device->storm.unmasks, 0);
+    CHECK_EQUAL(device->storm.resets, 0);
+    CHECK(!fixture.nub->isInterruptEnabled());
+    CHECK(!device->interrupt_simulator->getDeadline());
+
+    fixture.advance(I2C_HID_STORM_BACKOFF_MAX_MS * MS);
+    CHECK(!fixture.nub->isInterruptEnabled());
+
+    // Waking up polls for the acknowledgement of the resume reset, the interrupt stays masked for another backoff
+
+    CHECK_EQUAL(device->setPowerState(1, device), kIOPMAckImplied);
+
+    CHECK(device->storm.active);
+    CHECK(!fixture.nub->isInterruptEnabled());
+    CHECK(device->storm_timer->getDeadline());
+
+    CHECK(fixture.waitUntil([&] {
+        fixture.advance(I2C_HID_POLL_INTERVAL_MIN_US * 1000ULL);
+        return device->reset_state == kVoodooI2CHIDResetAcknowledged;
+    }));
+    CHECK(!fixture.nub->isInterruptEnabled());
+
+    fixture.advance(I2C_HID_STORM_BACKOFF_MIN_MS * MS);
+
+    CHECK(!device->storm.active);
+    CHECK_EQUAL(device->storm.unmasks, 1);
+    CHECK(fixture.nub->isInterruptEnabled());
+
+    acknowledgeReset(fixture);
+}
+
+/* Interrupts accounted from several CPUs at once are all counted, and only one of them judges the window */
+
+static void testConcurrentDetection() {
+    TestDeviceFixture fixture;
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+
+    device->storm.window_start = now;
+    device->storm.window_interrupts = 0;
+    device->storm.window_reports = device->storm.valid_reports;
+
+    const int threads = 4;
+    const int interrupts = 10000;
+    std::vector<std::thread> cpus;
+    std::atomic<int> storms(0);
+
+    for (int i = 0; i < threads; i++) {
+        cpus.emplace_back([device, now, &storms] {
+            for (int j = 0; j < interrupts; j++) {
+                if (device->detectInterruptStorm(now))
+                    storms++;
+            }
+        });
+    }
+
+    for (std::thread& cpu : cpus)
+        cpu.join();
+
+    CHECK_EQUAL(storms.load(), 0);
+    CHECK_EQUAL(device->storm.window_interrupts, threads * interrupts);
+
+    // Every CPU sees the window expire at once
+
+    AbsoluteTime expired = now + I2C_HID_STORM_WINDOW_MS * MS;
+    cpus.clear();
+
+    for (int i = 0; i < threads; i++) {
+        cpus.emplace_back([device, expired, &storms] {
+            if (device->detectInterruptStorm(expired))
+                storms++;
+        });
+    }
+
+    for (std::thread& cpu : cpus)
+        cpu.join();
+
+    CHECK_EQUAL(storms.load(), 1);
+    CHECK_EQUAL(device->storm.window_start, expired);
+    CHECK(device->storm.window_interrupts < threads);
+}
+
+/* Holds the bus the way a command transfer does for <microseconds> */
+
+static void holdBus(TestHIDDevice* device, long microseconds) {
+    device->lockI2C();
+    device->read_in_progress = true;
+
+    struct timespec pause = {0, microseconds * 1000};
+    nanosleep(&pause, NULL);
+
+    device->read_in_progress = false;
+    device->unlockI2C();
+}
+
+/* An interrupt that arrives while the bus is held is read once it is released */
+
+static void testDeferredRead() {
+    TestDeviceFixture fixture;
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+    UInt64 skipped = device->interrupts_skipped;
+    UInt64 deferred = device->interrupts_deferred;
+
+    device->lockI2C();
+    device->read_in_progress = true;
+
+    fixture.nub->pushInput({1, 2, 3, 4, 5, 6});
+    CHECK(fixture.nub->interrupt());
+
+    CHECK_EQUAL(device->interrupts_skipped, skipped + 1);
+    CHECK(device->interrupt_pending);
+    CHECK_EQUAL(fixture.nub->pendingInput(), 1);
+
+    // Even with the flag down, the lock is still held
+
+    device->read_in_progress = false;
+    CHECK(fixture.nub->interrupt());
+    CHECK_EQUAL(device->interrupts_skipped, skipped + 2);
+
+    device->unlockI2C();
+
+    CHECK_EQUAL(device->interrupts_deferred, deferred + 1);
+    CHECK(fixture.waitUntil([&] { return device->reportCount() == 1; }));
+    CHECK(!device->interrupt_pending);
+    CHECK_EQUAL(fixture.nub->pendingInput(), 0);
+}
+
+/* Frames keep arriving on the line while another thread keeps taking the bus, none of them is lost */
+
+static void testDeferredHandoff() {
+    TestDeviceFixture fixture;
+    CHECK(fixture.start());
+
+    TestHIDDevice* device = fixture.device;
+    const UInt32 count = 1000;
+    UInt64 skipped = device->interrupts_skipped;
+    UInt64 deferred = device->interrupts_deferred;
+    UInt64 lost = device->lost_reports;
+    std::atomic<bool> done(false);
+
+    std::thread commands([device, &done] {
+        while (!done)
+            holdBus(device, 200);
+    });
+
+    for (UInt32 number = 0; number < count; number++) {
+        fixture.nub->pushInput({(UInt8)number, (UInt8)(number >> 8), 0, 0, 0, 0});
+
+        struct timespec pause = {0, 100000};
+        nanosleep(&pause, NULL);
+
+        // Never more than the ring can hold outstanding, the consumer on the work loop is not what is tested here
+
+        while (number + 1 - device->reportCount() >= I2C_HID_REPORT_RING_SIZE)
+            sched_yield();
+    }
+
+    CHECK(fixture.waitUntil([&] { return device->reportCount() == count; }));
+
+    done = true;
+    commands.join();
+
+    std::vector<std::vector<UInt8>> reports = device->copyReports();
+    bool ordered = reports.size() == count;
+
+    for (UInt32 i = 0; i < reports.size() && ordered; i++)
+        ordered = reports[i][0] == (UInt8)i && reports[i][1] == (UInt8)(i >> 8);
+
+    CHECK(ordered);
+    CHECK_EQUAL(device->report_ring_overflows, 0);
+    CHECK_EQUAL(device->lost_reports, lost);
+    CHECK(device->interrupts_skipped > skipped);
+    CHECK(device->interrupts_deferred > deferred);
+}
+
+/* Chooses the next polling interval on the work loop, <drained> reports having just been read */
+
+static UInt32 nextInterval(TestDeviceFixture& fixture, UInt32 drained) {
+    fixture.loop->closeGate();
+    UInt32 interval = fixture.device->nextPollingInterval(drained);
+    fixture.loop->openGate();
+
+    return interval;
+}
+
+/* Polling follows the report rate while the device is in use and backs off exponentially once it is idle */
+
+static void testPollingIntervals() {
+    TestDeviceFixture fixture;
+    CHECK(startManual(fixture));
+
+    TestHIDDevice* device = fixture.device;
+
+    // Come straight back for the acknowledgement of a reset
+
+    device->reset_state = kVoodooI2CHIDResetPending;
+    CHECK_EQUAL(nextInterval(fixture, 0), I2C_HID_POLL_INTERVAL_MIN_US);
+    device->reset_state = kVoodooI2CHIDResetAcknowledged;
+
+    // Without a report rate yet, the busy interval
+
+    CHECK_EQUAL(nextInterval(fixture, 1), I2C_HID_POLL_INTERVAL_BUSY_US);
+
+    // Half the report period of a device reporting every 3 ms, the average follows the rate as it changes
+
+    for (int i = 0; i < 8; i++) {
+        shimAdvanceUptime(3 * MS);
+        CHECK_EQUAL(nextInterval(fixture, 1), 1500);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        shimAdvanceUptime(7 * MS);
+        nextInterval(fixture, 1);
+    }
+
+    shimAdvanceUptime(7 * MS);
+
+    UInt32 interval = nextInterval(fixture, 1);
+    CHECK(interval > 3450 && interval <= 3500);
+
+    // Never slower than the busy interval, never faster than the minimum
+
+    for (int i = 0; i < 16; i++) {
+        shimAdvanceUptime(20 * MS);
+        nextInterval(fixture, 1);
+    }
+
+    CHECK_EQUAL(nextInterval(fixture, 0), I2C_HID_POLL_INTERVAL_BUSY_US);
+
+    for (int i = 0; i < 32; i++) {
+        shimAdvanceUptime(MS / 2);
+        nextInterval(fixture, 1);
+    }
+
+    CHECK_EQUAL(nextInterval(fixture, 0), I2C_HID_POLL_INTERVAL_MIN_US);
+
+    // A poll that found several reports waiting comes back for the rest right away
+
+    device->polling_report_interval = 8 * MS;
+    CHECK_EQUAL(nextInterval(fixture, 2), I2C_HID_POLL_INTERVAL_MIN_US);
+
+    // Idle, doubling up to the maximum
+
+    shimAdvanceUptime(I2C_HID_POLL_BUSY_WINDOW_MS * MS);
+
+    UInt32 expected = I2C_HID_POLL_INTERVAL_IDLE_MIN_US;
+
+    for (int i = 0; i < 8; i++) {
+        CHECK_EQUAL(nextInterval(fixture, 0), expected);
+
+        expected *= 2;
+        if (expected > I2C_HID_POLL_INTERVAL_IDLE_MAX_US)
+            expected = I2C_HID_POLL_INTERVAL_IDLE_MAX_US;
+    }
+
+    CHECK_EQUAL(nextInterval(fixture, 0), I2C_HID_POLL_INTERVAL_IDLE_MAX_US);
+
+    // Activity from an event driver makes it busy again, and the next idle period starts over
+
+    device->reportInputActivity();
+    CHECK(nextInterval(fixture, 0) <= I2C_HID_POLL_INTERVAL_BUSY_US);
+
+    shimAdvanceUptime(I2C_HID_POLL_BUSY_WINDOW_MS * MS);
+    CHECK_EQUAL(nextInterval(fixture, 0), I2C_HID_POLL_INTERVAL_IDLE_MIN_US);
+    CHECK_EQUAL(nextInterval(fixture, 0), 2 * I2C_HID_POLL_INTERVAL_IDLE_MIN_US);
+}
+
+int main() {
+    testStormMitigation();
+    testStormAcrossSleep();
+    testConcurrentDetection();
+    testDeferredRead();
+    testDeferredHandoff();
+    testPollingIntervals();
+
+    return testResult("VoodooI2CHIDDeviceInterruptTests");
+}
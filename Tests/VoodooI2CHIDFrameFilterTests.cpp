@@ -0,0 +1,173 @@
+//
+//  VoodooI2CHIDFrameFilterTests.cpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include "VoodooI2CHIDFrameFilter.hpp"
+#include "VoodooI2CHIDTest.hpp"
+
+#define MS  1000000ULL
+
+/* Offers a frame to the filter and records the outcome the way the driver does */
+
+static bool offerFrame(VoodooI2CHIDFrameFilter* filter, bool contacts_changed, UInt8 contact_count, bool any_down, AbsoluteTime now) {
+    if (filter->shouldForward(contacts_changed, contact_count, any_down, now)) {
+        filter->recordForwarded(contact_count, now);
+        return true;
+    }
+
+    filter->recordSuppressed();
+    return false;
+}
+
+/* Frames that change nothing are suppressed, any change of the contacts or of their count is forwarded */
+
+static void testChanges() {
+    VoodooI2CHIDFrameFilter filter;
+    AbsoluteTime now = 1000 * MS;
+
+    filter.reset();
+
+    CHECK(!offerFrame(&filter, false, 0, false, now));
+    CHECK(offerFrame(&filter, true, 1, true, now += 8 * MS));
+    CHECK(!offerFrame(&filter, false, 1, true, now += 8 * MS));
+    CHECK(offerFrame(&filter, true, 1, true, now += 8 * MS));
+
+    // A second finger lands with the first one unchanged, then both lift
+
+    CHECK(offerFrame(&filter, false, 2, true, now += 8 * MS));
+    CHECK(!offerFrame(&filter, false, 2, true, now += 8 * MS));
+    CHECK(offerFrame(&filter, true, 0, false, now += 8 * MS));
+    CHECK(!offerFrame(&filter, false, 0, false, now += 8 * MS));
+
+    CHECK_EQUAL(filter.forwarded_frames, 4);
+    CHECK_EQUAL(filter.suppressed_frames, 4);
+}
+
+/* A change the owner flags, such as a button, forwards exactly one frame */
+
+static void testOwnerChange() {
+    VoodooI2CHIDFrameFilter filter;
+    AbsoluteTime now = 1000 * MS;
+
+    filter.reset();
+    filter.dirty = true;
+
+    CHECK(offerFrame(&filter, false, 0, false, now));
+    CHECK(!filter.dirty);
+    CHECK(!offerFrame(&filter, false, 0, false, now += 8 * MS));
+
+    // Suppressing a frame also clears the flag, a change set after the decision is for the next frame
+
+    filter.dirty = true;
+    filter.recordSuppressed();
+
+    CHECK(!filter.dirty);
+}
+
+/* Resting contacts are forwarded every keepalive period, lifted ones are not */
+
+static void testKeepalive() {
+    VoodooI2CHIDFrameFilter filter;
+    AbsoluteTime now = 1000 * MS;
+    AbsoluteTime last = now;
+
+    filter.reset();
+
+    CHECK(offerFrame(&filter, true, 1, true, now));
+
+    // A finger resting for a second, reported at 125 Hz
+
+    for (int frame = 0; frame < 125; frame++) {
+        now += 8 * MS;
+
+        bool forwarded = offerFrame(&filter, false, 1, true, now);
+
+        CHECK_EQUAL(forwarded, now - last >= kFrameKeepaliveMs * MS);
+
+        if (forwarded)
+            last = now;
+    }
+
+    // Every seventh frame, 56 ms apart
+
+    CHECK_EQUAL(filter.forwarded_frames, 1 + 125 / 7);
+
+    // Exactly at the period counts
+
+    filter.keepalive_ms = 20;
+
+    CHECK(!offerFrame(&filter, false, 1, true, last + 20 * MS - 1));
+    CHECK(offerFrame(&filter, false, 1, true, last + 20 * MS));
+
+    // Nothing is down, nothing is kept alive however long it has been
+
+    CHECK(offerFrame(&filter, true, 0, false, now += 8 * MS));
+    CHECK(!offerFrame(&filter, false, 0, false, now += 1000 * MS));
+}
+
+/* Without a keepalive period every frame is forwarded while a contact is down, as the touchscreen needs */
+
+static void testNoKeepalive() {
+    VoodooI2CHIDFrameFilter filter;
+    AbsoluteTime now = 1000 * MS;
+
+    filter.reset();
+    filter.keepalive_ms = 0;
+
+    CHECK(offerFrame(&filter, true, 1, true, now));
+
+    for (int frame = 0; frame < 10; frame++)
+        CHECK(offerFrame(&filter, false, 1, true, now += 8 * MS));
+
+    CHECK(offerFrame(&filter, true, 0, false, now += 8 * MS));
+    CHECK(!offerFrame(&filter, false, 0, false, now += 8 * MS));
+}
+
+/* A touchpad session replayed at 125 Hz: a finger lands and moves for half a second, rests for a second, lifts, and
+ * the device keeps reporting nothing for another second, as some do after a lift
+ */
+
+static void testReplay() {
+    VoodooI2CHIDFrameFilter filter;
+    AbsoluteTime now = 1000 * MS;
+    UInt64 frames = 0;
+
+    filter.reset();
+
+    for (int frame = 0; frame < 63; frame++, frames++)
+        offerFrame(&filter, true, 1, true, now += 8 * MS);
+
+    for (int frame = 0; frame < 125; frame++, frames++)
+        offerFrame(&filter, false, 1, true, now += 8 * MS);
+
+    offerFrame(&filter, true, 0, false, now += 8 * MS);
+    frames++;
+
+    for (int frame = 0; frame < 125; frame++, frames++)
+        offerFrame(&filter, false, 0, false, now += 8 * MS);
+
+    CHECK_EQUAL(filter.forwarded_frames + filter.suppressed_frames, frames);
+    CHECK_EQUAL(filter.forwarded_frames, 63 + 125 / 7 + 1);
+
+    fprintf(stderr, "replay: %llu frames, %llu forwarded, %llu suppressed\n", (unsigned long long)frames,
+            (unsigned long long)filter.forwarded_frames, (unsigned long long)filter.suppressed_frames);
+
+    filter.reset();
+
+    CHECK_EQUAL(filter.forwarded_frames, 0);
+    CHECK_EQUAL(filter.suppressed_frames, 0);
+    CHECK(!offerFrame(&filter, false, 0, false, now));
+}
+
+int main() {
+    testChanges();
+    testOwnerChange();
+    testKeepalive();
+    testNoKeepalive();
+    testReplay();
+
+    return testResult("VoodooI2CHIDFrameFilterTests");
+}
@@ -0,0 +1,198 @@
+//
+//  VoodooI2CHIDLatencyHistogramTests.cpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include "VoodooI2CHIDLatencyHistogram.hpp"
+#include "VoodooI2CHIDTest.hpp"
+
+#define US  1000ULL
+
+/* The upper bound of the bucket a value lands in, as <percentile> reports it when a larger value was recorded too */
+
+static uint64_t bucketBound(uint64_t value_us) {
+    VoodooI2CHIDLatencyHistogram histogram;
+
+    histogram.reset();
+    histogram.record(value_us * US);
+    histogram.record(UINT64_MAX);
+
+    return histogram.percentile(50);
+}
+
+static uint64_t dictionaryValue(OSDictionary* dictionary, const char* key) {
+    OSNumber* number = OSDynamicCast(OSNumber, dictionary->getObject(key));
+    return number ? number->unsigned64BitValue() : ~0ULL;
+}
+
+static void testEmpty() {
+    VoodooI2CHIDLatencyHistogram histogram;
+
+    histogram.reset();
+
+    CHECK_EQUAL(histogram.count, 0);
+    CHECK_EQUAL(histogram.max, 0);
+    CHECK_EQUAL(histogram.percentile(0), 0);
+    CHECK_EQUAL(histogram.percentile(50), 0);
+    CHECK_EQUAL(histogram.percentile(100), 0);
+}
+
+/* Latencies are recorded in whole microseconds, anything under one is a zero */
+
+static void testZero() {
+    VoodooI2CHIDLatencyHistogram histogram;
+
+    histogram.reset();
+    histogram.record(0);
+    histogram.record(999);
+
+    CHECK_EQUAL(histogram.count, 2);
+    CHECK_EQUAL(histogram.max, 0);
+    CHECK_EQUAL(histogram.percentile(50), 0);
+    CHECK_EQUAL(histogram.percentile(100), 0);
+
+    histogram.record(1000);
+
+    CHECK_EQUAL(histogram.max, 1);
+    CHECK_EQUAL(histogram.percentile(50), 0);
+    CHECK_EQUAL(histogram.percentile(100), 1);
+}
+
+/* Every bucket bound is at or above the values in it and within a quarter of them, bounds only grow with the
+ * value and a new bucket starts right after each bound. The last bucket, from 7 * 2^21 us, is checked by <testMax>.
+ */
+
+static void testBucketBoundaries() {
+    uint64_t previous = 0;
+    int errors = 0;
+
+    for (uint64_t value = 0; value < (7ULL << 21); value += value < 4096 ? 1 : value / 1024) {
+        uint64_t bound = bucketBound(value);
+
+        if (bound < value || bound - value > value / 4 || bound < previous) {
+            if (errors++ < 10)
+                fprintf(stderr, "%llu us: bound %llu, previous %llu\n", (unsigned long long)value, (unsigned long long)bound, (unsigned long long)previous);
+        }
+
+        if (value < 4096 && value && bound != previous && previous != value - 1) {
+            if (errors++ < 10)
+                fprintf(stderr, "%llu us starts a bucket but the previous one ended at %llu\n", (unsigned long long)value, (unsigned long long)previous);
+        }
+
+        previous = bound;
+    }
+
+    CHECK_EQUAL(errors, 0);
+
+    // The first buckets are exact, then each power of two splits in four
+
+    CHECK_EQUAL(bucketBound(3), 3);
+    CHECK_EQUAL(bucketBound(4), 4);
+    CHECK_EQUAL(bucketBound(7), 7);
+    CHECK_EQUAL(bucketBound(8), 9);
+    CHECK_EQUAL(bucketBound(9), 9);
+    CHECK_EQUAL(bucketBound(10), 11);
+    CHECK_EQUAL(bucketBound(1024), 1279);
+    CHECK_EQUAL(bucketBound(1279), 1279);
+    CHECK_EQUAL(bucketBound(1280), 1535);
+}
+
+/* Values past the tracked range share the last bucket, which reports the maximum rather than its own bound */
+
+static void testMax() {
+    VoodooI2CHIDLatencyHistogram histogram;
+
+    histogram.reset();
+    histogram.record(5 * US);
+    histogram.record(UINT64_MAX);
+
+    CHECK_EQUAL(histogram.max, UINT64_MAX / 1000);
+    CHECK_EQUAL(histogram.percentile(50), 5);
+    CHECK_EQUAL(histogram.percentile(100), UINT64_MAX / 1000);
+
+    histogram.reset();
+    histogram.record((1ULL << 24) * US);
+    histogram.record((1ULL << 30) * US);
+
+    CHECK_EQUAL(histogram.percentile(50), 1ULL << 30);
+    CHECK_EQUAL(histogram.percentile(100), 1ULL << 30);
+
+    // Never above the maximum, even when the bucket's bound is
+
+    histogram.reset();
+    histogram.record(1024 * US);
+
+    CHECK_EQUAL(histogram.percentile(100), 1024);
+}
+
+static void testPercentiles() {
+    VoodooI2CHIDLatencyHistogram histogram;
+
+    histogram.reset();
+
+    for (uint64_t value = 1; value <= 1000; value++)
+        histogram.record(value * US);
+
+    uint64_t p0 = histogram.percentile(0), p50 = histogram.percentile(50), p90 = histogram.percentile(90);
+    uint64_t p99 = histogram.percentile(99), p100 = histogram.percentile(100);
+
+    CHECK_EQUAL(histogram.count, 1000);
+    CHECK_EQUAL(p0, 1);
+    CHECK(p50 >= 500 && p50 <= 500 + 500 / 4);
+    CHECK(p90 >= 900 && p90 <= 900 + 900 / 4);
+    CHECK(p99 >= 990 && p99 <= 1000);
+    CHECK_EQUAL(p100, 1000);
+    CHECK(p0 <= p50 && p50 <= p90 && p90 <= p99 && p99 <= p100);
+
+    // A single outlier only shows from the percentile it accounts for
+
+    histogram.reset();
+
+    for (int i = 0; i < 99; i++)
+        histogram.record(10 * US);
+    histogram.record(100000 * US);
+
+    CHECK_EQUAL(histogram.percentile(99), 11);
+    CHECK_EQUAL(histogram.percentile(100), 100000);
+}
+
+static void testDictionary() {
+    VoodooI2CHIDLatencyHistogram histogram;
+
+    histogram.reset();
+
+    for (uint64_t value = 1; value <= 100; value++)
+        histogram.record(value * US);
+
+    OSDictionary* dictionary = histogram.copyDictionary();
+
+    CHECK(dictionary != NULL);
+    CHECK_EQUAL(dictionary->getCount(), 5);
+    CHECK_EQUAL(dictionaryValue(dictionary, "Count"), 100);
+    CHECK_EQUAL(dictionaryValue(dictionary, "P50Us"), histogram.percentile(50));
+    CHECK_EQUAL(dictionaryValue(dictionary, "P90Us"), histogram.percentile(90));
+    CHECK_EQUAL(dictionaryValue(dictionary, "P99Us"), histogram.percentile(99));
+    CHECK_EQUAL(dictionaryValue(dictionary, "MaxUs"), 100);
+
+    dictionary->release();
+}
+
+static void testElapsedNanoseconds() {
+    CHECK_EQUAL(elapsedNanoseconds(100, 250), 150);
+    CHECK_EQUAL(elapsedNanoseconds(250, 250), 0);
+    CHECK_EQUAL(elapsedNanoseconds(250, 100), 0);
+}
+
+int main() {
+    testEmpty();
+    testZero();
+    testBucketBoundaries();
+    testMax();
+    testPercentiles();
+    testDictionary();
+    testElapsedNanoseconds();
+
+    return testResult("VoodooI2CHIDLatencyHistogramTests");
+}
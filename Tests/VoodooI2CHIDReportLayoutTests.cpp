@@ -0,0 +1,257 @@
+//
+//  VoodooI2CHIDReportLayoutTests.cpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include "VoodooI2CHIDReportLayout.hpp"
+#include "VoodooI2CHIDDescriptorBuilder.hpp"
+#include "VoodooI2CHIDTest.hpp"
+
+/* <extract> and <extractLanes> against the reference for random fields, half of them on the byte aligned fast path */
+
+static void testExtractMatchesReference() {
+    TestRandom random(0x5EED);
+    UInt8 report[REPORT_BYTES];
+    UInt32 values[I2C_HID_LAYOUT_MAX_TRANSDUCERS];
+    int mismatches = 0;
+
+    for (int iteration = 0; iteration < 200000; iteration++) {
+        VoodooI2CHIDReportLayoutField field = {};
+        UInt32 stride, lanes = 1 + random.below(I2C_HID_LAYOUT_MAX_TRANSDUCERS);
+
+        if (iteration & 1) {
+            field.bit_size = random.below(2) ? 8 : 16;
+            field.bit_offset = 8 * random.below(32);
+            stride = 8 * (random.below(8) + field.bit_size / 8);
+            field.is_signed = random.below(4) == 0;
+        } else {
+            field.bit_size = 1 + random.below(32);
+            field.bit_offset = random.below(256);
+            stride = field.bit_size + random.below(64);
+            field.is_signed = random.below(2);
+        }
+
+        // Keep the last lane inside the report, <extract> may touch the byte after the field's last bit
+
+        while (lanes > 1 && field.bit_offset + (lanes - 1) * stride + field.bit_size + 8 > REPORT_BYTES * 8)
+            lanes--;
+
+        if (field.bit_offset + (lanes - 1) * stride + field.bit_size + 8 > REPORT_BYTES * 8)
+            continue;
+
+        fillReport(&random, report, sizeof(report));
+
+        VoodooI2CHIDReportLayout::extractLanes(report, &field, stride, lanes, values);
+
+        for (UInt32 lane = 0; lane < lanes; lane++) {
+            UInt32 bit_offset = field.bit_offset + lane * stride;
+            UInt32 expected = referenceValue(report, bit_offset, field.bit_size, field.is_signed);
+
+            VoodooI2CHIDReportLayoutField single = field;
+            single.bit_offset = bit_offset;
+
+            if (values[lane] != expected || VoodooI2CHIDReportLayout::extract(report, &single) != expected) {
+                if (mismatches++ < 10)
+                    fprintf(stderr, "offset %u size %u signed %d stride %u lane %u: lanes %08x extract %08x reference %08x\n",
+                        field.bit_offset, field.bit_size, field.is_signed, stride, lane, values[lane],
+                        VoodooI2CHIDReportLayout::extract(report, &single), expected);
+            }
+        }
+    }
+
+    CHECK_EQUAL(mismatches, 0);
+}
+
+/* Fields at the edges of the value range, where sign extension and masking go wrong first */
+
+static void testExtractEdges() {
+    UInt8 report[8] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    VoodooI2CHIDReportLayoutField field = {};
+
+    field.bit_size = 32;
+    CHECK_EQUAL(VoodooI2CHIDReportLayout::extract(report, &field), 0xFFFFFFFF);
+
+    field.bit_offset = 3;
+    field.bit_size = 1;
+    CHECK_EQUAL(VoodooI2CHIDReportLayout::extract(report, &field), 1);
+
+    field.is_signed = true;
+    CHECK_EQUAL(VoodooI2CHIDReportLayout::extract(report, &field), 0xFFFFFFFF);
+
+    field.bit_offset = 7;
+    field.bit_size = 12;
+    CHECK_EQUAL(VoodooI2CHIDReportLayout::extract(report, &field), 0xFFFFFFFF);
+
+    field.is_signed = false;
+    CHECK_EQUAL(VoodooI2CHIDReportLayout::extract(report, &field), 0xFFF);
+
+    report[1] = 0x7F;
+    field.bit_offset = 8;
+    field.bit_size = 8;
+    field.is_signed = true;
+    CHECK_EQUAL(VoodooI2CHIDReportLayout::extract(report, &field), 0x7F);
+}
+
+/* Compiles a touchpad and checks the compiled and strided paths decode random reports exactly like the reference
+ * reads the fields at the offsets the descriptor gives them
+ */
+
+static void checkCompiledTouchpad(const char* name, const FingerField* fields, UInt32 field_count, UInt32 finger_count, bool expect_fast_path) {
+    DescriptorBuilder descriptor;
+    OSArray* fingers = OSArray::withCapacity(finger_count);
+    VoodooI2CHIDReportLayout layout;
+    TestRandom random(0xF1A6);
+    UInt8 report[REPORT_BYTES];
+    UInt32 values[I2C_HID_LAYOUT_MAX_TRANSDUCERS];
+    UInt32 stride = fingerBits(fields, field_count);
+    UInt32 length = 1 + (finger_count * stride + 7) / 8 + 1;
+    UInt32 used_fields = 0;
+    int mismatches = 0;
+
+    for (UInt32 i = 0; i < field_count; i++) {
+        if (fields[i].usage != FIELD_PADDING)
+            used_fields++;
+    }
+
+    buildTouchpad(&descriptor, fingers, 1, finger_count, fields, field_count);
+
+    CHECK(layout.compile(descriptor.bytes.data(), (UInt32)descriptor.bytes.size(), fingers));
+    CHECK_EQUAL(layout.field_count, used_fields * finger_count);
+
+    const VoodooI2CHIDReportLayoutReport* compiled = layout.layoutForReport(1, length);
+
+    CHECK(compiled != NULL);
+    CHECK(layout.layoutForReport(1, layout.reportLength(1) - 1) == NULL);
+    CHECK(layout.layoutForReport(2, length) == NULL);
+
+    if (!compiled) {
+        fprintf(stderr, "%s: not compiled\n", name);
+        layout.free();
+        fingers->release();
+        return;
+    }
+
+    CHECK_EQUAL(compiled->lanes, finger_count);
+    CHECK_EQUAL(compiled->stride, stride);
+
+    const VoodooI2CHIDReportLayoutField* compiled_fields = layout.fieldsOf(compiled);
+    UInt32 lane_fields = compiled->count / compiled->lanes;
+    bool fast_path = false;
+
+    for (int iteration = 0; iteration < 20000; iteration++) {
+        fillReport(&random, report, sizeof(report));
+        report[0] = 1;
+
+        // The compiled path: every field on its own, checked against where the descriptor puts it
+
+        for (UInt32 finger = 0, k = 0; finger < finger_count; finger++) {
+            UInt32 bit_offset = 8 + finger * stride;
+
+            for (UInt32 i = 0; i < field_count; bit_offset += fields[i++].bit_size) {
+                if (fields[i].usage == FIELD_PADDING)
+                    continue;
+
+                const VoodooI2CHIDReportLayoutField* field = &compiled_fields[k++];
+                UInt32 expected = referenceValue(report, bit_offset, fields[i].bit_size, fields[i].logical_min < 0);
+
+                if (field->transducer != finger || field->bit_offset != bit_offset || field->usage != fields[i].usage ||
+                    VoodooI2CHIDReportLayout::extract(report, field) != expected) {
+                    if (mismatches++ < 10)
+                        fprintf(stderr, "%s: finger %u usage %x: compiled at bit %u, expected %u\n", name, finger, fields[i].usage, field->bit_offset, bit_offset);
+                }
+            }
+        }
+
+        // The strided path: the first finger's fields extracted for every finger at once
+
+        for (UInt32 i = 0; i < lane_fields; i++) {
+            const VoodooI2CHIDReportLayoutField* field = &compiled_fields[i];
+
+            if (!(field->bit_offset & 7) && !(compiled->stride & 7) && !field->is_signed && (field->bit_size == 8 || field->bit_size == 16))
+                fast_path = true;
+
+            VoodooI2CHIDReportLayout::extractLanes(report, field, compiled->stride, compiled->lanes, values);
+
+            for (UInt32 lane = 0; lane < compiled->lanes; lane++) {
+                UInt32 expected = VoodooI2CHIDReportLayout::extract(report, &compiled_fields[lane * lane_fields + i]);
+
+                if (values[lane] != expected && mismatches++ < 10)
+                    fprintf(stderr, "%s: lane %u field %u: strided %08x, compiled %08x\n", name, lane, i, values[lane], expected);
+            }
+        }
+    }
+
+    CHECK_EQUAL(mismatches, 0);
+    CHECK_EQUAL(fast_path, expect_fast_path);
+
+    layout.free();
+    fingers->release();
+}
+
+/* A parallel mode touchpad with byte aligned 8 and 16 bit fields, the common case */
+
+static void testCompiledAlignedTouchpad() {
+    const FingerField fields[] = {
+        {kHIDPage_Digitizer, kHIDUsage_Dig_TouchValid, 1, 0, 1},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_TipSwitch, 1, 0, 1},
+        {0, FIELD_PADDING, 6, 0, 0},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_ContactIdentifier, 8, 0, 255},
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_X, 16, 0, 4095},
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_Y, 16, 0, 4095},
+    };
+
+    checkCompiledTouchpad("aligned", fields, sizeof(fields) / sizeof(fields[0]), 5, true);
+}
+
+/* Packed 12 bit coordinates and a signed field, which the fast path must leave to <extract> */
+
+static void testCompiledPackedTouchpad() {
+    const FingerField fields[] = {
+        {kHIDPage_Digitizer, kHIDUsage_Dig_TipSwitch, 1, 0, 1},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_ContactIdentifier, 7, 0, 127},
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_X, 12, 0, 4095},
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_Y, 12, 0, 4095},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_Width, 8, -128, 127},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_Height, 5, 0, 31},
+    };
+
+    checkCompiledTouchpad("packed", fields, sizeof(fields) / sizeof(fields[0]), 4, false);
+}
+
+/* An element the descriptor does not have, or one of a different size, means the layout cannot be trusted */
+
+static void testCompileRejectsMismatchedElements() {
+    const FingerField fields[] = {
+        {kHIDPage_Digitizer, kHIDUsage_Dig_TipSwitch, 1, 0, 1},
+        {0, FIELD_PADDING, 7, 0, 0},
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_X, 16, 0, 4095},
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_Y, 16, 0, 4095},
+    };
+
+    DescriptorBuilder descriptor;
+    OSArray* fingers = OSArray::withCapacity(2);
+    VoodooI2CHIDReportLayout layout;
+
+    buildTouchpad(&descriptor, fingers, 1, 2, fields, sizeof(fields) / sizeof(fields[0]));
+
+    IOHIDElement* finger = OSDynamicCast(IOHIDElement, fingers->getObject(1));
+    finger->addChild(IOHIDElement::withUsage(kIOHIDElementTypeInput_Misc, kHIDPage_Digitizer, kHIDUsage_Dig_TipPressure, 1, 8, 255, 255));
+
+    CHECK(!layout.compile(descriptor.bytes.data(), (UInt32)descriptor.bytes.size(), fingers));
+    CHECK_EQUAL(layout.field_count, 0);
+    CHECK(layout.layoutForReport(1, REPORT_BYTES) == NULL);
+
+    fingers->release();
+}
+
+int main() {
+    testExtractEdges();
+    testExtractMatchesReference();
+    testCompiledAlignedTouchpad();
+    testCompiledPackedTouchpad();
+    testCompileRejectsMismatchedElements();
+
+    return testResult("VoodooI2CHIDReportLayoutTests");
+}
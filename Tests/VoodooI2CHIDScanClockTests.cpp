@@ -0,0 +1,113 @@
+//
+//  VoodooI2CHIDScanClockTests.cpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include "VoodooI2CHIDScanClock.hpp"
+#include "VoodooI2CHIDTest.hpp"
+
+#define MS  1000000ULL
+#define US  1000ULL
+
+/* The first frame anchors the clock to the transport's timestamp */
+
+static void testAnchor() {
+    VoodooI2CHIDScanClock clock;
+    AbsoluteTime start = 1000 * MS;
+
+    clock.reset();
+
+    CHECK_EQUAL(clock.sample(1234, start), start);
+    CHECK_EQUAL(clock.offset.count, 0);
+}
+
+/* Frames are spaced by their Scan Time difference, whatever the jitter of the transport */
+
+static void testSpacing() {
+    VoodooI2CHIDScanClock clock;
+    AbsoluteTime start = 1000 * MS;
+
+    clock.reset();
+    clock.sample(100, start);
+
+    // 10 ms later by the device's clock, delivered 3 ms late
+
+    CHECK_EQUAL(clock.sample(200, start + 13 * MS), start + 10 * MS);
+    CHECK_EQUAL(clock.offset.count, 1);
+    CHECK_EQUAL(clock.offset.max, 3 * MS / US);
+
+    // Then delivered right away, and a frame the device sampled twice
+
+    CHECK_EQUAL(clock.sample(300, start + 20 * MS), start + 20 * MS);
+    CHECK_EQUAL(clock.sample(300, start + 21 * MS), start + 20 * MS);
+    CHECK_EQUAL(clock.offset.count, 3);
+}
+
+/* Scan Time rolls over at 16 bits, the frame after it is still spaced by the difference */
+
+static void testWraparound() {
+    VoodooI2CHIDScanClock clock;
+    AbsoluteTime start = 1000 * MS;
+
+    clock.reset();
+    clock.sample(0xFFF0, start);
+
+    CHECK_EQUAL(clock.sample(0x0010, start + 4 * MS), start + 0x20 * kScanTimeUnitNs);
+    CHECK_EQUAL(clock.sample(0x0038, start + 8 * MS), start + 0x48 * kScanTimeUnitNs);
+
+    // Values wider than 16 bits are taken modulo the roll over
+
+    CHECK_EQUAL(clock.sample(0x10040, start + 9 * MS), start + 0x50 * kScanTimeUnitNs);
+
+    // A full lap is indistinguishable from no time at all, the lag catches it
+
+    CHECK_EQUAL(clock.sample(0x0040, start + 9 * MS + 65536ULL * kScanTimeUnitNs), start + 9 * MS + 65536ULL * kScanTimeUnitNs);
+}
+
+/* The clock is anchored again when the device runs ahead of the transport or lags too far behind it */
+
+static void testReanchor() {
+    VoodooI2CHIDScanClock clock;
+    AbsoluteTime start = 1000 * MS;
+
+    clock.reset();
+    clock.sample(0, start);
+
+    // The device claims 20 ms passed, the transport only saw 15
+
+    CHECK_EQUAL(clock.sample(200, start + 15 * MS), start + 15 * MS);
+    CHECK_EQUAL(clock.offset.count, 0);
+
+    // Spaced from the new anchor
+
+    CHECK_EQUAL(clock.sample(300, start + 26 * MS), start + 25 * MS);
+    CHECK_EQUAL(clock.offset.count, 1);
+
+    // After an idle gap the Scan Time difference says little, the frame is taken as sampled when it arrived
+
+    AbsoluteTime later = start + 2000 * MS;
+
+    CHECK_EQUAL(clock.sample(310, later), later);
+    CHECK_EQUAL(clock.offset.count, 1);
+
+    // Exactly at the maximum lag is still fine
+
+    CHECK_EQUAL(clock.sample(320, later + MS + kScanTimeMaxLagNs), later + MS);
+    CHECK_EQUAL(clock.offset.max, kScanTimeMaxLagNs / US);
+
+    clock.reset();
+
+    CHECK_EQUAL(clock.sample(330, later + 100 * MS), later + 100 * MS);
+    CHECK_EQUAL(clock.offset.count, 0);
+}
+
+int main() {
+    testAnchor();
+    testSpacing();
+    testWraparound();
+    testReanchor();
+
+    return testResult("VoodooI2CHIDScanClockTests");
+}
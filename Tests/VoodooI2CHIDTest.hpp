@@ -0,0 +1,79 @@
+//
+//  VoodooI2CHIDTest.hpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDTest_hpp
+#define VoodooI2CHIDTest_hpp
+
+#include <stdio.h>
+
+#include <IOKit/IOLib.h>
+
+/* Minimal test harness for the host-side tests
+ *
+ * Each test binary runs its cases from <main> and returns <testResult>. A failed check prints where it failed and
+ * carries on so that one run reports every failure.
+ */
+
+inline int test_failures = 0;
+inline int test_checks = 0;
+
+#define CHECK(condition) do {                                                                   \
+    test_checks++;                                                                              \
+    if (!(condition)) {                                                                         \
+        test_failures++;                                                                        \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);           \
+    }                                                                                           \
+} while (0)
+
+#define CHECK_EQUAL(actual, expected) do {                                                      \
+    test_checks++;                                                                              \
+    unsigned long long _actual = (unsigned long long)(actual);                                  \
+    unsigned long long _expected = (unsigned long long)(expected);                              \
+    if (_actual != _expected) {                                                                 \
+        test_failures++;                                                                        \
+        fprintf(stderr, "%s:%d: %s is %llu, expected %llu\n", __FILE__, __LINE__, #actual,       \
+            _actual, _expected);                                                                \
+    }                                                                                           \
+} while (0)
+
+/* Deterministic xorshift generator, so that a failing run can be reproduced */
+
+class TestRandom {
+ public:
+    explicit TestRandom(uint64_t seed) : state(seed ? seed : 1) {}
+
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    /* A value in [0, bound) */
+
+    UInt32 below(UInt32 bound) {
+        return bound ? (UInt32)(next() % bound) : 0;
+    }
+
+ private:
+    uint64_t state;
+};
+
+/* Prints a summary, checks nothing allocated through the shim leaked and returns the exit status */
+
+static inline int testResult(const char* name) {
+    if (shim_outstanding_allocations) {
+        test_failures++;
+        fprintf(stderr, "%s: %ld allocations leaked\n", name, shim_outstanding_allocations);
+    }
+
+    fprintf(stderr, "%s: %d checks, %d failed\n", name, test_checks, test_failures);
+
+    return test_failures ? 1 : 0;
+}
+
+#endif /* VoodooI2CHIDTest_hpp */
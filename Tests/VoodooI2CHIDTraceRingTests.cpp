@@ -0,0 +1,306 @@
+//
+//  VoodooI2CHIDTraceRingTests.cpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// The tests set the ring's sequence and records up directly
+
+#define private public
+#include "VoodooI2CHIDTraceRing.hpp"
+#undef private
+
+#include "VoodooI2CHIDTraceDecoder.hpp"
+#include "VoodooI2CHIDTest.hpp"
+
+/* A record whose every field is derived from <value>, so that one mixing two writes shows */
+
+static VoodooI2CHIDDeviceTraceRecord derivedRecord(UInt64 value) {
+    VoodooI2CHIDDeviceTraceRecord record;
+
+    memset(&record, 0, sizeof(record));
+    record.timestamp = value;
+    record.lock_wait = (UInt32)value ^ 0xA5A5A5A5;
+    record.duration = (UInt32)(value >> 7) * 3;
+    record.status = ~(SInt32)value;
+    record.reg = (UInt16)(value >> 3);
+    record.write_length = (UInt16)(value * 5);
+    record.read_length = (UInt16)(value >> 17);
+    record.operation = (UInt8)(value % 3 + 1);
+    record.reserved = (UInt8)(value >> 11);
+
+    return record;
+}
+
+static bool isDerived(const VoodooI2CHIDDeviceTraceRecord& record) {
+    VoodooI2CHIDDeviceTraceRecord expected = derivedRecord(record.timestamp);
+    expected.sequence = record.sequence;
+
+    return !memcmp(&expected, &record, sizeof(record));
+}
+
+/* Records are numbered from 1 and can be read back until they are overwritten a lap later */
+
+static void testSequence() {
+    static VoodooI2CHIDTraceRing ring;
+    VoodooI2CHIDDeviceTraceRecord copy;
+
+    ring.reset();
+
+    CHECK_EQUAL(ring.last(), 0);
+    CHECK(!ring.read(0, &copy));
+    CHECK(!ring.read(1, &copy));
+
+    for (UInt64 i = 1; i <= I2C_HID_TRACE_SIZE + 10; i++) {
+        VoodooI2CHIDDeviceTraceRecord record = derivedRecord(i);
+
+        ring.record(&record);
+        CHECK_EQUAL(record.sequence, i);
+    }
+
+    CHECK_EQUAL(ring.last(), I2C_HID_TRACE_SIZE + 10);
+    CHECK_EQUAL(ring.dropped, 0);
+
+    for (UInt32 i = 1; i <= 10; i++)
+        CHECK(!ring.read(i, &copy));
+
+    for (UInt32 i = 11; i <= I2C_HID_TRACE_SIZE + 10; i++) {
+        CHECK(ring.read(i, &copy));
+        CHECK_EQUAL(copy.sequence, i);
+        CHECK_EQUAL(copy.timestamp, i);
+        CHECK(isDerived(copy));
+    }
+
+    CHECK(!ring.read(I2C_HID_TRACE_SIZE + 11, &copy));
+}
+
+/* The sequence skips the values that mark unwritten and busy records when it wraps */
+
+static void testSequenceWraparound() {
+    static VoodooI2CHIDTraceRing ring;
+    VoodooI2CHIDDeviceTraceRecord copy;
+
+    ring.reset();
+    ring.sequence = I2C_HID_TRACE_BUSY - 3;
+
+    std::vector<UInt32> sequences;
+
+    for (UInt64 i = 0; i < 6; i++) {
+        VoodooI2CHIDDeviceTraceRecord record = derivedRecord(i);
+
+        ring.record(&record);
+        sequences.push_back(record.sequence);
+    }
+
+    CHECK(sequences == std::vector<UInt32>({I2C_HID_TRACE_BUSY - 2, I2C_HID_TRACE_BUSY - 1, 1, 2, 3, 4}));
+
+    for (UInt32 sequence : sequences)
+        CHECK(ring.read(sequence, &copy));
+
+    CHECK(!ring.read(I2C_HID_TRACE_BUSY, &copy));
+    CHECK(!ring.read(0, &copy));
+}
+
+/* A record whose previous writer has not finished yet is dropped rather than written over */
+
+static void testBusyRecord() {
+    static VoodooI2CHIDTraceRing ring;
+    VoodooI2CHIDDeviceTraceRecord copy;
+
+    ring.reset();
+    ring.records[1].sequence = I2C_HID_TRACE_BUSY;
+
+    VoodooI2CHIDDeviceTraceRecord record = derivedRecord(42);
+    ring.record(&record);
+
+    CHECK_EQUAL(ring.dropped, 1);
+    CHECK(!ring.read(1, &copy));
+    CHECK_EQUAL(ring.records[1].sequence, I2C_HID_TRACE_BUSY);
+
+    // The writer finishes, the next lap uses the record again
+
+    ring.records[1].sequence = 1;
+    ring.sequence = I2C_HID_TRACE_SIZE;
+
+    ring.record(&record);
+
+    CHECK_EQUAL(ring.dropped, 1);
+    CHECK(ring.read(I2C_HID_TRACE_SIZE + 1, &copy));
+    CHECK(isDerived(copy));
+}
+
+/* Several writers race each other around the ring while a reader keeps copying it, no copy is ever torn */
+
+static void testConcurrentWriters() {
+    static VoodooI2CHIDTraceRing ring;
+    const int writers = 4;
+    const UInt64 records = 200000;
+
+    std::atomic<int> running(writers);
+    std::atomic<UInt64> copies(0);
+    std::atomic<UInt64> torn(0);
+    std::vector<std::thread> threads;
+
+    ring.reset();
+
+    for (int writer = 0; writer < writers; writer++) {
+        threads.emplace_back([writer, records, &running] {
+            for (UInt64 i = 0; i < records; i++) {
+                VoodooI2CHIDDeviceTraceRecord record = derivedRecord(i * writers + writer + 1);
+                ring.record(&record);
+            }
+
+            running--;
+        });
+    }
+
+    threads.emplace_back([&running, &copies, &torn] {
+        while (running) {
+            UInt32 last = ring.last();
+
+            for (UInt32 i = I2C_HID_TRACE_SIZE; i > 0; i--) {
+                VoodooI2CHIDDeviceTraceRecord copy;
+
+                if (!ring.read(last - i + 1, &copy))
+                    continue;
+
+                copies++;
+
+                if (copy.sequence != last - i + 1 || !isDerived(copy))
+                    torn++;
+            }
+        }
+    });
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    CHECK(copies > 0);
+    CHECK_EQUAL(torn.load(), 0);
+
+    // Every sequence number was handed out once, recorded or dropped
+
+    CHECK_EQUAL(ring.last(), writers * records);
+
+    UInt64 readable = 0;
+
+    for (UInt32 i = ring.last() - I2C_HID_TRACE_SIZE + 1; i <= ring.last(); i++) {
+        VoodooI2CHIDDeviceTraceRecord copy;
+
+        if (ring.read(i, &copy)) {
+            readable++;
+            CHECK(isDerived(copy));
+        }
+    }
+
+    CHECK(readable + ring.dropped >= I2C_HID_TRACE_SIZE);
+}
+
+/* The decoder lays records out oldest first, relative to the first one, and points out gaps */
+
+static void testDecoder() {
+    std::vector<VoodooI2CHIDDeviceTraceRecord> records(3);
+
+    memset(records.data(), 0, records.size() * sizeof(records[0]));
+
+    records[0].sequence = 7;
+    records[0].timestamp = 1000000;
+    records[0].duration = 250000;
+    records[0].lock_wait = 1500;
+    records[0].reg = 0x0005;
+    records[0].write_length = 4;
+    records[0].operation = kVoodooI2CHIDTraceWrite;
+
+    records[1].sequence = 10;
+    records[1].timestamp = 1500000;
+    records[1].duration = 120000;
+    records[1].reg = 0x0003;
+    records[1].read_length = 32;
+    records[1].status = (SInt32)0xE00002D8;
+    records[1].operation = kVoodooI2CHIDTraceRead;
+
+    records[2].sequence = 8;
+    records[2].timestamp = 1250000;
+    records[2].reg = 0x0005;
+    records[2].write_length = 5;
+    records[2].read_length = 12;
+    records[2].operation = kVoodooI2CHIDTraceWriteRead;
+
+    std::string timeline = decodeTransactionTrace(records.data(), records.size() * sizeof(records[0]) + 3);
+
+    size_t first = timeline.find("#7 ");
+    size_t second = timeline.find("#8 ");
+    size_t gap = timeline.find("-- 1 record missing --");
+    size_t third = timeline.find("#10 ");
+
+    CHECK(first != std::string::npos && second != std::string::npos && third != std::string::npos);
+    CHECK(first < second && second < gap && gap < third);
+
+    CHECK(timeline.find("+0.000  #7          write      reg 0x0005  write 4     read 0        250.000 us  lock      1.500 us  ok") != std::string::npos);
+    CHECK(timeline.find("+250.000  #8          write-read") != std::string::npos);
+    CHECK(timeline.find("+500.000  #10         read       reg 0x0003  write 0     read 32       120.000 us") != std::string::npos);
+    CHECK(timeline.find("error 0xe00002d8") != std::string::npos);
+    CHECK(timeline.find("3 trailing bytes ignored") != std::string::npos);
+
+    // Across the wrap of the sequence, where I2C_HID_TRACE_BUSY and 0 are skipped
+
+    records.resize(2);
+    records[0].sequence = I2C_HID_TRACE_BUSY - 1;
+    records[1].sequence = 1;
+
+    timeline = decodeTransactionTrace(records.data(), records.size() * sizeof(records[0]));
+
+    CHECK(timeline.find("missing") == std::string::npos);
+    CHECK(timeline.find("#4294967294") < timeline.find("#1 "));
+}
+
+/* Dumps come out of ioreg as base64 in a property list */
+
+static void testPropertyList() {
+    VoodooI2CHIDDeviceTraceRecord record = derivedRecord(0x1234);
+    record.sequence = 3;
+
+    const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const UInt8* bytes = reinterpret_cast<const UInt8*>(&record);
+    std::string encoded;
+
+    for (size_t i = 0; i < sizeof(record); i += 3) {
+        UInt32 group = bytes[i] << 16 | (i + 1 < sizeof(record) ? bytes[i + 1] << 8 : 0) | (i + 2 < sizeof(record) ? bytes[i + 2] : 0);
+
+        encoded += alphabet[group >> 18 & 63];
+        encoded += alphabet[group >> 12 & 63];
+        encoded += i + 1 < sizeof(record) ? alphabet[group >> 6 & 63] : '=';
+        encoded += i + 2 < sizeof(record) ? alphabet[group & 63] : '=';
+
+        if (i % 48 == 45)
+            encoded += "\n\t\t\t";
+    }
+
+    std::string plist = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<plist version=\"1.0\">\n<array>\n\t<dict>\n"
+                        "\t\t<key>TransactionTrace</key>\n\t\t<data>\n\t\t" + encoded + "\n\t\t</data>\n\t</dict>\n</array>\n</plist>\n";
+
+    std::vector<UInt8> decoded;
+
+    CHECK(extractTraceData(plist, &decoded));
+    CHECK_EQUAL(decoded.size(), sizeof(record));
+    CHECK(decoded.size() == sizeof(record) && !memcmp(decoded.data(), &record, sizeof(record)));
+
+    CHECK(!extractTraceData("<plist><dict></dict></plist>", &decoded));
+    CHECK(!extractTraceData("<data>not*base64</data>", &decoded));
+}
+
+int main() {
+    testSequence();
+    testSequenceWraparound();
+    testBusyRecord();
+    testConcurrentWriters();
+    testDecoder();
+    testPropertyList();
+
+    return testResult("VoodooI2CHIDTraceRingTests");
+}
@@ -0,0 +1,453 @@
+//
+//  VoodooI2CHIDTransducerBindingTests.cpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include <chrono>
+
+#include "VoodooI2CHIDContactStore.hpp"
+#include "VoodooI2CHIDTransducerWrapper.hpp"
+#include "VoodooI2CHIDDescriptorBuilder.hpp"
+#include "VoodooI2CHIDTest.hpp"
+
+#define MS  1000000ULL
+
+/* The per-element usage switch the bindings replaced, as a reference for them
+ *
+ * Stylus usages only apply to styluses, the switch this was taken from cast every transducer to one.
+ */
+
+static void referenceWalk(VoodooI2CDigitiserTransducer* transducer, AbsoluteTime timestamp, UInt32 report_id) {
+    VoodooI2CDigitiserStylus* stylus = OSDynamicCast(VoodooI2CDigitiserStylus, transducer);
+    OSArray* child_elements = transducer->collection->getChildElements();
+    bool has_confidence = false;
+
+    for (UInt32 i = 0; i < child_elements->getCount(); i++) {
+        IOHIDElement* element = OSDynamicCast(IOHIDElement, child_elements->getObject(i));
+        UInt32 usage = element->getUsage();
+        UInt32 value = element->getValue();
+
+        transducer->id = report_id;
+        transducer->timestamp = element->getTimeStamp();
+
+        switch (element->getUsagePage()) {
+            case kHIDPage_GenericDesktop:
+                if (usage == kHIDUsage_GD_X) {
+                    transducer->coordinates.x.update(value, timestamp);
+                    transducer->logical_max_x = element->getLogicalMax();
+                } else if (usage == kHIDUsage_GD_Y) {
+                    transducer->coordinates.y.update(value, timestamp);
+                    transducer->logical_max_y = element->getLogicalMax();
+                } else if (usage == kHIDUsage_GD_Z) {
+                    transducer->coordinates.z.update(value, timestamp);
+                    transducer->logical_max_z = element->getLogicalMax();
+                }
+                break;
+            case kHIDPage_Button:
+                if (value)
+                    transducer->physical_button.update(transducer->physical_button.current.value |= 1 << (usage - 1), timestamp);
+                else
+                    transducer->physical_button.update(transducer->physical_button.current.value &= ~(1 << (usage - 1)), timestamp);
+                break;
+            case kHIDPage_Digitizer:
+                switch (usage) {
+                    case kHIDUsage_Dig_TransducerIndex:
+                    case kHIDUsage_Dig_ContactIdentifier:
+                        transducer->secondary_id = value;
+                        break;
+                    case kHIDUsage_Dig_Touch:
+                    case kHIDUsage_Dig_TipSwitch:
+                        transducer->tip_switch.update(value ? transducer->tip_switch.current.value | 1 : transducer->tip_switch.current.value & ~1, timestamp);
+                        break;
+                    case kHIDUsage_Dig_InRange:
+                        transducer->in_range = value != 0;
+                        break;
+                    case kHIDUsage_Dig_TipPressure:
+                    case kHIDUsage_Dig_SecondaryTipSwitch:
+                        transducer->tip_pressure.update(value, timestamp);
+                        transducer->pressure_physical_max = element->getPhysicalMax();
+                        break;
+                    case kHIDUsage_Dig_XTilt:
+                        transducer->tilt_orientation.x_tilt.update(element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
+                        break;
+                    case kHIDUsage_Dig_YTilt:
+                        transducer->tilt_orientation.y_tilt.update(element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
+                        break;
+                    case kHIDUsage_Dig_Azimuth:
+                        transducer->azi_alti_orientation.azimuth.update(value, timestamp);
+                        break;
+                    case kHIDUsage_Dig_Altitude:
+                        transducer->azi_alti_orientation.altitude.update(value, timestamp);
+                        break;
+                    case kHIDUsage_Dig_Twist:
+                        transducer->azi_alti_orientation.twist.update(element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
+                        break;
+                    case kHIDUsage_Dig_Width:
+                        transducer->dimensions.width.update(value, timestamp);
+                        break;
+                    case kHIDUsage_Dig_Height:
+                        transducer->dimensions.height.update(value, timestamp);
+                        break;
+                    case kHIDUsage_Dig_DataValid:
+                    case kHIDUsage_Dig_TouchValid:
+                    case kHIDUsage_Dig_Quality:
+                        transducer->is_valid = value != 0;
+                        has_confidence = true;
+                        break;
+                    case kHIDUsage_Dig_BarrelPressure:
+                        if (stylus)
+                            stylus->barrel_pressure.update(element->getScaledFixedValue(kIOHIDValueScaleTypeCalibrated), timestamp);
+                        break;
+                    case kHIDUsage_Dig_BarrelSwitch:
+                        if (stylus)
+                            stylus->barrel_switch.update(value ? stylus->barrel_switch.current.value | 2 : stylus->barrel_switch.current.value & ~2, timestamp);
+                        break;
+                    case kHIDUsage_Dig_BatteryStrength:
+                        if (stylus)
+                            stylus->battery_strength = value;
+                        break;
+                    case kHIDUsage_Dig_Eraser:
+                        if (stylus) {
+                            stylus->eraser.update(value ? stylus->eraser.current.value | 4 : stylus->eraser.current.value & ~4, timestamp);
+                            stylus->invert = value != 0;
+                        }
+                        break;
+                    case kHIDUsage_Dig_Invert:
+                        if (stylus)
+                            stylus->invert = value != 0;
+                        break;
+                }
+                break;
+        }
+    }
+
+    if (!has_confidence)
+        transducer->is_valid = true;
+}
+
+template <typename T>
+static bool sameState(const DigitiserTransducerState<T>& a, const DigitiserTransducerState<T>& b) {
+    return a.current.value == b.current.value && a.current.timestamp == b.current.timestamp;
+}
+
+/* Compares everything a transducer hands to the multitouch interface */
+
+static bool sameTransducer(VoodooI2CDigitiserTransducer* a, VoodooI2CDigitiserTransducer* b) {
+    if (!sameState(a->coordinates.x, b->coordinates.x) || !sameState(a->coordinates.y, b->coordinates.y) ||
+        !sameState(a->coordinates.z, b->coordinates.z) || !sameState(a->physical_button, b->physical_button) ||
+        !sameState(a->tip_switch, b->tip_switch) || !sameState(a->tip_pressure, b->tip_pressure) ||
+        !sameState(a->tilt_orientation.x_tilt, b->tilt_orientation.x_tilt) ||
+        !sameState(a->tilt_orientation.y_tilt, b->tilt_orientation.y_tilt) ||
+        !sameState(a->azi_alti_orientation.azimuth, b->azi_alti_orientation.azimuth) ||
+        !sameState(a->azi_alti_orientation.altitude, b->azi_alti_orientation.altitude) ||
+        !sameState(a->azi_alti_orientation.twist, b->azi_alti_orientation.twist) ||
+        !sameState(a->dimensions.width, b->dimensions.width) || !sameState(a->dimensions.height, b->dimensions.height))
+        return false;
+
+    if (a->id != b->id || a->secondary_id != b->secondary_id || a->timestamp != b->timestamp ||
+        a->in_range != b->in_range || a->is_valid != b->is_valid)
+        return false;
+
+    VoodooI2CDigitiserStylus* stylus_a = OSDynamicCast(VoodooI2CDigitiserStylus, a);
+    VoodooI2CDigitiserStylus* stylus_b = OSDynamicCast(VoodooI2CDigitiserStylus, b);
+
+    if (!stylus_a || !stylus_b)
+        return !stylus_a && !stylus_b;
+
+    return sameState(stylus_a->barrel_pressure, stylus_b->barrel_pressure) && sameState(stylus_a->barrel_switch, stylus_b->barrel_switch) &&
+           sameState(stylus_a->eraser, stylus_b->eraser) && stylus_a->battery_strength == stylus_b->battery_strength &&
+           stylus_a->invert == stylus_b->invert;
+}
+
+static VoodooI2CHIDTransducerWrapper* wrapTransducer(VoodooI2CDigitiserTransducer* transducer) {
+    VoodooI2CHIDTransducerWrapper* wrapper = VoodooI2CHIDTransducerWrapper::wrapper();
+
+    wrapper->transducers->setObject(transducer);
+    transducer->release();
+
+    return wrapper;
+}
+
+/* A collection with every usage the bindings know of, a few twice, and one they don't */
+
+static IOHIDElement* everyUsageCollection(bool confidence) {
+    const UInt16 usages[][3] = {
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_X, 4095},
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_Y, 2047},
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_Z, 255},
+        {kHIDPage_Button, 1, 1},
+        {kHIDPage_Button, 3, 1},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_ContactIdentifier, 15},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_TipSwitch, 1},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_InRange, 1},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_TipPressure, 1023},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_XTilt, 127},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_YTilt, 127},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_Azimuth, 359},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_Altitude, 90},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_Twist, 359},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_Width, 63},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_Height, 63},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_BarrelPressure, 255},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_BarrelSwitch, 1},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_BatteryStrength, 100},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_Eraser, 1},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_Invert, 1},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_Touch, 1},
+        {kHIDPage_Digitizer, 0x5A, 255},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_TouchValid, 1},
+    };
+
+    IOHIDElement* collection = IOHIDElement::withUsage(kIOHIDElementTypeCollection, kHIDPage_Digitizer, kHIDUsage_Dig_Finger);
+    UInt32 count = sizeof(usages) / sizeof(usages[0]) - (confidence ? 0 : 1);
+
+    for (UInt32 i = 0; i < count; i++)
+        collection->addChild(IOHIDElement::withUsage(kIOHIDElementTypeInput_Misc, usages[i][0], usages[i][1], 1, 16, usages[i][2], usages[i][2] * 2));
+
+    return collection;
+}
+
+/* The bound setters leave a transducer exactly as the usage switch did, report after report */
+
+static void checkBindingsMatchWalk(const char* name, bool stylus, bool confidence) {
+    IOHIDElement* collection = everyUsageCollection(confidence);
+    TestRandom random(0xB1D5);
+    int mismatches = 0;
+
+    VoodooI2CDigitiserTransducer* walked;
+    VoodooI2CDigitiserTransducer* bound;
+
+    if (stylus) {
+        walked = VoodooI2CDigitiserStylus::stylus(kDigitiserTransducerStylus, collection);
+        bound = VoodooI2CDigitiserStylus::stylus(kDigitiserTransducerStylus, collection);
+    } else {
+        walked = VoodooI2CDigitiserTransducer::transducer(kDigitiserTransducerFinger, collection);
+        bound = VoodooI2CDigitiserTransducer::transducer(kDigitiserTransducerFinger, collection);
+    }
+
+    VoodooI2CHIDTransducerWrapper* walked_wrapper = wrapTransducer(walked);
+    VoodooI2CHIDTransducerWrapper* bound_wrapper = wrapTransducer(bound);
+
+    CHECK(bound_wrapper->bind());
+
+    // Only the stylus binds the stylus usages, nothing binds the unknown one
+
+    CHECK_EQUAL(bound_wrapper->bindings[0].count, collection->getChildElements()->getCount() - (stylus ? 1 : 6));
+    CHECK_EQUAL(bound_wrapper->bindings[0].has_confidence, confidence);
+
+    for (int iteration = 0; iteration < 5000; iteration++) {
+        OSArray* elements = collection->getChildElements();
+        AbsoluteTime timestamp;
+
+        shimAdvanceUptime(MS);
+        clock_get_uptime(&timestamp);
+
+        for (UInt32 i = 0; i < elements->getCount(); i++) {
+            IOHIDElement* element = OSDynamicCast(IOHIDElement, elements->getObject(i));
+            element->setValue(random.below(element->getLogicalMax() + 1));
+        }
+
+        referenceWalk(walked, timestamp, 1 + iteration % 3);
+        bound_wrapper->update(0, timestamp, 1 + iteration % 3);
+
+        if (!sameTransducer(walked, bound) && mismatches++ < 10)
+            fprintf(stderr, "%s: report %d differs\n", name, iteration);
+    }
+
+    CHECK_EQUAL(mismatches, 0);
+
+    // The maxima the walk stored on every report were stored once when binding
+
+    CHECK_EQUAL(bound->logical_max_x, walked->logical_max_x);
+    CHECK_EQUAL(bound->logical_max_y, walked->logical_max_y);
+    CHECK_EQUAL(bound->logical_max_z, walked->logical_max_z);
+    CHECK_EQUAL(bound->pressure_physical_max, walked->pressure_physical_max);
+    CHECK_EQUAL(bound->logical_max_x, 4095);
+
+    walked_wrapper->release();
+    bound_wrapper->release();
+    collection->release();
+}
+
+static void testBindingsMatchWalk() {
+    checkBindingsMatchWalk("finger", false, true);
+    checkBindingsMatchWalk("finger without confidence", false, false);
+    checkBindingsMatchWalk("stylus", true, true);
+}
+
+/* Decodes the same reports through the compiled layout and the bound elements, and checks both leave the fingers in
+ * the same state
+ *
+ * Both paths are timed afterwards. The element values <IOHIDDevice> sets are not part of the walk's cost, and the sync
+ * is not part of the compiled path's as the driver only does it for the frames it forwards. The shim's elements are
+ * plain objects, in the kernel every getter the walk calls is virtual.
+ */
+
+static void checkCompiledMatchesBindings(const char* name, const FingerField* fields, UInt32 field_count, UInt32 finger_count, bool strided) {
+    DescriptorBuilder descriptor;
+    OSArray* fingers = OSArray::withCapacity(finger_count);
+    OSArray* compiled_wrappers = OSArray::withCapacity(1);
+    VoodooI2CHIDTransducerWrapper* walked_wrapper = VoodooI2CHIDTransducerWrapper::wrapper();
+    VoodooI2CHIDTransducerWrapper* compiled_wrapper = VoodooI2CHIDTransducerWrapper::wrapper();
+    VoodooI2CHIDReportLayout layout;
+    VoodooI2CHIDContactStore contacts;
+    TestRandom random(0xC0DE);
+    UInt32 stride = fingerBits(fields, field_count);
+    UInt32 length = 1 + (finger_count * stride + 7) / 8 + 1;
+    const int reports = 4000;
+    std::vector<UInt8> trace(reports * length);
+    int mismatches = 0;
+
+    buildTouchpad(&descriptor, fingers, 1, finger_count, fields, field_count);
+
+    for (UInt32 finger = 0; finger < finger_count; finger++) {
+        IOHIDElement* collection = OSDynamicCast(IOHIDElement, fingers->getObject(finger));
+        VoodooI2CDigitiserTransducer* transducer;
+
+        transducer = VoodooI2CDigitiserTransducer::transducer(kDigitiserTransducerFinger, collection);
+        walked_wrapper->transducers->setObject(transducer);
+        transducer->release();
+
+        transducer = VoodooI2CDigitiserTransducer::transducer(kDigitiserTransducerFinger, collection);
+        compiled_wrapper->transducers->setObject(transducer);
+        transducer->release();
+    }
+
+    compiled_wrappers->setObject(compiled_wrapper);
+
+    CHECK(walked_wrapper->bind());
+    CHECK(compiled_wrapper->bind());
+    CHECK(contacts.allocate(compiled_wrappers));
+    CHECK_EQUAL(contacts.capacity, finger_count);
+    CHECK(layout.compile(descriptor.bytes.data(), (UInt32)descriptor.bytes.size(), fingers));
+
+    const VoodooI2CHIDReportLayoutReport* compiled = layout.layoutForReport(1, length);
+    CHECK(compiled != NULL);
+
+    if (!compiled) {
+        fprintf(stderr, "%s: not compiled\n", name);
+        goto exit;
+    }
+
+    {
+        VoodooI2CHIDReportLayoutReport report_layout = *compiled;
+        const VoodooI2CHIDReportLayoutField* compiled_fields = layout.fieldsOf(compiled);
+
+        // Fields decoded one at a time when the fingers are not looked at as lanes
+
+        if (!strided)
+            report_layout.lanes = 0;
+
+        for (int i = 0; i < reports; i++) {
+            UInt8* report = &trace[i * length];
+
+            fillReport(&random, report, length);
+            report[0] = 1;
+        }
+
+        for (int i = 0; i < reports; i++) {
+            const UInt8* report = &trace[i * length];
+            AbsoluteTime timestamp;
+
+            shimAdvanceUptime(MS);
+            clock_get_uptime(&timestamp);
+
+            // What <IOHIDDevice> does with the report before the driver sees it
+
+            for (UInt32 finger = 0; finger < finger_count; finger++) {
+                OSArray* elements = OSDynamicCast(IOHIDElement, fingers->getObject(finger))->getChildElements();
+                UInt32 bit_offset = 8 + finger * stride;
+
+                for (UInt32 j = 0, k = 0; j < field_count; bit_offset += fields[j++].bit_size) {
+                    if (fields[j].usage != FIELD_PADDING)
+                        OSDynamicCast(IOHIDElement, elements->getObject(k++))->setValue(referenceValue(report, bit_offset, fields[j].bit_size, fields[j].logical_min < 0));
+                }
+            }
+
+            for (UInt32 finger = 0; finger < finger_count; finger++)
+                walked_wrapper->update(finger, timestamp, 1);
+
+            if (contacts.decode(0, finger_count, &report_layout, compiled_fields, report, timestamp, timestamp, 1) != strided && mismatches++ < 10)
+                fprintf(stderr, "%s: report %d decoded %s\n", name, i, strided ? "field by field" : "as lanes");
+
+            contacts.sync();
+
+            for (UInt32 finger = 0; finger < finger_count; finger++) {
+                VoodooI2CDigitiserTransducer* walked = OSDynamicCast(VoodooI2CDigitiserTransducer, walked_wrapper->transducers->getObject(finger));
+                VoodooI2CDigitiserTransducer* decoded = OSDynamicCast(VoodooI2CDigitiserTransducer, compiled_wrapper->transducers->getObject(finger));
+
+                if (!sameTransducer(walked, decoded) && mismatches++ < 10)
+                    fprintf(stderr, "%s: report %d finger %u differs\n", name, i, finger);
+            }
+        }
+
+        CHECK_EQUAL(mismatches, 0);
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < reports; i++) {
+            for (UInt32 finger = 0; finger < finger_count; finger++)
+                walked_wrapper->update(finger, i, 1);
+        }
+
+        auto walked = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < reports; i++) {
+            contacts.decode(0, finger_count, &report_layout, compiled_fields, &trace[i * length], i, i, 1);
+        }
+
+        auto decoded = std::chrono::steady_clock::now();
+
+        double walk_ns = std::chrono::duration<double, std::nano>(walked - start).count() / reports;
+        double decode_ns = std::chrono::duration<double, std::nano>(decoded - walked).count() / reports;
+
+        fprintf(stderr, "%s: %u fingers, walk %.0f ns/report, compiled %.0f ns/report, %.1f contacts/us\n", name,
+                finger_count, walk_ns, decode_ns, finger_count * 1000 / decode_ns);
+    }
+
+exit:
+    layout.free();
+    contacts.free();
+    compiled_wrappers->release();
+    compiled_wrapper->release();
+    walked_wrapper->release();
+    fingers->release();
+}
+
+/* The finger collection of the SYNA3602 override, five of them to a report */
+
+static void testCompiledMatchesBindings() {
+    const FingerField syna3602[] = {
+        {kHIDPage_Digitizer, kHIDUsage_Dig_TouchValid, 1, 0, 1},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_TipSwitch, 1, 0, 1},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_ContactIdentifier, 3, 0, 5},
+        {0, FIELD_PADDING, 3, 0, 0},
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_X, 16, 0, 2628},
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_Y, 16, 0, 1332},
+    };
+
+    const FingerField packed[] = {
+        {kHIDPage_Digitizer, kHIDUsage_Dig_TipSwitch, 1, 0, 1},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_InRange, 1, 0, 1},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_ContactIdentifier, 6, 0, 63},
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_X, 12, 0, 4095},
+        {kHIDPage_GenericDesktop, kHIDUsage_GD_Y, 12, 0, 4095},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_TipPressure, 8, 0, 255},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_Width, 8, -128, 127},
+        {kHIDPage_Digitizer, kHIDUsage_Dig_Height, 5, 0, 31},
+    };
+
+    checkCompiledMatchesBindings("SYNA3602", syna3602, sizeof(syna3602) / sizeof(syna3602[0]), 5, true);
+    checkCompiledMatchesBindings("SYNA3602 field by field", syna3602, sizeof(syna3602) / sizeof(syna3602[0]), 5, false);
+    checkCompiledMatchesBindings("packed", packed, sizeof(packed) / sizeof(packed[0]), 4, true);
+    checkCompiledMatchesBindings("packed field by field", packed, sizeof(packed) / sizeof(packed[0]), 4, false);
+}
+
+int main() {
+    testBindingsMatchWalk();
+    testCompiledMatchesBindings();
+
+    return testResult("VoodooI2CHIDTransducerBindingTests");
+}
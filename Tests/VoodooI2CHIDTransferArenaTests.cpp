@@ -0,0 +1,196 @@
+//
+//  VoodooI2CHIDTransferArenaTests.cpp
+//  VoodooI2CHID Tests
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include "VoodooI2CHIDTransferArena.hpp"
+#include "VoodooI2CHIDTest.hpp"
+
+static bool aligned(const UInt8* buffer) {
+    return !((uintptr_t)buffer & (I2C_HID_ARENA_ALIGNMENT - 1));
+}
+
+static bool overlap(const UInt8* a, UInt32 a_size, const UInt8* b, UInt32 b_size) {
+    return a < b + b_size && b < a + a_size;
+}
+
+/* Every buffer is aligned, whatever size came before it */
+
+static void testAlignment() {
+    VoodooI2CHIDTransferArena arena;
+    TestRandom random(0xA11C);
+
+    CHECK(arena.init(1024));
+
+    for (int i = 0; i < 10000; i++) {
+        arena.begin();
+
+        UInt8* buffer = arena.allocate(1 + random.below(100));
+
+        CHECK(buffer != NULL);
+        CHECK(aligned(buffer));
+
+        arena.end();
+    }
+
+    CHECK_EQUAL(arena.failures, 0);
+    CHECK(arena.wraps > 0);
+
+    arena.free();
+}
+
+/* A transaction may wrap around once, but never onto a buffer it already handed out */
+
+static void testWrapWithinTransactionIsRefused() {
+    VoodooI2CHIDTransferArena arena;
+
+    CHECK(arena.init(64));
+
+    // Wrapping right from the start of the pool would reach the first buffer
+
+    arena.begin();
+    UInt8* first = arena.allocate(32);
+    CHECK(first != NULL);
+    CHECK(arena.allocate(48) == NULL);
+    CHECK_EQUAL(arena.failures, 1);
+    CHECK_EQUAL(arena.wraps, 0);
+    arena.end();
+
+    // Starting at 32, the second buffer wraps and may use everything up to where the transaction started
+
+    arena.begin();
+    UInt8* tail = arena.allocate(32);
+    UInt8* head = arena.allocate(16);
+    UInt8* rest = arena.allocate(16);
+
+    CHECK(tail != NULL && head != NULL && rest != NULL);
+    CHECK_EQUAL(arena.wraps, 1);
+    CHECK(!overlap(tail, 32, head, 16));
+    CHECK(!overlap(tail, 32, rest, 16));
+    CHECK(!overlap(head, 16, rest, 16));
+
+    // The pool is now full up to the start of the transaction, and it may not wrap twice
+
+    CHECK(arena.allocate(1) == NULL);
+    CHECK(arena.allocate(64) == NULL);
+    CHECK_EQUAL(arena.failures, 3);
+    arena.end();
+
+    // A new transaction is free to wrap over the last one
+
+    arena.begin();
+    CHECK(arena.allocate(64) != NULL);
+    CHECK_EQUAL(arena.wraps, 2);
+    arena.end();
+
+    arena.begin();
+    CHECK(arena.allocate(65) == NULL);
+    arena.end();
+
+    arena.free();
+}
+
+/* Buffers handed out within a transaction never overlap, whatever the sizes */
+
+static void testTransactionsNeverOverlap() {
+    VoodooI2CHIDTransferArena arena;
+    TestRandom random(0x0B5E);
+    int overlaps = 0;
+
+    CHECK(arena.init(256));
+
+    for (int i = 0; i < 20000; i++) {
+        UInt8* buffers[4];
+        UInt32 sizes[4];
+        UInt32 count = 0;
+
+        arena.begin();
+
+        for (UInt32 j = 0; j < 4; j++) {
+            UInt32 size = 1 + random.below(96);
+            UInt8* buffer = arena.allocate(size);
+
+            if (!buffer)
+                continue;
+
+            for (UInt32 k = 0; k < count; k++) {
+                if (overlap(buffer, size, buffers[k], sizes[k]))
+                    overlaps++;
+            }
+
+            buffers[count] = buffer;
+            sizes[count++] = size;
+        }
+
+        arena.end();
+    }
+
+    CHECK_EQUAL(overlaps, 0);
+    CHECK(arena.failures > 0);
+
+    arena.free();
+}
+
+/* The high water mark is the most a single transaction used, padding and the skipped end of the pool included */
+
+static void testHighWater() {
+    VoodooI2CHIDTransferArena arena;
+
+    CHECK(arena.init(128));
+    CHECK_EQUAL(arena.high_water, 0);
+
+    // 10 bytes, 6 of padding and 10 more
+
+    arena.begin();
+    arena.allocate(10);
+    arena.allocate(10);
+    arena.end();
+
+    CHECK_EQUAL(arena.high_water, 26);
+
+    arena.begin();
+    arena.allocate(1);
+    arena.end();
+
+    CHECK_EQUAL(arena.high_water, 26);
+
+    // Starting a transaction ends the previous one just as well. From 33: 15 bytes of padding, 20, 12 more and 20.
+
+    arena.begin();
+    arena.allocate(20);
+    arena.allocate(20);
+    arena.begin();
+
+    CHECK_EQUAL(arena.high_water, 67);
+
+    arena.free();
+
+    // Wrapping skips the end of the pool, which the transaction still kept from being used
+
+    CHECK(arena.init(128));
+
+    arena.begin();
+    arena.allocate(64);
+    arena.end();
+
+    arena.begin();
+    CHECK(arena.allocate(40) != NULL);
+    CHECK(arena.allocate(40) != NULL);
+    arena.end();
+
+    CHECK_EQUAL(arena.wraps, 1);
+    CHECK_EQUAL(arena.high_water, 40 + 24 + 40);
+
+    arena.free();
+}
+
+int main() {
+    testAlignment();
+    testWrapWithinTransactionIsRefused();
+    testTransactionsNeverOverlap();
+    testHighWater();
+
+    return testResult("VoodooI2CHIDTransferArenaTests");
+}
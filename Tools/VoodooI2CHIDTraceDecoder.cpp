@@ -0,0 +1,55 @@
+//
+//  VoodooI2CHIDTraceDecoder.cpp
+//  VoodooI2CHID Tools
+//
+//  Prints the transaction trace of a VoodooI2CHIDDevice as a timeline. Set "DumpTransactionTrace" on the device, with
+//  IORegistryEntrySetCFProperty or a tool such as ioio, then feed the property list ioreg prints for it to the decoder:
+//
+//      ioreg -r -c VoodooI2CHIDDevice -k TransactionTrace -a | VoodooI2CHIDTraceDecoder
+//
+//  A raw dump, as saved from the property's data, works just as well.
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include <iostream>
+#include <iterator>
+#include <fstream>
+
+#include "VoodooI2CHIDTraceDecoder.hpp"
+
+int main(int argc, char* argv[]) {
+    std::string input;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [dump]\n", argv[0]);
+        return 2;
+    }
+
+    if (argc == 2) {
+        std::ifstream file(argv[1], std::ios::binary);
+        if (!file) {
+            fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[1]);
+            return 1;
+        }
+
+        input.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    } else {
+        input.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+    }
+
+    std::vector<UInt8> bytes;
+
+    if (input.compare(0, 5, "<?xml") == 0) {
+        if (!extractTraceData(input, &bytes)) {
+            fprintf(stderr, "%s: no TransactionTrace data in the property list\n", argv[0]);
+            return 1;
+        }
+    } else {
+        bytes.assign(input.begin(), input.end());
+    }
+
+    fputs(decodeTransactionTrace(bytes.data(), bytes.size()).c_str(), stdout);
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+//
+//  VoodooI2CHIDTraceDecoder.hpp
+//  VoodooI2CHID Tools
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDTraceDecoder_hpp
+#define VoodooI2CHIDTraceDecoder_hpp
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "VoodooI2CHIDTraceRing.hpp"
+
+/* Extracts the first <data> element of a property list, as printed by `ioreg -a`
+ * @plist The property list
+ * @bytes Where to store the decoded bytes
+ *
+ * @return *true* if a data element was found and was valid base64, *false* otherwise
+ */
+
+static inline bool extractTraceData(const std::string& plist, std::vector<UInt8>* bytes) {
+    size_t begin = plist.find("<data>");
+    size_t end = begin == std::string::npos ? begin : plist.find("</data>", begin);
+
+    if (end == std::string::npos)
+        return false;
+
+    UInt32 accumulator = 0;
+    int bits = 0;
+
+    bytes->clear();
+
+    for (size_t i = begin + 6; i < end; i++) {
+        char c = plist[i];
+        int value;
+
+        if (c >= 'A' && c <= 'Z')
+            value = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            value = c - '0' + 52;
+        else if (c == '+')
+            value = 62;
+        else if (c == '/')
+            value = 63;
+        else if (c == '=' || isspace((unsigned char)c))
+            continue;
+        else
+            return false;
+
+        accumulator = accumulator << 6 | value;
+        bits += 6;
+
+        if (bits >= 8) {
+            bits -= 8;
+            bytes->push_back((UInt8)(accumulator >> bits));
+        }
+    }
+
+    return true;
+}
+
+static inline const char* traceOperationName(UInt8 operation) {
+    switch (operation) {
+        case kVoodooI2CHIDTraceRead:
+            return "read";
+        case kVoodooI2CHIDTraceWrite:
+            return "write";
+        case kVoodooI2CHIDTraceWriteRead:
+            return "write-read";
+        default:
+            return "unknown";
+    }
+}
+
+/* Turns a "TransactionTrace" dump into a timeline, one line per transaction
+ * @bytes The records as dumped by <VoodooI2CHIDDevice::dumpTransactionTrace>
+ * @length The length of the dump in bytes
+ *
+ * Times are relative to the start of the oldest transaction, in microseconds. Records missing between two that were
+ * dumped, because they were being written or overwritten at the time, are reported as a gap.
+ *
+ * @return The timeline
+ */
+
+static inline std::string decodeTransactionTrace(const void* bytes, size_t length) {
+    std::vector<VoodooI2CHIDDeviceTraceRecord> records(length / sizeof(VoodooI2CHIDDeviceTraceRecord));
+    std::string timeline;
+    char line[160];
+
+    if (!records.empty())
+        memcpy(records.data(), bytes, records.size() * sizeof(VoodooI2CHIDDeviceTraceRecord));
+
+    // Sequence numbers wrap, order them by their distance from the newest one. A dump spans far less than half of
+    // their range, so the newest is the one no other is ahead of.
+
+    if (!records.empty()) {
+        UInt32 newest = records[0].sequence;
+
+        for (const VoodooI2CHIDDeviceTraceRecord& record : records) {
+            if ((SInt32)(record.sequence - newest) > 0)
+                newest = record.sequence;
+        }
+
+        std::stable_sort(records.begin(), records.end(), [newest](const VoodooI2CHIDDeviceTraceRecord& a, const VoodooI2CHIDDeviceTraceRecord& b) {
+            return newest - a.sequence > newest - b.sequence;
+        });
+    }
+
+    for (size_t i = 0; i < records.size(); i++) {
+        const VoodooI2CHIDDeviceTraceRecord& record = records[i];
+
+        if (i) {
+            UInt32 missing = record.sequence - records[i - 1].sequence - 1;
+
+            // Neither I2C_HID_TRACE_BUSY nor 0 are ever handed out, both lie in between when the sequence wrapped
+
+            if (record.sequence < records[i - 1].sequence)
+                missing -= 2;
+
+            if (missing) {
+                snprintf(line, sizeof(line), "%14s  -- %u record%s missing --\n", "", missing, missing == 1 ? "" : "s");
+                timeline += line;
+            }
+        }
+
+        // Records are ordered by when they were recorded, a transaction may have started before the one ahead of it
+
+        double start = (double)(SInt64)(record.timestamp - records[0].timestamp) / 1000;
+
+        snprintf(line, sizeof(line), "%+14.3f  #%-10u %-10s reg 0x%04x  write %-5u read %-5u %10.3f us  lock %10.3f us  ",
+                 start, record.sequence, traceOperationName(record.operation), record.reg, record.write_length,
+                 record.read_length, (double)record.duration / 1000, (double)record.lock_wait / 1000);
+        timeline += line;
+
+        if (record.status)
+            snprintf(line, sizeof(line), "error 0x%08x\n", (UInt32)record.status);
+        else
+            snprintf(line, sizeof(line), "ok\n");
+        timeline += line;
+    }
+
+    if (length % sizeof(VoodooI2CHIDDeviceTraceRecord)) {
+        snprintf(line, sizeof(line), "%zu trailing bytes ignored\n", length % sizeof(VoodooI2CHIDDeviceTraceRecord));
+        timeline += line;
+    }
+
+    return timeline;
+}
+
+#endif /* VoodooI2CHIDTraceDecoder_hpp */
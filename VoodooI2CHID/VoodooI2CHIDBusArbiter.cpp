@@ -0,0 +1,216 @@
+//
+//  VoodooI2CHIDBusArbiter.cpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include "VoodooI2CHIDBusArbiter.hpp"
+
+#define super OSObject
+OSDefineMetaClassAndStructors(VoodooI2CHIDBusArbiter, OSObject);
+
+/* Arbiters are looked up by controller. The list holds a reference to each of them, controllers are only compared
+ * by address and never dereferenced.
+ */
+
+static VoodooI2CHIDBusArbiter* arbiters = NULL;
+static IOLock* arbiters_lock = NULL;
+
+static IOLock* getArbitersLock() {
+    if (!arbiters_lock) {
+        IOLock* lock = IOLockAlloc();
+
+        if (lock && !OSCompareAndSwapPtr(NULL, lock, &arbiters_lock))
+            IOLockFree(lock);
+    }
+
+    return arbiters_lock;
+}
+
+VoodooI2CHIDBusArbiter* VoodooI2CHIDBusArbiter::arbiterForController(IOService* controller) {
+    IOLock* list_lock = getArbitersLock();
+    VoodooI2CHIDBusArbiter* arbiter;
+
+    if (!list_lock)
+        return NULL;
+
+    IOLockLock(list_lock);
+
+    for (arbiter = arbiters; arbiter; arbiter = arbiter->next) {
+        if (arbiter->controller == controller)
+            break;
+    }
+
+    if (!arbiter) {
+        arbiter = OSTypeAlloc(VoodooI2CHIDBusArbiter);
+
+        if (arbiter && arbiter->initWithController(controller)) {
+            arbiter->next = arbiters;
+            arbiters = arbiter;
+        } else {
+            OSSafeReleaseNULL(arbiter);
+        }
+    }
+
+    if (arbiter)
+        arbiter->retain();
+
+    IOLockUnlock(list_lock);
+
+    return arbiter;
+}
+
+bool VoodooI2CHIDBusArbiter::initWithController(IOService* controller) {
+    if (!super::init())
+        return false;
+
+    this->controller = controller;
+    clients = NULL;
+    owner = NULL;
+    virtual_clock = 0;
+    next = NULL;
+
+    lock = IOLockAlloc();
+
+    return lock != NULL;
+}
+
+void VoodooI2CHIDBusArbiter::free() {
+    if (lock) {
+        IOLockFree(lock);
+        lock = NULL;
+    }
+
+    super::free();
+}
+
+void VoodooI2CHIDBusArbiter::registerClient(VoodooI2CHIDBusClient* client, VoodooI2CHIDBusPriority priority, UInt32 budget) {
+    client->priority = priority;
+    client->budget = budget;
+    client->waiting = false;
+    client->window_start = 0;
+    client->window_bytes = 0;
+    client->grants = client->contended = client->over_budget = client->bytes = 0;
+    client->wait.reset();
+
+    IOLockLock(lock);
+
+    // Start level with everyone else rather than owed all the bandwidth used before
+
+    client->virtual_time = virtual_clock;
+    client->next = clients;
+    clients = client;
+
+    IOLockUnlock(lock);
+}
+
+void VoodooI2CHIDBusArbiter::unregisterClient(VoodooI2CHIDBusClient* client) {
+    IOLockLock(lock);
+
+    for (VoodooI2CHIDBusClient** link = &clients; *link; link = &(*link)->next) {
+        if (*link == client) {
+            *link = client->next;
+            break;
+        }
+    }
+
+    client->next = NULL;
+
+    IOLockUnlock(lock);
+}
+
+void VoodooI2CHIDBusArbiter::acquireBus(VoodooI2CHIDBusClient* client) {
+    AbsoluteTime start, now;
+    clock_get_uptime(&start);
+
+    IOLockLock(lock);
+
+    if (client->virtual_time < virtual_clock)
+        client->virtual_time = virtual_clock;
+
+    if (owner) {
+        client->contended++;
+        client->waiting = true;
+
+        while (owner != client)
+            IOLockSleep(lock, client, THREAD_UNINT);
+    } else {
+        owner = client;
+        virtual_clock = client->virtual_time;
+    }
+
+    clock_get_uptime(&now);
+
+    if (overBudget(client, now))
+        client->over_budget++;
+
+    IOLockUnlock(lock);
+
+    client->grants++;
+    client->wait.record(elapsedNanoseconds(start, now));
+}
+
+void VoodooI2CHIDBusArbiter::releaseBus(VoodooI2CHIDBusClient* client, UInt32 bytes) {
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+
+    client->bytes += bytes;
+
+    IOLockLock(lock);
+
+    overBudget(client, now);
+    client->window_bytes += bytes;
+    client->virtual_time += bytes;
+
+    owner = nextClient(now);
+
+    if (owner) {
+        owner->waiting = false;
+        virtual_clock = owner->virtual_time;
+        IOLockWakeup(lock, owner, true);
+    }
+
+    IOLockUnlock(lock);
+}
+
+bool VoodooI2CHIDBusArbiter::overBudget(VoodooI2CHIDBusClient* client, AbsoluteTime now) {
+    if (!client->window_start || elapsedNanoseconds(client->window_start, now) >= I2C_HID_BUS_WINDOW_MS * 1000000ULL) {
+        client->window_start = now;
+        client->window_bytes = 0;
+    }
+
+    if (!client->budget)
+        return false;
+
+    return (uint64_t)client->window_bytes * 1000 > (uint64_t)client->budget * I2C_HID_BUS_WINDOW_MS;
+}
+
+VoodooI2CHIDBusClient* VoodooI2CHIDBusArbiter::nextClient(AbsoluteTime now) {
+    VoodooI2CHIDBusClient* best = NULL;
+    bool best_over_budget = false;
+
+    for (VoodooI2CHIDBusClient* client = clients; client; client = client->next) {
+        if (!client->waiting)
+            continue;
+
+        bool over_budget = overBudget(client, now);
+
+        if (best) {
+            if (over_budget != best_over_budget) {
+                if (over_budget)
+                    continue;
+            } else if (client->priority != best->priority) {
+                if (client->priority > best->priority)
+                    continue;
+            } else if (client->virtual_time >= best->virtual_time) {
+                continue;
+            }
+        }
+
+        best = client;
+        best_over_budget = over_budget;
+    }
+
+    return best;
+}
@@ -0,0 +1,122 @@
+//
+//  VoodooI2CHIDBusArbiter.hpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDBusArbiter_hpp
+#define VoodooI2CHIDBusArbiter_hpp
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOService.h>
+
+#include "VoodooI2CHIDLatencyHistogram.hpp"
+
+#define I2C_HID_BUS_WINDOW_MS           100
+#define I2C_HID_BUS_BUDGET_OTHER        (64 * 1024)
+#define I2C_HID_BUS_BUDGET_SENSOR       (16 * 1024)
+
+/* Latency classes, in order of precedence */
+
+typedef enum {
+    kVoodooI2CHIDBusPriorityTouch = 0,
+    kVoodooI2CHIDBusPriorityPen,
+    kVoodooI2CHIDBusPriorityOther,
+    kVoodooI2CHIDBusPrioritySensor
+} VoodooI2CHIDBusPriority;
+
+/* A device's registration with the arbiter of its controller
+ *
+ * The scheduling members are protected by the arbiter's lock. The statistics are only written by the thread
+ * holding the grant, which the device serialises with its own I2C lock.
+ */
+
+typedef struct VoodooI2CHIDBusClient {
+    struct VoodooI2CHIDBusClient* next;
+    VoodooI2CHIDBusPriority priority;
+    UInt32 budget;
+    bool waiting;
+    uint64_t virtual_time;
+    AbsoluteTime window_start;
+    UInt32 window_bytes;
+    UInt64 grants;
+    UInt64 contended;
+    UInt64 over_budget;
+    UInt64 bytes;
+    VoodooI2CHIDLatencyHistogram wait;
+} VoodooI2CHIDBusClient;
+
+/* Schedules the transfers of all HID devices sharing an I2C controller
+ *
+ * Every transfer is granted the bus separately. When the bus is released, the waiting client that is within its
+ * bandwidth budget and has the highest priority gets it next, ties are broken by start-time fair queuing on the
+ * bytes each client transferred. A client over budget is still served when nobody else is waiting.
+ *
+ * There is one arbiter per controller for the lifetime of the kext.
+ */
+
+class VoodooI2CHIDBusArbiter : public OSObject {
+  OSDeclareDefaultStructors(VoodooI2CHIDBusArbiter);
+
+ public:
+    /* Finds or creates the arbiter of a controller
+     * @controller The I2C controller
+     *
+     * @return A retained arbiter, *NULL* on allocation failure
+     */
+
+    static VoodooI2CHIDBusArbiter* arbiterForController(IOService* controller);
+
+    /* Adds a client to the arbiter
+     * @client The client, owned by the caller until <unregisterClient> returns
+     * @priority The latency class of the client
+     * @budget The bandwidth budget of the client in bytes per second, *0* for unlimited
+     */
+
+    void registerClient(VoodooI2CHIDBusClient* client, VoodooI2CHIDBusPriority priority, UInt32 budget);
+
+    /* Removes a client from the arbiter
+     * @client The client, which must not hold or wait for the bus
+     */
+
+    void unregisterClient(VoodooI2CHIDBusClient* client);
+
+    /* Waits until the bus is granted to a client
+     * @client The client
+     */
+
+    void acquireBus(VoodooI2CHIDBusClient* client);
+
+    /* Hands the bus over to the next client
+     * @client The client holding the bus
+     * @bytes The number of bytes transferred while it held the bus
+     */
+
+    void releaseBus(VoodooI2CHIDBusClient* client, UInt32 bytes);
+
+    void free() override;
+
+ private:
+    IOService* controller;
+    IOLock* lock;
+    VoodooI2CHIDBusClient* clients;
+    VoodooI2CHIDBusClient* owner;
+    uint64_t virtual_clock;
+    VoodooI2CHIDBusArbiter* next;
+
+    bool initWithController(IOService* controller);
+
+    /* Whether a client exceeded its budget in the current window, must be called with <lock> held */
+
+    bool overBudget(VoodooI2CHIDBusClient* client, AbsoluteTime now);
+
+    /* Picks the waiting client to grant the bus to next, must be called with <lock> held
+     *
+     * @return The client, *NULL* if nobody is waiting
+     */
+
+    VoodooI2CHIDBusClient* nextClient(AbsoluteTime now);
+};
+
+#endif /* VoodooI2CHIDBusArbiter_hpp */
@@ -0,0 +1,261 @@
+//
+//  VoodooI2CHIDContactStore.cpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include "VoodooI2CHIDContactStore.hpp"
+
+template <typename T>
+static T* carve(UInt8** cursor, UInt32 count) {
+    T* array = reinterpret_cast<T*>(*cursor);
+    *cursor += count * sizeof(T);
+    return array;
+}
+
+template <typename T>
+static inline UInt32 exchange(T* column, UInt32 slot, UInt32 value) {
+    UInt32 changed = column[slot] ^ (T)value;
+    column[slot] = (T)value;
+    return changed;
+}
+
+bool VoodooI2CHIDContactStore::allocate(OSArray* wrappers) {
+    UInt32 count = 0;
+    UInt32 slot = 0;
+
+    free();
+
+    for (UInt32 i = 0; i < wrappers->getCount(); i++) {
+        VoodooI2CHIDTransducerWrapper* wrapper = OSDynamicCast(VoodooI2CHIDTransducerWrapper, wrappers->getObject(i));
+
+        if (!wrapper)
+            continue;
+
+        for (UInt32 j = 0; j < wrapper->transducers->getCount(); j++) {
+            VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, wrapper->transducers->getObject(j));
+
+            if (transducer && transducer->type == kDigitiserTransducerFinger)
+                count++;
+        }
+    }
+
+    if (!count)
+        return true;
+
+    // Widest members first so that every array stays naturally aligned
+
+    block_size = count * (2 * sizeof(AbsoluteTime) + sizeof(VoodooI2CDigitiserTransducer*) + 13 * sizeof(UInt32) + 4 * sizeof(UInt8));
+    block = IOMalloc(block_size);
+
+    if (!block) {
+        block_size = 0;
+        return false;
+    }
+
+    bzero(block, block_size);
+
+    UInt8* cursor = reinterpret_cast<UInt8*>(block);
+
+    timestamp = carve<AbsoluteTime>(&cursor, count);
+    report_timestamp = carve<AbsoluteTime>(&cursor, count);
+    transducers = carve<VoodooI2CDigitiserTransducer*>(&cursor, count);
+
+    pending = carve<UInt32>(&cursor, count);
+    x = carve<UInt32>(&cursor, count);
+    y = carve<UInt32>(&cursor, count);
+    z = carve<UInt32>(&cursor, count);
+    pressure = carve<UInt32>(&cursor, count);
+    width = carve<UInt32>(&cursor, count);
+    height = carve<UInt32>(&cursor, count);
+    azimuth = carve<UInt32>(&cursor, count);
+    altitude = carve<UInt32>(&cursor, count);
+    secondary_id = carve<UInt32>(&cursor, count);
+    buttons = carve<UInt32>(&cursor, count);
+    logical_max_x = carve<UInt32>(&cursor, count);
+    logical_max_y = carve<UInt32>(&cursor, count);
+
+    report_id = carve<UInt8>(&cursor, count);
+    tip = carve<UInt8>(&cursor, count);
+    in_range = carve<UInt8>(&cursor, count);
+    valid = carve<UInt8>(&cursor, count);
+
+    capacity = count;
+
+    for (UInt32 i = 0; i < wrappers->getCount(); i++) {
+        VoodooI2CHIDTransducerWrapper* wrapper = OSDynamicCast(VoodooI2CHIDTransducerWrapper, wrappers->getObject(i));
+
+        if (!wrapper)
+            continue;
+
+        for (UInt32 j = 0; j < wrapper->transducers->getCount(); j++) {
+            VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, wrapper->transducers->getObject(j));
+
+            if (!transducer || transducer->type != kDigitiserTransducerFinger)
+                continue;
+
+            // The maxima were stored on the transducer when its wrapper was bound
+
+            transducers[slot] = transducer;
+            logical_max_x[slot] = transducer->logical_max_x;
+            logical_max_y[slot] = transducer->logical_max_y;
+
+            load(slot++);
+        }
+    }
+
+    dirty = 0;
+
+    return true;
+}
+
+void VoodooI2CHIDContactStore::free() {
+    if (block)
+        IOFree(block, block_size);
+
+    block = NULL;
+    block_size = 0;
+    capacity = 0;
+    dirty = 0;
+
+    timestamp = report_timestamp = NULL;
+    transducers = NULL;
+    pending = x = y = z = pressure = width = height = azimuth = altitude = secondary_id = buttons = NULL;
+    logical_max_x = logical_max_y = NULL;
+    report_id = tip = in_range = valid = NULL;
+}
+
+void VoodooI2CHIDContactStore::load(UInt32 slot) {
+    VoodooI2CDigitiserTransducer* transducer = transducers[slot];
+    UInt32 changed = 0;
+
+    pending[slot] = 0;
+    timestamp[slot] = transducer->timestamp;
+    report_timestamp[slot] = transducer->timestamp;
+    report_id[slot] = transducer->id;
+
+    changed |= exchange(x, slot, transducer->coordinates.x.value());
+    changed |= exchange(y, slot, transducer->coordinates.y.value());
+    changed |= exchange(z, slot, transducer->coordinates.z.value());
+    changed |= exchange(pressure, slot, transducer->tip_pressure.value());
+    changed |= exchange(width, slot, transducer->dimensions.width.value());
+    changed |= exchange(height, slot, transducer->dimensions.height.value());
+    changed |= exchange(azimuth, slot, transducer->azi_alti_orientation.azimuth.value());
+    changed |= exchange(altitude, slot, transducer->azi_alti_orientation.altitude.value());
+    changed |= exchange(secondary_id, slot, transducer->secondary_id);
+    changed |= exchange(buttons, slot, transducer->physical_button.value());
+
+    changed |= exchange(tip, slot, transducer->tip_switch.value() & 1);
+    changed |= exchange(in_range, slot, transducer->in_range);
+    changed |= exchange(valid, slot, transducer->is_valid);
+
+    if (changed)
+        dirty |= I2C_HID_CONTACT_SLOT_BIT(slot);
+}
+
+bool VoodooI2CHIDContactStore::decode(UInt32 first_slot, UInt32 transducer_count, const VoodooI2CHIDReportLayoutReport* layout, const VoodooI2CHIDReportLayoutField* fields, const UInt8* bytes, AbsoluteTime timestamp, AbsoluteTime report_timestamp, UInt32 report_id) {
+    UInt8 was_valid[I2C_HID_LAYOUT_MAX_TRANSDUCERS];
+    bool strided = layout->lanes == transducer_count;
+
+    for (UInt32 i = 0, slot = first_slot; i < transducer_count; i++, slot++) {
+        this->timestamp[slot] = timestamp;
+        this->report_timestamp[slot] = report_timestamp;
+        this->report_id[slot] = report_id;
+
+        // Stays valid unless the report carries a confidence usage saying otherwise
+
+        was_valid[i] = valid[slot];
+        valid[slot] = true;
+    }
+
+    if (strided) {
+        decodeLanes(first_slot, layout, fields, bytes);
+    } else {
+        for (UInt32 i = 0; i < layout->count; i++) {
+            const VoodooI2CHIDReportLayoutField* field = &fields[i];
+
+            if (field->transducer < transducer_count)
+                store(first_slot + field->transducer, field->target, field->argument, VoodooI2CHIDReportLayout::extract(bytes, field));
+        }
+    }
+
+    for (UInt32 i = 0, slot = first_slot; i < transducer_count; i++, slot++) {
+        if (valid[slot] != was_valid[i])
+            dirty |= I2C_HID_CONTACT_SLOT_BIT(slot);
+    }
+
+    return strided;
+}
+
+void VoodooI2CHIDContactStore::decodeLanes(UInt32 first_slot, const VoodooI2CHIDReportLayoutReport* layout, const VoodooI2CHIDReportLayoutField* fields, const UInt8* bytes) {
+    UInt32 values[I2C_HID_LAYOUT_MAX_TRANSDUCERS];
+    UInt32 lanes = layout->lanes;
+    UInt32 lane_fields = layout->count / lanes;
+    UInt32 mask = 0;
+
+    // Each field is extracted for every finger at once and stored column by column where possible
+
+    for (UInt32 i = 0; i < lane_fields; i++) {
+        const VoodooI2CHIDReportLayoutField* field = &fields[i];
+        UInt32* destination = column(field->target);
+
+        VoodooI2CHIDReportLayout::extractLanes(bytes, field, layout->stride, lanes, values);
+
+        if (destination) {
+            for (UInt32 lane = 0; lane < lanes; lane++)
+                storeColumn(destination, first_slot + lane, values[lane]);
+
+            mask |= I2C_HID_CONTACT_BIT(field->target);
+        } else {
+            for (UInt32 lane = 0; lane < lanes; lane++)
+                store(first_slot + lane, field->target, field->argument, values[lane]);
+        }
+    }
+
+    for (UInt32 lane = 0; lane < lanes; lane++)
+        pending[first_slot + lane] |= mask;
+}
+
+void VoodooI2CHIDContactStore::sync() {
+    for (UInt32 slot = 0; slot < capacity; slot++) {
+        UInt32 mask = pending[slot];
+
+        if (!mask)
+            continue;
+
+        VoodooI2CDigitiserTransducer* transducer = transducers[slot];
+        AbsoluteTime updated = timestamp[slot];
+
+        pending[slot] = 0;
+
+        transducer->id = report_id[slot];
+        transducer->timestamp = report_timestamp[slot];
+        transducer->is_valid = valid[slot];
+
+        if (mask & I2C_HID_CONTACT_BIT(kVoodooI2CHIDLayoutTargetX))
+            transducer->coordinates.x.update(x[slot], updated);
+        if (mask & I2C_HID_CONTACT_BIT(kVoodooI2CHIDLayoutTargetY))
+            transducer->coordinates.y.update(y[slot], updated);
+        if (mask & I2C_HID_CONTACT_BIT(kVoodooI2CHIDLayoutTargetZ))
+            transducer->coordinates.z.update(z[slot], updated);
+        if (mask & I2C_HID_CONTACT_BIT(kVoodooI2CHIDLayoutTargetButton))
+            transducer->physical_button.update(buttons[slot], updated);
+        if (mask & I2C_HID_CONTACT_BIT(kVoodooI2CHIDLayoutTargetSecondaryID))
+            transducer->secondary_id = secondary_id[slot];
+        if (mask & I2C_HID_CONTACT_BIT(kVoodooI2CHIDLayoutTargetTipSwitch))
+            transducer->tip_switch.update((transducer->tip_switch.value() & ~1U) | tip[slot], updated);
+        if (mask & I2C_HID_CONTACT_BIT(kVoodooI2CHIDLayoutTargetInRange))
+            transducer->in_range = in_range[slot];
+        if (mask & I2C_HID_CONTACT_BIT(kVoodooI2CHIDLayoutTargetTipPressure))
+            transducer->tip_pressure.update(pressure[slot], updated);
+        if (mask & I2C_HID_CONTACT_BIT(kVoodooI2CHIDLayoutTargetAzimuth))
+            transducer->azi_alti_orientation.azimuth.update(azimuth[slot], updated);
+        if (mask & I2C_HID_CONTACT_BIT(kVoodooI2CHIDLayoutTargetAltitude))
+            transducer->azi_alti_orientation.altitude.update(altitude[slot], updated);
+        if (mask & I2C_HID_CONTACT_BIT(kVoodooI2CHIDLayoutTargetWidth))
+            transducer->dimensions.width.update(width[slot], updated);
+        if (mask & I2C_HID_CONTACT_BIT(kVoodooI2CHIDLayoutTargetHeight))
+            transducer->dimensions.height.update(height[slot], updated);
+    }
+}
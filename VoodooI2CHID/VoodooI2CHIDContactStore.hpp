@@ -0,0 +1,210 @@
+//
+//  VoodooI2CHIDContactStore.hpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDContactStore_hpp
+#define VoodooI2CHIDContactStore_hpp
+
+#include <IOKit/IOLib.h>
+
+#include "VoodooI2CHIDReportLayout.hpp"
+#include "VoodooI2CHIDTransducerWrapper.hpp"
+
+#define I2C_HID_CONTACT_BIT(target) (1U << (target))
+
+// Slots past the 63rd share the last bit of a dirty mask
+
+#define I2C_HID_CONTACT_SLOT_BIT(slot) (1ULL << ((slot) < 63 ? (slot) : 63))
+
+/* The finger contacts of a digitiser, one slot per finger transducer
+ *
+ * Each member is stored in its own array so that a frame is decoded and inspected without touching the transducer
+ * objects. Slots are numbered wrapper by wrapper, so the contacts of the report for wrapper *n* start at
+ * *n* times the number of fingers per report.
+ *
+ * The transducer objects are only brought up to date by <sync>, for consumers that need them. <pending> holds a
+ * bit per <VoodooI2CHIDReportLayoutTarget> written to a slot since its last sync. <dirty> holds a bit per slot whose
+ * contact changed since the owner last cleared it.
+ */
+
+class VoodooI2CHIDContactStore {
+ public:
+    /* Sizes the store for the finger transducers of a digitiser
+     * @wrappers The transducer wrappers, after they have been bound
+     *
+     * @return *true* on success, *false* on allocation failure
+     */
+
+    bool allocate(OSArray* wrappers);
+
+    /* Frees the store */
+
+    void free();
+
+    /* Copies the current state of a slot's transducer into the store, dropping anything pending
+     * @slot The slot
+     */
+
+    void load(UInt32 slot);
+
+    /* Stores a decoded field in a slot, marking the slot dirty if its value changed
+     * @slot The slot
+     * @target The member the field is decoded into
+     * @argument The button bit for *kVoodooI2CHIDLayoutTargetButton*
+     * @value The value of the field
+     *
+     * The confidence of a contact never marks it dirty, callers compare <valid> around the whole report instead.
+     */
+
+    inline void store(UInt32 slot, UInt8 target, UInt32 argument, UInt32 value) {
+        UInt32 previous;
+
+        switch (target) {
+            case kVoodooI2CHIDLayoutTargetButton:
+                previous = buttons[slot];
+                value = value ? previous | (1U << argument) : previous & ~(1U << argument);
+                buttons[slot] = value;
+                break;
+            case kVoodooI2CHIDLayoutTargetTipSwitch:
+                previous = tip[slot];
+                value = value != 0;
+                tip[slot] = value;
+                break;
+            case kVoodooI2CHIDLayoutTargetInRange:
+                previous = in_range[slot];
+                value = value != 0;
+                in_range[slot] = value;
+                break;
+            case kVoodooI2CHIDLayoutTargetConfidence:
+                valid[slot] = value != 0;
+                pending[slot] |= I2C_HID_CONTACT_BIT(target);
+                return;
+            default: {
+                UInt32* values = column(target);
+
+                if (!values)
+                    return;
+
+                previous = values[slot];
+                values[slot] = value;
+                break;
+            }
+        }
+
+        pending[slot] |= I2C_HID_CONTACT_BIT(target);
+
+        if (previous != value)
+            dirty |= I2C_HID_CONTACT_SLOT_BIT(slot);
+    }
+
+    /* Stores a value in a column returned by <column>, marking the slot dirty if it changed */
+
+    inline void storeColumn(UInt32* values, UInt32 slot, UInt32 value) {
+        if (values[slot] != value) {
+            values[slot] = value;
+            dirty |= I2C_HID_CONTACT_SLOT_BIT(slot);
+        }
+    }
+
+    /* The column a target is stored in
+     * @target The member a field is decoded into
+     *
+     * @return The column, *NULL* for the targets that are not stored as plain values
+     */
+
+    inline UInt32* column(UInt8 target) const {
+        switch (target) {
+            case kVoodooI2CHIDLayoutTargetX:
+                return x;
+            case kVoodooI2CHIDLayoutTargetY:
+                return y;
+            case kVoodooI2CHIDLayoutTargetZ:
+                return z;
+            case kVoodooI2CHIDLayoutTargetSecondaryID:
+                return secondary_id;
+            case kVoodooI2CHIDLayoutTargetTipPressure:
+                return pressure;
+            case kVoodooI2CHIDLayoutTargetAzimuth:
+                return azimuth;
+            case kVoodooI2CHIDLayoutTargetAltitude:
+                return altitude;
+            case kVoodooI2CHIDLayoutTargetWidth:
+                return width;
+            case kVoodooI2CHIDLayoutTargetHeight:
+                return height;
+            default:
+                return NULL;
+        }
+    }
+
+    /* Whether any contact has its tip switch down */
+
+    inline bool anyDown() const {
+        for (UInt32 slot = 0; slot < capacity; slot++) {
+            if (tip[slot])
+                return true;
+        }
+
+        return false;
+    }
+
+    /* Decodes the fingers of a report straight from its bytes
+     * @first_slot The slot of the report's first finger
+     * @transducer_count The number of fingers in the report
+     * @layout The layout of the report
+     * @fields The fields of the report
+     * @bytes The raw report, at least as long as <layout> requires
+     * @timestamp The timestamp of the interrupt report
+     * @report_timestamp The timestamp of the report as captured by the transport
+     * @report_id The report ID of the report
+     *
+     * @return *true* if the fingers repeat at a constant stride and were decoded one field at a time for all of them,
+     * *false* if they were decoded field by field
+     */
+
+    bool decode(UInt32 first_slot, UInt32 transducer_count, const VoodooI2CHIDReportLayoutReport* layout, const VoodooI2CHIDReportLayoutField* fields, const UInt8* bytes, AbsoluteTime timestamp, AbsoluteTime report_timestamp, UInt32 report_id);
+
+    /* Writes the pending members of every slot to its transducer */
+
+    void sync();
+
+    UInt32 capacity = 0;
+    UInt64 dirty = 0;
+
+    AbsoluteTime* timestamp = NULL;
+    AbsoluteTime* report_timestamp = NULL;
+    VoodooI2CDigitiserTransducer** transducers = NULL;
+
+    UInt32* pending = NULL;
+    UInt32* x = NULL;
+    UInt32* y = NULL;
+    UInt32* z = NULL;
+    UInt32* pressure = NULL;
+    UInt32* width = NULL;
+    UInt32* height = NULL;
+    UInt32* azimuth = NULL;
+    UInt32* altitude = NULL;
+    UInt32* secondary_id = NULL;
+    UInt32* buttons = NULL;
+
+    UInt32* logical_max_x = NULL;
+    UInt32* logical_max_y = NULL;
+
+    UInt8* report_id = NULL;
+    UInt8* tip = NULL;
+    UInt8* in_range = NULL;
+    UInt8* valid = NULL;
+
+ private:
+    void* block = NULL;
+    vm_size_t block_size = 0;
+
+    /* Decodes a report whose fingers repeat the same fields at a constant stride, one field at a time for all fingers */
+
+    void decodeLanes(UInt32 first_slot, const VoodooI2CHIDReportLayoutReport* layout, const VoodooI2CHIDReportLayoutField* fields, const UInt8* bytes);
+};
+
+#endif /* VoodooI2CHIDContactStore_hpp */
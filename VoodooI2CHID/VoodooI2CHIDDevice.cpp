@@ -8,13 +8,246 @@
 
 #include <IOKit/hid/IOHIDDevice.h>
 #include <kern/locks.h>
+#include <mach/mach_types.h>
 #include "VoodooI2CHIDDevice.hpp"
 #include "../../../VoodooI2C/VoodooI2C/VoodooI2CDevice/VoodooI2CDeviceNub.hpp"
 
 #define super IOHIDDevice
 OSDefineMetaClassAndStructors(VoodooI2CHIDDevice, IOHIDDevice);
 
-extern volatile AbsoluteTime last_multi_touch_event;
+/* Report descriptors are cached for the lifetime of the kext so that restarting a driver or re-probing a device
+ * doesn't read them over the bus again. Entries are keyed by vendor ID, product ID and version and only used if
+ * the device's current HID descriptor is identical to the one the report descriptor was read with. The cache only
+ * lives in memory, the first start after boot always reads the descriptor over the bus.
+ */
+
+typedef struct {
+    VoodooI2CHIDDeviceHIDDescriptor hid_descriptor;
+    UInt32 checksum;
+} VoodooI2CHIDDeviceDescriptorCacheEntry;
+
+static OSDictionary* descriptor_cache = NULL;
+static IOLock* descriptor_cache_lock = NULL;
+
+static IOLock* getDescriptorCacheLock() {
+    if (!descriptor_cache_lock) {
+        IOLock* lock = IOLockAlloc();
+
+        if (lock && !OSCompareAndSwapPtr(NULL, lock, &descriptor_cache_lock))
+            IOLockFree(lock);
+    }
+
+    return descriptor_cache_lock;
+}
+
+static UInt32 descriptorChecksum(const UInt8* buffer, UInt32 length) {
+    UInt32 crc = 0xFFFFFFFF;
+
+    for (UInt32 i = 0; i < length; i++) {
+        crc ^= buffer[i];
+
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+
+    return ~crc;
+}
+
+// The number of distinct report IDs of the input reports in a report descriptor, 0 if it has no report IDs
+
+static UInt32 countInputReportIDs(const UInt8* descriptor, UInt32 length) {
+    UInt32 seen[256 / 32] = {};
+    UInt32 count = 0;
+    UInt8 report_id = 0;
+    UInt32 i = 0;
+
+    while (i < length) {
+        UInt8 prefix = descriptor[i];
+
+        // Long items carry their size in the next byte and are never report IDs or inputs
+
+        if (prefix == 0xFE) {
+            if (i + 1 >= length)
+                break;
+            i += 3 + descriptor[i + 1];
+            continue;
+        }
+
+        UInt32 size = prefix & 0x03;
+        if (size == 3)
+            size = 4;
+
+        if (i + 1 + size > length)
+            break;
+
+        switch (prefix & 0xFC) {
+            case 0x84:
+                report_id = size ? descriptor[i + 1] : 0;
+                break;
+            case 0x80:
+                if (report_id && !(seen[report_id / 32] & (1U << (report_id % 32)))) {
+                    seen[report_id / 32] |= 1U << (report_id % 32);
+                    count++;
+                }
+                break;
+            default:
+                break;
+        }
+
+        i += 1 + size;
+    }
+
+    return count;
+}
+
+static const OSSymbol* copyDescriptorCacheKey(const VoodooI2CHIDDeviceHIDDescriptor* hid_descriptor) {
+    char key[16];
+
+    snprintf(key, sizeof(key), "%04x:%04x:%04x", hid_descriptor->wVendorID, hid_descriptor->wProductID, hid_descriptor->wVersionID);
+
+    return OSSymbol::withCString(key);
+}
+
+static OSData* copyDescriptorCacheEntry(const VoodooI2CHIDDeviceHIDDescriptor* hid_descriptor) {
+    IOLock* lock = getDescriptorCacheLock();
+    const OSSymbol* key = copyDescriptorCacheKey(hid_descriptor);
+    OSData* entry = NULL;
+
+    if (!lock || !key) {
+        OSSafeReleaseNULL(key);
+        return NULL;
+    }
+
+    IOLockLock(lock);
+
+    if (descriptor_cache)
+        entry = OSDynamicCast(OSData, descriptor_cache->getObject(key));
+
+    if (entry)
+        entry->retain();
+
+    IOLockUnlock(lock);
+
+    key->release();
+
+    if (!entry)
+        return NULL;
+
+    const VoodooI2CHIDDeviceDescriptorCacheEntry* header = reinterpret_cast<const VoodooI2CHIDDeviceDescriptorCacheEntry*>(entry->getBytesNoCopy());
+
+    if (entry->getLength() != sizeof(VoodooI2CHIDDeviceDescriptorCacheEntry) + hid_descriptor->wReportDescLength ||
+        memcmp(&header->hid_descriptor, hid_descriptor, sizeof(VoodooI2CHIDDeviceHIDDescriptor)) != 0 ||
+        header->checksum != descriptorChecksum(reinterpret_cast<const UInt8*>(header + 1), hid_descriptor->wReportDescLength)) {
+        entry->release();
+        return NULL;
+    }
+
+    return entry;
+}
+
+static bool copyCachedReportDescriptor(const VoodooI2CHIDDeviceHIDDescriptor* hid_descriptor, UInt8* buffer) {
+    OSData* entry = copyDescriptorCacheEntry(hid_descriptor);
+
+    if (!entry)
+        return false;
+
+    const VoodooI2CHIDDeviceDescriptorCacheEntry* header = reinterpret_cast<const VoodooI2CHIDDeviceDescriptorCacheEntry*>(entry->getBytesNoCopy());
+    memcpy(buffer, header + 1, hid_descriptor->wReportDescLength);
+
+    entry->release();
+
+    return true;
+}
+
+static bool cachedReportDescriptorMatches(const VoodooI2CHIDDeviceHIDDescriptor* hid_descriptor, const UInt8* buffer) {
+    OSData* entry = copyDescriptorCacheEntry(hid_descriptor);
+
+    if (!entry)
+        return false;
+
+    const VoodooI2CHIDDeviceDescriptorCacheEntry* header = reinterpret_cast<const VoodooI2CHIDDeviceDescriptorCacheEntry*>(entry->getBytesNoCopy());
+    bool matches = header->checksum == descriptorChecksum(buffer, hid_descriptor->wReportDescLength);
+
+    entry->release();
+
+    return matches;
+}
+
+static void cacheReportDescriptor(const VoodooI2CHIDDeviceHIDDescriptor* hid_descriptor, const UInt8* buffer) {
+    IOLock* lock = getDescriptorCacheLock();
+    const OSSymbol* key = copyDescriptorCacheKey(hid_descriptor);
+    OSData* entry = OSData::withCapacity(sizeof(VoodooI2CHIDDeviceDescriptorCacheEntry) + hid_descriptor->wReportDescLength);
+
+    if (!lock || !key || !entry)
+        goto exit;
+
+    VoodooI2CHIDDeviceDescriptorCacheEntry header;
+    memcpy(&header.hid_descriptor, hid_descriptor, sizeof(VoodooI2CHIDDeviceHIDDescriptor));
+    header.checksum = descriptorChecksum(buffer, hid_descriptor->wReportDescLength);
+
+    entry->appendBytes(&header, sizeof(VoodooI2CHIDDeviceDescriptorCacheEntry));
+    entry->appendBytes(buffer, hid_descriptor->wReportDescLength);
+
+    IOLockLock(lock);
+
+    if (!descriptor_cache)
+        descriptor_cache = OSDictionary::withCapacity(2);
+
+    if (descriptor_cache)
+        descriptor_cache->setObject(key, entry);
+
+    IOLockUnlock(lock);
+
+exit:
+    OSSafeReleaseNULL(entry);
+    OSSafeReleaseNULL(key);
+}
+
+static void invalidateCachedReportDescriptor(const VoodooI2CHIDDeviceHIDDescriptor* hid_descriptor) {
+    IOLock* lock = getDescriptorCacheLock();
+    const OSSymbol* key = copyDescriptorCacheKey(hid_descriptor);
+
+    if (lock && key) {
+        IOLockLock(lock);
+
+        if (descriptor_cache)
+            descriptor_cache->removeObject(key);
+
+        IOLockUnlock(lock);
+    }
+
+    OSSafeReleaseNULL(key);
+}
+
+/* Entry points of the kext, set as MODULE_START and MODULE_STOP
+ *
+ * The kext is only unloaded once every instance is gone, nothing uses the cache by the time <VoodooI2CHID_stop> runs.
+ */
+
+extern "C" kern_return_t VoodooI2CHID_start(kmod_info_t* info, void* data) {
+    return KERN_SUCCESS;
+}
+
+extern "C" kern_return_t VoodooI2CHID_stop(kmod_info_t* info, void* data) {
+    OSSafeReleaseNULL(descriptor_cache);
+
+    if (descriptor_cache_lock) {
+        IOLockFree(descriptor_cache_lock);
+        descriptor_cache_lock = NULL;
+    }
+
+    return KERN_SUCCESS;
+}
+
+static void setDictionaryNumber(OSDictionary* dictionary, const char* key, UInt64 value) {
+    OSNumber* number = OSNumber::withNumber(value, 64);
+
+    if (!number)
+        return;
+
+    dictionary->setObject(key, number);
+    number->release();
+}
 
 bool VoodooI2CHIDDevice::init(OSDictionary* properties) {
     if (!super::init(properties))
@@ -24,11 +257,82 @@ bool VoodooI2CHIDDevice::init(OSDictionary* properties) {
     read_in_progress_mutex = IOLockAlloc();
     ready_for_input = false;
     reset_event = false;
+    reset_state = kVoodooI2CHIDResetIdle;
+    memset(&reset_timing, 0, sizeof(reset_timing));
+    reset_timer = NULL;
+    memset(&resume_timing, 0, sizeof(resume_timing));
     memset(&hid_descriptor, 0, sizeof(VoodooI2CHIDDeviceHIDDescriptor));
     acpi_device = NULL;
     api = NULL;
     command_gate = NULL;
     interrupt_simulator = NULL;
+    input_report_buffer = NULL;
+    report_ring_pool = NULL;
+    report_ring_slot_size = 0;
+    report_ring_head = 0;
+    report_ring_tail = 0;
+    reset_ring_mark = 0;
+    report_consumer = NULL;
+    interrupt_pending = false;
+    interrupts_skipped = 0;
+    interrupts_deferred = 0;
+    deferred_reader = NULL;
+    interrupt_time = 0;
+    drain_interrupt_time = 0;
+    latency_interrupt_to_read.reset();
+    latency_read_to_dispatch.reset();
+    latency_interrupt_to_dispatch.reset();
+    trace_ring.reset();
+    lock_wait = 0;
+    learned_read_sizing = false;
+    learned_length = 0;
+    learned_window_max = 0;
+    learned_window_reports = 0;
+    bus_bytes_read = 0;
+    useful_bytes_read = 0;
+    read_size_mispredictions = 0;
+    memset(command_queue_head, 0, sizeof(command_queue_head));
+    memset(command_queue_tail, 0, sizeof(command_queue_tail));
+    command_dispatcher = NULL;
+    command_timer = NULL;
+    bus_quiet_until = 0;
+    command_queue_depth = 0;
+    command_queue_max_depth = 0;
+    commands_completed = 0;
+    commands_timed_out = 0;
+    command_max_wait = 0;
+    command_max_bus_hold = 0;
+    set_reports = 0;
+    set_report_bytes_copied = 0;
+    reset_response_pending = false;
+    polling_last_report = 0;
+    polling_report_interval = 0;
+    polling_idle_interval = I2C_HID_POLL_INTERVAL_IDLE_MIN_US;
+    memset(&input_activity, 0, sizeof(input_activity));
+    descriptor_verifier = NULL;
+    descriptor_cache_hit = false;
+    descriptor_cache_verified = false;
+    descriptor_cache_mismatches = 0;
+    descriptor_fetch_time = 0;
+    probe_time = 0;
+    report_ring_overflows = 0;
+    report_ring_consumed = 0;
+    invalid_reports = 0;
+    lost_reports = 0;
+    report_errors = 0;
+    memset(&storm, 0, sizeof(storm));
+    storm.backoff_ms = I2C_HID_STORM_BACKOFF_MIN_MS;
+    storm_mitigator = NULL;
+    storm_timer = NULL;
+    memset(&recovery, 0, sizeof(recovery));
+    recovery_trigger = NULL;
+    recovery_timer = NULL;
+    bus_arbiter = NULL;
+    report_ring_max_depth = 0;
+    report_ring_max_lag = 0;
+    statistics_last_publish = 0;
+    memset(report_ring, 0, sizeof(report_ring));
+    memset(drain_histogram, 0, sizeof(drain_histogram));
     ready_for_input = false;
     
     client_lock = IOLockAlloc();
@@ -40,10 +344,8 @@ bool VoodooI2CHIDDevice::init(OSDictionary* properties) {
         return false;
     }
     
-    buf_i2c_cnt_intr = 0;
-    buf_i2c_cnt = 0;
-    buf_i2c_pool_intr = (UInt8 *)IOMalloc(I2C_MAX_BUF_SIZE);
-    buf_i2c_pool = (UInt8 *)IOMalloc(I2C_MAX_BUF_SIZE);
+    if (!transfer_arena.init(I2C_MAX_BUF_SIZE) || !input_arena.init(I2C_MAX_BUF_SIZE))
+        return false;
 
     return true;
 }
@@ -52,8 +354,8 @@ void VoodooI2CHIDDevice::free() {
     if (client_lock)
         IOLockFree(client_lock);
     
-    IOFree(buf_i2c_pool_intr, I2C_MAX_BUF_SIZE);
-    IOFree(buf_i2c_pool, I2C_MAX_BUF_SIZE);
+    transfer_arena.free();
+    input_arena.free();
     if (read_in_progress_mutex) {
         IOLockFree(read_in_progress_mutex);
         read_in_progress_mutex = NULL;
@@ -62,31 +364,20 @@ void VoodooI2CHIDDevice::free() {
     super::free();
 }
 
-UInt8* VoodooI2CHIDDevice::getMallocI2CIntr(UInt16 size) {
-    if ((buf_i2c_cnt_intr + size + 0x10) >= I2C_MAX_BUF_SIZE)
-        buf_i2c_cnt_intr = 0;
-    UInt8* retaddr = (buf_i2c_pool_intr + buf_i2c_cnt_intr);
-    buf_i2c_cnt_intr += size + 0x10;
-
-    return retaddr;
-}
-
-UInt8* VoodooI2CHIDDevice::getMallocI2C(UInt16 size) {
-    if ((buf_i2c_cnt + size + 0x10) >= I2C_MAX_BUF_SIZE)
-        buf_i2c_cnt = 0;
-    UInt8* retaddr = (buf_i2c_pool + buf_i2c_cnt);
-    buf_i2c_cnt += size + 0x10;
-
-    return retaddr;
-}
-
 IOReturn VoodooI2CHIDDevice::getHIDDescriptor() {
     I2C_LOCK();
     read_in_progress = true;
-    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*)getMallocI2C(sizeof(VoodooI2CHIDDeviceCommand));
+    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*)transfer_arena.allocate(sizeof(VoodooI2CHIDDeviceCommand));
+
+    if (!command) {
+        read_in_progress = false;
+        I2C_UNLOCK();
+        return kIOReturnNoSpace;
+    }
+
     command->c.reg = hid_descriptor_register;
 
-    if (api->writeReadI2C(command->data, 2, (UInt8*)&hid_descriptor, (UInt16)sizeof(VoodooI2CHIDDeviceHIDDescriptor)) != kIOReturnSuccess) {
+    if (writeReadI2C(command->data, 2, (UInt8*)&hid_descriptor, (UInt16)sizeof(VoodooI2CHIDDeviceHIDDescriptor)) != kIOReturnSuccess) {
         IOLog("%s::%s Request for HID descriptor failed\n", getName(), name);
         read_in_progress = false;
         I2C_UNLOCK();
@@ -112,19 +403,19 @@ IOReturn VoodooI2CHIDDevice::parseHIDDescriptor() {
     }
 
     OSDictionary* property_array = OSDictionary::withCapacity(1);
-    property_array->setObject("HIDDescLength", OSNumber::withNumber(hid_descriptor.wHIDDescLength, 32));
-    property_array->setObject("BCDVersion", OSNumber::withNumber(hid_descriptor.bcdVersion, 32));
-    property_array->setObject("ReportDescLength", OSNumber::withNumber(hid_descriptor.wReportDescLength, 32));
-    property_array->setObject("ReportDescRegister", OSNumber::withNumber(hid_descriptor.wReportDescRegister, 32));
-    property_array->setObject("MaxInputLength", OSNumber::withNumber(hid_descriptor.wMaxInputLength, 32));
-    property_array->setObject("InputRegister", OSNumber::withNumber(hid_descriptor.wInputRegister, 32));
-    property_array->setObject("MaxOutputLength", OSNumber::withNumber(hid_descriptor.wMaxOutputLength, 32));
-    property_array->setObject("OutputRegister", OSNumber::withNumber(hid_descriptor.wOutputRegister, 32));
-    property_array->setObject("CommandRegister", OSNumber::withNumber(hid_descriptor.wCommandRegister, 32));
-    property_array->setObject("DataRegister", OSNumber::withNumber(hid_descriptor.wDataRegister, 32));
-    property_array->setObject("VendorID", OSNumber::withNumber(hid_descriptor.wVendorID, 32));
-    property_array->setObject("ProductID", OSNumber::withNumber(hid_descriptor.wProductID, 32));
-    property_array->setObject("VersionID", OSNumber::withNumber(hid_descriptor.wVersionID, 32));
+    setDictionaryNumber(property_array, "HIDDescLength", hid_descriptor.wHIDDescLength);
+    setDictionaryNumber(property_array, "BCDVersion", hid_descriptor.bcdVersion);
+    setDictionaryNumber(property_array, "ReportDescLength", hid_descriptor.wReportDescLength);
+    setDictionaryNumber(property_array, "ReportDescRegister", hid_descriptor.wReportDescRegister);
+    setDictionaryNumber(property_array, "MaxInputLength", hid_descriptor.wMaxInputLength);
+    setDictionaryNumber(property_array, "InputRegister", hid_descriptor.wInputRegister);
+    setDictionaryNumber(property_array, "MaxOutputLength", hid_descriptor.wMaxOutputLength);
+    setDictionaryNumber(property_array, "OutputRegister", hid_descriptor.wOutputRegister);
+    setDictionaryNumber(property_array, "CommandRegister", hid_descriptor.wCommandRegister);
+    setDictionaryNumber(property_array, "DataRegister", hid_descriptor.wDataRegister);
+    setDictionaryNumber(property_array, "VendorID", hid_descriptor.wVendorID);
+    setDictionaryNumber(property_array, "ProductID", hid_descriptor.wProductID);
+    setDictionaryNumber(property_array, "VersionID", hid_descriptor.wVersionID);
 
     setProperty("HIDDescriptor", property_array);
 
@@ -184,222 +475,1402 @@ IOReturn VoodooI2CHIDDevice::getHIDDescriptorAddress() {
     return kIOReturnSuccess;
 }
 
-void VoodooI2CHIDDevice::getInputReport() {
-    IOBufferMemoryDescriptor* buffer;
-    IOReturn ret;
-    int return_size;
-    unsigned char* report;
+UInt32 VoodooI2CHIDDevice::getInputReport() {
+    int return_size = 0;
+    UInt32 drained = 0;
     
     if (I2C_TRYLOCK() == false) {
-        IOLog("%s::%s Skipping a HID read interrupt while other thread read/write I2C\n", getName(), name);
-        return;
+        // The interrupt stays pending, the current holder reads it through <deferred_reader> once it unlocks
+
+        __atomic_fetch_add(&interrupts_skipped, 1, __ATOMIC_RELAXED);
+        return 0;
     }
     
     read_in_progress = true;
-    
-    report = getMallocI2CIntr(hid_descriptor.wMaxInputLength);
-    report[0] = report[1] = 0;
-    ret = api->readI2C(report, hid_descriptor.wMaxInputLength);
-    if (ret != kIOReturnSuccess) {
-        goto exit;
-    }
 
-    return_size = report[0] | report[1] << 8;
-    /*
-     * "return_size" can be 0 when resetHIDDevice() is called; booting or waking up from sleep.
-     * Since ready_for_input can still be FALSE when booting,
-     * It needs to be checked before checking ready_for_input.
-     */
-    if (!return_size) {
-        command_gate->commandWakeup(&reset_event);
-        goto exit;
-    }
+    // Whatever was pending is covered by the reads below
 
-    if (!ready_for_input || return_size > hid_descriptor.wMaxInputLength) {
-        goto exit;
-    }
+    __atomic_store_n(&interrupt_pending, false, __ATOMIC_SEQ_CST);
+    drain_interrupt_time = __atomic_load_n(&interrupt_time, __ATOMIC_RELAXED);
 
-    buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, return_size);
-    buffer->writeBytes(0, report + 2, return_size - 2);
+    // A device may queue several reports behind a single assertion of its interrupt line, for example a hybrid mode
+    // touchpad splitting one frame across several reports. Keep reading until the input register is empty.
 
-    ret = handleReport(buffer, kIOHIDReportTypeInput);
+    while (drained < I2C_HID_DRAIN_BUDGET) {
+        return_size = readInputReport(drained == 0);
 
-    if (ret != kIOReturnSuccess)
-        IOLog("%s::%s Error handling input report: 0x%.8x\n", getName(), name, ret);
-    
-    buffer->release();
+        if (return_size <= 0)
+            break;
 
-exit:
-    read_in_progress = false;
-    I2C_UNLOCK();
-}
+        drained++;
+    }
 
-IOReturn VoodooI2CHIDDevice::getReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options) {
-    if (reportType != kIOHIDReportTypeFeature && reportType != kIOHIDReportTypeInput)
-        return kIOReturnBadArgument;
+    drain_histogram[drained]++;
 
-    UInt8 args[3];
-    IOReturn ret;
-    int args_len = 0;
-    UInt16 read_register = hid_descriptor.wDataRegister;
-    UInt8 report_id = options & 0xFF;
-    UInt8 raw_report_type = (reportType == kIOHIDReportTypeFeature) ? 0x03 : 0x01;
-    
-    if (report_id >= 0x0F) {
-        args[args_len++] = report_id;
-        report_id = 0x0F;
-    }
+    if (drained)
+        report_consumer->interruptOccurred(NULL, NULL, 0);
 
-    args[args_len++] = read_register & 0xFF;
-    args[args_len++] = read_register >> 8;
-    
-    I2C_LOCK();
-    read_in_progress = true;
+    // Any transfer that went through, even an empty read, shows that the device is answering again
 
-    UInt8 length = sizeof(VoodooI2CHIDDeviceCommand);
-    UInt8* buffer = (UInt8*) getMallocI2C(report->getLength());
-    memset(buffer, 0, report->getLength());
+    bool recovery_changed = false;
+
+    if (return_size == -2) {
+        recovery.transfer_errors++;
+        recovery_changed = __atomic_fetch_add(&recovery.consecutive_errors, 1, __ATOMIC_RELAXED) == 0;
+    } else if (recovery.consecutive_errors) {
+        __atomic_store_n(&recovery.consecutive_errors, 0, __ATOMIC_RELAXED);
+        recovery_changed = true;
+    }
+
+    if (recovery_changed && recovery_trigger)
+        recovery_trigger->interruptOccurred(NULL, NULL, 0);
 
-    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) getMallocI2C(length + args_len);
-    memset(command, 0, length + args_len);
-    command->c.reg = hid_descriptor.wCommandRegister;
-    command->c.opcode = 0x02;
-    command->c.report_type_id = report_id | raw_report_type << 4;
-    
-    UInt8* raw_command = (UInt8*)command;
-    
-    memcpy(raw_command + length, args, args_len);
-    ret = api->writeReadI2C(raw_command, length+args_len, buffer, report->getLength());
-    
-    report->writeBytes(0, buffer+2, report->getLength()-2);
-    
     read_in_progress = false;
     I2C_UNLOCK();
 
-    return ret;
+    return drained;
 }
 
-void VoodooI2CHIDDevice::interruptOccured(OSObject* owner, IOInterruptEventSource* src, int intCount) {
-    if (read_in_progress)
-        return;
-    if (!awake)
-        return;
+void VoodooI2CHIDDevice::lockI2C() const {
+    AbsoluteTime start, end;
+    clock_get_uptime(&start);
+
+    IOLockLock(read_in_progress_mutex);
 
-    command_gate->attemptAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CHIDDevice::getInputReport));
+    clock_get_uptime(&end);
+    uint64_t wait = elapsedNanoseconds(start, end);
+    lock_wait = wait > UINT32_MAX ? UINT32_MAX : (UInt32)wait;
+
+    transfer_arena.begin();
 }
 
-VoodooI2CHIDDevice* VoodooI2CHIDDevice::probe(IOService* provider, SInt32* score) {
-    if (!super::probe(provider, score))
-        return NULL;
+bool VoodooI2CHIDDevice::tryLockI2C() const {
+    if (!IOLockTryLock(read_in_progress_mutex))
+        return false;
 
-    name = getMatchedName(provider);
-    
-    acpi_device = OSDynamicCast(IOACPIPlatformDevice, provider->getProperty("acpi-device"));
-    //acpi_device->retain();
-    
-    if (!acpi_device) {
-        IOLog("%s::%s Could not get ACPI device\n", getName(), name);
-        return NULL;
-    }
-    
-    // Sometimes an I2C HID will have power state methods, lets turn it on in case
-    
-    acpi_device->evaluateObject("_PS0");
+    lock_wait = 0;
+    transfer_arena.begin();
+    return true;
+}
 
-    api = OSDynamicCast(VoodooI2CDeviceNub, provider);
-    //api->retain();
-    
-    if (!api) {
-        IOLog("%s::%s Could not get VoodooI2C API access\n", getName(), name);
-        return NULL;
-    }
-    
-    if (getHIDDescriptorAddress() != kIOReturnSuccess) {
-        IOLog("%s::%s Could not get HID descriptor\n", getName(), name);
-        return NULL;
-    }
+void VoodooI2CHIDDevice::traceTransaction(VoodooI2CHIDDeviceTraceOperation operation, UInt16 reg, UInt16 write_length, UInt16 read_length, IOReturn status, AbsoluteTime start) const {
+    AbsoluteTime end;
+    clock_get_uptime(&end);
 
-    if (getHIDDescriptor() != kIOReturnSuccess) {
-        IOLog("%s::%s Could not get HID descriptor\n", getName(), name);
-        return NULL;
-    }
+    VoodooI2CHIDDeviceTraceRecord record;
+    uint64_t timestamp, duration = elapsedNanoseconds(start, end);
+    absolutetime_to_nanoseconds(start, &timestamp);
 
-    return this;
-}
+    memset(&record, 0, sizeof(record));
+    record.timestamp = timestamp;
+    record.duration = duration > UINT32_MAX ? UINT32_MAX : (UInt32)duration;
+    record.status = status;
+    record.reg = reg;
+    record.write_length = write_length;
+    record.read_length = read_length;
+    record.operation = operation;
 
-void VoodooI2CHIDDevice::releaseResources() {
-    if (command_gate) {
-        command_gate->disable();
-        work_loop->removeEventSource(command_gate);
-        command_gate->release();
-        command_gate = NULL;
-    }
-    
-    if (interrupt_simulator) {
-        interrupt_simulator->disable();
-        work_loop->removeEventSource(interrupt_simulator);
-        interrupt_simulator->release();
-        interrupt_simulator = NULL;
-    }
+    // Only the holder of the I2C lock gets here, the wait is reported once per transaction
 
-    api->disableInterrupt(0);
-    api->unregisterInterrupt(0);
+    record.lock_wait = lock_wait;
+    lock_wait = 0;
 
-    if (work_loop) {
-        work_loop->release();
-        work_loop = NULL;
-    }
-    
-    if (acpi_device) {
-        acpi_device->release();
-        acpi_device = NULL;
-    }
-    
-    if (api) {
-        if (api->isOpen(this))
-            api->close(this);
-        api->release();
-        api = NULL;
-    }
+    trace_ring.record(&record);
 }
 
-IOReturn VoodooI2CHIDDevice::resetHIDDevice() {
-    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CHIDDevice::resetHIDDeviceGated));
-}
+IOReturn VoodooI2CHIDDevice::readI2C(UInt8* values, UInt16 length) const {
+    VoodooI2CHIDBusArbiter* arbiter = __atomic_load_n(&bus_arbiter, __ATOMIC_ACQUIRE);
+    if (arbiter)
+        arbiter->acquireBus(&bus_client);
 
-IOReturn VoodooI2CHIDDevice::resetHIDDeviceGated() {
-    setHIDPowerState(kVoodooI2CStateOn);
+    AbsoluteTime start;
+    clock_get_uptime(&start);
 
-    I2C_LOCK();
-    read_in_progress = true;
-    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) getMallocI2C(sizeof(VoodooI2CHIDDeviceCommand));
-    command->c.reg = hid_descriptor.wCommandRegister;
-    command->c.opcode = 0x01;
-    command->c.report_type_id = 0;
+    IOReturn ret = api->readI2C(values, length);
 
-    api->writeI2C(command->data, sizeof(VoodooI2CHIDDeviceCommand));
-    IOSleep(100);
+    if (arbiter)
+        arbiter->releaseBus(&bus_client, length);
 
-    AbsoluteTime absolute_time, deadline;
+    traceTransaction(kVoodooI2CHIDTraceRead, hid_descriptor.wInputRegister, 0, length, ret, start);
 
-    // Device is required to complete a host-initiated reset in at most 6 seconds.
+    return ret;
+}
+
+IOReturn VoodooI2CHIDDevice::writeI2C(UInt8* values, UInt16 length) const {
+    VoodooI2CHIDBusArbiter* arbiter = __atomic_load_n(&bus_arbiter, __ATOMIC_ACQUIRE);
+    if (arbiter)
+        arbiter->acquireBus(&bus_client);
+
+    AbsoluteTime start;
+    clock_get_uptime(&start);
+
+    IOReturn ret = api->writeI2C(values, length);
+
+    if (arbiter)
+        arbiter->releaseBus(&bus_client, length);
+
+    traceTransaction(kVoodooI2CHIDTraceWrite, length >= 2 ? (values[0] | values[1] << 8) : 0, length, 0, ret, start);
+
+    return ret;
+}
+
+IOReturn VoodooI2CHIDDevice::writeReadI2C(UInt8* write_buffer, UInt16 write_length, UInt8* read_buffer, UInt16 read_length) const {
+    VoodooI2CHIDBusArbiter* arbiter = __atomic_load_n(&bus_arbiter, __ATOMIC_ACQUIRE);
+    if (arbiter)
+        arbiter->acquireBus(&bus_client);
+
+    AbsoluteTime start;
+    clock_get_uptime(&start);
+
+    IOReturn ret = api->writeReadI2C(write_buffer, write_length, read_buffer, read_length);
+
+    if (arbiter)
+        arbiter->releaseBus(&bus_client, write_length + read_length);
+
+    traceTransaction(kVoodooI2CHIDTraceWriteRead, write_length >= 2 ? (write_buffer[0] | write_buffer[1] << 8) : 0, write_length, read_length, ret, start);
+
+    return ret;
+}
+
+void VoodooI2CHIDDevice::dumpTransactionTrace() {
+    OSData* trace = OSData::withCapacity(I2C_HID_TRACE_SIZE * sizeof(VoodooI2CHIDDeviceTraceRecord));
+
+    if (!trace)
+        return;
+
+    // Records still being written or overwritten while we copied them are left out, the decoder reports the gap
+
+    UInt32 last = trace_ring.last();
+
+    for (UInt32 i = I2C_HID_TRACE_SIZE; i > 0; i--) {
+        VoodooI2CHIDDeviceTraceRecord copy;
+
+        if (trace_ring.read(last - i + 1, &copy))
+            trace->appendBytes(&copy, sizeof(copy));
+    }
+
+    setProperty("TransactionTrace", trace);
+    setProperty("TransactionTraceDropped", __atomic_load_n(&trace_ring.dropped, __ATOMIC_RELAXED), 64);
+    trace->release();
+}
+
+IOReturn VoodooI2CHIDDevice::setProperties(OSObject* properties) {
+    OSDictionary* dict = OSDynamicCast(OSDictionary, properties);
+
+    if (dict && dict->getObject("DumpTransactionTrace")) {
+        dumpTransactionTrace();
+        return kIOReturnSuccess;
+    }
+
+    return super::setProperties(properties);
+}
+
+void VoodooI2CHIDDevice::unlockI2C() const {
+    transfer_arena.end();
+    IOLockUnlock(read_in_progress_mutex);
+
+    if (__atomic_load_n(&interrupt_pending, __ATOMIC_SEQ_CST) && deferred_reader) {
+        __atomic_fetch_add(&interrupts_deferred, 1, __ATOMIC_RELAXED);
+        deferred_reader->interruptOccurred(NULL, NULL, 0);
+    }
+}
+
+void VoodooI2CHIDDevice::readDeferredInput(OSObject* owner, IOInterruptEventSource* src, int intCount) {
+    if (!awake || !__atomic_load_n(&interrupt_pending, __ATOMIC_SEQ_CST))
+        return;
+
+    getInputReport();
+}
+
+int VoodooI2CHIDDevice::readInputReport(bool first) {
+    VoodooI2CHIDDeviceReportSlot* slot = NULL;
+    IOReturn ret;
+    int return_size;
+    unsigned char* report;
+    UInt32 head, tail;
+
+    head = report_ring_head;
+    tail = __atomic_load_n(&report_ring_tail, __ATOMIC_ACQUIRE);
+
+    // If the consumer has fallen behind, the report still has to be read off the bus to deassert the interrupt
+
+    if (head - tail < I2C_HID_REPORT_RING_SIZE) {
+        slot = &report_ring[head % I2C_HID_REPORT_RING_SIZE];
+        report = slot->data;
+    } else {
+        input_arena.begin();
+        report = input_arena.allocate(hid_descriptor.wMaxInputLength);
+        if (!report)
+            return -1;
+    }
+
+    UInt16 read_length = hid_descriptor.wMaxInputLength;
+
+    if (learned_read_sizing && learned_length)
+        read_length = learned_length;
+
+    report[0] = report[1] = 0;
+    ret = readI2C(report, read_length);
+    if (ret != kIOReturnSuccess)
+        return -2;
+
+    bus_bytes_read += read_length;
+    return_size = report[0] | report[1] << 8;
+
+    bool reread = false;
+
+    if (return_size > read_length && return_size <= hid_descriptor.wMaxInputLength) {
+        // Cut short, the rest of this report is gone but the next one will be read at the right size
+
+        read_size_mispredictions++;
+        reread = true;
+        learned_length = return_size;
+
+        report[0] = report[1] = 0;
+        ret = readI2C(report, hid_descriptor.wMaxInputLength);
+        if (ret != kIOReturnSuccess)
+            return -2;
+
+        bus_bytes_read += hid_descriptor.wMaxInputLength;
+        return_size = report[0] | report[1] << 8;
+    }
+    /*
+     * "return_size" can be 0 when resetHIDDevice() is called; booting or waking up from sleep.
+     * Since ready_for_input can still be FALSE when booting,
+     * It needs to be checked before checking ready_for_input.
+     *
+     * When draining, a zero-length report after the first one just means the input register is empty. Neither is
+     * one read in place of a report that was cut short: that report is lost, not a reset acknowledged.
+     */
+    if (!return_size) {
+        if (reread) {
+            lost_reports++;
+        } else if (first && reset_state == kVoodooI2CHIDResetPending) {
+            __atomic_store_n(&reset_response_pending, true, __ATOMIC_RELEASE);
+            report_consumer->interruptOccurred(NULL, NULL, 0);
+        }
+        return 0;
+    }
+
+    if (!ready_for_input)
+        return -1;
+
+    if (return_size <= 2 || return_size > hid_descriptor.wMaxInputLength) {
+        invalid_reports++;
+        return -1;
+    }
+
+    useful_bytes_read += return_size;
+    __atomic_store_n(&storm.valid_reports, storm.valid_reports + 1, __ATOMIC_RELAXED);
+
+    if (learned_read_sizing) {
+        if (return_size > learned_window_max)
+            learned_window_max = return_size;
+
+        // Grow at once, shrink only to the longest report of a whole window
+
+        if (return_size > learned_length)
+            learned_length = return_size;
+
+        if (++learned_window_reports >= I2C_HID_LEARNED_WINDOW_REPORTS) {
+            learned_length = learned_window_max;
+            learned_window_max = 0;
+            learned_window_reports = 0;
+        }
+    }
+
+    if (!slot) {
+        report_ring_overflows++;
+        return return_size;
+    }
+
+    slot->length = return_size;
+    clock_get_uptime(&slot->timestamp);
+    slot->interrupt_time = drain_interrupt_time;
+    __atomic_store_n(&report_ring_head, head + 1, __ATOMIC_RELEASE);
+
+    return return_size;
+}
+
+void VoodooI2CHIDDevice::consumeInputReports(OSObject* owner, IOInterruptEventSource* src, int intCount) {
+    if (__atomic_exchange_n(&reset_response_pending, false, __ATOMIC_ACQ_REL))
+        completeReset(kVoodooI2CHIDResetAcknowledged);
+
+    UInt32 tail = report_ring_tail;
+    UInt32 head = __atomic_load_n(&report_ring_head, __ATOMIC_ACQUIRE);
+    UInt64 consumed = report_ring_consumed;
+
+    if (head - tail > report_ring_max_depth)
+        report_ring_max_depth = head - tail;
+
+    while (tail != head) {
+        VoodooI2CHIDDeviceReportSlot* slot = &report_ring[tail % I2C_HID_REPORT_RING_SIZE];
+
+        AbsoluteTime now;
+        clock_get_uptime(&now);
+        uint64_t lag = elapsedNanoseconds(slot->timestamp, now);
+        if (lag > report_ring_max_lag)
+            report_ring_max_lag = lag;
+
+        input_report_buffer->setLength(slot->length - 2);
+        input_report_buffer->writeBytes(0, slot->data + 2, slot->length - 2);
+
+        // Stamp the report with the time the device signalled it rather than the time we got around to parsing it
+
+        IOReturn ret = handleReportWithTime(slot->interrupt_time ? slot->interrupt_time : slot->timestamp, input_report_buffer, kIOHIDReportTypeInput);
+
+        if (ret != kIOReturnSuccess) {
+            report_errors++;
+            IOLogLimited("%s::%s Error handling input report: 0x%.8x\n", getName(), name, ret);
+        }
+
+        AbsoluteTime dispatched;
+        clock_get_uptime(&dispatched);
+
+        latency_interrupt_to_read.record(elapsedNanoseconds(slot->interrupt_time, slot->timestamp));
+        latency_read_to_dispatch.record(elapsedNanoseconds(slot->timestamp, dispatched));
+        latency_interrupt_to_dispatch.record(elapsedNanoseconds(slot->interrupt_time, dispatched));
+
+        report_ring_consumed++;
+        __atomic_store_n(&report_ring_tail, ++tail, __ATOMIC_RELEASE);
+
+        // Pick up anything the producer published while we were parsing
+
+        if (tail == head)
+            head = __atomic_load_n(&report_ring_head, __ATOMIC_ACQUIRE);
+    }
+
+    if (report_ring_consumed != consumed) {
+        AbsoluteTime now;
+        clock_get_uptime(&now);
+        accountActivity(now);
+        input_activity.last_report = now;
+
+        // Some devices skip the zero-length acknowledgement, a valid report read after the reset command shows it
+        // completed just as well
+
+        if ((SInt32)(tail - reset_ring_mark) > 0)
+            completeReset(kVoodooI2CHIDResetAcknowledged);
+
+        if (resume_timing.awaiting_report) {
+            resume_timing.awaiting_report = false;
+            resume_timing.first_report = elapsedNanoseconds(resume_timing.start, now);
+            if (resume_timing.first_report > resume_timing.max_first_report)
+                resume_timing.max_first_report = resume_timing.first_report;
+
+            publishResumeTiming();
+        }
+    }
+
+    publishStatistics();
+}
+
+void VoodooI2CHIDDevice::dropInputReports() {
+    UInt32 head = report_ring_head;
+    UInt32 tail = report_ring_tail;
+
+    lost_reports += head - tail;
+    __atomic_store_n(&report_ring_tail, head, __ATOMIC_RELEASE);
+}
+
+IOReturn VoodooI2CHIDDevice::getReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options) {
+    return getReport(report, reportType, options, 0, NULL);
+}
+
+IOReturn VoodooI2CHIDDevice::getReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options, UInt32 completionTimeout, IOHIDCompletion* completion) {
+    if (reportType != kIOHIDReportTypeFeature && reportType != kIOHIDReportTypeInput)
+        return kIOReturnBadArgument;
+
+    return queueCommand(kVoodooI2CHIDCommandGetReport, report, reportType, options, completionTimeout, completion);
+}
+
+IOReturn VoodooI2CHIDDevice::transferGetReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options) {
+    UInt8 args[3];
+    IOReturn ret;
+    int args_len = 0;
+    UInt16 read_register = hid_descriptor.wDataRegister;
+    UInt8 report_id = options & 0xFF;
+    UInt8 raw_report_type = (reportType == kIOHIDReportTypeFeature) ? 0x03 : 0x01;
+    
+    if (report_id >= 0x0F) {
+        args[args_len++] = report_id;
+        report_id = 0x0F;
+    }
+
+    args[args_len++] = read_register & 0xFF;
+    args[args_len++] = read_register >> 8;
+    
+    I2C_LOCK();
+    read_in_progress = true;
+
+    UInt8 length = sizeof(VoodooI2CHIDDeviceCommand);
+    UInt8* buffer = transfer_arena.allocate(report->getLength());
+    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) transfer_arena.allocate(length + args_len);
+
+    if (!buffer || !command) {
+        read_in_progress = false;
+        I2C_UNLOCK();
+        return kIOReturnNoSpace;
+    }
+
+    memset(buffer, 0, report->getLength());
+    memset(command, 0, length + args_len);
+    command->c.reg = hid_descriptor.wCommandRegister;
+    command->c.opcode = 0x02;
+    command->c.report_type_id = report_id | raw_report_type << 4;
+    
+    UInt8* raw_command = (UInt8*)command;
+    
+    memcpy(raw_command + length, args, args_len);
+    ret = writeReadI2C(raw_command, length+args_len, buffer, report->getLength());
+    
+    report->writeBytes(0, buffer+2, report->getLength()-2);
+    
+    read_in_progress = false;
+    I2C_UNLOCK();
+
+    return ret;
+}
+
+IOReturn VoodooI2CHIDDevice::queueCommand(VoodooI2CHIDDeviceCommandType type, IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options, UInt32 completionTimeout, IOHIDCompletion* completion) {
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+
+    bool quiet = bus_quiet_until > now;
+
+    // The work loop must never wait out the quiet period, a synchronous command issued from it can only run right away
+
+    if (command_gate && work_loop->onThread() && quiet && !completion) {
+        IOLogLimited("%s::%s Synchronous command issued from the work loop while the bus is quiet, rejecting\n", getName(), name);
+        return kIOReturnBusy;
+    }
+
+    // Asynchronous commands issued from the work loop while the bus is quiet are queued, <command_timer> runs them
+
+    if (!command_gate || (work_loop->onThread() && !quiet)) {
+        // Without a command gate nothing is running on the work loop yet
+
+        if (quiet)
+            IOSleep((UInt32)(elapsedNanoseconds(now, bus_quiet_until) / 1000000) + 1);
+
+        IOReturn ret = executeCommand(type, report, reportType, options);
+
+        if (completion)
+            (completion->action)(completion->target, completion->parameter, ret, 0);
+
+        return completion ? kIOReturnSuccess : ret;
+    }
+
+    VoodooI2CHIDDeviceCommandRequest* request = reinterpret_cast<VoodooI2CHIDDeviceCommandRequest*>(IOMalloc(sizeof(VoodooI2CHIDDeviceCommandRequest)));
+    if (!request)
+        return kIOReturnNoMemory;
+
+    memset(request, 0, sizeof(VoodooI2CHIDDeviceCommandRequest));
+    request->type = type;
+    request->report = report;
+    request->report_type = reportType;
+    request->options = options;
+    request->timeout_ms = completionTimeout;
+    request->status = kIOReturnSuccess;
+
+    if (completion) {
+        request->completion = *completion;
+        request->asynchronous = true;
+    }
+
+    report->retain();
+
+    IOReturn ret = command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CHIDDevice::queueCommandGated), request);
+
+    // A queued asynchronous request belongs to the queue and may already be gone, anything else is ours to free
+
+    if (!completion || ret == kIOReturnNotPermitted) {
+        report->release();
+        IOFree(request, sizeof(VoodooI2CHIDDeviceCommandRequest));
+    }
+
+    return ret;
+}
+
+IOReturn VoodooI2CHIDDevice::queueCommandGated(VoodooI2CHIDDeviceCommandRequest* request) {
+    // A blocked caller is waiting on a mode switch or a feature value, let it skip ahead of asynchronous traffic
+
+    VoodooI2CHIDDeviceCommandPriority priority = request->asynchronous ? kVoodooI2CHIDCommandPriorityNormal : kVoodooI2CHIDCommandPriorityHigh;
+
+    AbsoluteTime deadline = 0;
+
+    clock_get_uptime(&request->queued);
+
+    if (request->timeout_ms && !request->asynchronous)
+        clock_interval_to_deadline(request->timeout_ms, kMillisecondScale, &deadline);
+
+    if (command_queue_tail[priority])
+        command_queue_tail[priority]->next = request;
+    else
+        command_queue_head[priority] = request;
+    command_queue_tail[priority] = request;
+
+    if (++command_queue_depth > command_queue_max_depth)
+        command_queue_max_depth = command_queue_depth;
+
+    command_dispatcher->interruptOccurred(NULL, NULL, 0);
+
+    if (request->asynchronous)
+        return kIOReturnSuccess;
+
+    while (!request->done) {
+        if (!deadline) {
+            command_gate->commandSleep(request, THREAD_UNINT);
+            continue;
+        }
+
+        // Commands run with the gate closed, a request that is not done by the time we hold it again is still queued
+
+        if (command_gate->commandSleep(request, deadline, THREAD_UNINT) == THREAD_TIMED_OUT && !request->done) {
+            VoodooI2CHIDDeviceCommandRequest* previous = NULL;
+            VoodooI2CHIDDeviceCommandRequest** link = &command_queue_head[priority];
+
+            while (*link != request) {
+                previous = *link;
+                link = &previous->next;
+            }
+
+            *link = request->next;
+            if (command_queue_tail[priority] == request)
+                command_queue_tail[priority] = previous;
+
+            command_queue_depth--;
+            commands_timed_out++;
+
+            IOLogLimited("%s::%s Command timed out after %u ms in the queue\n", getName(), name, request->timeout_ms);
+            return kIOReturnTimeout;
+        }
+    }
+
+    return request->status;
+}
+
+void VoodooI2CHIDDevice::runCommands() {
+    while (command_queue_depth) {
+        AbsoluteTime now;
+        clock_get_uptime(&now);
+
+        if (bus_quiet_until > now) {
+            command_timer->wakeAtTime(bus_quiet_until);
+            return;
+        }
+
+        // Input always goes first, commands only run between frames
+
+        if (__atomic_load_n(&interrupt_pending, __ATOMIC_SEQ_CST) && awake)
+            getInputReport();
+
+        VoodooI2CHIDDeviceCommandRequest* request = NULL;
+
+        for (int priority = 0; priority < kVoodooI2CHIDCommandPriorityCount && !request; priority++) {
+            request = command_queue_head[priority];
+
+            if (request) {
+                command_queue_head[priority] = request->next;
+                if (!command_queue_head[priority])
+                    command_queue_tail[priority] = NULL;
+            }
+        }
+
+        command_queue_depth--;
+
+        AbsoluteTime start, end;
+        clock_get_uptime(&start);
+
+        uint64_t wait = elapsedNanoseconds(request->queued, start);
+        if (wait > command_max_wait)
+            command_max_wait = wait;
+
+        request->status = executeCommand(request->type, request->report, request->report_type, request->options);
+
+        clock_get_uptime(&end);
+
+        // Time the bus was unavailable to input, the worst case added latency for a report arriving meanwhile
+
+        uint64_t hold = elapsedNanoseconds(start, end);
+        if (hold > command_max_bus_hold)
+            command_max_bus_hold = hold;
+
+        commands_completed++;
+
+        if (request->asynchronous) {
+            (request->completion.action)(request->completion.target, request->completion.parameter, request->status, 0);
+            request->report->release();
+            IOFree(request, sizeof(VoodooI2CHIDDeviceCommandRequest));
+        } else {
+            request->done = true;
+            command_gate->commandWakeup(request);
+        }
+    }
+
+    publishCommandStatistics();
+}
+
+void VoodooI2CHIDDevice::dispatchCommands(OSObject* owner, IOInterruptEventSource* src, int intCount) {
+    runCommands();
+}
+
+void VoodooI2CHIDDevice::dispatchCommandsAfterQuiet(OSObject* owner, IOTimerEventSource* timer) {
+    runCommands();
+}
+
+void VoodooI2CHIDDevice::abortCommandsGated() {
+    for (int priority = 0; priority < kVoodooI2CHIDCommandPriorityCount; priority++) {
+        while (command_queue_head[priority]) {
+            VoodooI2CHIDDeviceCommandRequest* request = command_queue_head[priority];
+            command_queue_head[priority] = request->next;
+
+            request->status = kIOReturnAborted;
+
+            if (request->asynchronous) {
+                (request->completion.action)(request->completion.target, request->completion.parameter, kIOReturnAborted, 0);
+                request->report->release();
+                IOFree(request, sizeof(VoodooI2CHIDDeviceCommandRequest));
+            } else {
+                request->done = true;
+                command_gate->commandWakeup(request);
+            }
+        }
+
+        command_queue_tail[priority] = NULL;
+    }
+
+    command_queue_depth = 0;
+}
+
+IOReturn VoodooI2CHIDDevice::executeCommand(VoodooI2CHIDDeviceCommandType type, IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options) {
+    if (type == kVoodooI2CHIDCommandGetReport)
+        return transferGetReport(report, reportType, options);
+
+    return transferSetReport(report, reportType, options);
+}
+
+void VoodooI2CHIDDevice::publishCommandStatistics() {
+    OSDictionary* queue = OSDictionary::withCapacity(7);
+    if (!queue)
+        return;
+
+    setDictionaryNumber(queue, "Completed", commands_completed);
+    setDictionaryNumber(queue, "TimedOut", commands_timed_out);
+    setDictionaryNumber(queue, "MaxDepth", command_queue_max_depth);
+    setDictionaryNumber(queue, "MaxWaitUs", command_max_wait / 1000);
+    setDictionaryNumber(queue, "MaxBusHoldUs", command_max_bus_hold / 1000);
+    setDictionaryNumber(queue, "SetReports", set_reports);
+    setDictionaryNumber(queue, "SetReportBytesCopied", set_report_bytes_copied);
+
+    setProperty("CommandQueue", queue);
+    queue->release();
+}
+
+void VoodooI2CHIDDevice::interruptOccured(OSObject* owner, IOInterruptEventSource* src, int intCount) {
+    if (!awake)
+        return;
+
+    // The line may still fire a few times after a storm was detected, until the work loop gets to mask it
+
+    if (__atomic_load_n(&storm.active, __ATOMIC_ACQUIRE)) {
+        __atomic_fetch_add(&storm.ignored_interrupts, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_fetch_add(&input_activity.interrupt_wakeups, 1, __ATOMIC_RELAXED);
+
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+    __atomic_store_n(&interrupt_time, now, __ATOMIC_RELAXED);
+
+    if (detectInterruptStorm(now)) {
+        __atomic_store_n(&storm.active, true, __ATOMIC_RELEASE);
+        storm_mitigator->interruptOccurred(NULL, NULL, 0);
+        return;
+    }
+
+    // Must be visible before the lock is tried, see <unlockI2C>
+
+    __atomic_store_n(&interrupt_pending, true, __ATOMIC_SEQ_CST);
+
+    if (read_in_progress) {
+        __atomic_fetch_add(&interrupts_skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    getInputReport();
+}
+
+bool VoodooI2CHIDDevice::detectInterruptStorm(AbsoluteTime now) {
+    __atomic_fetch_add(&storm.window_interrupts, 1, __ATOMIC_RELAXED);
+
+    AbsoluteTime window_start = __atomic_load_n(&storm.window_start, __ATOMIC_ACQUIRE);
+
+    if (window_start && elapsedNanoseconds(window_start, now) < I2C_HID_STORM_WINDOW_MS * 1000000ULL)
+        return false;
+
+    // Only the interrupt that moves the window on judges it, one racing it on another CPU sees the new window
+
+    if (!__atomic_compare_exchange_n(&storm.window_start, &window_start, now, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return false;
+
+    UInt32 interrupts = __atomic_exchange_n(&storm.window_interrupts, 0, __ATOMIC_RELAXED);
+    UInt64 valid_reports = __atomic_load_n(&storm.valid_reports, __ATOMIC_RELAXED);
+    UInt64 reports = valid_reports - __atomic_exchange_n(&storm.window_reports, valid_reports, __ATOMIC_RELAXED);
+
+    return window_start && storm_mitigator && interrupts >= I2C_HID_STORM_MIN_INTERRUPTS
+        && reports * I2C_HID_STORM_REPORT_RATIO < interrupts;
+}
+
+void VoodooI2CHIDDevice::mitigateInterruptStorm(OSObject* owner, IOInterruptEventSource* src, int intCount) {
+    if (!__atomic_load_n(&storm.active, __ATOMIC_ACQUIRE))
+        return;
+
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+
+    storm.storms++;
+
+    api->disableInterrupt(0);
+    storm.masks++;
+
+    // Nothing is lost while the interrupt is masked, the polling path drains the input register just the same
+
+    interrupt_simulator->setTimeoutUS(I2C_HID_POLL_INTERVAL_MIN_US);
+    storm.polling_switches++;
+
+    if (storm.recovered && elapsedNanoseconds(storm.recovered, now) < I2C_HID_STORM_PROBATION_MS * 1000000ULL) {
+        storm.backoff_ms *= 2;
+        if (storm.backoff_ms > I2C_HID_STORM_BACKOFF_MAX_MS)
+            storm.backoff_ms = I2C_HID_STORM_BACKOFF_MAX_MS;
+    } else {
+        storm.backoff_ms = I2C_HID_STORM_BACKOFF_MIN_MS;
+    }
+
+    storm_timer->setTimeoutMS(storm.backoff_ms);
+
+    IOLogLimited("%s::%s Interrupt storm detected, polling for %u ms\n", getName(), name, storm.backoff_ms);
+
+    publishStormStatistics();
+}
+
+void VoodooI2CHIDDevice::recoverFromInterruptStorm(OSObject* owner, IOTimerEventSource* timer) {
+    if (!__atomic_load_n(&storm.active, __ATOMIC_ACQUIRE))
+        return;
+
+    // The interrupt stays masked while asleep, <resumeGated> starts the backoff over once the device is back
+
+    if (!awake) {
+        interrupt_simulator->cancelTimeout();
+        return;
+    }
+
+    // A reset is the only way to get some controllers to deassert the line, the acknowledgement is picked up by
+    // whichever of polling or the interrupt gets to it first
+
+    if (reset_state != kVoodooI2CHIDResetPending) {
+        startResetGated();
+        storm.resets++;
+    }
+
+    interrupt_simulator->cancelTimeout();
+    clock_get_uptime(&storm.recovered);
+
+    // Interrupts are ignored until <active> is cleared, so the window is handed back to them fresh
+
+    __atomic_store_n(&storm.window_start, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&storm.window_interrupts, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&storm.active, false, __ATOMIC_RELEASE);
+
+    api->enableInterrupt(0);
+    storm.unmasks++;
+
+    publishStormStatistics();
+}
+
+void VoodooI2CHIDDevice::publishStormStatistics() {
+    OSDictionary* statistics = OSDictionary::withCapacity(8);
+    if (!statistics)
+        return;
+
+    setDictionaryNumber(statistics, "Storms", storm.storms);
+    setDictionaryNumber(statistics, "Masks", storm.masks);
+    setDictionaryNumber(statistics, "PollingSwitches", storm.polling_switches);
+    setDictionaryNumber(statistics, "Resets", storm.resets);
+    setDictionaryNumber(statistics, "Unmasks", storm.unmasks);
+    setDictionaryNumber(statistics, "IgnoredInterrupts", __atomic_load_n(&storm.ignored_interrupts, __ATOMIC_RELAXED));
+    setDictionaryNumber(statistics, "BackoffMs", storm.backoff_ms);
+    setDictionaryNumber(statistics, "Active", storm.active);
+
+    setProperty("InterruptStorm", statistics);
+    statistics->release();
+}
+
+void VoodooI2CHIDDevice::updateRecovery(OSObject* owner, IOInterruptEventSource* src, int intCount) {
+    bool failing = __atomic_load_n(&recovery.consecutive_errors, __ATOMIC_RELAXED);
+
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+
+    if (failing && recovery.state == kVoodooI2CHIDRecoveryHealthy) {
+        recovery.episodes++;
+        recovery.unavailable_since = now;
+        recovery.state = kVoodooI2CHIDRecoveryRetrying;
+        recovery.attempts = 0;
+        recovery.reset_delay_ms = I2C_HID_RECOVERY_RESET_MIN_MS;
+
+        recovery_timer->setTimeoutMS(I2C_HID_RECOVERY_RETRY_MS);
+
+        IOLogLimited("%s::%s Input transfer failed, starting recovery\n", getName(), name);
+    } else if (!failing && recovery.state != kVoodooI2CHIDRecoveryHealthy) {
+        uint64_t time_to_recover = elapsedNanoseconds(recovery.unavailable_since, now);
+
+        recovery.downtime += time_to_recover;
+        recovery.last_time_to_recover = time_to_recover;
+        if (time_to_recover > recovery.max_time_to_recover)
+            recovery.max_time_to_recover = time_to_recover;
+
+        recovery.recoveries++;
+
+        // Never leave the device switched off half way through a power cycle
+
+        if (recovery.state == kVoodooI2CHIDRecoveryPoweredOff)
+            setHIDPowerState(kVoodooI2CStateOn);
+
+        recovery.state = kVoodooI2CHIDRecoveryHealthy;
+        recovery_timer->cancelTimeout();
+
+        IOLogLimited("%s::%s Recovered from transfer errors after %llu ms\n", getName(), name, time_to_recover / 1000000);
+    } else {
+        return;
+    }
+
+    publishRecoveryStatistics();
+}
+
+void VoodooI2CHIDDevice::escalateRecovery(OSObject* owner, IOTimerEventSource* timer) {
+    UInt32 delay_ms = I2C_HID_RECOVERY_RETRY_MS;
+    bool descriptor_changed;
+
+    // Parked while asleep, <resumeGated> resets the device anyway and restarts the timer
+
+    if (recovery.state == kVoodooI2CHIDRecoveryHealthy || !awake)
+        return;
+
+    switch (recovery.state) {
+        case kVoodooI2CHIDRecoveryRetrying:
+            recovery.retries++;
+            if (++recovery.attempts >= I2C_HID_RECOVERY_RETRIES)
+                recovery.state = kVoodooI2CHIDRecoveryPowerCycling;
+            break;
+        case kVoodooI2CHIDRecoveryPowerCycling:
+            recovery.power_cycles++;
+            setHIDPowerState(kVoodooI2CStateOff);
+            recovery.state = kVoodooI2CHIDRecoveryPoweredOff;
+
+            // Nothing to probe while the device is off, power it back on in the next step
+
+            recovery_timer->setTimeoutMS(I2C_HID_RECOVERY_POWER_OFF_MS);
+            publishRecoveryStatistics();
+            return;
+        case kVoodooI2CHIDRecoveryPoweredOff:
+            setHIDPowerState(kVoodooI2CStateOn);
+            recovery.state = kVoodooI2CHIDRecoveryResetting;
+            break;
+        case kVoodooI2CHIDRecoveryResetting:
+            recovery.resets++;
+            if (refetchHIDDescriptor(&descriptor_changed) == kIOReturnSuccess && descriptor_changed)
+                recovery.descriptor_changes++;
+            if (reset_state != kVoodooI2CHIDResetPending)
+                startResetGated();
+
+            delay_ms = recovery.reset_delay_ms;
+            recovery.reset_delay_ms *= 2;
+            if (recovery.reset_delay_ms > I2C_HID_RECOVERY_RESET_MAX_MS)
+                recovery.reset_delay_ms = I2C_HID_RECOVERY_RESET_MAX_MS;
+            break;
+        default:
+            break;
+    }
+
+    // A successful read clears the error count, <updateRecovery> then completes the recovery. Stamp the probe like
+    // a polling wakeup so that whatever it drains is not timed from a stale interrupt.
+
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+    __atomic_store_n(&interrupt_time, now, __ATOMIC_RELAXED);
+
+    getInputReport();
+
+    recovery_timer->setTimeoutMS(delay_ms);
+    publishRecoveryStatistics();
+}
+
+IOReturn VoodooI2CHIDDevice::refetchHIDDescriptor(bool* changed) {
+    VoodooI2CHIDDeviceHIDDescriptor descriptor;
+    VoodooI2CHIDDeviceHIDDescriptor previous;
+    VoodooI2CHIDDeviceCommand* command;
+    IOBufferMemoryDescriptor* buffer = NULL;
+    UInt8* pool = NULL;
+    UInt32 head;
+    IOReturn ret;
+
+    if (changed)
+        *changed = false;
+
+    I2C_LOCK();
+    read_in_progress = true;
+    command = (VoodooI2CHIDDeviceCommand*)transfer_arena.allocate(sizeof(VoodooI2CHIDDeviceCommand));
+
+    if (!command) {
+        ret = kIOReturnNoSpace;
+        goto exit;
+    }
+
+    command->c.reg = hid_descriptor_register;
 
-    nanoseconds_to_absolutetime(6000000000, &absolute_time);
+    if (writeReadI2C(command->data, 2, (UInt8*)&descriptor, (UInt16)sizeof(VoodooI2CHIDDeviceHIDDescriptor)) != kIOReturnSuccess) {
+        ret = kIOReturnIOError;
+        goto exit;
+    }
 
-    clock_absolutetime_interval_to_deadline(absolute_time, &deadline);
-    IOReturn sleep = command_gate->commandSleep(&reset_event, deadline, THREAD_ABORTSAFE);
+    ret = kIOReturnSuccess;
 
-    if (sleep == THREAD_TIMED_OUT) {
-        IOLog("%s::%s Timeout waiting for device to complete host initiated reset\n", getName(), name);
-        read_in_progress = false;
+    if (!memcmp(&descriptor, &hid_descriptor, sizeof(VoodooI2CHIDDeviceHIDDescriptor)))
+        goto exit;
+
+    IOLogLimited("%s::%s HID descriptor changed during recovery, applying it\n", getName(), name);
+
+    // The ring and the report buffer only ever grow, slots sized for longer reports hold shorter ones as well
+
+    if (descriptor.wMaxInputLength > report_ring_slot_size) {
+        buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, descriptor.wMaxInputLength);
+        pool = reinterpret_cast<UInt8*>(IOMalloc(I2C_HID_REPORT_RING_SIZE * descriptor.wMaxInputLength));
+
+        if (!buffer || !pool) {
+            IOLog("%s::%s Could not allocate input buffers for the new HID descriptor\n", getName(), name);
+            OSSafeReleaseNULL(buffer);
+            if (pool)
+                IOFree(pool, I2C_HID_REPORT_RING_SIZE * descriptor.wMaxInputLength);
+            ret = kIOReturnNoMemory;
+            goto exit;
+        }
+    }
+
+    // Reports read under the old descriptor are dropped rather than dispatched under the new one. Producers hold the
+    // I2C lock and the consumer runs on the work loop, so neither touches the ring meanwhile.
+
+    head = report_ring_head;
+    lost_reports += head - report_ring_tail;
+    __atomic_store_n(&report_ring_tail, head, __ATOMIC_RELEASE);
+
+    if (pool) {
+        if (report_ring_pool)
+            IOFree(report_ring_pool, I2C_HID_REPORT_RING_SIZE * report_ring_slot_size);
+
+        report_ring_pool = pool;
+        report_ring_slot_size = descriptor.wMaxInputLength;
+
+        for (int i = 0; i < I2C_HID_REPORT_RING_SIZE; i++)
+            report_ring[i].data = report_ring_pool + i * report_ring_slot_size;
+
+        OSSafeReleaseNULL(input_report_buffer);
+        input_report_buffer = buffer;
+    }
+
+    memcpy(&previous, &hid_descriptor, sizeof(VoodooI2CHIDDeviceHIDDescriptor));
+    memcpy(&hid_descriptor, &descriptor, sizeof(VoodooI2CHIDDeviceHIDDescriptor));
+
+    ret = parseHIDDescriptor();
+
+    if (ret != kIOReturnSuccess) {
+        memcpy(&hid_descriptor, &previous, sizeof(VoodooI2CHIDDeviceHIDDescriptor));
+        goto exit;
+    }
+
+    learned_length = 0;
+
+    if (changed)
+        *changed = true;
+
+exit:
+    read_in_progress = false;
+    I2C_UNLOCK();
+
+    return ret;
+}
+
+void VoodooI2CHIDDevice::publishRecoveryStatistics() {
+    OSDictionary* statistics = OSDictionary::withCapacity(11);
+    if (!statistics)
+        return;
+
+    uint64_t downtime = recovery.downtime;
+
+    if (recovery.state != kVoodooI2CHIDRecoveryHealthy) {
+        AbsoluteTime now;
+        clock_get_uptime(&now);
+        downtime += elapsedNanoseconds(recovery.unavailable_since, now);
+    }
+
+    setDictionaryNumber(statistics, "State", recovery.state);
+    setDictionaryNumber(statistics, "TransferErrors", recovery.transfer_errors);
+    setDictionaryNumber(statistics, "Episodes", recovery.episodes);
+    setDictionaryNumber(statistics, "Retries", recovery.retries);
+    setDictionaryNumber(statistics, "PowerCycles", recovery.power_cycles);
+    setDictionaryNumber(statistics, "Resets", recovery.resets);
+    setDictionaryNumber(statistics, "DescriptorChanges", recovery.descriptor_changes);
+    setDictionaryNumber(statistics, "Recoveries", recovery.recoveries);
+    setDictionaryNumber(statistics, "DowntimeMs", downtime / 1000000);
+    setDictionaryNumber(statistics, "LastTimeToRecoverMs", recovery.last_time_to_recover / 1000000);
+    setDictionaryNumber(statistics, "MaxTimeToRecoverMs", recovery.max_time_to_recover / 1000000);
+
+    setProperty("TransferRecovery", statistics);
+    statistics->release();
+}
+
+VoodooI2CHIDDevice* VoodooI2CHIDDevice::probe(IOService* provider, SInt32* score) {
+    if (!super::probe(provider, score))
+        return NULL;
+
+    name = getMatchedName(provider);
+
+    clock_get_uptime(&probe_time);
+    
+    acpi_device = OSDynamicCast(IOACPIPlatformDevice, provider->getProperty("acpi-device"));
+    //acpi_device->retain();
+    
+    if (!acpi_device) {
+        IOLog("%s::%s Could not get ACPI device\n", getName(), name);
+        return NULL;
+    }
+    
+    // Sometimes an I2C HID will have power state methods, lets turn it on in case
+    
+    acpi_device->evaluateObject("_PS0");
+
+    api = OSDynamicCast(VoodooI2CDeviceNub, provider);
+    //api->retain();
+    
+    if (!api) {
+        IOLog("%s::%s Could not get VoodooI2C API access\n", getName(), name);
+        return NULL;
+    }
+    
+    if (getHIDDescriptorAddress() != kIOReturnSuccess) {
+        IOLog("%s::%s Could not get HID descriptor\n", getName(), name);
+        return NULL;
+    }
+
+    if (getHIDDescriptor() != kIOReturnSuccess) {
+        IOLog("%s::%s Could not get HID descriptor\n", getName(), name);
+        return NULL;
+    }
+
+    return this;
+}
+
+void VoodooI2CHIDDevice::releaseResources() {
+    if (bus_arbiter) {
+        // All transfers happen with the I2C lock held, so none is using the arbiter once we have it
+
+        I2C_LOCK();
+        VoodooI2CHIDBusArbiter* arbiter = bus_arbiter;
+        __atomic_store_n(&bus_arbiter, NULL, __ATOMIC_RELEASE);
         I2C_UNLOCK();
-        return kIOReturnTimeout;
+
+        arbiter->unregisterClient(&bus_client);
+        arbiter->release();
+    }
+
+    // Nothing may reach the command gate once it is gone, so stop the interrupt and every timer and trigger first
+
+    api->disableInterrupt(0);
+    api->unregisterInterrupt(0);
+
+    if (interrupt_simulator) {
+        interrupt_simulator->cancelTimeout();
+        interrupt_simulator->disable();
+        work_loop->removeEventSource(interrupt_simulator);
+        interrupt_simulator->release();
+        interrupt_simulator = NULL;
+    }
+
+    if (command_timer) {
+        command_timer->cancelTimeout();
+        work_loop->removeEventSource(command_timer);
+        OSSafeReleaseNULL(command_timer);
+    }
+
+    if (reset_timer) {
+        reset_timer->cancelTimeout();
+        work_loop->removeEventSource(reset_timer);
+        OSSafeReleaseNULL(reset_timer);
+    }
+
+    if (descriptor_verifier) {
+        descriptor_verifier->cancelTimeout();
+        work_loop->removeEventSource(descriptor_verifier);
+        OSSafeReleaseNULL(descriptor_verifier);
+    }
+
+    if (storm_timer) {
+        storm_timer->cancelTimeout();
+        work_loop->removeEventSource(storm_timer);
+        OSSafeReleaseNULL(storm_timer);
+    }
+
+    if (recovery_timer) {
+        recovery_timer->cancelTimeout();
+        work_loop->removeEventSource(recovery_timer);
+        OSSafeReleaseNULL(recovery_timer);
+    }
+
+    if (storm_mitigator) {
+        storm_mitigator->disable();
+        work_loop->removeEventSource(storm_mitigator);
+        OSSafeReleaseNULL(storm_mitigator);
+    }
+
+    if (deferred_reader) {
+        deferred_reader->disable();
+        work_loop->removeEventSource(deferred_reader);
+        OSSafeReleaseNULL(deferred_reader);
+    }
+
+    if (recovery_trigger) {
+        recovery_trigger->disable();
+        work_loop->removeEventSource(recovery_trigger);
+        OSSafeReleaseNULL(recovery_trigger);
+    }
+
+    if (report_consumer) {
+        report_consumer->disable();
+        work_loop->removeEventSource(report_consumer);
+        report_consumer->release();
+        report_consumer = NULL;
+    }
+
+    if (command_dispatcher) {
+        command_dispatcher->disable();
+        work_loop->removeEventSource(command_dispatcher);
+        OSSafeReleaseNULL(command_dispatcher);
+    }
+
+    if (command_gate) {
+        command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CHIDDevice::abortCommandsGated));
+        command_gate->disable();
+        work_loop->removeEventSource(command_gate);
+        command_gate->release();
+        command_gate = NULL;
+    }
+
+    if (report_ring_pool) {
+        IOFree(report_ring_pool, I2C_HID_REPORT_RING_SIZE * report_ring_slot_size);
+        report_ring_pool = NULL;
+    }
+
+    OSSafeReleaseNULL(input_report_buffer);
+
+    if (work_loop) {
+        work_loop->release();
+        work_loop = NULL;
     }
     
+    if (acpi_device) {
+        acpi_device->release();
+        acpi_device = NULL;
+    }
+    
+    if (api) {
+        if (api->isOpen(this))
+            api->close(this);
+        api->release();
+        api = NULL;
+    }
+}
+
+IOReturn VoodooI2CHIDDevice::resetHIDDevice() {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CHIDDevice::resetHIDDeviceGated));
+}
+
+IOReturn VoodooI2CHIDDevice::resetHIDDeviceGated() {
+    IOReturn ret = startResetGated();
+
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    // The bus is free while we wait so that the acknowledgement can actually be read. <reset_timer> normally ends
+    // the wait, the deadline makes sure it ends even if the timer never gets to run.
+
+    AbsoluteTime deadline;
+    clock_interval_to_deadline(I2C_HID_RESET_TIMEOUT_MS, kMillisecondScale, &deadline);
+
+    while (reset_state == kVoodooI2CHIDResetPending) {
+        if (command_gate->commandSleep(&reset_event, deadline, THREAD_UNINT) == THREAD_TIMED_OUT) {
+            completeReset(kVoodooI2CHIDResetTimedOut);
+            break;
+        }
+    }
+
+    if (reset_state == kVoodooI2CHIDResetTimedOut) {
+        IOLog("%s::%s Timeout waiting for device to complete host initiated reset\n", getName(), name);
+        return kIOReturnTimeout;
+    }
+
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooI2CHIDDevice::startResetGated() {
+    AbsoluteTime now;
+
+    clock_get_uptime(&reset_timing.start);
+    reset_timing.command = reset_timing.acknowledge = 0;
+
+    setHIDPowerState(kVoodooI2CStateOn);
+
+    clock_get_uptime(&now);
+    reset_timing.power_on = elapsedNanoseconds(reset_timing.start, now);
+
+    // Armed before the command is written, the device may acknowledge straight away
+
+    reset_state = kVoodooI2CHIDResetPending;
+    if (reset_timer)
+        reset_timer->setTimeoutMS(I2C_HID_RESET_TIMEOUT_MS);
+
+    I2C_LOCK();
+    read_in_progress = true;
+
+    // Whatever was read before the command is from before the reset and can't acknowledge it. Nothing else touches
+    // the ring meanwhile: the producer needs the bus and the consumer runs on the work loop.
+
+    dropInputReports();
+    __atomic_store_n(&reset_response_pending, false, __ATOMIC_RELEASE);
+    reset_ring_mark = report_ring_head;
+
+    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) transfer_arena.allocate(sizeof(VoodooI2CHIDDeviceCommand));
+    IOReturn ret = kIOReturnNoSpace;
+
+    if (command) {
+        command->c.reg = hid_descriptor.wCommandRegister;
+        command->c.opcode = 0x01;
+        command->c.report_type_id = 0;
+
+        ret = writeI2C(command->data, sizeof(VoodooI2CHIDDeviceCommand));
+    }
+
     read_in_progress = false;
     I2C_UNLOCK();
 
-    return kIOReturnSuccess;
+    clock_get_uptime(&now);
+    reset_timing.command = elapsedNanoseconds(reset_timing.start, now) - reset_timing.power_on;
+    reset_timing.resets++;
+
+    if (ret != kIOReturnSuccess) {
+        IOLog("%s::%s Could not issue host initiated reset\n", getName(), name);
+        if (reset_timer)
+            reset_timer->cancelTimeout();
+        reset_state = kVoodooI2CHIDResetIdle;
+    }
+
+    return ret;
+}
+
+void VoodooI2CHIDDevice::completeReset(VoodooI2CHIDDeviceResetState state) {
+    if (reset_state != kVoodooI2CHIDResetPending)
+        return;
+
+    if (reset_timer)
+        reset_timer->cancelTimeout();
+
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+    uint64_t total = elapsedNanoseconds(reset_timing.start, now);
+
+    reset_timing.acknowledge = total - reset_timing.power_on - reset_timing.command;
+    if (state == kVoodooI2CHIDResetTimedOut)
+        reset_timing.timeouts++;
+
+    reset_state = state;
+    command_gate->commandWakeup(&reset_event);
+
+    if (state == kVoodooI2CHIDResetAcknowledged && resume_timing.awaiting_report && !resume_timing.ready) {
+        resume_timing.ready = elapsedNanoseconds(resume_timing.start, now);
+        publishResumeTiming();
+    }
+
+    OSDictionary* timing = OSDictionary::withCapacity(6);
+    if (!timing)
+        return;
+
+    setDictionaryNumber(timing, "PowerOnUs", reset_timing.power_on / 1000);
+    setDictionaryNumber(timing, "CommandUs", reset_timing.command / 1000);
+    setDictionaryNumber(timing, "AcknowledgeUs", reset_timing.acknowledge / 1000);
+    setDictionaryNumber(timing, "TotalUs", total / 1000);
+    setDictionaryNumber(timing, "Resets", reset_timing.resets);
+    setDictionaryNumber(timing, "Timeouts", reset_timing.timeouts);
+
+    setProperty("ResetTiming", timing);
+    timing->release();
+}
+
+IOReturn VoodooI2CHIDDevice::resumeGated() {
+    clock_get_uptime(&resume_timing.start);
+    resume_timing.awaiting_report = true;
+    resume_timing.ready = resume_timing.first_report = 0;
+    resume_timing.resumes++;
+
+    // Recovery is parked while asleep, pick it up where it left off
+
+    if (recovery.state != kVoodooI2CHIDRecoveryHealthy && recovery_timer)
+        recovery_timer->setTimeoutMS(I2C_HID_RECOVERY_RETRY_MS);
+
+    // So is a storm, the interrupt is still masked so poll until the backoff has expired again
+
+    if (__atomic_load_n(&storm.active, __ATOMIC_ACQUIRE) && storm_timer) {
+        interrupt_simulator->setTimeoutUS(I2C_HID_POLL_INTERVAL_MIN_US);
+        storm_timer->setTimeoutMS(storm.backoff_ms);
+    }
+
+    return startResetGated();
+}
+
+IOReturn VoodooI2CHIDDevice::waitForDeviceReady(UInt32 timeout_ms) {
+    if (!command_gate)
+        return kIOReturnNotReady;
+
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CHIDDevice::waitForDeviceReadyGated), &timeout_ms);
+}
+
+IOReturn VoodooI2CHIDDevice::waitForDeviceReadyGated(UInt32* timeout_ms) {
+    AbsoluteTime deadline;
+    clock_interval_to_deadline(*timeout_ms, kMillisecondScale, &deadline);
+
+    while (reset_state == kVoodooI2CHIDResetPending) {
+        if (command_gate->commandSleep(&reset_event, deadline, THREAD_UNINT) == THREAD_TIMED_OUT)
+            return kIOReturnTimeout;
+    }
+
+    return reset_state == kVoodooI2CHIDResetTimedOut ? kIOReturnTimeout : kIOReturnSuccess;
+}
+
+void VoodooI2CHIDDevice::publishResumeTiming() {
+    OSDictionary* timing = OSDictionary::withCapacity(4);
+    if (!timing)
+        return;
+
+    setDictionaryNumber(timing, "ReadyUs", resume_timing.ready / 1000);
+    setDictionaryNumber(timing, "FirstReportUs", resume_timing.first_report / 1000);
+    setDictionaryNumber(timing, "MaxFirstReportUs", resume_timing.max_first_report / 1000);
+    setDictionaryNumber(timing, "Resumes", resume_timing.resumes);
+
+    setProperty("ResumeTiming", timing);
+    timing->release();
+}
+
+void VoodooI2CHIDDevice::resetTimedOut(OSObject* owner, IOTimerEventSource* timer) {
+    completeReset(kVoodooI2CHIDResetTimedOut);
 }
 
 IOReturn VoodooI2CHIDDevice::setHIDPowerState(VoodooI2CState state) {
@@ -409,84 +1880,110 @@ IOReturn VoodooI2CHIDDevice::setHIDPowerState(VoodooI2CState state) {
     IOReturn ret = kIOReturnSuccess;
     int attempts = 5;
     do {
-        VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) getMallocI2C(sizeof(VoodooI2CHIDDeviceCommand));
+        // Only a failed attempt is worth waiting for, the command itself needs no settling time
+
+        if (ret != kIOReturnSuccess)
+            IOSleep(I2C_HID_POWER_RETRY_DELAY_MS);
+
+        VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) transfer_arena.allocate(sizeof(VoodooI2CHIDDeviceCommand));
+
+        // Retrying would only fail the same way
+
+        if (!command) {
+            ret = kIOReturnNoSpace;
+            break;
+        }
+
         command->c.reg = hid_descriptor.wCommandRegister;
         command->c.opcode = 0x08;
         command->c.report_type_id = state ? I2C_HID_PWR_ON : I2C_HID_PWR_SLEEP;
 
-        ret = api->writeI2C(command->data, sizeof(VoodooI2CHIDDeviceCommand));
-        IOSleep(100);
-    } while (ret != kIOReturnSuccess && --attempts >= 0);
+        ret = writeI2C(command->data, sizeof(VoodooI2CHIDDeviceCommand));
+    } while (ret != kIOReturnSuccess && --attempts >= 0);
+    
+    read_in_progress = false;
+    I2C_UNLOCK();
+    
+    return ret;
+}
+
+IOReturn VoodooI2CHIDDevice::setReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options) {
+    return setReport(report, reportType, options, 0, NULL);
+}
+
+IOReturn VoodooI2CHIDDevice::setReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options, UInt32 completionTimeout, IOHIDCompletion* completion) {
+    if (reportType != kIOHIDReportTypeFeature && reportType != kIOHIDReportTypeOutput)
+        return kIOReturnBadArgument;
+
+    return queueCommand(kVoodooI2CHIDCommandSetReport, report, reportType, options, completionTimeout, completion);
+}
+
+IOReturn VoodooI2CHIDDevice::transferSetReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options) {
+    UInt8 raw_report_type = (reportType == kIOHIDReportTypeFeature) ? 0x03 : 0x02;
+    UInt16 report_length = report->getLength();
+    UInt8 header[sizeof(VoodooI2CHIDDeviceCommand) + I2C_HID_SET_REPORT_MAX_HEADER];
+    UInt8 header_length = encodeSetReportHeader(header, raw_report_type, options & 0xFF, report_length);
+    UInt16 length = header_length + report_length;
+
+    I2C_LOCK();
+    read_in_progress = true;
+
+    // The header is encoded around the report in the transfer buffer, the report itself is copied exactly once
+
+    UInt8* raw_command = transfer_arena.allocate(length);
+    if (!raw_command) {
+        read_in_progress = false;
+        I2C_UNLOCK();
+        return kIOReturnNoSpace;
+    }
+
+    memcpy(raw_command, header, header_length);
+    report->readBytes(0, raw_command + header_length, report_length);
+
+    IOReturn ret = writeI2C(raw_command, length);
     
     read_in_progress = false;
     I2C_UNLOCK();
-    
+
+    set_reports++;
+    set_report_bytes_copied += report_length;
+
+    // Give the device time to process the report before the next command, input may be read in the meantime
+
+    clock_interval_to_deadline(I2C_HID_SET_REPORT_QUIET_MS, kMillisecondScale, &bus_quiet_until);
+
     return ret;
 }
 
-IOReturn VoodooI2CHIDDevice::setReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options) {
-    if (reportType != kIOHIDReportTypeFeature && reportType != kIOHIDReportTypeOutput)
-        return kIOReturnBadArgument;
-    
+UInt8 VoodooI2CHIDDevice::encodeSetReportHeader(UInt8* header, UInt8 raw_report_type, UInt8 report_id, UInt16 report_length) {
     UInt16 data_register = hid_descriptor.wDataRegister;
-    UInt8 raw_report_type = (reportType == kIOHIDReportTypeFeature) ? 0x03 : 0x02;
-    UInt8 idx = 0;
-    UInt16 size;
-    UInt16 arguments_length;
-    UInt8 report_id = options & 0xFF;
-    UInt8* buffer = (UInt8*)IOMalloc(report->getLength());
-    report->readBytes(0, buffer, report->getLength());
-    
-    size = 2 +
-    (report_id ? 1 : 0)     /* reportID */ +
-    report->getLength()     /* buf */;
+    UInt16 size = 2 + (report_id ? 1 : 0) + report_length;
+    UInt8 idx = sizeof(VoodooI2CHIDDeviceCommand);
+    UInt8 extended_report_id = report_id;
 
-    arguments_length = (report_id >= 0x0F ? 1 : 0)  /* optional third byte */ +
-    2                                               /* dataRegister */ +
-    size                                            /* args */;
-    
-    UInt8* arguments = (UInt8*)IOMalloc(arguments_length);
-    memset(arguments, 0, arguments_length);
-    
-    if (report_id >= 0x0F) {
-        arguments[idx++] = report_id;
+    // Report IDs of 15 and above don't fit into the opcode byte and are sent as an extra byte instead
+
+    if (report_id >= 0x0F)
         report_id = 0x0F;
-    }
-    
-    arguments[idx++] = data_register & 0xFF;
-    arguments[idx++] = data_register >> 8;
-    
-    arguments[idx++] = size & 0xFF;
-    arguments[idx++] = size >> 8;
-    
-    if (report_id)
-        arguments[idx++] = report_id;
-    
-    memcpy(&arguments[idx], buffer, report->getLength());
-    
-    I2C_LOCK();
-    read_in_progress = true;
 
-    UInt8 length = sizeof(VoodooI2CHIDDeviceCommand);
-    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) getMallocI2C(length + arguments_length);
-    memset(command, 0, length + arguments_length);
+    VoodooI2CHIDDeviceCommand* command = reinterpret_cast<VoodooI2CHIDDeviceCommand*>(header);
     command->c.reg = hid_descriptor.wCommandRegister;
     command->c.opcode = 0x03;
     command->c.report_type_id = report_id | raw_report_type << 4;
-    
-    UInt8* raw_command = (UInt8*)command;
-    
-    memcpy(raw_command + length, arguments, arguments_length);
-    IOReturn ret = api->writeI2C(raw_command, length+arguments_length);
-    IOSleep(10);
-    
-    read_in_progress = false;
-    I2C_UNLOCK();
-    
-    IOFree(arguments, arguments_length);
-    IOFree(buffer, report->getLength());
 
-    return ret;
+    if (report_id == 0x0F)
+        header[idx++] = extended_report_id;
+
+    header[idx++] = data_register & 0xFF;
+    header[idx++] = data_register >> 8;
+
+    header[idx++] = size & 0xFF;
+    header[idx++] = size >> 8;
+
+    if (extended_report_id)
+        header[idx++] = extended_report_id;
+
+    return idx;
 }
 
 IOReturn VoodooI2CHIDDevice::setPowerState(unsigned long whichState, IOService* whatDevice) {
@@ -502,24 +1999,12 @@ IOReturn VoodooI2CHIDDevice::setPowerState(unsigned long whichState, IOService*
         }
     } else {
         if (!awake) {
-            setHIDPowerState(kVoodooI2CStateOn);
-            
-            IOSleep(1);
-            
-            I2C_LOCK();
-            read_in_progress = true;
-            
-            VoodooI2CHIDDeviceCommand *command = (VoodooI2CHIDDeviceCommand*) getMallocI2C(sizeof(VoodooI2CHIDDeviceCommand));
-            command->c.reg = hid_descriptor.wCommandRegister;
-            command->c.opcode = 0x01;
-            command->c.report_type_id = 0;
-            
-            api->writeI2C(command->data, sizeof(VoodooI2CHIDDeviceCommand));
-            
+            // Awake first so that the reset acknowledgement is read, the reset then completes on the work loop
+
             awake = true;
-            read_in_progress = false;
-            I2C_UNLOCK();
-            
+
+            command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CHIDDevice::resumeGated));
+
             IOLog("%s::%s Woke up\n", getName(), name);
         }
     }
@@ -549,37 +2034,119 @@ bool VoodooI2CHIDDevice::handleStart(IOService* provider) {
     acpi_device->retain();
     api->retain();
 
+    input_report_buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, hid_descriptor.wMaxInputLength);
+    if (!input_report_buffer) {
+        IOLog("%s::%s Could not allocate input report buffer\n", getName(), name);
+        goto exit;
+    }
+
+    report_ring_pool = reinterpret_cast<UInt8*>(IOMalloc(I2C_HID_REPORT_RING_SIZE * hid_descriptor.wMaxInputLength));
+    if (!report_ring_pool) {
+        IOLog("%s::%s Could not allocate input report ring\n", getName(), name);
+        goto exit;
+    }
+
+    report_ring_slot_size = hid_descriptor.wMaxInputLength;
+
+    for (int i = 0; i < I2C_HID_REPORT_RING_SIZE; i++)
+        report_ring[i].data = report_ring_pool + i * report_ring_slot_size;
+
+    report_consumer = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &VoodooI2CHIDDevice::consumeInputReports));
+    if (!report_consumer || (work_loop->addEventSource(report_consumer) != kIOReturnSuccess)) {
+        IOLog("%s::%s Could not add input report consumer to work loop\n", getName(), name);
+        goto exit;
+    }
+    report_consumer->enable();
+
+    deferred_reader = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &VoodooI2CHIDDevice::readDeferredInput));
+    if (!deferred_reader || (work_loop->addEventSource(deferred_reader) != kIOReturnSuccess)) {
+        IOLog("%s::%s Could not add deferred input reader to work loop\n", getName(), name);
+        goto exit;
+    }
+    deferred_reader->enable();
+
+    command_dispatcher = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &VoodooI2CHIDDevice::dispatchCommands));
+    if (!command_dispatcher || (work_loop->addEventSource(command_dispatcher) != kIOReturnSuccess)) {
+        IOLog("%s::%s Could not add command dispatcher to work loop\n", getName(), name);
+        goto exit;
+    }
+    command_dispatcher->enable();
+
+    command_timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooI2CHIDDevice::dispatchCommandsAfterQuiet));
+    if (!command_timer || (work_loop->addEventSource(command_timer) != kIOReturnSuccess)) {
+        IOLog("%s::%s Could not add command timer to work loop\n", getName(), name);
+        goto exit;
+    }
+
+    reset_timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooI2CHIDDevice::resetTimedOut));
+    if (!reset_timer || (work_loop->addEventSource(reset_timer) != kIOReturnSuccess)) {
+        IOLog("%s::%s Could not add reset timer to work loop\n", getName(), name);
+        goto exit;
+    }
+
+    recovery_trigger = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &VoodooI2CHIDDevice::updateRecovery));
+    if (!recovery_trigger || (work_loop->addEventSource(recovery_trigger) != kIOReturnSuccess)) {
+        IOLog("%s::%s Could not add recovery trigger to work loop\n", getName(), name);
+        goto exit;
+    }
+    recovery_trigger->enable();
+
+    recovery_timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooI2CHIDDevice::escalateRecovery));
+    if (!recovery_timer || (work_loop->addEventSource(recovery_timer) != kIOReturnSuccess)) {
+        IOLog("%s::%s Could not add recovery timer to work loop\n", getName(), name);
+        goto exit;
+    }
+
+    descriptor_verifier = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooI2CHIDDevice::verifyReportDescriptor));
+    if (!descriptor_verifier || (work_loop->addEventSource(descriptor_verifier) != kIOReturnSuccess)) {
+        IOLog("%s::%s Could not add report descriptor verifier to work loop\n", getName(), name);
+        goto exit;
+    }
+
     if (!api->open(this)) {
         IOLog("%s::%s Could not open API\n", getName(), name);
         goto exit;
     }
     
+    // Polling is also the fallback while an interrupt storm is being mitigated, so the timer always exists
+
+    interrupt_simulator = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooI2CHIDDevice::simulateInterrupt));
+    if (!interrupt_simulator || (work_loop->addEventSource(interrupt_simulator) != kIOReturnSuccess)) {
+        IOLog("%s::%s Could not get timer event source\n", getName(), name);
+        goto exit;
+    }
+
+    storm_timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooI2CHIDDevice::recoverFromInterruptStorm));
+    if (!storm_timer || (work_loop->addEventSource(storm_timer) != kIOReturnSuccess)) {
+        IOLog("%s::%s Could not add interrupt storm timer to work loop\n", getName(), name);
+        goto exit;
+    }
+
     /* ISR should work in VoodooGPIO's workloop to block the level interrupt, so use direct interrupt here. */
     if (api->registerInterrupt(0, this, OSMemberFunctionCast(IOInterruptAction, this, &VoodooI2CHIDDevice::interruptOccured), 0) != kIOReturnSuccess) {
         IOLog("%s::%s Warning: Could not get interrupt event source, using polling instead\n", getName(), name);
-        interrupt_simulator = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooI2CHIDDevice::simulateInterrupt));
-        
-        if (!interrupt_simulator) {
-            IOLog("%s::%s Could not get timer event source\n", getName(), name);
+        interrupt_simulator->setTimeoutUS(I2C_HID_POLL_INTERVAL_MIN_US);
+    } else {
+        // Created before the interrupt is enabled, <detectInterruptStorm> never flags a storm without it
+
+        storm_mitigator = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &VoodooI2CHIDDevice::mitigateInterruptStorm));
+        if (!storm_mitigator || (work_loop->addEventSource(storm_mitigator) != kIOReturnSuccess)) {
+            IOLog("%s::%s Could not add interrupt storm mitigator to work loop\n", getName(), name);
             goto exit;
         }
-        work_loop->addEventSource(interrupt_simulator);
-        interrupt_simulator->setTimeoutMS(200);
-    } else {
+        storm_mitigator->enable();
+
         api->enableInterrupt(0);
     }
 
-    resetHIDDevice();
+    // The reset only returns once the device has acknowledged it, so IOHIDDevice can safely request the
+    // report descriptor straight after
 
+    resetHIDDevice();
 
     PMinit();
     api->joinPMtree(this);
     registerPowerDriver(this, VoodooI2CIOPMPowerStates, kVoodooI2CIOPMNumberPowerStates);
-    
-    // Give the reset a bit of time so that IOHIDDevice doesnt happen to start requesting the report
-    // descriptor before the driver is ready
-
-    IOSleep(100);
 
     return true;
 exit:
@@ -595,9 +2162,68 @@ bool VoodooI2CHIDDevice::start(IOService* provider) {
 
     setProperty("VoodooI2CServices Supported", kOSBooleanTrue);
 
+    if (getProperty("LearnedReadSizing") == kOSBooleanTrue) {
+        OSData* descriptor = OSDynamicCast(OSData, getProperty(kIOHIDReportDescriptorKey));
+
+        if (descriptor && countInputReportIDs(reinterpret_cast<const UInt8*>(descriptor->getBytesNoCopy()), descriptor->getLength()) <= 1)
+            learned_read_sizing = true;
+        else
+            IOLog("%s::%s Device has several input reports, learned read sizing disabled\n", getName(), name);
+    }
+
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+    setProperty("ProbeToReadyMs", elapsedNanoseconds(probe_time, now) / 1000000, 32);
+
+    publishDescriptorCacheStatistics();
+
+    registerWithBusArbiter();
+
     return true;
 }
 
+void VoodooI2CHIDDevice::registerWithBusArbiter() {
+    VoodooI2CHIDBusPriority priority = kVoodooI2CHIDBusPriorityOther;
+    UInt32 budget = I2C_HID_BUS_BUDGET_OTHER;
+
+    OSNumber* usage_page = OSDynamicCast(OSNumber, getProperty(kIOHIDPrimaryUsagePageKey));
+    OSNumber* usage = OSDynamicCast(OSNumber, getProperty(kIOHIDPrimaryUsageKey));
+
+    if (usage_page && usage) {
+        switch (usage_page->unsigned32BitValue()) {
+            case kHIDPage_Digitizer:
+                priority = usage->unsigned32BitValue() == kHIDUsage_Dig_Pen ? kVoodooI2CHIDBusPriorityPen : kVoodooI2CHIDBusPriorityTouch;
+                budget = 0;
+                break;
+            case kHIDPage_GenericDesktop:
+                // Mice and keyboards are just as latency sensitive as touch
+
+                priority = kVoodooI2CHIDBusPriorityTouch;
+                budget = 0;
+                break;
+            case kHIDPage_Sensor:
+                priority = kVoodooI2CHIDBusPrioritySensor;
+                budget = I2C_HID_BUS_BUDGET_SENSOR;
+                break;
+            default:
+                break;
+        }
+    }
+
+    OSNumber* budget_override = OSDynamicCast(OSNumber, getProperty("BusBandwidthBudget"));
+    if (budget_override)
+        budget = budget_override->unsigned32BitValue();
+
+    VoodooI2CHIDBusArbiter* arbiter = VoodooI2CHIDBusArbiter::arbiterForController(api->getProvider());
+    if (!arbiter) {
+        IOLog("%s::%s Could not get bus arbiter, transfers will not be arbitrated\n", getName(), name);
+        return;
+    }
+
+    arbiter->registerClient(&bus_client, priority, budget);
+    __atomic_store_n(&bus_arbiter, arbiter, __ATOMIC_RELEASE);
+}
+
 void VoodooI2CHIDDevice::stop(IOService* provider) {
     IOLockLock(client_lock);
     for(;;) {
@@ -615,44 +2241,234 @@ void VoodooI2CHIDDevice::stop(IOService* provider) {
     super::stop(provider);
 }
 
+void VoodooI2CHIDDevice::publishStatistics(bool force) {
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+
+    if (!force && elapsedNanoseconds(statistics_last_publish, now) < 1000000000)
+        return;
+
+    statistics_last_publish = now;
+
+    OSDictionary* queue = OSDictionary::withCapacity(11);
+    if (!queue)
+        return;
+
+    setDictionaryNumber(queue, "Overflows", report_ring_overflows);
+    setDictionaryNumber(queue, "InvalidReports", invalid_reports);
+    setDictionaryNumber(queue, "LostReports", lost_reports);
+    setDictionaryNumber(queue, "ReportErrors", report_errors);
+    setDictionaryNumber(queue, "Consumed", report_ring_consumed);
+    setDictionaryNumber(queue, "MaxDepth", report_ring_max_depth);
+    setDictionaryNumber(queue, "MaxLagUs", report_ring_max_lag / 1000);
+    setDictionaryNumber(queue, "SkippedInterrupts", __atomic_load_n(&interrupts_skipped, __ATOMIC_RELAXED));
+    setDictionaryNumber(queue, "DeferredReads", __atomic_load_n(&interrupts_deferred, __ATOMIC_RELAXED));
+    setDictionaryNumber(queue, "BusBytes", bus_bytes_read);
+    setDictionaryNumber(queue, "UsefulBytes", useful_bytes_read);
+    setDictionaryNumber(queue, "ReadSizeMispredictions", read_size_mispredictions);
+
+    setProperty("InputReportQueue", queue);
+    queue->release();
+
+    OSDictionary* arena = OSDictionary::withCapacity(3);
+    if (!arena)
+        return;
+
+    setDictionaryNumber(arena, "HighWater", transfer_arena.high_water);
+    setDictionaryNumber(arena, "Wraps", transfer_arena.wraps);
+    setDictionaryNumber(arena, "Failures", transfer_arena.failures + input_arena.failures);
+
+    setProperty("TransferArena", arena);
+    arena->release();
+
+    OSDictionary* latency = OSDictionary::withCapacity(3);
+    if (!latency)
+        return;
+
+    const char* stages[] = {"InterruptToRead", "ReadToDispatch", "InterruptToDispatch"};
+    VoodooI2CHIDLatencyHistogram* histograms[] = {&latency_interrupt_to_read, &latency_read_to_dispatch, &latency_interrupt_to_dispatch};
+
+    for (int i = 0; i < 3; i++) {
+        OSDictionary* histogram = histograms[i]->copyDictionary();
+        if (histogram) {
+            latency->setObject(stages[i], histogram);
+            histogram->release();
+        }
+    }
+
+    setProperty("InputLatency", latency);
+    latency->release();
+
+    OSArray* histogram = OSArray::withCapacity(I2C_HID_DRAIN_BUDGET + 1);
+    if (!histogram)
+        return;
+
+    for (int i = 0; i <= I2C_HID_DRAIN_BUDGET; i++) {
+        OSNumber* number = OSNumber::withNumber(drain_histogram[i], 64);
+        if (number) {
+            histogram->setObject(number);
+            number->release();
+        }
+    }
+
+    setProperty("ReportsPerWakeup", histogram);
+    histogram->release();
+
+    accountActivity(now);
+
+    OSDictionary* activity = OSDictionary::withCapacity(5);
+    if (!activity)
+        return;
+
+    setDictionaryNumber(activity, "InterruptWakeups", input_activity.interrupt_wakeups);
+    setDictionaryNumber(activity, "PollWakeups", input_activity.poll_wakeups);
+    setDictionaryNumber(activity, "BusyTimeMs", input_activity.busy_time / 1000000);
+    setDictionaryNumber(activity, "IdleTimeMs", input_activity.idle_time / 1000000);
+    setDictionaryNumber(activity, "LastActivityAgeMs", elapsedNanoseconds(input_activity.accounted_activity, now) / 1000000);
+
+    setProperty("InputActivity", activity);
+    activity->release();
+
+    if (!bus_arbiter)
+        return;
+
+    OSDictionary* bus = OSDictionary::withCapacity(7);
+    if (!bus)
+        return;
+
+    setDictionaryNumber(bus, "Priority", bus_client.priority);
+    setDictionaryNumber(bus, "BudgetBytesPerSecond", bus_client.budget);
+    setDictionaryNumber(bus, "Grants", bus_client.grants);
+    setDictionaryNumber(bus, "Contended", bus_client.contended);
+    setDictionaryNumber(bus, "OverBudget", bus_client.over_budget);
+    setDictionaryNumber(bus, "Bytes", bus_client.bytes);
+
+    OSDictionary* wait = bus_client.wait.copyDictionary();
+    if (wait) {
+        bus->setObject("WaitLatency", wait);
+        wait->release();
+    }
+
+    setProperty("BusArbitration", bus);
+    bus->release();
+}
+
 IOReturn VoodooI2CHIDDevice::newReportDescriptor(IOMemoryDescriptor** descriptor) const {
     if (!hid_descriptor.wReportDescLength) {
         IOLog("%s::%s Invalid report descriptor size\n", getName(), name);
         return kIOReturnDeviceError;
     }
-    
-    I2C_LOCK();
-
-    VoodooI2CHIDDeviceCommand command;
-    command.c.reg = hid_descriptor.wReportDescRegister;
-    
-    UInt8* buffer = reinterpret_cast<UInt8*>(IOMalloc(hid_descriptor.wReportDescLength));
-    memset(buffer, 0, hid_descriptor.wReportDescLength);
-
-    if (api->writeReadI2C(command.data, 2, buffer, hid_descriptor.wReportDescLength) != kIOReturnSuccess) {
-        I2C_UNLOCK();
-        IOFree(buffer, hid_descriptor.wReportDescLength);
-        IOLog("%s::%s Could not get report descriptor\n", getName(), name);
-        return kIOReturnIOError;
-    }
 
     IOBufferMemoryDescriptor* report_descriptor = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, hid_descriptor.wReportDescLength);
 
     if (!report_descriptor) {
-        I2C_UNLOCK();
-        IOFree(buffer, hid_descriptor.wReportDescLength);
         IOLog("%s::%s Could not allocated buffer for report descriptor\n", getName(), name);
         return kIOReturnNoResources;
     }
 
-    report_descriptor->writeBytes(0, buffer, hid_descriptor.wReportDescLength);
+    UInt8* buffer = reinterpret_cast<UInt8*>(report_descriptor->getBytesNoCopy());
+
+    if (copyCachedReportDescriptor(&hid_descriptor, buffer)) {
+        descriptor_cache_hit = true;
+
+        // Make sure the device still matches what we cached once it has settled
+
+        if (descriptor_verifier)
+            descriptor_verifier->setTimeoutMS(I2C_HID_DESCRIPTOR_VERIFY_DELAY_MS);
+    } else {
+        memset(buffer, 0, hid_descriptor.wReportDescLength);
+
+        if (readReportDescriptor(buffer) != kIOReturnSuccess) {
+            report_descriptor->release();
+            IOLog("%s::%s Could not get report descriptor\n", getName(), name);
+            return kIOReturnIOError;
+        }
+
+        cacheReportDescriptor(&hid_descriptor, buffer);
+    }
+
     *descriptor = report_descriptor;
-    
+
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooI2CHIDDevice::readReportDescriptor(UInt8* buffer) const {
+    AbsoluteTime start, end;
+    clock_get_uptime(&start);
+
+    I2C_LOCK();
+
+    VoodooI2CHIDDeviceCommand command;
+    command.c.reg = hid_descriptor.wReportDescRegister;
+
+    IOReturn ret = writeReadI2C(command.data, 2, buffer, hid_descriptor.wReportDescLength);
+
     I2C_UNLOCK();
 
+    clock_get_uptime(&end);
+    descriptor_fetch_time = elapsedNanoseconds(start, end);
+
+    return ret;
+}
+
+void VoodooI2CHIDDevice::verifyReportDescriptor(OSObject* owner, IOTimerEventSource* timer) {
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+
+    // Don't hold the bus for a whole report descriptor read while the device is in use
+
+    if (input_activity.last_report && elapsedNanoseconds(input_activity.last_report, now) < I2C_HID_POLL_BUSY_WINDOW_MS * 1000000ULL) {
+        descriptor_verifier->setTimeoutMS(I2C_HID_DESCRIPTOR_VERIFY_DELAY_MS);
+        return;
+    }
+
+    UInt8* buffer = reinterpret_cast<UInt8*>(IOMalloc(hid_descriptor.wReportDescLength));
+    if (!buffer)
+        return;
+
+    memset(buffer, 0, hid_descriptor.wReportDescLength);
+
+    if (readReportDescriptor(buffer) == kIOReturnSuccess) {
+        if (!cachedReportDescriptorMatches(&hid_descriptor, buffer)) {
+            IOLog("%s::%s Report descriptor changed since it was cached, dropping the cached copy\n", getName(), name);
+            invalidateCachedReportDescriptor(&hid_descriptor);
+            descriptor_cache_mismatches++;
+
+            // Carry on with what the device reports now. The elements were built from the stale descriptor and stay
+            // as they are until the device is started again, which reads the descriptor over the bus.
+
+            OSData* published = OSData::withBytes(buffer, hid_descriptor.wReportDescLength);
+            if (published) {
+                setProperty(kIOHIDReportDescriptorKey, published);
+                published->release();
+            }
+
+            if (learned_read_sizing && countInputReportIDs(buffer, hid_descriptor.wReportDescLength) > 1) {
+                learned_read_sizing = false;
+                IOLog("%s::%s Device has several input reports, learned read sizing disabled\n", getName(), name);
+            }
+        }
+
+        descriptor_cache_verified = true;
+    }
+
     IOFree(buffer, hid_descriptor.wReportDescLength);
 
-    return kIOReturnSuccess;
+    publishDescriptorCacheStatistics();
+}
+
+void VoodooI2CHIDDevice::publishDescriptorCacheStatistics() {
+    OSDictionary* cache = OSDictionary::withCapacity(4);
+    if (!cache)
+        return;
+
+    cache->setObject("Hit", descriptor_cache_hit ? kOSBooleanTrue : kOSBooleanFalse);
+    cache->setObject("Verified", descriptor_cache_verified ? kOSBooleanTrue : kOSBooleanFalse);
+    setDictionaryNumber(cache, "Mismatches", descriptor_cache_mismatches);
+    setDictionaryNumber(cache, "FetchTimeUs", descriptor_fetch_time / 1000);
+
+    setProperty("ReportDescriptorCache", cache);
+    cache->release();
 }
 
 OSNumber* VoodooI2CHIDDevice::newVendorIDNumber() const {
@@ -676,28 +2492,113 @@ OSString* VoodooI2CHIDDevice::newManufacturerString() const {
 }
 
 void VoodooI2CHIDDevice::simulateInterrupt(OSObject* owner, IOTimerEventSource* timer) {
-    AbsoluteTime prev_time = last_multi_touch_event;
-    if (!read_in_progress && awake) {
-        VoodooI2CHIDDevice::getInputReport();
+    UInt32 drained = 0;
+
+    input_activity.poll_wakeups++;
+
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+    __atomic_store_n(&interrupt_time, now, __ATOMIC_RELAXED);
+
+    if (!read_in_progress && awake)
+        drained = getInputReport();
+
+    interrupt_simulator->setTimeoutUS(nextPollingInterval(drained));
+
+    publishStatistics();
+}
+
+void VoodooI2CHIDDevice::accountActivity(AbsoluteTime now) {
+    // Nothing happened since the last call other than what is recorded in <accounted_activity>, so the device
+    // was busy until the busy window following that activity expired and idle afterwards
+
+    if (input_activity.accounted_until) {
+        uint64_t elapsed = elapsedNanoseconds(input_activity.accounted_until, now);
+        uint64_t busy = 0;
+
+        if (input_activity.accounted_activity) {
+            uint64_t since_activity = elapsedNanoseconds(input_activity.accounted_activity, input_activity.accounted_until);
+
+            if (since_activity < I2C_HID_POLL_BUSY_WINDOW_MS * 1000000ULL)
+                busy = I2C_HID_POLL_BUSY_WINDOW_MS * 1000000ULL - since_activity;
+            if (busy > elapsed)
+                busy = elapsed;
+        }
+
+        input_activity.busy_time += busy;
+        input_activity.idle_time += elapsed - busy;
     }
-    
-    if (last_multi_touch_event == 0) {
-        interrupt_simulator->setTimeoutMS(INTERRUPT_SIMULATOR_TIMEOUT);
-        return;
+
+    AbsoluteTime last_activity = __atomic_load_n(&input_activity.last_activity, __ATOMIC_RELAXED);
+
+    input_activity.accounted_until = now;
+    input_activity.accounted_activity = input_activity.last_report > last_activity ? input_activity.last_report : last_activity;
+}
+
+void VoodooI2CHIDDevice::reportInputActivity() {
+    AbsoluteTime now;
+    clock_get_uptime(&now);
+
+    __atomic_store_n(&input_activity.last_activity, now, __ATOMIC_RELAXED);
+}
+
+UInt32 VoodooI2CHIDDevice::nextPollingInterval(UInt32 drained) {
+    AbsoluteTime now, last_activity;
+    clock_get_uptime(&now);
+
+    if (drained) {
+        uint64_t interval = elapsedNanoseconds(polling_last_report, now);
+
+        // Only consecutive reports of the same burst say anything about the rate at which the device reports
+
+        if (polling_last_report && interval < I2C_HID_POLL_INTERVAL_IDLE_MAX_US * 1000ULL)
+            polling_report_interval = polling_report_interval ? (3 * polling_report_interval + interval) / 4 : interval;
+
+        polling_last_report = now;
     }
-    
-    IOSleep(1);
-    if (last_multi_touch_event != prev_time) {
-        interrupt_simulator->setTimeoutMS(INTERRUPT_SIMULATOR_TIMEOUT_BUSY);
-        return;
+
+    last_activity = polling_last_report;
+    if (input_activity.last_activity > last_activity)
+        last_activity = __atomic_load_n(&input_activity.last_activity, __ATOMIC_RELAXED);
+
+    uint64_t idle = elapsedNanoseconds(last_activity, now);
+
+    accountActivity(now);
+
+    // Pick up the reset acknowledgement as soon as it is there
+
+    if (reset_state == kVoodooI2CHIDResetPending)
+        return I2C_HID_POLL_INTERVAL_MIN_US;
+
+    if (last_activity && idle < I2C_HID_POLL_BUSY_WINDOW_MS * 1000000ULL) {
+        polling_idle_interval = I2C_HID_POLL_INTERVAL_IDLE_MIN_US;
+
+        // The device is still backed up, come straight back for the rest of the frame
+
+        if (drained >= 2)
+            return I2C_HID_POLL_INTERVAL_MIN_US;
+
+        // Sampling at half the device's own report period bounds the added latency to a quarter period on average
+
+        UInt32 interval = polling_report_interval ? (UInt32)(polling_report_interval / 2000) : I2C_HID_POLL_INTERVAL_BUSY_US;
+
+        if (interval < I2C_HID_POLL_INTERVAL_MIN_US)
+            interval = I2C_HID_POLL_INTERVAL_MIN_US;
+        if (interval > I2C_HID_POLL_INTERVAL_BUSY_US)
+            interval = I2C_HID_POLL_INTERVAL_BUSY_US;
+
+        return interval;
     }
-        
-    uint64_t        nsecs;
-    AbsoluteTime    cur_time;
-    clock_get_uptime(&cur_time);
-    SUB_ABSOLUTETIME(&cur_time, &last_multi_touch_event);
-    absolutetime_to_nanoseconds(cur_time, &nsecs);
-    interrupt_simulator->setTimeoutMS((nsecs > 1500000000) ? INTERRUPT_SIMULATOR_TIMEOUT_IDLE : INTERRUPT_SIMULATOR_TIMEOUT_BUSY);
+
+    // Idle, back off exponentially so that an untouched device costs close to no wakeups
+
+    UInt32 interval = polling_idle_interval;
+
+    polling_idle_interval *= 2;
+    if (polling_idle_interval > I2C_HID_POLL_INTERVAL_IDLE_MAX_US)
+        polling_idle_interval = I2C_HID_POLL_INTERVAL_IDLE_MAX_US;
+
+    return interval;
 }
 
 bool VoodooI2CHIDDevice::open(IOService *forClient, IOOptionBits options, void *arg) {
@@ -15,21 +15,56 @@
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 #include <IOKit/IOInterruptEventSource.h>
 #include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/hid/IOHIDDevice.h>
 #include <IOKit/hid/IOHIDElement.h>
 #include "../../../Dependencies/helpers.hpp"
 
-#define INTERRUPT_SIMULATOR_TIMEOUT 5
-#define INTERRUPT_SIMULATOR_TIMEOUT_BUSY 2
-#define INTERRUPT_SIMULATOR_TIMEOUT_IDLE 50
+#include "VoodooI2CHIDBusArbiter.hpp"
+#include "VoodooI2CHIDLatencyHistogram.hpp"
+#include "VoodooI2CHIDLog.hpp"
+#include "VoodooI2CHIDTraceRing.hpp"
+#include "VoodooI2CHIDTransferArena.hpp"
+
+#define I2C_HID_POLL_INTERVAL_MIN_US        1000
+#define I2C_HID_POLL_INTERVAL_BUSY_US       4000
+#define I2C_HID_POLL_INTERVAL_IDLE_MIN_US   8000
+#define I2C_HID_POLL_INTERVAL_IDLE_MAX_US   100000
+#define I2C_HID_POLL_BUSY_WINDOW_MS         1500
+
+#define I2C_HID_DESCRIPTOR_VERIFY_DELAY_MS  5000
+
+#define I2C_HID_LEARNED_WINDOW_REPORTS      64
 
 #define I2C_HID_PWR_ON  0x00
 #define I2C_HID_PWR_SLEEP 0x01
 
+#define I2C_HID_RESET_TIMEOUT_MS        6000
+#define I2C_HID_POWER_RETRY_DELAY_MS    100
+#define I2C_HID_RESUME_READY_TIMEOUT_MS 250
+
+#define I2C_HID_SET_REPORT_QUIET_MS     10
+#define I2C_HID_SET_REPORT_MAX_HEADER   6
+
+#define I2C_HID_STORM_WINDOW_MS         100
+#define I2C_HID_STORM_MIN_INTERRUPTS    200
+#define I2C_HID_STORM_REPORT_RATIO      4
+#define I2C_HID_STORM_BACKOFF_MIN_MS    500
+#define I2C_HID_STORM_BACKOFF_MAX_MS    32000
+#define I2C_HID_STORM_PROBATION_MS      10000
+
+#define I2C_HID_RECOVERY_RETRIES        3
+#define I2C_HID_RECOVERY_RETRY_MS       10
+#define I2C_HID_RECOVERY_POWER_OFF_MS   20
+#define I2C_HID_RECOVERY_RESET_MIN_MS   1000
+#define I2C_HID_RECOVERY_RESET_MAX_MS   30000
+
 #define I2C_MAX_BUF_SIZE            0x400
-#define I2C_LOCK()                  IOLockLock(read_in_progress_mutex)
-#define I2C_UNLOCK()                IOLockUnlock(read_in_progress_mutex)
-#define I2C_TRYLOCK()               IOLockTryLock(read_in_progress_mutex)
+#define I2C_HID_REPORT_RING_SIZE    16
+#define I2C_HID_DRAIN_BUDGET        8
+#define I2C_LOCK()                  lockI2C()
+#define I2C_UNLOCK()                unlockI2C()
+#define I2C_TRYLOCK()               tryLockI2C()
 
 #define EXPORT __attribute__((visibility("default")))
 
@@ -59,6 +94,159 @@ typedef struct __attribute__((__packed__)) {
     UInt32 reserved;
 } VoodooI2CHIDDeviceHIDDescriptor;
 
+/* Per-device input activity
+ *
+ * <last_activity> is written by the event drivers, everything else is only touched on the work loop.
+ */
+
+typedef struct {
+    AbsoluteTime last_activity;
+    AbsoluteTime last_report;
+    AbsoluteTime accounted_until;
+    AbsoluteTime accounted_activity;
+    uint64_t busy_time;
+    uint64_t idle_time;
+    UInt64 interrupt_wakeups;
+    UInt64 poll_wakeups;
+} VoodooI2CHIDDeviceActivity;
+
+/* Progress of a host initiated reset
+ *
+ * A reset is <kVoodooI2CHIDResetPending> from the moment the reset command is written until the device either
+ * acknowledges it or the timeout expires.
+ */
+
+typedef enum {
+    kVoodooI2CHIDResetIdle = 0,
+    kVoodooI2CHIDResetPending,
+    kVoodooI2CHIDResetAcknowledged,
+    kVoodooI2CHIDResetTimedOut
+} VoodooI2CHIDDeviceResetState;
+
+/* Timing of the last host initiated reset, in nanoseconds */
+
+typedef struct {
+    AbsoluteTime start;
+    uint64_t power_on;
+    uint64_t command;
+    uint64_t acknowledge;
+    UInt32 resets;
+    UInt32 timeouts;
+} VoodooI2CHIDDeviceResetTiming;
+
+/* Timing of the last wake, in nanoseconds since the device was powered on */
+
+typedef struct {
+    AbsoluteTime start;
+    bool awaiting_report;
+    uint64_t ready;
+    uint64_t first_report;
+    uint64_t max_first_report;
+    UInt32 resumes;
+} VoodooI2CHIDDeviceResumeTiming;
+
+/* Interrupt storm detection and mitigation state
+ *
+ * The window members are updated atomically by <interruptOccured>, which may run on several CPUs at once, and only
+ * reset by the work loop before it clears <active>. <valid_reports> is only written with <read_in_progress_mutex>
+ * held and everything else only on the work loop. <active> hands the interrupt over from one to the other.
+ */
+
+typedef struct {
+    bool active;
+    AbsoluteTime window_start;
+    UInt32 window_interrupts;
+    UInt64 window_reports;
+    UInt64 valid_reports;
+    AbsoluteTime recovered;
+    UInt32 backoff_ms;
+    UInt64 storms;
+    UInt64 masks;
+    UInt64 polling_switches;
+    UInt64 resets;
+    UInt64 unmasks;
+    UInt64 ignored_interrupts;
+} VoodooI2CHIDDeviceInterruptStorm;
+
+/* Escalation steps of the transfer error recovery
+ *
+ * Recovery starts at <kVoodooI2CHIDRecoveryRetrying> on the first failed input transfer and moves one step up
+ * each time the previous one did not bring the device back. A power cycle spans two timer steps so that the device
+ * stays off for <I2C_HID_RECOVERY_POWER_OFF_MS> without blocking the work loop. Resets are repeated with a growing delay.
+ */
+
+typedef enum {
+    kVoodooI2CHIDRecoveryHealthy = 0,
+    kVoodooI2CHIDRecoveryRetrying,
+    kVoodooI2CHIDRecoveryPowerCycling,
+    kVoodooI2CHIDRecoveryPoweredOff,
+    kVoodooI2CHIDRecoveryResetting
+} VoodooI2CHIDDeviceRecoveryState;
+
+/* Transfer error recovery state, times in nanoseconds
+ *
+ * <consecutive_errors> and <transfer_errors> are only written with <read_in_progress_mutex> held, everything else is
+ * only touched on the work loop.
+ */
+
+typedef struct {
+    UInt32 consecutive_errors;
+    UInt64 transfer_errors;
+    VoodooI2CHIDDeviceRecoveryState state;
+    UInt32 attempts;
+    UInt32 reset_delay_ms;
+    AbsoluteTime unavailable_since;
+    uint64_t downtime;
+    uint64_t last_time_to_recover;
+    uint64_t max_time_to_recover;
+    UInt64 episodes;
+    UInt64 retries;
+    UInt64 power_cycles;
+    UInt64 resets;
+    UInt64 descriptor_changes;
+    UInt64 recoveries;
+} VoodooI2CHIDDeviceRecovery;
+
+/* A get or set report request waiting in the command queue
+ *
+ * Synchronous requests have no <completion> and are waited for by the submitting thread, asynchronous requests are
+ * owned by the queue and completed through <completion>.
+ */
+
+typedef enum {
+    kVoodooI2CHIDCommandGetReport = 0,
+    kVoodooI2CHIDCommandSetReport
+} VoodooI2CHIDDeviceCommandType;
+
+typedef enum {
+    kVoodooI2CHIDCommandPriorityHigh = 0,
+    kVoodooI2CHIDCommandPriorityNormal,
+    kVoodooI2CHIDCommandPriorityCount
+} VoodooI2CHIDDeviceCommandPriority;
+
+typedef struct VoodooI2CHIDDeviceCommandRequest {
+    struct VoodooI2CHIDDeviceCommandRequest* next;
+    VoodooI2CHIDDeviceCommandType type;
+    IOMemoryDescriptor* report;
+    IOHIDReportType report_type;
+    IOOptionBits options;
+    UInt32 timeout_ms;
+    IOHIDCompletion completion;
+    bool asynchronous;
+    bool done;
+    IOReturn status;
+    AbsoluteTime queued;
+} VoodooI2CHIDDeviceCommandRequest;
+
+/* A raw input report as read off the bus, including its two byte length prefix */
+
+typedef struct {
+    UInt8* data;
+    UInt16 length;
+    AbsoluteTime timestamp;
+    AbsoluteTime interrupt_time;
+} VoodooI2CHIDDeviceReportSlot;
+
 class VoodooI2CDeviceNub;
 
 /* Implements an I2C-HID device as specified by Microsoft's protocol in the following document: http://download.microsoft.com/download/7/D/D/7DD44BB7-2A7A-4505-AC1C-7227D3D96D5B/hid-over-i2c-protocol-spec-v1-0.docx
@@ -109,7 +297,32 @@ class EXPORT VoodooI2CHIDDevice : public IOHIDDevice {
 
     IOReturn getHIDDescriptorAddress();
     
-    IOReturn getReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options);
+    /* Issues an I2C-HID get report command.
+     * @report A buffer to receive the report
+     * @reportType The type of HID report to be requested
+     * @options Options for the report, the first two bytes are the report ID
+     *
+     * The command is queued behind pending input, see <queueCommand>.
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnBusy* if issued from the work loop while the bus is quiet after
+     * a set report, an error returned by the I2C controller otherwise
+     */
+
+    IOReturn getReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options) override;
+
+    /* Asynchronous variant of <getReport>
+     * @completionTimeout If the call is synchronous, how long to wait in milliseconds for the command to run, *0* for no limit
+     * @completion Called on the work loop once the command completed, if *NULL* the call is synchronous
+     */
+
+    IOReturn getReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options, UInt32 completionTimeout, IOHIDCompletion* completion) override;
+
+    /* Asynchronous variant of <setReport>
+     * @completionTimeout If the call is synchronous, how long to wait in milliseconds for the command to run, *0* for no limit
+     * @completion Called on the work loop once the command completed, if *NULL* the call is synchronous
+     */
+
+    IOReturn setReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options, UInt32 completionTimeout, IOHIDCompletion* completion) override;
     
     IOReturn parseHIDDescriptor();
 
@@ -136,6 +349,13 @@ class EXPORT VoodooI2CHIDDevice : public IOHIDDevice {
 
     bool handleStart(IOService* provider);
     
+    /* Polls the device for input reports when no interrupt could be registered
+     * @owner The owner of the timer event source
+     * @timer The timer event source that fired
+     *
+     * This function runs on the work loop and must never sleep. The next deadline is chosen by <nextPollingInterval>.
+     */
+
     void simulateInterrupt(OSObject* owner, IOTimerEventSource* timer);
     
     /* Sets a few properties that are needed after <IOHIDDevice> finishes starting
@@ -201,6 +421,34 @@ class EXPORT VoodooI2CHIDDevice : public IOHIDDevice {
     bool open(IOService *forClient, IOOptionBits options = 0, void *arg = 0) override;
     void close(IOService *forClient, IOOptionBits options) override;
 
+    /* Notifies the device that one of its event drivers has processed user input
+     *
+     * Keeps the polling scheduler of this device, and only this device, at the busy rate while it is in use.
+     * This function may be called from any thread.
+     */
+
+    void reportInputActivity();
+
+    /* Waits for the device to complete the reset issued when it was last powered on
+     * @timeout_ms The maximum time to wait for in milliseconds
+     *
+     * Event drivers that need to talk to the device on wake should call this instead of sleeping for a fixed time.
+     *
+     * @return *kIOReturnSuccess* if the device is ready, *kIOReturnTimeout* otherwise
+     */
+
+    IOReturn waitForDeviceReady(UInt32 timeout_ms);
+
+    /* Handles property changes from user space
+     * @properties OSDictionary of configured properties
+     *
+     * Setting "DumpTransactionTrace" publishes the current content of the trace ring as the "TransactionTrace" property.
+     *
+     * @return *kIOReturnSuccess* if the properties are received successfully, otherwise the result of <IOHIDDevice::setProperties>
+     */
+
+    IOReturn setProperties(OSObject* properties) override;
+
  protected:
     bool awake;
     
@@ -211,13 +459,32 @@ class EXPORT VoodooI2CHIDDevice : public IOHIDDevice {
 
     IOReturn resetHIDDeviceGated();
 
-    /* Issues an I2C-HID reset command.
+    /* Issues an I2C-HID reset command and waits for the device to acknowledge it.
      *
      * @return *kIOReturnSuccess* on successful reset, *kIOReturnTimeout* otherwise
      */
 
     IOReturn resetHIDDevice();
 
+    /* Powers the device on and issues an I2C-HID reset command without waiting for it to complete
+     *
+     * This function must be called from within the command gate. The reset completes on the work loop as soon as
+     * the device acknowledges it, or when <I2C_HID_RESET_TIMEOUT_MS> expires.
+     *
+     * @return *kIOReturnSuccess* if the reset command was sent, an error returned by the I2C controller otherwise
+     */
+
+    IOReturn startResetGated();
+
+    /* Powers the device back on after sleep
+     *
+     * This function must be called from within the command gate. It starts a reset and the resume timing.
+     *
+     * @return *kIOReturnSuccess* if the reset command was sent, an error returned by the I2C controller otherwise
+     */
+
+    IOReturn resumeGated();
+
     /* Issues an I2C-HID power state command.
      * @state The power state that the device should enter
      *
@@ -242,10 +509,13 @@ class EXPORT VoodooI2CHIDDevice : public IOHIDDevice {
      * @reportType The type of HID report to be sent
      * @options Options for the report, the first two bytes are the report ID
      *
-     * @return *kIOReturnSuccess* on successful power state change, *kIOReturnTimeout* otherwise
+     * The command is queued behind pending input, see <queueCommand>.
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnBusy* if issued from the work loop while the bus is quiet after
+     * a previous set report, an error returned by the I2C controller otherwise
      */
 
-    IOReturn setReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options);
+    IOReturn setReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options) override;
     
  private:
     IOACPIPlatformDevice* acpi_device;
@@ -255,27 +525,230 @@ class EXPORT VoodooI2CHIDDevice : public IOHIDDevice {
     IOTimerEventSource* interrupt_simulator;
     bool ready_for_input;
     bool reset_event;
+    VoodooI2CHIDDeviceResetState reset_state;
+    VoodooI2CHIDDeviceResetTiming reset_timing;
+    IOTimerEventSource* reset_timer;
+    VoodooI2CHIDDeviceResumeTiming resume_timing;
     IOWorkLoop* work_loop;
     bool read_in_progress;
     IOLock* read_in_progress_mutex;
 
     /* Buffers for <api->readI2C>, <api->writeI2C>, <api->writeReadI2C>
      *
-     * Since the functions may use the buffers even after the end of calls,
-     * the buffers need to be kept after calls.
+     * Every section holding <read_in_progress_mutex> is a transaction of <transfer_arena>. <input_arena> is only used
+     * by <readInputReport> for reports that don't fit into the report ring, each read being its own transaction.
+     */
+
+    mutable VoodooI2CHIDTransferArena transfer_arena;
+    VoodooI2CHIDTransferArena input_arena;
+
+    /* Takes <read_in_progress_mutex> and starts a <transfer_arena> transaction */
+
+    void lockI2C() const;
+
+    /* Tries to take <read_in_progress_mutex>, starting a <transfer_arena> transaction on success
+     *
+     * @return *true* if the lock was taken, *false* otherwise
+     */
+
+    bool tryLockI2C() const;
+
+    /* Lock-free trace of every bus transaction, see <VoodooI2CHIDTraceRing> */
+
+    mutable VoodooI2CHIDTraceRing trace_ring;
+    mutable UInt32 lock_wait;
+
+    /* Records a bus transaction in the trace ring
+     * @start The uptime at which the transaction started
      */
 
-    UInt16 buf_i2c_cnt_intr, buf_i2c_cnt;
-    UInt8* buf_i2c_pool_intr, *buf_i2c_pool;
-    UInt8* getMallocI2CIntr(UInt16 size);
-    UInt8* getMallocI2C(UInt16 size);
+    void traceTransaction(VoodooI2CHIDDeviceTraceOperation operation, UInt16 reg, UInt16 write_length, UInt16 read_length, IOReturn status, AbsoluteTime start) const;
+
+    /* Traced wrappers around <api->readI2C>, <api->writeI2C> and <api->writeReadI2C> */
+
+    IOReturn readI2C(UInt8* values, UInt16 length) const;
+
+    IOReturn writeI2C(UInt8* values, UInt16 length) const;
+
+    IOReturn writeReadI2C(UInt8* write_buffer, UInt16 write_length, UInt8* read_buffer, UInt16 read_length) const;
+
+    /* Publishes the trace ring as the "TransactionTrace" property and the records it dropped as "TransactionTraceDropped"
+     *
+     * Tools/VoodooI2CHIDTraceDecoder turns the former into a timeline.
+     */
+
+    void dumpTransactionTrace();
+
+    /* Descriptor handed to <handleReport> for every input report
+     *
+     * Only <consumeInputReports> uses it and <handleReport> consumes the report synchronously so a single
+     * descriptor sized from <hid_descriptor.wMaxInputLength> is allocated in <handleStart> and recycled for every report.
+     */
+
+    IOBufferMemoryDescriptor* input_report_buffer;
+
+    /* Single-producer/single-consumer ring of raw input reports
+     *
+     * <getInputReport> reads reports off the bus and publishes them by advancing <report_ring_head>. Producers are
+     * serialised by <read_in_progress_mutex>. <consumeInputReports> runs on the work loop, parses and dispatches the
+     * reports and advances <report_ring_tail>.
+     */
+
+    VoodooI2CHIDDeviceReportSlot report_ring[I2C_HID_REPORT_RING_SIZE];
+    UInt8* report_ring_pool;
+    UInt16 report_ring_slot_size;
+    UInt32 report_ring_head;
+    UInt32 report_ring_tail;
+    UInt32 reset_ring_mark;
+    IOInterruptEventSource* report_consumer;
+    bool reset_response_pending;
+
+    UInt64 report_ring_overflows;
+    UInt64 invalid_reports;
+    UInt64 lost_reports;
+    UInt64 report_errors;
+    UInt64 report_ring_consumed;
+    UInt32 report_ring_max_depth;
+    UInt64 report_ring_max_lag;
+    AbsoluteTime statistics_last_publish;
+
+    /* Number of wakeups that drained exactly `i` reports, indexed by `i` */
+
+    UInt64 drain_histogram[I2C_HID_DRAIN_BUDGET + 1];
+
+    /* Polling scheduler state, only used by <simulateInterrupt> on the work loop */
+
+    AbsoluteTime polling_last_report;
+    uint64_t polling_report_interval;
+    UInt32 polling_idle_interval;
+
+    /* Chooses the next polling deadline
+     * @drained The number of reports read by the poll that just completed
+     *
+     * While the device is in use the deadline tracks the observed report rate of the device, bounded by
+     * <I2C_HID_POLL_INTERVAL_MIN_US> and <I2C_HID_POLL_INTERVAL_BUSY_US>. Once the device has been idle for
+     * <I2C_HID_POLL_BUSY_WINDOW_MS> the interval backs off exponentially up to <I2C_HID_POLL_INTERVAL_IDLE_MAX_US>.
+     *
+     * @return The next polling interval in microseconds
+     */
+
+    UInt32 nextPollingInterval(UInt32 drained);
+
+    VoodooI2CHIDDeviceActivity input_activity;
+
+    /* Accumulates the time spent busy or idle since the last call
+     * @now The current uptime
+     *
+     * A device is busy for <I2C_HID_POLL_BUSY_WINDOW_MS> after each input report or event driver activity.
+     * This function must be called on the work loop.
+     */
+
+    void accountActivity(AbsoluteTime now);
 
     /* Queries the I2C-HID device for an input report
      *
      * This function is called from the interrupt handler in a new thread. It is thus not called from interrupt context.
+     * Reports are drained off the bus until the input register is empty or <I2C_HID_DRAIN_BUDGET> reports have been read.
+     * They are only published to the report ring, parsing happens in <consumeInputReports>.
+     *
+     * @return The number of reports read
+     */
+
+    UInt32 getInputReport();
+
+    /* Uptime at which the interrupt line was last asserted or the polling timer last fired, and its value for the
+     * reports currently being drained by <getInputReport>
+     */
+
+    AbsoluteTime interrupt_time;
+    AbsoluteTime drain_interrupt_time;
+
+    /* Input latency, from the interrupt to the end of the read, from the end of the read to the end of
+     * <handleReport> and end to end
+     */
+
+    VoodooI2CHIDLatencyHistogram latency_interrupt_to_read;
+    VoodooI2CHIDLatencyHistogram latency_read_to_dispatch;
+    VoodooI2CHIDLatencyHistogram latency_interrupt_to_dispatch;
+
+    /* Interrupts that could not be serviced because another thread held <read_in_progress_mutex>
+     *
+     * <interruptOccured> sets <interrupt_pending> before trying to take the lock and <getInputReport> clears it once it
+     * has the lock. Whoever releases the lock with an interrupt still pending triggers <deferred_reader>, so no
+     * interrupt is ever dropped. The counters are bumped atomically from interrupt context and whichever thread
+     * unlocks.
+     */
+
+    mutable bool interrupt_pending;
+    mutable UInt64 interrupts_skipped;
+    mutable UInt64 interrupts_deferred;
+    IOInterruptEventSource* deferred_reader;
+
+    /* Releases <read_in_progress_mutex> and schedules a read for an interrupt that arrived while it was held */
+
+    void unlockI2C() const;
+
+    /* Reads the input reports of an interrupt that was skipped because of lock contention
+     *
+     * This function runs on the work loop and is triggered by <unlockI2C> through <deferred_reader>.
+     */
+
+    void readDeferredInput(OSObject* owner, IOInterruptEventSource* src, int intCount);
+
+    /* Reads a single input report off the bus and publishes it to the report ring
+     * @first *true* if this is the first read since the interrupt was asserted
+     *
+     * This function must be called with <read_in_progress_mutex> held.
+     *
+     * A zero-length report only acknowledges a reset while one is pending, and only if it was read first. If it was read
+     * again after a report that was cut short, that report is counted in <lost_reports>.
+     *
+     * @return The size of the report read, *0* if the input register was empty, *-1* on error or if the report was invalid,
+     * *-2* if the transfer itself failed
+     */
+
+    int readInputReport(bool first);
+
+    /* Learned read sizing
+     *
+     * Enabled by the "LearnedReadSizing" personality property, and only kept by <start> for devices with at most
+     * one input report ID since the next report of a device with several cannot be predicted. Instead of
+     * <hid_descriptor.wMaxInputLength> bytes, <readInputReport> reads <learned_length> bytes, the longest report
+     * of the previous window of <I2C_HID_LEARNED_WINDOW_REPORTS> reports, so that it shrinks back after a burst of
+     * long reports. If the length prefix shows the report was cut short, that report is dropped, the input register
+     * is read again at full length and the longer length is used right away.
      */
 
-    void getInputReport();
+    bool learned_read_sizing;
+    UInt16 learned_length;
+    UInt16 learned_window_max;
+    UInt32 learned_window_reports;
+    UInt64 bus_bytes_read;
+    UInt64 useful_bytes_read;
+    UInt64 read_size_mispredictions;
+
+    /* Parses and dispatches the input reports published to the report ring
+     *
+     * A report published at or past <reset_ring_mark> also acknowledges a pending reset, for devices that never send
+     * the zero-length acknowledgement.
+     *
+     * This function runs on the work loop and is triggered by <getInputReport> through <report_consumer>.
+     */
+
+    void consumeInputReports(OSObject* owner, IOInterruptEventSource* src, int intCount);
+
+    /* Discards the reports published to the report ring that have not been consumed yet, counting them as lost
+     *
+     * This function must be called with <read_in_progress_mutex> held, from the work loop.
+     */
+
+    void dropInputReports();
+
+    /* Publishes the transport statistics to the IORegistry
+     * @force Publish even if the statistics were published less than a second ago
+     */
+
+    void publishStatistics(bool force = false);
 
     /*
     * This function is called when the I2C-HID device asserts its interrupt line.
@@ -290,6 +763,237 @@ class EXPORT VoodooI2CHIDDevice : public IOHIDDevice {
      */
 
     void releaseResources();
+
+    /* Command queue
+     *
+     * Get and set report commands are queued and run one at a time on the work loop by <runCommands>. Input takes
+     * priority: pending interrupts are serviced before every command and no command starts before <bus_quiet_until>,
+     * which replaces the sleep that used to follow every set report with the lock held. Power and reset commands run
+     * within the command gate and thus always go ahead of queued commands.
+     */
+
+    VoodooI2CHIDDeviceCommandRequest* command_queue_head[kVoodooI2CHIDCommandPriorityCount];
+    VoodooI2CHIDDeviceCommandRequest* command_queue_tail[kVoodooI2CHIDCommandPriorityCount];
+    IOInterruptEventSource* command_dispatcher;
+    IOTimerEventSource* command_timer;
+    AbsoluteTime bus_quiet_until;
+    UInt32 command_queue_depth;
+    UInt32 command_queue_max_depth;
+    UInt64 commands_completed;
+    UInt64 commands_timed_out;
+    uint64_t command_max_wait;
+    uint64_t command_max_bus_hold;
+
+    /* Queues a get or set report command
+     * @completionTimeout How long a synchronous caller waits for the command to run, in milliseconds, *0* for no limit
+     * @completion If *NULL*, waits for the command to complete
+     *
+     * Commands issued from the work loop itself, for example by an event driver while it handles a report, run
+     * immediately since the queue could never make progress while they wait. While the bus is quiet after a set
+     * report, asynchronous ones are queued behind <command_timer> instead and synchronous ones fail with
+     * *kIOReturnBusy* rather than stall the work loop. A synchronous command still queued when <completionTimeout>
+     * expires is taken off the queue and never sent.
+     *
+     * @return The status of the command if synchronous, *kIOReturnSuccess* if an asynchronous command was queued,
+     * *kIOReturnBusy* as described above, *kIOReturnTimeout* if a synchronous command timed out, an error otherwise
+     */
+
+    IOReturn queueCommand(VoodooI2CHIDDeviceCommandType type, IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options, UInt32 completionTimeout, IOHIDCompletion* completion);
+
+    IOReturn queueCommandGated(VoodooI2CHIDDeviceCommandRequest* request);
+
+    /* Runs queued commands in priority order until the queue is empty or the bus needs to stay quiet
+     *
+     * This function runs on the work loop.
+     */
+
+    void runCommands();
+
+    void dispatchCommands(OSObject* owner, IOInterruptEventSource* src, int intCount);
+
+    void dispatchCommandsAfterQuiet(OSObject* owner, IOTimerEventSource* timer);
+
+    /* Completes every queued command with *kIOReturnAborted* */
+
+    void abortCommandsGated();
+
+    /* Performs the bus transfer of a command
+     *
+     * @return *kIOReturnSuccess* on success, an error returned by the I2C controller otherwise
+     */
+
+    IOReturn executeCommand(VoodooI2CHIDDeviceCommandType type, IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options);
+
+    IOReturn transferGetReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options);
+
+    IOReturn transferSetReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options);
+
+    /* Encodes everything a set report command sends ahead of the report itself
+     * @header A buffer of at least *sizeof(VoodooI2CHIDDeviceCommand) + I2C_HID_SET_REPORT_MAX_HEADER* bytes
+     * @raw_report_type The I2C-HID report type
+     * @report_id The report ID
+     * @report_length The length of the report
+     *
+     * The header is the command register and opcode, the optional extended report ID, the data register, the length
+     * and the report ID.
+     *
+     * @return The length of the header
+     */
+
+    UInt8 encodeSetReportHeader(UInt8* header, UInt8 raw_report_type, UInt8 report_id, UInt16 report_length);
+
+    UInt64 set_reports;
+    UInt64 set_report_bytes_copied;
+
+    /* Publishes the command queue statistics to the IORegistry */
+
+    void publishCommandStatistics();
+
+    /* Completes a pending host initiated reset
+     * @state Either *kVoodooI2CHIDResetAcknowledged* or *kVoodooI2CHIDResetTimedOut*
+     *
+     * This function runs on the work loop. It does nothing if no reset is pending.
+     */
+
+    void completeReset(VoodooI2CHIDDeviceResetState state);
+
+    IOReturn waitForDeviceReadyGated(UInt32* timeout_ms);
+
+    /* Publishes the timing of the last wake to the IORegistry */
+
+    void publishResumeTiming();
+
+    /* Called by <reset_timer> when the device did not acknowledge a reset in time */
+
+    void resetTimedOut(OSObject* owner, IOTimerEventSource* timer);
+
+    /* Report descriptor cache state
+     *
+     * <newReportDescriptor> is const, hence the mutable members.
+     */
+
+    IOTimerEventSource* descriptor_verifier;
+    mutable bool descriptor_cache_hit;
+    bool descriptor_cache_verified;
+    UInt32 descriptor_cache_mismatches;
+    mutable uint64_t descriptor_fetch_time;
+    AbsoluteTime probe_time;
+
+    /* Reads the report descriptor over the bus
+     * @buffer A buffer of at least <hid_descriptor.wReportDescLength> bytes
+     *
+     * @return *kIOReturnSuccess* on success, an error returned by the I2C controller otherwise
+     */
+
+    IOReturn readReportDescriptor(UInt8* buffer) const;
+
+    /* Checks in the background that a report descriptor served from the cache still matches the device
+     *
+     * This function runs on the work loop some time after <newReportDescriptor> was served from the cache. If the
+     * device's descriptor changed, the cache entry is dropped and the new descriptor is published. The device keeps
+     * running with the elements it was started with, state derived from the descriptor is updated in place.
+     */
+
+    void verifyReportDescriptor(OSObject* owner, IOTimerEventSource* timer);
+
+    /* Publishes the report descriptor cache statistics to the IORegistry */
+
+    void publishDescriptorCacheStatistics();
+
+    /* Interrupt storm state
+     *
+     * Some controllers leave the interrupt line asserted after a bus error, each interrupt then costs a full read
+     * that returns nothing. <interruptOccured> compares the interrupt rate against the rate of valid reports and
+     * triggers <storm_mitigator> when the former runs away.
+     */
+
+    VoodooI2CHIDDeviceInterruptStorm storm;
+    IOInterruptEventSource* storm_mitigator;
+    IOTimerEventSource* storm_timer;
+
+    /* Accounts an interrupt to the current storm detection window
+     * @now The time the interrupt was asserted
+     *
+     * This function must only be called from <interruptOccured>.
+     *
+     * @return *true* if the window that just closed was a storm, *false* otherwise
+     */
+
+    bool detectInterruptStorm(AbsoluteTime now);
+
+    /* Masks the interrupt and switches to polling until <storm_timer> expires
+     *
+     * The time spent polling doubles each time a storm starts again within <I2C_HID_STORM_PROBATION_MS> of the
+     * last recovery, up to <I2C_HID_STORM_BACKOFF_MAX_MS>. This function runs on the work loop.
+     */
+
+    void mitigateInterruptStorm(OSObject* owner, IOInterruptEventSource* src, int intCount);
+
+    /* Resets the device, stops polling and unmasks the interrupt once the backoff has expired
+     *
+     * The interrupt stays masked if the device went to sleep meanwhile, <resumeGated> arms the backoff again.
+     */
+
+    void recoverFromInterruptStorm(OSObject* owner, IOTimerEventSource* timer);
+
+    /* Publishes the interrupt storm statistics to the IORegistry */
+
+    void publishStormStatistics();
+
+    /* Transfer error recovery state
+     *
+     * <getInputReport> counts failed transfers and triggers <recovery_trigger> whenever the device stops or starts
+     * answering again. <recovery_timer> drives the escalation in between.
+     */
+
+    VoodooI2CHIDDeviceRecovery recovery;
+    IOInterruptEventSource* recovery_trigger;
+    IOTimerEventSource* recovery_timer;
+
+    /* Starts or completes a recovery depending on whether input transfers are currently failing
+     *
+     * This function runs on the work loop and is triggered by <getInputReport> through <recovery_trigger>.
+     */
+
+    void updateRecovery(OSObject* owner, IOInterruptEventSource* src, int intCount);
+
+    /* Takes the next recovery step and probes the input register to see whether it helped */
+
+    void escalateRecovery(OSObject* owner, IOTimerEventSource* timer);
+
+    /* Fetches the HID descriptor again and applies it if it changed
+     * @changed Set to *true* if a changed descriptor was applied, may be *NULL*
+     *
+     * This function runs on the work loop. A changed descriptor is applied with the I2C lock held: the report ring
+     * and <input_report_buffer> are reallocated if the maximum input length grew, reports still in the ring are
+     * dropped and the descriptor is parsed and published again. The report descriptor and the elements built from it
+     * stay as they are until the device is enumerated again.
+     *
+     * @return *kIOReturnSuccess* if the descriptor is unchanged or was applied, *kIOReturnIOError* if the request failed,
+     * *kIOReturnNoMemory* if the buffers could not be grown, *kIOReturnInvalid* if the new descriptor is malformed
+     */
+
+    IOReturn refetchHIDDescriptor(bool* changed = NULL);
+
+    /* Publishes the transfer error recovery statistics to the IORegistry */
+
+    void publishRecoveryStatistics();
+
+    /* Shared bus arbitration
+     *
+     * Devices on the same controller take turns through <bus_arbiter>, see <VoodooI2CHIDBusArbiter>. Transfers made
+     * before <registerWithBusArbiter> are not arbitrated.
+     */
+
+    VoodooI2CHIDBusArbiter* bus_arbiter;
+    mutable VoodooI2CHIDBusClient bus_client;
+
+    /* Registers with the arbiter of the controller, in a latency class derived from the primary usage
+     *
+     * The budget of the class can be overridden with the *BusBandwidthBudget* property, in bytes per second.
+     */
+
+    void registerWithBusArbiter();
 };
 
 
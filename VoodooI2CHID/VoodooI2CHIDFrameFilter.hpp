@@ -0,0 +1,90 @@
+//
+//  VoodooI2CHIDFrameFilter.hpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDFrameFilter_hpp
+#define VoodooI2CHIDFrameFilter_hpp
+
+#include <IOKit/IOLib.h>
+#include <kern/clock.h>
+
+#include "VoodooI2CHIDLatencyHistogram.hpp"
+
+// Unchanged frames are still forwarded this often while a contact is down
+#define kFrameKeepaliveMs 50
+
+/* Change detection of the frames a digitiser hands to the multitouch interface
+ *
+ * A frame is forwarded when a contact or the contact count changed since the last forwarded frame, or when its owner
+ * flagged a change of its own in <dirty>. Unchanged frames are suppressed, except that resting contacts are still
+ * forwarded every <keepalive_ms> so that nothing downstream takes them for lifted. The filter does no locking of its
+ * own.
+ */
+
+class VoodooI2CHIDFrameFilter {
+ public:
+    /* Forgets the last forwarded frame and clears the counters */
+
+    void reset() {
+        dirty = false;
+        forwarded_frames = 0;
+        suppressed_frames = 0;
+        forwarded_contact_count = 0;
+        last_forward = 0;
+    }
+
+    /* Decides whether a complete frame has to be forwarded
+     * @contacts_changed Whether a contact changed since the last frame
+     * @contact_count The number of contacts the frame reports
+     * @any_down Whether a contact of the frame has its tip switch down
+     * @now The current time
+     *
+     * @return *true* if the frame has to be forwarded, *false* if it can be suppressed
+     */
+
+    bool shouldForward(bool contacts_changed, UInt8 contact_count, bool any_down, AbsoluteTime now) const {
+        if (dirty || contacts_changed || contact_count != forwarded_contact_count)
+            return true;
+
+        return any_down && elapsedNanoseconds(last_forward, now) >= keepalive_ms * 1000000ULL;
+    }
+
+    /* Records that a frame was forwarded
+     * @contact_count The number of contacts the frame reported
+     * @when When the frame was handed over
+     */
+
+    void recordForwarded(UInt8 contact_count, AbsoluteTime when) {
+        forwarded_contact_count = contact_count;
+        last_forward = when;
+        forwarded_frames++;
+        dirty = false;
+    }
+
+    /* Records that a frame was suppressed */
+
+    void recordSuppressed() {
+        suppressed_frames++;
+        dirty = false;
+    }
+
+    /* Set by the owner when something outside the contacts changed, such as the stylus or a button */
+
+    bool dirty = false;
+
+    /* How often unchanged frames are forwarded while a contact is down, *0* to forward every frame while one is */
+
+    UInt32 keepalive_ms = kFrameKeepaliveMs;
+
+    UInt64 forwarded_frames = 0;
+    UInt64 suppressed_frames = 0;
+
+ private:
+    UInt8 forwarded_contact_count = 0;
+    AbsoluteTime last_forward = 0;
+};
+
+#endif /* VoodooI2CHIDFrameFilter_hpp */
@@ -0,0 +1,141 @@
+//
+//  VoodooI2CHIDLatencyHistogram.hpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDLatencyHistogram_hpp
+#define VoodooI2CHIDLatencyHistogram_hpp
+
+#include <IOKit/IOLib.h>
+#include <kern/clock.h>
+
+#define I2C_HID_LATENCY_SUB_BUCKETS     4
+#define I2C_HID_LATENCY_BUCKETS         92
+
+/* Returns the time elapsed between two uptimes in nanoseconds, *0* if <now> is not after <since> */
+
+static inline uint64_t elapsedNanoseconds(AbsoluteTime since, AbsoluteTime now) {
+    uint64_t nsecs;
+
+    if (now <= since)
+        return 0;
+
+    SUB_ABSOLUTETIME(&now, &since);
+    absolutetime_to_nanoseconds(now, &nsecs);
+
+    return nsecs;
+}
+
+/* Log-bucketed histogram of latencies in microseconds
+ *
+ * Every power of two is split into <I2C_HID_LATENCY_SUB_BUCKETS> buckets so percentiles are accurate to within 25%.
+ * Values up to 2^24 us are tracked, larger ones land in the last bucket. Recording is a handful of integer operations
+ * and never allocates. The histogram does no locking of its own.
+ */
+
+class VoodooI2CHIDLatencyHistogram {
+ public:
+    /* Clears the histogram */
+
+    void reset() {
+        memset(buckets, 0, sizeof(buckets));
+        count = 0;
+        max = 0;
+    }
+
+    /* Records a latency
+     * @latency The latency in nanoseconds
+     */
+
+    void record(uint64_t latency) {
+        uint64_t value = latency / 1000;
+
+        buckets[bucketForValue(value)]++;
+        count++;
+
+        if (value > max)
+            max = value;
+    }
+
+    /* Estimates a percentile
+     * @percentile The percentile, between 0 and 100
+     *
+     * @return The upper bound of the bucket containing the percentile in microseconds, capped to the maximum, *0* if
+     * nothing was recorded
+     */
+
+    uint64_t percentile(UInt32 percentile) const {
+        if (!count)
+            return 0;
+
+        uint64_t target = (count * percentile + 99) / 100;
+        uint64_t seen = 0;
+
+        for (int i = 0; i < I2C_HID_LATENCY_BUCKETS; i++) {
+            seen += buckets[i];
+
+            if (seen >= target && seen) {
+                // The last bucket also holds everything past the tracked range, only the maximum bounds it
+
+                uint64_t bound = i < I2C_HID_LATENCY_BUCKETS - 1 ? upperBoundForBucket(i) : max;
+                return bound < max ? bound : max;
+            }
+        }
+
+        return max;
+    }
+
+    /* Creates a dictionary with the count, the maximum and the 50th, 90th and 99th percentiles
+     *
+     * @return The dictionary, *NULL* on failure. The caller is responsible for releasing it.
+     */
+
+    OSDictionary* copyDictionary() const {
+        OSDictionary* dictionary = OSDictionary::withCapacity(5);
+        if (!dictionary)
+            return NULL;
+
+        const char* keys[] = {"Count", "P50Us", "P90Us", "P99Us", "MaxUs"};
+        uint64_t values[] = {count, percentile(50), percentile(90), percentile(99), max};
+
+        for (int i = 0; i < 5; i++) {
+            OSNumber* number = OSNumber::withNumber(values[i], 64);
+            if (number) {
+                dictionary->setObject(keys[i], number);
+                number->release();
+            }
+        }
+
+        return dictionary;
+    }
+
+    uint64_t count;
+    uint64_t max;
+
+ private:
+    UInt32 buckets[I2C_HID_LATENCY_BUCKETS];
+
+    static int bucketForValue(uint64_t value) {
+        if (value < I2C_HID_LATENCY_SUB_BUCKETS)
+            return (int)value;
+
+        int msb = 63 - __builtin_clzll(value);
+        int index = I2C_HID_LATENCY_SUB_BUCKETS + (msb - 2) * I2C_HID_LATENCY_SUB_BUCKETS + (int)((value >> (msb - 2)) & 3);
+
+        return index < I2C_HID_LATENCY_BUCKETS ? index : I2C_HID_LATENCY_BUCKETS - 1;
+    }
+
+    static uint64_t upperBoundForBucket(int index) {
+        if (index < I2C_HID_LATENCY_SUB_BUCKETS)
+            return index;
+
+        int msb = (index - I2C_HID_LATENCY_SUB_BUCKETS) / I2C_HID_LATENCY_SUB_BUCKETS + 2;
+        int sub = (index - I2C_HID_LATENCY_SUB_BUCKETS) % I2C_HID_LATENCY_SUB_BUCKETS;
+
+        return ((uint64_t)(I2C_HID_LATENCY_SUB_BUCKETS + sub + 1) << (msb - 2)) - 1;
+    }
+};
+
+#endif /* VoodooI2CHIDLatencyHistogram_hpp */
@@ -0,0 +1,76 @@
+//
+//  VoodooI2CHIDLog.hpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDLog_hpp
+#define VoodooI2CHIDLog_hpp
+
+#include <IOKit/IOLib.h>
+
+#include "VoodooI2CHIDLatencyHistogram.hpp"
+
+#define I2C_HID_LOG_INTERVAL_NS     1000000000ULL
+#define I2C_HID_LOG_BURST           5
+
+/* Token bucket limiting how often a single log call site may print
+ *
+ * A call site may print <I2C_HID_LOG_BURST> messages in a row, then one per <I2C_HID_LOG_INTERVAL_NS>. Messages
+ * that are dropped are counted and the count is printed with the next message that gets through. Concurrent
+ * callers may race on the bucket, which at worst lets an extra message through or miscounts a suppressed one.
+ */
+
+typedef struct {
+    AbsoluteTime last;
+    uint64_t credit;
+    UInt64 suppressed;
+
+    /* Takes a token from the bucket
+     * @suppressed Set to the number of messages dropped since the last one that got through
+     *
+     * @return *true* if the message may be printed, *false* otherwise
+     */
+
+    bool allow(UInt64* suppressed) {
+        AbsoluteTime now;
+        clock_get_uptime(&now);
+
+        credit = last ? credit + elapsedNanoseconds(last, now) : I2C_HID_LOG_BURST * I2C_HID_LOG_INTERVAL_NS;
+        if (credit > I2C_HID_LOG_BURST * I2C_HID_LOG_INTERVAL_NS)
+            credit = I2C_HID_LOG_BURST * I2C_HID_LOG_INTERVAL_NS;
+        last = now;
+
+        if (credit < I2C_HID_LOG_INTERVAL_NS) {
+            this->suppressed++;
+            return false;
+        }
+
+        credit -= I2C_HID_LOG_INTERVAL_NS;
+        *suppressed = this->suppressed;
+        this->suppressed = 0;
+
+        return true;
+    }
+} VoodooI2CHIDLogLimiter;
+
+/* IOLog for hot paths, rate limited per call site
+ *
+ * Evaluates to *true* if the message was printed. Every such message should be backed by a counter published to
+ * the IORegistry since most occurrences are never printed.
+ */
+
+#define IOLogLimited(fmt, ...) ({                                                               \
+    static VoodooI2CHIDLogLimiter _limiter;                                                     \
+    UInt64 _suppressed = 0;                                                                     \
+    bool _allowed = _limiter.allow(&_suppressed);                                               \
+    if (_allowed) {                                                                             \
+        IOLog(fmt, ##__VA_ARGS__);                                                              \
+        if (_suppressed)                                                                        \
+            IOLog("VoodooI2CHID: %llu similar messages suppressed\n", _suppressed);             \
+    }                                                                                           \
+    _allowed;                                                                                   \
+})
+
+#endif /* VoodooI2CHIDLog_hpp */
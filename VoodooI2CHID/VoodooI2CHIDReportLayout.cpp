@@ -0,0 +1,482 @@
+//
+//  VoodooI2CHIDReportLayout.cpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include "VoodooI2CHIDReportLayout.hpp"
+#include <IOKit/hid/IOHIDUsageTables.h>
+
+#define kHIDItemTypeMain            0
+#define kHIDItemTypeGlobal          1
+#define kHIDItemTypeLocal           2
+
+#define kHIDMainInput               0x8
+#define kHIDMainCollection          0xA
+#define kHIDMainEndCollection       0xC
+
+#define kHIDGlobalUsagePage         0x0
+#define kHIDGlobalLogicalMinimum    0x1
+#define kHIDGlobalReportSize        0x7
+#define kHIDGlobalReportID          0x8
+#define kHIDGlobalReportCount       0x9
+#define kHIDGlobalPush              0xA
+#define kHIDGlobalPop               0xB
+
+#define kHIDLocalUsage              0x0
+#define kHIDLocalUsageMinimum       0x1
+#define kHIDLocalUsageMaximum       0x2
+
+#define kHIDMainConstant            0x01
+#define kHIDMainVariable            0x02
+
+#define kHIDLayoutMaxUsages         32
+
+typedef struct {
+    UInt16 usage_page;
+    SInt32 logical_min;
+    UInt32 report_size;
+    UInt32 report_count;
+    UInt8 report_id;
+} VoodooI2CHIDReportLayoutGlobals;
+
+/* Maps a usage to the transducer member the element walk in <VoodooI2CMultitouchHIDEventDriver> updates for it */
+
+static UInt8 layoutTarget(UInt16 usage_page, UInt16 usage) {
+    switch (usage_page) {
+        case kHIDPage_GenericDesktop:
+            switch (usage) {
+                case kHIDUsage_GD_X:
+                    return kVoodooI2CHIDLayoutTargetX;
+                case kHIDUsage_GD_Y:
+                    return kVoodooI2CHIDLayoutTargetY;
+                case kHIDUsage_GD_Z:
+                    return kVoodooI2CHIDLayoutTargetZ;
+            }
+            break;
+        case kHIDPage_Button:
+            return usage >= 1 && usage <= 32 ? kVoodooI2CHIDLayoutTargetButton : kVoodooI2CHIDLayoutTargetUnsupported;
+        case kHIDPage_Digitizer:
+            switch (usage) {
+                case kHIDUsage_Dig_TransducerIndex:
+                case kHIDUsage_Dig_ContactIdentifier:
+                    return kVoodooI2CHIDLayoutTargetSecondaryID;
+                case kHIDUsage_Dig_Touch:
+                case kHIDUsage_Dig_TipSwitch:
+                    return kVoodooI2CHIDLayoutTargetTipSwitch;
+                case kHIDUsage_Dig_InRange:
+                    return kVoodooI2CHIDLayoutTargetInRange;
+                case kHIDUsage_Dig_TipPressure:
+                case kHIDUsage_Dig_SecondaryTipSwitch:
+                    return kVoodooI2CHIDLayoutTargetTipPressure;
+                case kHIDUsage_Dig_Azimuth:
+                    return kVoodooI2CHIDLayoutTargetAzimuth;
+                case kHIDUsage_Dig_Altitude:
+                    return kVoodooI2CHIDLayoutTargetAltitude;
+                case kHIDUsage_Dig_Width:
+                    return kVoodooI2CHIDLayoutTargetWidth;
+                case kHIDUsage_Dig_Height:
+                    return kVoodooI2CHIDLayoutTargetHeight;
+                case kHIDUsage_Dig_DataValid:
+                case kHIDUsage_Dig_TouchValid:
+                case kHIDUsage_Dig_Quality:
+                    return kVoodooI2CHIDLayoutTargetConfidence;
+
+                // Scaled or stylus only, left to the element walk
+
+                case kHIDUsage_Dig_XTilt:
+                case kHIDUsage_Dig_YTilt:
+                case kHIDUsage_Dig_Twist:
+                case kHIDUsage_Dig_BarrelPressure:
+                case kHIDUsage_Dig_BarrelSwitch:
+                case kHIDUsage_Dig_BatteryStrength:
+                case kHIDUsage_Dig_Eraser:
+                case kHIDUsage_Dig_Invert:
+                    return kVoodooI2CHIDLayoutTargetUnsupported;
+            }
+            break;
+    }
+
+    return kVoodooI2CHIDLayoutTargetNone;
+}
+
+bool VoodooI2CHIDReportLayout::compile(const UInt8* descriptor, UInt32 length, OSArray* fingers) {
+    VoodooI2CHIDReportLayoutGlobals globals = {0, 0, 0, 0, 0};
+    VoodooI2CHIDReportLayoutGlobals stack[I2C_HID_LAYOUT_STACK_DEPTH];
+    UInt32 stack_depth = 0;
+
+    UInt32 usages[kHIDLayoutMaxUsages];
+    UInt32 usage_count = 0;
+    UInt32 usage_min = 0, usage_max = 0;
+    bool has_usage_range = false;
+
+    UInt32 depth = 0;
+    bool in_digitiser = false;
+    SInt32 finger = -1;
+    UInt32 finger_depth = 0;
+    UInt32 next_finger = 0;
+    bool uses_report_ids = false;
+
+    UInt32 candidate_count = 0;
+    bool compiled = false;
+
+    free();
+
+    UInt32 finger_count = fingers->getCount();
+    if (finger_count > I2C_HID_LAYOUT_MAX_TRANSDUCERS)
+        return false;
+
+    UInt32* offsets = reinterpret_cast<UInt32*>(IOMalloc(256 * sizeof(UInt32)));
+    VoodooI2CHIDReportLayoutField* candidates = reinterpret_cast<VoodooI2CHIDReportLayoutField*>(IOMalloc(I2C_HID_LAYOUT_MAX_FIELDS * sizeof(VoodooI2CHIDReportLayoutField)));
+
+    if (!offsets || !candidates)
+        goto exit;
+
+    memset(offsets, 0, 256 * sizeof(UInt32));
+
+    for (UInt32 i = 0; i < length;) {
+        UInt8 prefix = descriptor[i];
+
+        // Long items are reserved and never used for anything we decode
+
+        if (prefix == 0xFE) {
+            if (i + 1 >= length)
+                goto exit;
+            i += 3 + descriptor[i + 1];
+            continue;
+        }
+
+        UInt32 size = prefix & 0x3;
+        if (size == 3)
+            size = 4;
+
+        if (i + 1 + size > length)
+            goto exit;
+
+        UInt32 data = 0;
+        for (UInt32 j = 0; j < size; j++)
+            data |= (UInt32)descriptor[i + 1 + j] << (8 * j);
+
+        SInt32 signed_data = (SInt32)data;
+        if (size && size < 4 && (data >> (8 * size - 1)) & 1)
+            signed_data = (SInt32)(data | (0xFFFFFFFF << (8 * size)));
+
+        UInt8 type = (prefix >> 2) & 0x3;
+        UInt8 tag = prefix >> 4;
+
+        i += 1 + size;
+
+        if (type == kHIDItemTypeGlobal) {
+            switch (tag) {
+                case kHIDGlobalUsagePage:
+                    globals.usage_page = data;
+                    break;
+                case kHIDGlobalLogicalMinimum:
+                    globals.logical_min = signed_data;
+                    break;
+                case kHIDGlobalReportSize:
+                    globals.report_size = data;
+                    break;
+                case kHIDGlobalReportID:
+                    globals.report_id = data;
+                    uses_report_ids = true;
+                    break;
+                case kHIDGlobalReportCount:
+                    globals.report_count = data;
+                    break;
+                case kHIDGlobalPush:
+                    if (stack_depth == I2C_HID_LAYOUT_STACK_DEPTH)
+                        goto exit;
+                    stack[stack_depth++] = globals;
+                    break;
+                case kHIDGlobalPop:
+                    if (!stack_depth)
+                        goto exit;
+                    globals = stack[--stack_depth];
+                    break;
+            }
+            continue;
+        }
+
+        if (type == kHIDItemTypeLocal) {
+            UInt32 usage = size == 4 ? data : (globals.usage_page << 16) | data;
+
+            switch (tag) {
+                case kHIDLocalUsage:
+                    if (usage_count < kHIDLayoutMaxUsages)
+                        usages[usage_count++] = usage;
+                    break;
+                case kHIDLocalUsageMinimum:
+                    usage_min = usage;
+                    has_usage_range = true;
+                    break;
+                case kHIDLocalUsageMaximum:
+                    usage_max = usage;
+                    has_usage_range = true;
+                    break;
+            }
+            continue;
+        }
+
+        if (type != kHIDItemTypeMain)
+            continue;
+
+        switch (tag) {
+            case kHIDMainCollection: {
+                UInt32 usage = usage_count ? usages[0] : 0;
+                UInt16 usage_page = usage >> 16;
+
+                // Same fingers <parseDigitizerElement> picks up: direct children of a digitiser application collection
+
+                if (!depth) {
+                    in_digitiser = usage_page == kHIDPage_Digitizer && ((usage & 0xFFFF) == kHIDUsage_Dig_Pen ||
+                        (usage & 0xFFFF) == kHIDUsage_Dig_TouchScreen || (usage & 0xFFFF) == kHIDUsage_Dig_TouchPad);
+                } else if (depth == 1 && in_digitiser && usage_page == kHIDPage_Digitizer && (usage & 0xFFFF) == kHIDUsage_Dig_Finger) {
+                    finger = next_finger++;
+                    finger_depth = depth;
+                }
+
+                depth++;
+                break;
+            }
+            case kHIDMainEndCollection:
+                if (!depth)
+                    goto exit;
+
+                depth--;
+                if (finger >= 0 && depth == finger_depth)
+                    finger = -1;
+                break;
+            case kHIDMainInput: {
+                UInt32 bits = globals.report_size * globals.report_count;
+
+                if (finger >= 0 && (UInt32)finger < finger_count && !(data & kHIDMainConstant)) {
+                    if (!(data & kHIDMainVariable) || globals.report_size > 32 || !globals.report_size)
+                        goto exit;
+
+                    for (UInt32 j = 0; j < globals.report_count; j++) {
+                        UInt32 usage;
+
+                        if (has_usage_range)
+                            usage = usage_min + j > usage_max ? usage_max : usage_min + j;
+                        else if (usage_count)
+                            usage = usages[j < usage_count ? j : usage_count - 1];
+                        else
+                            break;
+
+                        UInt8 target = layoutTarget(usage >> 16, usage & 0xFFFF);
+
+                        if (target == kVoodooI2CHIDLayoutTargetUnsupported)
+                            goto exit;
+
+                        if (target == kVoodooI2CHIDLayoutTargetNone)
+                            continue;
+
+                        if (candidate_count == I2C_HID_LAYOUT_MAX_FIELDS)
+                            goto exit;
+
+                        VoodooI2CHIDReportLayoutField* field = &candidates[candidate_count++];
+
+                        field->bit_offset = offsets[globals.report_id] + j * globals.report_size;
+                        field->bit_size = globals.report_size;
+                        field->is_signed = globals.logical_min < 0;
+                        field->transducer = finger;
+                        field->target = target;
+                        field->argument = target == kVoodooI2CHIDLayoutTargetButton ? (usage & 0xFFFF) - 1 : 0;
+                        field->report_id = globals.report_id;
+                        field->usage_page = usage >> 16;
+                        field->usage = usage & 0xFFFF;
+                        field->limit = 0;
+                    }
+                }
+
+                offsets[globals.report_id] += bits;
+                break;
+            }
+        }
+
+        usage_count = 0;
+        has_usage_range = false;
+    }
+
+    if (!candidate_count)
+        goto exit;
+
+    for (UInt32 i = 0; i < candidate_count; i++) {
+        UInt32 bit_offset = candidates[i].bit_offset + (uses_report_ids ? 8 : 0);
+
+        if ((bit_offset + candidates[i].bit_size + 7) / 8 > I2C_HID_LAYOUT_MAX_REPORT_LENGTH)
+            goto exit;
+
+        candidates[i].bit_offset = bit_offset;
+    }
+
+    if (!verify(candidates, candidate_count, fingers))
+        goto exit;
+
+    fields = reinterpret_cast<VoodooI2CHIDReportLayoutField*>(IOMalloc(candidate_count * sizeof(VoodooI2CHIDReportLayoutField)));
+    reports = reinterpret_cast<VoodooI2CHIDReportLayoutReport*>(IOMalloc(256 * sizeof(VoodooI2CHIDReportLayoutReport)));
+
+    if (!fields || !reports)
+        goto exit;
+
+    memset(reports, 0, 256 * sizeof(VoodooI2CHIDReportLayoutReport));
+
+    // Group the fields by report ID, keeping descriptor order within a report
+
+    for (UInt32 i = 0; i < candidate_count; i++) {
+        VoodooI2CHIDReportLayoutReport* report = &reports[candidates[i].report_id];
+        UInt16 end = (candidates[i].bit_offset + candidates[i].bit_size + 7) / 8;
+
+        report->count++;
+        if (end > report->length)
+            report->length = end;
+    }
+
+    for (UInt32 id = 0, first = 0; id < 256; id++) {
+        reports[id].first = first;
+        first += reports[id].count;
+        reports[id].count = 0;
+    }
+
+    for (UInt32 i = 0; i < candidate_count; i++) {
+        VoodooI2CHIDReportLayoutReport* report = &reports[candidates[i].report_id];
+        fields[report->first + report->count++] = candidates[i];
+    }
+
+    for (UInt32 id = 0; id < 256; id++)
+        detectStride(&reports[id]);
+
+    field_count = candidate_count;
+    compiled = true;
+
+exit:
+    if (offsets)
+        IOFree(offsets, 256 * sizeof(UInt32));
+
+    if (candidates)
+        IOFree(candidates, I2C_HID_LAYOUT_MAX_FIELDS * sizeof(VoodooI2CHIDReportLayoutField));
+
+    if (!compiled) {
+        if (fields) {
+            IOFree(fields, candidate_count * sizeof(VoodooI2CHIDReportLayoutField));
+            fields = NULL;
+        }
+
+        if (reports) {
+            IOFree(reports, 256 * sizeof(VoodooI2CHIDReportLayoutReport));
+            reports = NULL;
+        }
+    }
+
+    return compiled;
+}
+
+bool VoodooI2CHIDReportLayout::verify(VoodooI2CHIDReportLayoutField* candidates, UInt32 count, OSArray* fingers) {
+    UInt32 expected = 0;
+
+    for (UInt32 i = 0; i < fingers->getCount(); i++) {
+        IOHIDElement* finger = OSDynamicCast(IOHIDElement, fingers->getObject(i));
+        OSArray* children = finger ? finger->getChildElements() : NULL;
+
+        if (!children)
+            return false;
+
+        for (UInt32 j = 0; j < children->getCount(); j++) {
+            IOHIDElement* element = OSDynamicCast(IOHIDElement, children->getObject(j));
+
+            if (!element || element->getType() < kIOHIDElementTypeInput_Misc || element->getType() > kIOHIDElementTypeInput_ScanCodes)
+                continue;
+
+            UInt8 target = layoutTarget(element->getUsagePage(), element->getUsage());
+
+            if (target == kVoodooI2CHIDLayoutTargetUnsupported)
+                return false;
+
+            if (target == kVoodooI2CHIDLayoutTargetNone)
+                continue;
+
+            expected++;
+
+            VoodooI2CHIDReportLayoutField* match = NULL;
+
+            for (UInt32 k = 0; k < count && !match; k++) {
+                if (candidates[k].transducer == i && candidates[k].usage_page == element->getUsagePage() &&
+                    candidates[k].usage == element->getUsage())
+                    match = &candidates[k];
+            }
+
+            if (!match || match->report_id != element->getReportID() || match->bit_size != element->getReportSize())
+                return false;
+
+            if (target == kVoodooI2CHIDLayoutTargetTipPressure)
+                match->limit = element->getPhysicalMax();
+            else
+                match->limit = element->getLogicalMax();
+        }
+    }
+
+    // Anything the descriptor has that the elements don't means we misread it
+
+    return expected == count;
+}
+
+void VoodooI2CHIDReportLayout::detectStride(VoodooI2CHIDReportLayoutReport* report) {
+    const VoodooI2CHIDReportLayoutField* first = &fields[report->first];
+    UInt32 lanes = 0;
+    UInt32 lane_fields = 0;
+
+    report->stride = 0;
+    report->lanes = 0;
+
+    for (UInt32 i = 0; i < report->count; i++) {
+        if (first[i].transducer >= lanes)
+            lanes = first[i].transducer + 1;
+
+        if (first[i].transducer == 0)
+            lane_fields++;
+    }
+
+    if (lanes < 2 || !lane_fields || lane_fields * lanes != report->count)
+        return;
+
+    // The fingers are laid out one after the other, so finger n's fields follow finger n - 1's in descriptor order
+
+    if (first[lane_fields].bit_offset <= first[0].bit_offset)
+        return;
+
+    UInt32 stride = first[lane_fields].bit_offset - first[0].bit_offset;
+
+    for (UInt32 lane = 1; lane < lanes; lane++) {
+        for (UInt32 i = 0; i < lane_fields; i++) {
+            const VoodooI2CHIDReportLayoutField* field = &first[lane * lane_fields + i];
+            const VoodooI2CHIDReportLayoutField* model = &first[i];
+
+            if (field->transducer != lane ||
+                field->bit_offset != model->bit_offset + lane * stride ||
+                field->bit_size != model->bit_size ||
+                field->is_signed != model->is_signed ||
+                field->target != model->target ||
+                field->argument != model->argument)
+                return;
+        }
+    }
+
+    report->stride = stride;
+    report->lanes = lanes;
+}
+
+void VoodooI2CHIDReportLayout::free() {
+    if (fields) {
+        IOFree(fields, field_count * sizeof(VoodooI2CHIDReportLayoutField));
+        fields = NULL;
+    }
+
+    if (reports) {
+        IOFree(reports, 256 * sizeof(VoodooI2CHIDReportLayoutReport));
+        reports = NULL;
+    }
+
+    field_count = 0;
+}
@@ -0,0 +1,205 @@
+//
+//  VoodooI2CHIDReportLayout.hpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDReportLayout_hpp
+#define VoodooI2CHIDReportLayout_hpp
+
+#include <IOKit/IOLib.h>
+#include <IOKit/hid/IOHIDElement.h>
+
+#define I2C_HID_LAYOUT_MAX_FIELDS           256
+#define I2C_HID_LAYOUT_MAX_TRANSDUCERS      16
+#define I2C_HID_LAYOUT_MAX_REPORT_LENGTH    256
+#define I2C_HID_LAYOUT_STACK_DEPTH          4
+
+/* The transducer member a field is decoded into */
+
+typedef enum {
+    kVoodooI2CHIDLayoutTargetNone = 0,
+    kVoodooI2CHIDLayoutTargetX,
+    kVoodooI2CHIDLayoutTargetY,
+    kVoodooI2CHIDLayoutTargetZ,
+    kVoodooI2CHIDLayoutTargetButton,
+    kVoodooI2CHIDLayoutTargetSecondaryID,
+    kVoodooI2CHIDLayoutTargetTipSwitch,
+    kVoodooI2CHIDLayoutTargetInRange,
+    kVoodooI2CHIDLayoutTargetTipPressure,
+    kVoodooI2CHIDLayoutTargetAzimuth,
+    kVoodooI2CHIDLayoutTargetAltitude,
+    kVoodooI2CHIDLayoutTargetWidth,
+    kVoodooI2CHIDLayoutTargetHeight,
+    kVoodooI2CHIDLayoutTargetConfidence,
+    kVoodooI2CHIDLayoutTargetUnsupported
+} VoodooI2CHIDReportLayoutTarget;
+
+/* A single input field of a finger collection
+ *
+ * <bit_offset> counts from the start of the report including its report ID byte. <limit> is the logical maximum for
+ * coordinates and the physical maximum for pressure, as reported by the matching <IOHIDElement>.
+ */
+
+typedef struct {
+    UInt16 bit_offset;
+    UInt8 bit_size;
+    bool is_signed;
+    UInt8 transducer;
+    UInt8 target;
+    UInt8 argument;
+    UInt8 report_id;
+    UInt16 usage_page;
+    UInt16 usage;
+    UInt32 limit;
+} VoodooI2CHIDReportLayoutField;
+
+/* The fields of a single report ID
+ *
+ * When the report holds several identical finger collections back to back, as parallel mode devices send them,
+ * <lanes> is the number of fingers and <stride> the distance between them in bits. The fields of the first finger
+ * then describe every finger and the others are not looked at, otherwise <lanes> is *0*.
+ */
+
+typedef struct {
+    UInt16 first;
+    UInt16 count;
+    UInt16 length;
+    UInt16 stride;
+    UInt16 lanes;
+} VoodooI2CHIDReportLayoutReport;
+
+/* Decodes the finger collections of digitiser reports straight from the report bytes
+ *
+ * The layout is compiled once from the report descriptor into a flat table of fields per report ID, so that a report
+ * is decoded in a single pass instead of walking every <IOHIDElement> of every transducer. Only finger collections are
+ * compiled, and only if every field they contain is understood and matches the elements <IOHIDDevice> built. Anything
+ * else is left to the element walk.
+ */
+
+class VoodooI2CHIDReportLayout {
+ public:
+    /* Compiles the layout of the finger collections
+     * @descriptor The report descriptor
+     * @length The length of the report descriptor
+     * @fingers The finger collection elements, in descriptor order
+     *
+     * @return *true* if the layout was compiled, *false* if the fingers have to be decoded by walking their elements
+     */
+
+    bool compile(const UInt8* descriptor, UInt32 length, OSArray* fingers);
+
+    /* Frees the compiled layout */
+
+    void free();
+
+    /* Looks up the layout of a report
+     * @report_id The report ID
+     * @length The length of the report
+     *
+     * @return The layout, *NULL* if the report has no fields or is too short to hold them
+     */
+
+    const VoodooI2CHIDReportLayoutReport* layoutForReport(UInt32 report_id, UInt32 length) const {
+        if (!reports || report_id > 0xFF || !reports[report_id].count || length < reports[report_id].length)
+            return NULL;
+
+        return &reports[report_id];
+    }
+
+    /* The fields of a report whose layout was returned by <layoutForReport> */
+
+    const VoodooI2CHIDReportLayoutField* fieldsOf(const VoodooI2CHIDReportLayoutReport* report) const {
+        return &fields[report->first];
+    }
+
+    /* The number of bytes a report must have for its fields to be decoded */
+
+    UInt32 reportLength(UInt32 report_id) const {
+        return reports && report_id <= 0xFF ? reports[report_id].length : 0;
+    }
+
+    /* Extracts the value of a field, sign extended if its logical minimum is negative
+     * @report The report, at least as long as <fieldsForReport> requires
+     * @field The field
+     *
+     * @return The value as <IOHIDElement::getValue> would report it
+     */
+
+    static inline UInt32 extract(const UInt8* report, const VoodooI2CHIDReportLayoutField* field) {
+        const UInt8* bytes = report + (field->bit_offset >> 3);
+        UInt32 shift = field->bit_offset & 7;
+        UInt32 span = (shift + field->bit_size + 7) >> 3;
+        uint64_t raw = 0;
+
+        for (UInt32 i = 0; i < span; i++)
+            raw |= (uint64_t)bytes[i] << (8 * i);
+
+        uint64_t mask = (1ULL << field->bit_size) - 1;
+        raw = (raw >> shift) & mask;
+
+        if (field->is_signed && (raw >> (field->bit_size - 1)) & 1)
+            raw |= ~mask;
+
+        return (UInt32)raw;
+    }
+
+    /* Extracts a field of the first finger for every finger of a strided report
+     * @report The report, at least as long as <layoutForReport> requires
+     * @field The field of the first finger
+     * @stride The distance between fingers in bits
+     * @lanes The number of fingers
+     * @values Receives one value per finger
+     *
+     * Only unsigned 8 and 16 bit fields that start on a byte boundary and repeat at a whole number of bytes, which
+     * is what most devices use, take the fast path of loading their bytes directly. Those are plain scalar loads one
+     * finger at a time, not vector instructions, which the kext can't use here. Signed, unaligned and other sized
+     * fields go through <extract> one finger at a time, so the values are the same either way.
+     */
+
+    static inline void extractLanes(const UInt8* report, const VoodooI2CHIDReportLayoutField* field, UInt32 stride, UInt32 lanes, UInt32* values) {
+        if (!(field->bit_offset & 7) && !(stride & 7) && !field->is_signed) {
+            const UInt8* bytes = report + (field->bit_offset >> 3);
+            UInt32 step = stride >> 3;
+
+            if (field->bit_size == 8) {
+                for (UInt32 i = 0; i < lanes; i++, bytes += step)
+                    values[i] = bytes[0];
+                return;
+            }
+
+            if (field->bit_size == 16) {
+                for (UInt32 i = 0; i < lanes; i++, bytes += step)
+                    values[i] = bytes[0] | (bytes[1] << 8);
+                return;
+            }
+        }
+
+        VoodooI2CHIDReportLayoutField lane = *field;
+
+        for (UInt32 i = 0; i < lanes; i++, lane.bit_offset += stride)
+            values[i] = extract(report, &lane);
+    }
+
+    /* The number of compiled fields, *0* if nothing was compiled */
+
+    UInt32 field_count = 0;
+
+ private:
+    VoodooI2CHIDReportLayoutField* fields = NULL;
+    VoodooI2CHIDReportLayoutReport* reports = NULL;
+
+    /* Checks the compiled fields against the elements of the finger collections and picks up their limits
+     *
+     * @return *true* if every input element of every finger has exactly one matching field, *false* otherwise
+     */
+
+    bool verify(VoodooI2CHIDReportLayoutField* candidates, UInt32 count, OSArray* fingers);
+
+    /* Sets <stride> and <lanes> of a report if its fingers repeat the same fields at a constant distance */
+
+    void detectStride(VoodooI2CHIDReportLayoutReport* report);
+};
+
+#endif /* VoodooI2CHIDReportLayout_hpp */
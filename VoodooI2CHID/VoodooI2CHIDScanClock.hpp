@@ -0,0 +1,79 @@
+//
+//  VoodooI2CHIDScanClock.hpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDScanClock_hpp
+#define VoodooI2CHIDScanClock_hpp
+
+#include <IOKit/IOLib.h>
+#include <kern/clock.h>
+
+#include "VoodooI2CHIDLatencyHistogram.hpp"
+
+// Scan Time is counted in units of 100us and rolls over at 16 bits
+#define kScanTimeUnitNs 100000
+#define kScanTimeMask 0xFFFF
+
+// A derived timestamp lagging the transport's by more than this is re-anchored, covering idle gaps and clock drift
+#define kScanTimeMaxLagNs 20000000
+
+/* Derives the times at which a digitiser sampled its frames from their Scan Time usage
+ *
+ * Consecutive frames are spaced by their Scan Time difference, modulo the 16 bit roll over, starting from an anchor
+ * taken from the transport's timestamp. The clock is anchored again whenever the derived time would be after the
+ * transport's or lag it by more than <kScanTimeMaxLagNs>. The clock does no locking of its own.
+ */
+
+class VoodooI2CHIDScanClock {
+ public:
+    /* Forgets the anchor and clears <offset> */
+
+    void reset() {
+        last = 0;
+        anchor = 0;
+        offset.reset();
+    }
+
+    /* Derives the time at which a frame was sampled
+     * @scan_time The Scan Time value the frame carries
+     * @timestamp The timestamp of the report, as captured by the transport
+     *
+     * @return The derived timestamp, never after <timestamp>
+     */
+
+    AbsoluteTime sample(UInt32 scan_time, AbsoluteTime timestamp) {
+        UInt32 delta = (scan_time - last) & kScanTimeMask;
+        AbsoluteTime derived = anchor;
+
+        if (delta) {
+            AbsoluteTime interval;
+            nanoseconds_to_absolutetime((uint64_t)delta * kScanTimeUnitNs, &interval);
+            derived += interval;
+        }
+
+        // The device can't have sampled the frame after we were told about it
+
+        if (!anchor || derived > timestamp || elapsedNanoseconds(derived, timestamp) > kScanTimeMaxLagNs)
+            derived = timestamp;
+        else
+            offset.record(elapsedNanoseconds(derived, timestamp));
+
+        last = scan_time;
+        anchor = derived;
+
+        return derived;
+    }
+
+    /* How far the derived timestamps are ahead of the transport's */
+
+    VoodooI2CHIDLatencyHistogram offset;
+
+ private:
+    UInt32 last = 0;
+    AbsoluteTime anchor = 0;
+};
+
+#endif /* VoodooI2CHIDScanClock_hpp */
@@ -0,0 +1,126 @@
+//
+//  VoodooI2CHIDTraceRing.hpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDTraceRing_hpp
+#define VoodooI2CHIDTraceRing_hpp
+
+#include <IOKit/IOLib.h>
+
+#define I2C_HID_TRACE_SIZE              256
+#define I2C_HID_TRACE_BUSY              0xFFFFFFFF
+
+/* A bus transaction as recorded in the trace ring
+ *
+ * Records are dumped as-is into the "TransactionTrace" property, oldest first. All fields are little-endian and
+ * naturally aligned, times are in nanoseconds. <reg> is the register written ahead of the transfer, or the input
+ * register for plain reads. <lock_wait> is the time it took to acquire the I2C lock for the transaction the record
+ * is the first of, 0 otherwise.
+ */
+
+typedef enum {
+    kVoodooI2CHIDTraceRead = 1,
+    kVoodooI2CHIDTraceWrite,
+    kVoodooI2CHIDTraceWriteRead
+} VoodooI2CHIDDeviceTraceOperation;
+
+typedef struct {
+    UInt64 timestamp;
+    UInt32 sequence;
+    UInt32 lock_wait;
+    UInt32 duration;
+    SInt32 status;
+    UInt16 reg;
+    UInt16 write_length;
+    UInt16 read_length;
+    UInt8 operation;
+    UInt8 reserved;
+} VoodooI2CHIDDeviceTraceRecord;
+
+/* Fixed-size lock-free ring of bus transaction records
+ *
+ * Any number of writers may record at once, from any context. A writer draws the next sequence number, claims the
+ * record it maps to by swapping its sequence for <I2C_HID_TRACE_BUSY> and publishes it by storing its own sequence
+ * last. A record still claimed by a writer that was held up for a whole lap of the ring is not waited for, the newer
+ * record is dropped and counted instead. Readers copy a record and keep the copy only if its sequence was the one
+ * they expected both before and after, so they never see a record that is being written.
+ */
+
+class VoodooI2CHIDTraceRing {
+ public:
+    /* Clears the ring */
+
+    void reset() {
+        memset(records, 0, sizeof(records));
+        sequence = 0;
+        dropped = 0;
+    }
+
+    /* Records a transaction
+     * @entry The record, its sequence number is filled in
+     */
+
+    void record(VoodooI2CHIDDeviceTraceRecord* entry) {
+        UInt32 claimed;
+
+        // 0 marks a record never written and I2C_HID_TRACE_BUSY one being written, neither is a sequence number
+
+        do {
+            claimed = __atomic_add_fetch(&sequence, 1, __ATOMIC_RELAXED);
+        } while (!claimed || claimed == I2C_HID_TRACE_BUSY);
+
+        VoodooI2CHIDDeviceTraceRecord* slot = &records[claimed % I2C_HID_TRACE_SIZE];
+        UInt32 previous = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+
+        if (previous == I2C_HID_TRACE_BUSY || !__atomic_compare_exchange_n(&slot->sequence, &previous, I2C_HID_TRACE_BUSY, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        entry->sequence = I2C_HID_TRACE_BUSY;
+        memcpy(slot, entry, sizeof(*slot));
+        entry->sequence = claimed;
+
+        __atomic_store_n(&slot->sequence, claimed, __ATOMIC_RELEASE);
+    }
+
+    /* The sequence number of the latest record claimed, *0* if none was */
+
+    UInt32 last() const {
+        return __atomic_load_n(&sequence, __ATOMIC_ACQUIRE);
+    }
+
+    /* Copies a record out of the ring
+     * @number The sequence number of the record
+     * @copy Where to copy it
+     *
+     * @return *true* if the record was copied whole, *false* if it was overwritten, is being written or never was
+     */
+
+    bool read(UInt32 number, VoodooI2CHIDDeviceTraceRecord* copy) const {
+        const VoodooI2CHIDDeviceTraceRecord* slot = &records[number % I2C_HID_TRACE_SIZE];
+
+        if (!number || number == I2C_HID_TRACE_BUSY || __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != number)
+            return false;
+
+        memcpy(copy, slot, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        return __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == number && copy->sequence == number;
+    }
+
+    /* Records dropped because their slot was still being written */
+
+    UInt64 dropped;
+
+ private:
+    VoodooI2CHIDDeviceTraceRecord records[I2C_HID_TRACE_SIZE];
+    UInt32 sequence;
+};
+
+#endif /* VoodooI2CHIDTraceRing_hpp */
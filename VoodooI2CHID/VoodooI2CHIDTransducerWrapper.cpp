@@ -7,10 +7,185 @@
 //
 
 #include "VoodooI2CHIDTransducerWrapper.hpp"
+#include <IOKit/hid/IOHIDUsageTables.h>
 
 #define super OSObject
 OSDefineMetaClassAndStructors(VoodooI2CHIDTransducerWrapper, OSObject);
 
+static inline void setButton(DigitiserTransducerButtonState* state, UInt32 bit, UInt32 value, AbsoluteTime timestamp) {
+    UInt32 buttonMask = (1 << bit);
+
+    if (value != 0)
+        state->update(state->current.value |= buttonMask, timestamp);
+    else
+        state->update(state->current.value &= ~buttonMask, timestamp);
+}
+
+static void setX(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->coordinates.x.update(binding->element->getValue(), timestamp);
+}
+
+static void setY(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->coordinates.y.update(binding->element->getValue(), timestamp);
+}
+
+static void setZ(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->coordinates.z.update(binding->element->getValue(), timestamp);
+}
+
+static void setPhysicalButton(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    setButton(&transducer->physical_button, binding->argument, binding->element->getValue(), timestamp);
+}
+
+static void setSecondaryID(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->secondary_id = binding->element->getValue();
+}
+
+static void setTipSwitch(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    setButton(&transducer->tip_switch, 0, binding->element->getValue(), timestamp);
+}
+
+static void setInRange(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->in_range = binding->element->getValue() != 0;
+}
+
+static void setTipPressure(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->tip_pressure.update(binding->element->getValue(), timestamp);
+}
+
+static void setXTilt(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->tilt_orientation.x_tilt.update(binding->element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
+}
+
+static void setYTilt(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->tilt_orientation.y_tilt.update(binding->element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
+}
+
+static void setAzimuth(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->azi_alti_orientation.azimuth.update(binding->element->getValue(), timestamp);
+}
+
+static void setAltitude(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->azi_alti_orientation.altitude.update(binding->element->getValue(), timestamp);
+}
+
+static void setTwist(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->azi_alti_orientation.twist.update(binding->element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
+}
+
+static void setWidth(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->dimensions.width.update(binding->element->getValue(), timestamp);
+}
+
+static void setHeight(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->dimensions.height.update(binding->element->getValue(), timestamp);
+}
+
+static void setConfidence(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    transducer->is_valid = binding->element->getValue() != 0;
+}
+
+// The stylus setters are only bound to <VoodooI2CDigitiserStylus> transducers
+
+static void setBarrelPressure(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    static_cast<VoodooI2CDigitiserStylus*>(transducer)->barrel_pressure.update(binding->element->getScaledFixedValue(kIOHIDValueScaleTypeCalibrated), timestamp);
+}
+
+static void setBarrelSwitch(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    setButton(&static_cast<VoodooI2CDigitiserStylus*>(transducer)->barrel_switch, 1, binding->element->getValue(), timestamp);
+}
+
+static void setBatteryStrength(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    static_cast<VoodooI2CDigitiserStylus*>(transducer)->battery_strength = binding->element->getValue();
+}
+
+static void setEraser(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    VoodooI2CDigitiserStylus* stylus = static_cast<VoodooI2CDigitiserStylus*>(transducer);
+    UInt32 value = binding->element->getValue();
+
+    setButton(&stylus->eraser, 2, value, timestamp);
+    stylus->invert = value != 0;
+}
+
+static void setInvert(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp) {
+    static_cast<VoodooI2CDigitiserStylus*>(transducer)->invert = binding->element->getValue() != 0;
+}
+
+/* Resolves the setter of an element
+ * @element The element
+ * @is_stylus Whether the element belongs to a stylus
+ * @argument Set to the argument of the setter
+ *
+ * @return The setter, *NULL* if the element does not drive any transducer member
+ */
+
+static VoodooI2CHIDTransducerSetter bindingSetter(IOHIDElement* element, bool is_stylus, UInt32* argument) {
+    UInt32 usage = element->getUsage();
+
+    *argument = 0;
+
+    switch (element->getUsagePage()) {
+        case kHIDPage_GenericDesktop:
+            switch (usage) {
+                case kHIDUsage_GD_X:
+                    return setX;
+                case kHIDUsage_GD_Y:
+                    return setY;
+                case kHIDUsage_GD_Z:
+                    return setZ;
+            }
+            break;
+        case kHIDPage_Button:
+            *argument = usage - 1;
+            return setPhysicalButton;
+        case kHIDPage_Digitizer:
+            switch (usage) {
+                case kHIDUsage_Dig_TransducerIndex:
+                case kHIDUsage_Dig_ContactIdentifier:
+                    return setSecondaryID;
+                case kHIDUsage_Dig_Touch:
+                case kHIDUsage_Dig_TipSwitch:
+                    return setTipSwitch;
+                case kHIDUsage_Dig_InRange:
+                    return setInRange;
+                case kHIDUsage_Dig_TipPressure:
+                case kHIDUsage_Dig_SecondaryTipSwitch:
+                    return setTipPressure;
+                case kHIDUsage_Dig_XTilt:
+                    return setXTilt;
+                case kHIDUsage_Dig_YTilt:
+                    return setYTilt;
+                case kHIDUsage_Dig_Azimuth:
+                    return setAzimuth;
+                case kHIDUsage_Dig_Altitude:
+                    return setAltitude;
+                case kHIDUsage_Dig_Twist:
+                    return setTwist;
+                case kHIDUsage_Dig_Width:
+                    return setWidth;
+                case kHIDUsage_Dig_Height:
+                    return setHeight;
+                case kHIDUsage_Dig_DataValid:
+                case kHIDUsage_Dig_TouchValid:
+                case kHIDUsage_Dig_Quality:
+                    return setConfidence;
+                case kHIDUsage_Dig_BarrelPressure:
+                    return is_stylus ? setBarrelPressure : NULL;
+                case kHIDUsage_Dig_BarrelSwitch:
+                    return is_stylus ? setBarrelSwitch : NULL;
+                case kHIDUsage_Dig_BatteryStrength:
+                    return is_stylus ? setBatteryStrength : NULL;
+                case kHIDUsage_Dig_Eraser:
+                    return is_stylus ? setEraser : NULL;
+                case kHIDUsage_Dig_Invert:
+                    return is_stylus ? setInvert : NULL;
+            }
+            break;
+    }
+
+    return NULL;
+}
+
 bool VoodooI2CHIDTransducerWrapper::init() {
     if (!super::init())
         return false;
@@ -19,10 +194,16 @@ bool VoodooI2CHIDTransducerWrapper::init() {
     if (!transducers)
         return false;
 
+    bindings = NULL;
+    binding_table = NULL;
+    binding_capacity = 0;
+    bindings_capacity = 0;
+
     return true;
 }
 
 void VoodooI2CHIDTransducerWrapper::free() {
+    freeBindings();
     OSSafeReleaseNULL(transducers);
 
     super::free();
@@ -36,3 +217,117 @@ VoodooI2CHIDTransducerWrapper* VoodooI2CHIDTransducerWrapper::wrapper() {
 
     return wrapper;
 }
+
+bool VoodooI2CHIDTransducerWrapper::bind() {
+    UInt32 transducer_count = transducers->getCount();
+    UInt32 element_count = 0;
+    UInt32 binding_count = 0;
+
+    freeBindings();
+
+    for (UInt32 i = 0; i < transducer_count; i++) {
+        VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, transducers->getObject(i));
+
+        if (transducer && transducer->collection && transducer->collection->getChildElements())
+            element_count += transducer->collection->getChildElements()->getCount();
+    }
+
+    if (!transducer_count)
+        return true;
+
+    bindings = reinterpret_cast<VoodooI2CHIDTransducerBindings*>(IOMalloc(transducer_count * sizeof(VoodooI2CHIDTransducerBindings)));
+    if (!bindings)
+        goto exit;
+
+    bindings_capacity = transducer_count;
+    bzero(bindings, transducer_count * sizeof(VoodooI2CHIDTransducerBindings));
+
+    if (element_count) {
+        binding_table = reinterpret_cast<VoodooI2CHIDTransducerBinding*>(IOMalloc(element_count * sizeof(VoodooI2CHIDTransducerBinding)));
+        if (!binding_table)
+            goto exit;
+
+        binding_capacity = element_count;
+    }
+
+    for (UInt32 i = 0; i < transducer_count; i++) {
+        VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, transducers->getObject(i));
+
+        bindings[i].transducer = transducer;
+        bindings[i].first = &binding_table[binding_count];
+
+        if (!transducer || !transducer->collection || !transducer->collection->getChildElements())
+            continue;
+
+        OSArray* child_elements = transducer->collection->getChildElements();
+        bool is_stylus = OSDynamicCast(VoodooI2CDigitiserStylus, transducer) != NULL;
+
+        for (UInt32 j = 0; j < child_elements->getCount(); j++) {
+            IOHIDElement* element = OSDynamicCast(IOHIDElement, child_elements->getObject(j));
+            VoodooI2CHIDTransducerBinding* binding = &binding_table[binding_count];
+
+            if (!element)
+                continue;
+
+            binding->setter = bindingSetter(element, is_stylus, &binding->argument);
+            if (!binding->setter)
+                continue;
+
+            binding->element = element;
+            binding_count++;
+            bindings[i].count++;
+
+            if (binding->setter == setX)
+                transducer->logical_max_x = element->getLogicalMax();
+            else if (binding->setter == setY)
+                transducer->logical_max_y = element->getLogicalMax();
+            else if (binding->setter == setZ)
+                transducer->logical_max_z = element->getLogicalMax();
+            else if (binding->setter == setTipPressure)
+                transducer->pressure_physical_max = element->getPhysicalMax();
+            else if (binding->setter == setConfidence)
+                bindings[i].has_confidence = true;
+        }
+    }
+
+    return true;
+
+exit:
+    IOLog("%s::Unable to allocate binding tables\n", getMetaClass()->getClassName());
+    freeBindings();
+    return false;
+}
+
+void VoodooI2CHIDTransducerWrapper::update(UInt32 index, AbsoluteTime timestamp, UInt32 report_id) {
+    VoodooI2CDigitiserTransducer* transducer = bindings[index].transducer;
+    const VoodooI2CHIDTransducerBinding* binding = bindings[index].first;
+    const VoodooI2CHIDTransducerBinding* last = binding + bindings[index].count;
+
+    if (!transducer)
+        return;
+
+    transducer->id = report_id;
+
+    for (; binding < last; binding++)
+        binding->setter(transducer, binding, timestamp);
+
+    if (bindings[index].count)
+        transducer->timestamp = last[-1].element->getTimeStamp();
+
+    if (!bindings[index].has_confidence)
+        transducer->is_valid = true;
+}
+
+void VoodooI2CHIDTransducerWrapper::freeBindings() {
+    if (binding_table) {
+        IOFree(binding_table, binding_capacity * sizeof(VoodooI2CHIDTransducerBinding));
+        binding_table = NULL;
+        binding_capacity = 0;
+    }
+
+    if (bindings) {
+        IOFree(bindings, bindings_capacity * sizeof(VoodooI2CHIDTransducerBindings));
+        bindings = NULL;
+        bindings_capacity = 0;
+    }
+}
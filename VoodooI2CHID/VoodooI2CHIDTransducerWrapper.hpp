@@ -16,6 +16,34 @@
 #include <IOKit/hid/IOHIDElement.h>
 
 #include "../../../Multitouch Support/VoodooI2CDigitiserTransducer.hpp"
+#include "../../../Multitouch Support/VoodooI2CDigitiserStylus.hpp"
+
+struct VoodooI2CHIDTransducerBinding;
+
+/* Stores the current value of a bound element in its transducer
+ * @transducer The transducer the element belongs to
+ * @binding The binding of the element
+ * @timestamp The timestamp of the report
+ */
+
+typedef void (*VoodooI2CHIDTransducerSetter)(VoodooI2CDigitiserTransducer* transducer, const VoodooI2CHIDTransducerBinding* binding, AbsoluteTime timestamp);
+
+/* Pairs an input element with the setter of the transducer member it drives */
+
+typedef struct VoodooI2CHIDTransducerBinding {
+    IOHIDElement* element;
+    VoodooI2CHIDTransducerSetter setter;
+    UInt32 argument;
+} VoodooI2CHIDTransducerBinding;
+
+/* The bindings of a single transducer */
+
+typedef struct {
+    VoodooI2CDigitiserTransducer* transducer;
+    VoodooI2CHIDTransducerBinding* first;
+    UInt32 count;
+    bool has_confidence;
+} VoodooI2CHIDTransducerBindings;
 
 class EXPORT VoodooI2CHIDTransducerWrapper : public OSObject {
   OSDeclareDefaultStructors(VoodooI2CHIDTransducerWrapper);
@@ -25,10 +53,39 @@ class EXPORT VoodooI2CHIDTransducerWrapper : public OSObject {
     
     IOHIDElement* first_identifier;
 
+    /* One entry per transducer, in the same order as <transducers>, *NULL* until <bind> succeeds */
+
+    VoodooI2CHIDTransducerBindings* bindings;
+
     bool init() override;
     void free() override;
 
+    /* Builds the binding tables of the transducers
+     *
+     * Each input element is resolved to a setter once, and the logical and physical maxima the transducers report
+     * are stored at the same time as they do not change while the device is attached.
+     *
+     * @return *true* on success, *false* on allocation failure
+     */
+
+    bool bind();
+
+    /* Sets the values of a transducer from its bound elements
+     * @index The index of the transducer in <transducers>
+     * @timestamp The timestamp of the interrupt report
+     * @report_id The report ID of the interrupt report
+     */
+
+    void update(UInt32 index, AbsoluteTime timestamp, UInt32 report_id);
+
     static VoodooI2CHIDTransducerWrapper* wrapper();
+
+ private:
+    VoodooI2CHIDTransducerBinding* binding_table;
+    UInt32 binding_capacity;
+    UInt32 bindings_capacity;
+
+    void freeBindings();
 };
 
 
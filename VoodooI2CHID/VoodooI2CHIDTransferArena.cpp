@@ -0,0 +1,82 @@
+//
+//  VoodooI2CHIDTransferArena.cpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#include "VoodooI2CHIDTransferArena.hpp"
+
+bool VoodooI2CHIDTransferArena::init(UInt32 capacity) {
+    this->capacity = capacity;
+    offset = 0;
+    high_water = 0;
+    wraps = failures = 0;
+    scope_used = 0;
+
+    begin();
+
+    pool = reinterpret_cast<UInt8*>(IOMallocAligned(capacity, I2C_HID_ARENA_ALIGNMENT));
+
+    return pool != NULL;
+}
+
+void VoodooI2CHIDTransferArena::free() {
+    if (pool) {
+        IOFreeAligned(pool, capacity);
+        pool = NULL;
+    }
+}
+
+void VoodooI2CHIDTransferArena::begin() {
+    if (scope_used > high_water)
+        high_water = scope_used;
+
+    scope_start = offset;
+    scope_used = 0;
+    scope_allocations = 0;
+    scope_wrapped = false;
+}
+
+void VoodooI2CHIDTransferArena::end() {
+    begin();
+}
+
+UInt8* VoodooI2CHIDTransferArena::allocate(UInt32 size) {
+    UInt32 start = (offset + I2C_HID_ARENA_ALIGNMENT - 1) & ~(I2C_HID_ARENA_ALIGNMENT - 1);
+
+    if (!pool || size > capacity)
+        goto fail;
+
+    if (start + size > capacity) {
+        // Wrapping is only safe if it doesn't reach the buffers this transaction already handed out
+
+        if (scope_allocations && (scope_wrapped || size > scope_start))
+            goto fail;
+
+        scope_used += capacity - offset;
+        start = offset = 0;
+        wraps++;
+
+        if (scope_allocations)
+            scope_wrapped = true;
+        else
+            scope_start = 0;
+    } else if (scope_wrapped && start + size > scope_start) {
+        goto fail;
+    }
+
+    scope_used += start - offset + size;
+    scope_allocations++;
+    offset = start + size;
+
+#if DEBUG
+    memset(pool + start, I2C_HID_ARENA_POISON, size);
+#endif
+
+    return pool + start;
+
+fail:
+    failures++;
+    return NULL;
+}
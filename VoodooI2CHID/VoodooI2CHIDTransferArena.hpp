@@ -0,0 +1,79 @@
+//
+//  VoodooI2CHIDTransferArena.hpp
+//  VoodooI2CHID
+//
+//  Copyright © 2017 Alexandre Daoud. All rights reserved.
+//
+
+#ifndef VoodooI2CHIDTransferArena_hpp
+#define VoodooI2CHIDTransferArena_hpp
+
+#include <IOKit/IOLib.h>
+
+#define I2C_HID_ARENA_ALIGNMENT     16
+#define I2C_HID_ARENA_POISON        0xA5
+
+/* Buffers for <api->readI2C>, <api->writeI2C> and <api->writeReadI2C>
+ *
+ * The I2C controller may still use a buffer after a call returns, so buffers are handed out round-robin from a fixed
+ * pool and are only reused once the pool wraps around. Allocations are grouped into transactions: a transaction
+ * never wraps onto its own buffers, an allocation that would have to is refused instead.
+ *
+ * The arena does no locking of its own, callers serialise access to it.
+ */
+
+class VoodooI2CHIDTransferArena {
+ public:
+    /* Allocates the pool
+     * @capacity The size of the pool in bytes
+     *
+     * @return *true* on success, *false* otherwise
+     */
+
+    bool init(UInt32 capacity);
+
+    /* Frees the pool */
+
+    void free();
+
+    /* Starts a transaction, ending the previous one */
+
+    void begin();
+
+    /* Ends the current transaction */
+
+    void end();
+
+    /* Allocates a buffer within the current transaction
+     * @size The size of the buffer
+     *
+     * Buffers are aligned to <I2C_HID_ARENA_ALIGNMENT> bytes. In debug builds they are filled with <I2C_HID_ARENA_POISON>.
+     *
+     * @return A pointer to the buffer, *NULL* if it does not fit alongside the other buffers of the transaction
+     */
+
+    UInt8* allocate(UInt32 size);
+
+    /* The largest number of bytes used by a single transaction */
+
+    UInt32 high_water;
+
+    /* The number of times the pool wrapped around */
+
+    UInt64 wraps;
+
+    /* The number of refused allocations */
+
+    UInt64 failures;
+
+ private:
+    UInt8* pool;
+    UInt32 capacity;
+    UInt32 offset;
+    UInt32 scope_start;
+    UInt32 scope_used;
+    UInt32 scope_allocations;
+    bool scope_wrapped;
+};
+
+#endif /* VoodooI2CHIDTransferArena_hpp */
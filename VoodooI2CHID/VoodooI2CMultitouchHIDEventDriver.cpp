@@ -21,8 +21,6 @@
 #define super IOHIDEventService
 OSDefineMetaClassAndStructors(VoodooI2CMultitouchHIDEventDriver, IOHIDEventService);
 
-AbsoluteTime last_multi_touch_event = 0;
-
 static int pow(int x, int y) {
     int ret = 1;
     while (y > 0) {
@@ -62,6 +60,8 @@ bool VoodooI2CMultitouchHIDEventDriver::didTerminate(IOService* provider, IOOpti
 }
 
 void VoodooI2CMultitouchHIDEventDriver::forwardReport(VoodooI2CMultitouchEvent event, AbsoluteTime timestamp) {
+    contacts.sync();
+
     if (multitouch_interface)
         multitouch_interface->handleInterruptReport(event, timestamp);
 }
@@ -99,8 +99,8 @@ void VoodooI2CMultitouchHIDEventDriver::handleInterruptReport(AbsoluteTime times
     uint64_t now_ns;
     absolutetime_to_nanoseconds(now_abs, &now_ns);
     
-    if (report_type == kIOHIDReportTypeInput && readyForReports())
-        clock_get_uptime(&last_multi_touch_event);
+    if (report_type == kIOHIDReportTypeInput && readyForReports() && i2c_hid_device)
+        i2c_hid_device->reportInputActivity();
     
     // Ignore touchpad interaction(s) shortly after typing
     if (now_ns - key_time < max_after_typing)
@@ -109,6 +109,9 @@ void VoodooI2CMultitouchHIDEventDriver::handleInterruptReport(AbsoluteTime times
     if (!readyForReports() || report_type != kIOHIDReportTypeInput)
         return;
 
+    AbsoluteTime report_timestamp = timestamp;
+    timestamp = getScanTimestamp(timestamp, report_id);
+
     if (digitiser.contact_count && digitiser.contact_count->getValue()) {
         digitiser.current_contact_count = digitiser.contact_count->getValue();
         
@@ -118,14 +121,36 @@ void VoodooI2CMultitouchHIDEventDriver::handleInterruptReport(AbsoluteTime times
         digitiser.current_report = 1;
     }
 
-    handleDigitizerReport(timestamp, report_id);
+    handleDigitizerReport(timestamp, report_id, report, report_timestamp);
 
     if (digitiser.current_report == digitiser.report_count) {
-        VoodooI2CMultitouchEvent event;
-        event.contact_count = digitiser.current_contact_count;
-        event.transducers = digitiser.transducers;
+        if (frame_filter.shouldForward(contacts.dirty != 0, digitiser.current_contact_count, contacts.anyDown(), now_abs)) {
+            VoodooI2CMultitouchEvent event;
+            event.contact_count = digitiser.current_contact_count;
+            event.transducers = digitiser.transducers;
+
+            uint64_t forward_abs;
+            clock_get_uptime(&forward_abs);
+
+            forwardReport(event, timestamp);
+
+            uint64_t dispatched_abs;
+            clock_get_uptime(&dispatched_abs);
+
+            latency_parse.record(elapsedNanoseconds(now_abs, forward_abs));
+            latency_forward.record(elapsedNanoseconds(forward_abs, dispatched_abs));
+            latency_report_to_dispatch.record(elapsedNanoseconds(report_timestamp, dispatched_abs));
+
+            frame_filter.recordForwarded(digitiser.current_contact_count, dispatched_abs);
 
-        forwardReport(event, timestamp);
+            publishLatency(dispatched_abs);
+        } else {
+            frame_filter.recordSuppressed();
+
+            publishLatency(now_abs);
+        }
+
+        contacts.dirty = 0;
         
         digitiser.report_count = 1;
         digitiser.current_report = 1;
@@ -134,7 +159,89 @@ void VoodooI2CMultitouchHIDEventDriver::handleInterruptReport(AbsoluteTime times
     }
 }
 
-void VoodooI2CMultitouchHIDEventDriver::handleDigitizerReport(AbsoluteTime timestamp, UInt32 report_id) {
+AbsoluteTime VoodooI2CMultitouchHIDEventDriver::getScanTimestamp(AbsoluteTime timestamp, UInt32 report_id) {
+    // The element keeps the value of the last report that carried it, any other report would reuse a stale one
+
+    if (!digitiser.scan_time || digitiser.scan_time->getReportID() != report_id)
+        return timestamp;
+
+    return scan_clock.sample(digitiser.scan_time->getValue(), timestamp);
+}
+
+void VoodooI2CMultitouchHIDEventDriver::publishLatency(AbsoluteTime now) {
+    if (elapsedNanoseconds(latency_last_publish, now) < 1000000000)
+        return;
+
+    latency_last_publish = now;
+
+    publishStatistics();
+
+    OSDictionary* latency = OSDictionary::withCapacity(4);
+    if (!latency)
+        return;
+
+    const char* stages[] = {"Parse", "Forward", "ReportToDispatch", "ScanTimeOffset"};
+    VoodooI2CHIDLatencyHistogram* histograms[] = {&latency_parse, &latency_forward, &latency_report_to_dispatch, &scan_clock.offset};
+
+    for (int i = 0; i < 4; i++) {
+        OSDictionary* histogram = histograms[i]->copyDictionary();
+        if (histogram) {
+            latency->setObject(stages[i], histogram);
+            histogram->release();
+        }
+    }
+
+    setProperty("InputLatency", latency);
+    latency->release();
+
+    OSDictionary* layout = OSDictionary::withCapacity(4);
+    if (!layout)
+        return;
+
+    OSNumber* number;
+
+    if ((number = OSNumber::withNumber(report_layout.field_count, 32))) {
+        layout->setObject("Fields", number);
+        number->release();
+    }
+
+    if ((number = OSNumber::withNumber(compiled_reports, 64))) {
+        layout->setObject("CompiledReports", number);
+        number->release();
+    }
+
+    if ((number = OSNumber::withNumber(strided_reports, 64))) {
+        layout->setObject("StridedReports", number);
+        number->release();
+    }
+
+    if ((number = OSNumber::withNumber(walked_reports, 64))) {
+        layout->setObject("WalkedReports", number);
+        number->release();
+    }
+
+    setProperty("ReportLayout", layout);
+    layout->release();
+
+    OSDictionary* frames = OSDictionary::withCapacity(2);
+    if (!frames)
+        return;
+
+    if ((number = OSNumber::withNumber(frame_filter.forwarded_frames, 64))) {
+        frames->setObject("ForwardedFrames", number);
+        number->release();
+    }
+
+    if ((number = OSNumber::withNumber(frame_filter.suppressed_frames, 64))) {
+        frames->setObject("SuppressedFrames", number);
+        number->release();
+    }
+
+    setProperty("FrameFilter", frames);
+    frames->release();
+}
+
+void VoodooI2CMultitouchHIDEventDriver::handleDigitizerReport(AbsoluteTime timestamp, UInt32 report_id, IOMemoryDescriptor* report, AbsoluteTime report_timestamp) {
     if (!digitiser.transducers)
         return;
     
@@ -146,6 +253,7 @@ void VoodooI2CMultitouchHIDEventDriver::handleDigitizerReport(AbsoluteTime times
         return;
 
     UInt8 finger_count = digitiser.fingers->getCount();
+    UInt32 wrapper_index = digitiser.current_report - 1;
     
     if (finger_count) {
         // Check if we are sending the report to the right wrapper, 99% of the time, `digitiser.current_report - 1` will
@@ -163,19 +271,37 @@ void VoodooI2CMultitouchHIDEventDriver::handleDigitizerReport(AbsoluteTime times
             if (!wrapper) {
                 // Fall back to the original wrapper
                 wrapper = OSDynamicCast(VoodooI2CHIDTransducerWrapper, digitiser.wrappers->getObject(digitiser.current_report - 1));
+            } else {
+                wrapper_index = actual_index;
             }
         }
     }
 
-    for (int i = 0; i < wrapper->transducers->getCount(); i++) {
-        VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, wrapper->transducers->getObject(i));
-        handleDigitizerTransducerReport(transducer, timestamp, report_id);
+    if (finger_count && handleCompiledDigitizerReport(wrapper_index * finger_count, finger_count, report, timestamp, report_timestamp, report_id)) {
+        compiled_reports++;
+    } else {
+        walked_reports++;
+
+        for (int i = 0; i < wrapper->transducers->getCount(); i++)
+            wrapper->update(i, timestamp, report_id);
+
+        // Keep the contact store in step with the transducers that were just updated
+
+        for (UInt32 slot = wrapper_index * finger_count; finger_count && slot < (wrapper_index + 1) * finger_count && slot < contacts.capacity; slot++)
+            contacts.load(slot);
     }
     
     // Now handle button report
     if (digitiser.button) {
         VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, digitiser.transducers->getObject(0));
-        setButtonState(&transducer->physical_button, 0, digitiser.button->getValue(), timestamp);
+        UInt32 button_value = digitiser.button->getValue();
+
+        setButtonState(&transducer->physical_button, 0, button_value, timestamp);
+
+        if (button_value != last_button_value) {
+            last_button_value = button_value;
+            frame_filter.dirty = true;
+        }
     }
 
     if (digitiser.styluses->getCount() > 0) {
@@ -187,184 +313,38 @@ void VoodooI2CMultitouchHIDEventDriver::handleDigitizerReport(AbsoluteTime times
         IOHIDElement* element = OSDynamicCast(IOHIDElement, stylus->collection->getChildElements()->getObject(0));
         
         if (element && report_id == element->getReportID()) {
-            handleDigitizerTransducerReport(stylus, timestamp, report_id);
+            wrapper->update(0, timestamp, report_id);
+            frame_filter.dirty = true;
         }
     }
 }
 
-void VoodooI2CMultitouchHIDEventDriver::handleDigitizerTransducerReport(VoodooI2CDigitiserTransducer* transducer, AbsoluteTime timestamp, UInt32 report_id) {
-    bool handled = false;
-    bool has_confidence = false;
-    UInt32 element_index = 0;
-    UInt32 element_count = 0;
-    
-    if (!transducer->collection)
-        return;
-    
-    OSArray* child_elements = transducer->collection->getChildElements();
-    
-    if (!child_elements)
-        return;
-    
-    for (element_index=0, element_count=child_elements->getCount(); element_index < element_count; element_index++) {
-        IOHIDElement* element;
-        AbsoluteTime element_timestamp;
-        bool element_is_current;
-        UInt32 usage_page;
-        UInt32 usage;
-        UInt32 value;
-        
-        VoodooI2CDigitiserStylus* stylus = (VoodooI2CDigitiserStylus*)transducer;
-        
-        element = OSDynamicCast(IOHIDElement, child_elements->getObject(element_index));
-        if (!element)
-            continue;
-        
-        element_timestamp = element->getTimeStamp();
-        element_is_current = (element->getReportID() == report_id) && (CMP_ABSOLUTETIME(&timestamp, &element_timestamp) == 0);
-        
-        transducer->id = report_id;
-        transducer->timestamp = element_timestamp;
-        
-        usage_page = element->getUsagePage();
-        usage = element->getUsage();
-        value = element->getValue();
-        
-        switch (usage_page) {
-            case kHIDPage_GenericDesktop:
-                switch (usage) {
-                    case kHIDUsage_GD_X:
-                    {
-                        transducer->coordinates.x.update(element->getValue(), timestamp);
-                        transducer->logical_max_x = element->getLogicalMax();
-                        handled    |= element_is_current;
-                        break;
-                    }
-                    case kHIDUsage_GD_Y:
-                    {
-                        transducer->coordinates.y.update(element->getValue(), timestamp);
-                        transducer->logical_max_y = element->getLogicalMax();
-                        handled    |= element_is_current;
-                        break;
-                    }
-                    case kHIDUsage_GD_Z:
-                    {
-                        transducer->coordinates.z.update(element->getValue(), timestamp);
-                        transducer->logical_max_z = element->getLogicalMax();
-                        handled    |= element_is_current;
-                        break;
-                    }
-                }
-                break;
-            case kHIDPage_Button:
-                setButtonState(&transducer->physical_button, (usage - 1), value, timestamp);
-                handled    |= element_is_current;
-                break;
-            case kHIDPage_Digitizer:
-                switch (usage) {
-                    case kHIDUsage_Dig_TransducerIndex:
-                    case kHIDUsage_Dig_ContactIdentifier:
-                        transducer->secondary_id = value;
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_Touch:
-                    case kHIDUsage_Dig_TipSwitch:
-                        setButtonState(&transducer->tip_switch, 0, value, timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_InRange:
-                        transducer->in_range = value != 0;
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_TipPressure:
-                    case kHIDUsage_Dig_SecondaryTipSwitch:
-                    {
-                        transducer->tip_pressure.update(element->getValue(), timestamp);
-                        transducer->pressure_physical_max = element->getPhysicalMax();
-                        handled    |= element_is_current;
-                        break;
-                    }
-                    case kHIDUsage_Dig_XTilt:
-                        transducer->tilt_orientation.x_tilt.update(element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_YTilt:
-                        transducer->tilt_orientation.y_tilt.update(element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_Azimuth:
-                        transducer->azi_alti_orientation.azimuth.update(element->getValue(), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_Altitude:
-                        transducer->azi_alti_orientation.altitude.update(element->getValue(), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_Twist:
-                        transducer->azi_alti_orientation.twist.update(element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_Width:
-                        transducer->dimensions.width.update(element->getValue(), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_Height:
-                        transducer->dimensions.height.update(element->getValue(), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_DataValid:
-                    case kHIDUsage_Dig_TouchValid:
-                    case kHIDUsage_Dig_Quality:
-                        if (value)
-                            transducer->is_valid = true;
-                        else
-                            transducer->is_valid = false;
-                        has_confidence = true;
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_BarrelPressure:
-                        if (stylus) {
-                            stylus->barrel_pressure.update(element->getScaledFixedValue(kIOHIDValueScaleTypeCalibrated), timestamp);
-                            handled    |= element_is_current;
-                        }
-                        break;
-                    case kHIDUsage_Dig_BarrelSwitch:
-                        if (stylus) {
-                            setButtonState(&stylus->barrel_switch, 1, value, timestamp);
-                            handled    |= element_is_current;
-                        }
-                        break;
-                    case kHIDUsage_Dig_BatteryStrength:
-                        if (stylus) {
-                            stylus->battery_strength = element->getValue();
-                            handled |= element_is_current;
-                        }
-                        break;
-                    case kHIDUsage_Dig_Eraser:
-                        if (stylus) {
-                            setButtonState(&stylus->eraser, 2, value, timestamp);
-                            stylus->invert = value != 0;
-                            handled    |= element_is_current;
-                        }
-                        break;
-                    case kHIDUsage_Dig_Invert:
-                        if (stylus) {
-                            stylus->invert = value != 0;
-                            handled    |= element_is_current;
-                        }
-                        break;
-                    default:
-                        break;
-                }
-                break;
-        }
+bool VoodooI2CMultitouchHIDEventDriver::handleCompiledDigitizerReport(UInt32 first_slot, UInt32 transducer_count, IOMemoryDescriptor* report, AbsoluteTime timestamp, AbsoluteTime report_timestamp, UInt32 report_id) {
+    UInt8 copy[I2C_HID_LAYOUT_MAX_REPORT_LENGTH];
+    const UInt8* bytes;
+
+    if (!report || !report_layout.field_count || first_slot + transducer_count > contacts.capacity || transducer_count > I2C_HID_LAYOUT_MAX_TRANSDUCERS)
+        return false;
+
+    const VoodooI2CHIDReportLayoutReport* layout = report_layout.layoutForReport(report_id, (UInt32)report->getLength());
+    if (!layout)
+        return false;
+
+    const VoodooI2CHIDReportLayoutField* fields = report_layout.fieldsOf(layout);
+
+    IOBufferMemoryDescriptor* buffer = OSDynamicCast(IOBufferMemoryDescriptor, report);
+
+    if (buffer) {
+        bytes = reinterpret_cast<const UInt8*>(buffer->getBytesNoCopy());
+    } else {
+        report->readBytes(0, copy, report_layout.reportLength(report_id));
+        bytes = copy;
     }
 
-    if (!has_confidence)
-        transducer->is_valid = true;
-    
-    if (!handled)
-        return;
+    if (contacts.decode(first_slot, transducer_count, layout, fields, bytes, timestamp, report_timestamp, report_id))
+        strided_reports++;
+
+    return true;
 }
 
 bool VoodooI2CMultitouchHIDEventDriver::handleStart(IOService* provider) {
@@ -391,6 +371,8 @@ bool VoodooI2CMultitouchHIDEventDriver::handleStart(IOService* provider) {
     
     if (!hid_device)
         return false;
+
+    i2c_hid_device = OSDynamicCast(VoodooI2CHIDDevice, hid_device);
     
     name = getProductName();
 
@@ -437,6 +419,9 @@ bool VoodooI2CMultitouchHIDEventDriver::handleStart(IOService* provider) {
 }
 
 void VoodooI2CMultitouchHIDEventDriver::handleStop(IOService* provider) {
+    report_layout.free();
+    contacts.free();
+
     OSSafeReleaseNULL(digitiser.transducers);
     OSSafeReleaseNULL(digitiser.wrappers);
     OSSafeReleaseNULL(digitiser.styluses);
@@ -574,6 +559,11 @@ IOReturn VoodooI2CMultitouchHIDEventDriver::parseDigitizerElement(IOHIDElement*
             continue;
         }
         
+        if (element->conformsTo(kHIDPage_Digitizer, kHIDUsage_Dig_ScanTime)) {
+            digitiser.scan_time = element;
+            continue;
+        }
+
         if (element->conformsTo(kHIDPage_Button, kHIDUsage_Button_1)) {
             digitiser.button = element;
         }
@@ -682,9 +672,47 @@ IOReturn VoodooI2CMultitouchHIDEventDriver::parseElements() {
         stylus_wrapper->release();
     }
 
+    for (int i = 0; i < digitiser.wrappers->getCount(); i++) {
+        VoodooI2CHIDTransducerWrapper* wrapper = OSDynamicCast(VoodooI2CHIDTransducerWrapper, digitiser.wrappers->getObject(i));
+
+        if (!wrapper || !wrapper->bind()) {
+            IOLog("%s::%s Failed to bind transducer elements\n", getName(), name);
+            return kIOReturnNoResources;
+        }
+    }
+
+    if (!contacts.allocate(digitiser.wrappers)) {
+        IOLog("%s::%s Failed to allocate contact store\n", getName(), name);
+        return kIOReturnNoResources;
+    }
+
+    compileReportLayout();
+
     return kIOReturnSuccess;
 }
 
+void VoodooI2CMultitouchHIDEventDriver::compileReportLayout() {
+    OSData* descriptor;
+    bool compiled = false;
+
+    report_layout.free();
+
+    if (!hid_device || !digitiser.fingers || !digitiser.fingers->getCount())
+        goto exit;
+
+    // Use the descriptor IOHIDDevice already published rather than asking the transport for it again
+
+    descriptor = OSDynamicCast(OSData, hid_device->getProperty(kIOHIDReportDescriptorKey));
+
+    if (!descriptor || !descriptor->getLength())
+        goto exit;
+
+    compiled = report_layout.compile(reinterpret_cast<const UInt8*>(descriptor->getBytesNoCopy()), descriptor->getLength(), digitiser.fingers);
+
+exit:
+    setProperty("CompiledReportLayout", compiled);
+}
+
 IOReturn VoodooI2CMultitouchHIDEventDriver::publishMultitouchInterface() {
     multitouch_interface = OSTypeAlloc(VoodooI2CMultitouchInterface);
 
@@ -30,6 +30,11 @@
 
 
 #include "VoodooI2CHIDDevice.hpp"
+#include "VoodooI2CHIDContactStore.hpp"
+#include "VoodooI2CHIDFrameFilter.hpp"
+#include "VoodooI2CHIDLatencyHistogram.hpp"
+#include "VoodooI2CHIDReportLayout.hpp"
+#include "VoodooI2CHIDScanClock.hpp"
 #include "VoodooI2CHIDTransducerWrapper.hpp"
 
 #include "../../../Multitouch Support/VoodooI2CDigitiserStylus.hpp"
@@ -39,6 +44,7 @@
 #include "../../../Dependencies/helpers.hpp"
 
 #define kHIDUsage_Dig_Confidence kHIDUsage_Dig_TouchValid
+#define kHIDUsage_Dig_ScanTime 0x56
 
 // Message types defined by ApplePS2Keyboard
 enum {
@@ -69,6 +75,7 @@ class EXPORT VoodooI2CMultitouchHIDEventDriver : public IOHIDEventService {
         IOHIDElement*      contact_count;
         IOHIDElement*      input_mode;
         IOHIDElement*      button;
+        IOHIDElement*      scan_time;
         
         // collection level elements
         
@@ -110,17 +117,11 @@ class EXPORT VoodooI2CMultitouchHIDEventDriver : public IOHIDEventService {
     /* Called during the interrupt routine to interate over transducers
      * @timestamp The timestamp of the interrupt report
      * @report_id The report ID of the interrupt report
+     * @report The raw report, the finger transducers are decoded with the compiled report layout if it is given
+     * @report_timestamp The timestamp of the report as captured by the transport
      */
 
-    void handleDigitizerReport(AbsoluteTime timestamp, UInt32 report_id);
-
-    /* Called during the interrupt routine to set transducer values
-     * @transducer The transducer to be updated
-     * @timestamp The timestamp of the interrupt report
-     * @report_id The report ID of the interrupt report
-     */
-
-    void handleDigitizerTransducerReport(VoodooI2CDigitiserTransducer* transducer, AbsoluteTime timestamp, UInt32 report_id);
+    void handleDigitizerReport(AbsoluteTime timestamp, UInt32 report_id, IOMemoryDescriptor* report = NULL, AbsoluteTime report_timestamp = 0);
 
     /* Called during the interrupt routine to handle an interrupt report
      * @timestamp The timestamp of the interrupt report
@@ -248,9 +249,18 @@ class EXPORT VoodooI2CMultitouchHIDEventDriver : public IOHIDEventService {
     bool awake = true;
     IOHIDInterface* hid_interface;
     IOHIDDevice* hid_device;
+    VoodooI2CHIDDevice* i2c_hid_device = NULL;
     VoodooI2CMultitouchInterface* multitouch_interface;
     bool should_have_interface = true;
 
+    /* The finger contacts of the current frame, the transducers only reflect them once <contacts.sync> is called */
+
+    VoodooI2CHIDContactStore contacts;
+
+    /* Change detection of the frames handed to <forwardReport> */
+
+    VoodooI2CHIDFrameFilter frame_filter;
+
     virtual void forwardReport(VoodooI2CMultitouchEvent event, AbsoluteTime timestamp);
 
  private:
@@ -273,6 +283,69 @@ class EXPORT VoodooI2CMultitouchHIDEventDriver : public IOHIDEventService {
     IONotifier* bluetooth_hid_publish_notify; // Notification when a bluetooth HID device is connected
     IONotifier* bluetooth_hid_terminate_notify; // Notification when a bluetooth HID device is disconnected
 
+    /* Latency of the frames forwarded to the multitouch interface, from the start of <handleInterruptReport> to
+     * <forwardReport>, of <forwardReport> itself and from the report's timestamp to the end of <forwardReport>
+     */
+
+    VoodooI2CHIDLatencyHistogram latency_parse;
+    VoodooI2CHIDLatencyHistogram latency_forward;
+    VoodooI2CHIDLatencyHistogram latency_report_to_dispatch;
+    AbsoluteTime latency_last_publish = 0;
+
+    /* Publishes the latency histograms to the IORegistry, at most once a second */
+
+    void publishLatency(AbsoluteTime now);
+
+    /* Publishes the statistics of an inherited class, called by <publishLatency> at most once a second
+     *
+     * This function exists to be overriden by inherited classes should they need it.
+     */
+
+    virtual void publishStatistics() {}
+
+    /* Derived sample times */
+
+    VoodooI2CHIDScanClock scan_clock;
+
+    /* Derives the time at which the device sampled the current frame from its Scan Time usage
+     * @timestamp The timestamp of the interrupt report, as captured by the transport
+     * @report_id The ID of the interrupt report
+     *
+     * See <VoodooI2CHIDScanClock>.
+     *
+     * @return The derived timestamp, <timestamp> if the device has no Scan Time usage or the report does not carry it
+     */
+
+    AbsoluteTime getScanTimestamp(AbsoluteTime timestamp, UInt32 report_id);
+
+    /* Compiled layout of the finger collections and how many reports were decoded with it, how many of those were
+     * strided, and how many were decoded by walking elements
+     */
+
+    VoodooI2CHIDReportLayout report_layout;
+    UInt64 compiled_reports = 0;
+    UInt64 strided_reports = 0;
+    UInt64 walked_reports = 0;
+
+    /* Compiles <report_layout> from the device's report descriptor, called once the fingers have been parsed */
+
+    void compileReportLayout();
+
+    /* Decodes the finger contacts of a report straight from the report bytes into <contacts>
+     * @first_slot The contact slot of the report's first finger
+     * @transducer_count The number of fingers in the report
+     * @report The raw report
+     * @timestamp The timestamp of the interrupt report
+     * @report_timestamp The timestamp of the report as captured by the transport
+     * @report_id The report ID of the interrupt report
+     *
+     * @return *true* if the contacts were decoded, *false* if the transducers have to be decoded by walking their elements
+     */
+
+    bool handleCompiledDigitizerReport(UInt32 first_slot, UInt32 transducer_count, IOMemoryDescriptor* report, AbsoluteTime timestamp, AbsoluteTime report_timestamp, UInt32 report_id);
+
+    UInt32 last_button_value = 0;
+
     /*
      * Register for notifications of attached HID pointer devices (both USB and bluetooth)
      */
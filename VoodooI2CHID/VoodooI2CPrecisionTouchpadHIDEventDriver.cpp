@@ -57,7 +57,13 @@ IOReturn VoodooI2CPrecisionTouchpadHIDEventDriver::setPowerState(unsigned long w
             awake = false;
     } else {
         if (!awake) {
-            IOSleep(10);
+            // The device resets on wake, which drops it out of Precision Touchpad Mode
+
+            if (i2c_hid_device)
+                i2c_hid_device->waitForDeviceReady(I2C_HID_RESUME_READY_TIMEOUT_MS);
+            else
+                IOSleep(10);
+
             enterPrecisionTouchpadMode();
 
             awake = true;
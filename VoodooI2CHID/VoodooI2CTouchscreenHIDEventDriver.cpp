@@ -19,43 +19,43 @@ bool VoodooI2CTouchscreenHIDEventDriver::checkFingerTouch(AbsoluteTime timestamp
     
     // If there is a finger touch event, decide if it is single or multitouch.
     
-    for (int index = 0; index < digitiser.contact_count->getValue() + 1; index++) {
-        VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, event.transducers->getObject(index));
-        
-        if (!transducer)
-            return false;
-        
-        if (transducer->type == kDigitiserTransducerFinger && digitiser.contact_count->getValue() >= 2) {
-            // Our finger event is multitouch reset clicktick and wait to be dispatched to the multitouch engines.
-            
-            click_tick = 0;
-        }
+    UInt32 contact_count = digitiser.contact_count->getValue();
+    
+    if (contact_count >= 2) {
+        // Our finger event is multitouch reset clicktick and wait to be dispatched to the multitouch engines.
         
-        if (transducer->type == kDigitiserTransducerFinger && transducer->tip_switch.value()) {
-            if (transducer->logical_max_x == 0 || transducer->logical_max_y == 0) {
-                IOLog("%s:%s: Divided by zero in checkFingerTouch(). value / (%X or %X)\n", getName(), name, transducer->logical_max_x, transducer->logical_max_y);
+        click_tick = 0;
+    }
+    
+    // The finger contacts are read from the contact store, the transducers are only synced for the multitouch engines
+    
+    for (UInt32 slot = 0; slot < contact_count && slot < contacts.capacity; slot++) {
+        if (contacts.tip[slot]) {
+            if (contacts.logical_max_x[slot] == 0 || contacts.logical_max_y[slot] == 0) {
+                invalid_finger_frames++;
+                IOLogLimited("%s:%s: Divided by zero in checkFingerTouch(). value / (%X or %X)\n", getName(), name, contacts.logical_max_x[slot], contacts.logical_max_y[slot]);
                 continue;
             }
             
             got_transducer = true;
             // Convert logical coordinates to IOFixed and Scaled;
             
-            IOFixed x = ((UInt32)transducer->coordinates.x.value() * 0xFFFF) / transducer->logical_max_x;
-            IOFixed y = ((UInt32)transducer->coordinates.y.value() * 0xFFFF) / transducer->logical_max_y;
+            IOFixed x = (contacts.x[slot] * 0xFFFF) / contacts.logical_max_x[slot];
+            IOFixed y = (contacts.y[slot] * 0xFFFF) / contacts.logical_max_y[slot];
             
             checkRotation(&x, &y);
             
             // Track last ID and coordinates so that we can send the finger lift event after our watch dog timeout.
             last_x = x;
             last_y = y;
-            last_id = transducer->secondary_id;
+            last_id = contacts.secondary_id[slot];
             
             // Begin long press right click routine.  Increasing compare_input_counter check will lengthen the time until execution.
             
             UInt16 temp_x = x;
             UInt16 temp_y = y;
             
-            if (!right_click && digitiser.contact_count->getValue() == 1 && transducer->type == kDigitiserTransducerFinger && transducer->tip_switch) {
+            if (!right_click && contact_count == 1) {
                 if (temp_x == compare_input_x && temp_y == compare_input_y) {
                     compare_input_counter = compare_input_counter + 1;
                     compare_input_x = temp_x;
@@ -85,12 +85,12 @@ bool VoodooI2CTouchscreenHIDEventDriver::checkFingerTouch(AbsoluteTime timestamp
                 buttons = 0x0;
                 click_tick++;
             } else {
-                buttons = transducer->tip_switch.value();
+                buttons = contacts.tip[slot];
             }
             if (right_click)
                 buttons = 0x2;
             
-            dispatchDigitizerEventWithTiltOrientation(timestamp, transducer->secondary_id, transducer->type, 0x1, buttons, x, y);
+            dispatchDigitizerEventWithTiltOrientation(timestamp, contacts.secondary_id[slot], kDigitiserTransducerFinger, 0x1, buttons, x, y);
             
             //  This timer serves to let us know when a finger based event is finished executing as well as let us
             // know to reset the clicktick counter.
@@ -128,7 +128,8 @@ bool VoodooI2CTouchscreenHIDEventDriver::checkStylus(AbsoluteTime timestamp, Voo
             VoodooI2CDigitiserStylus* stylus = (VoodooI2CDigitiserStylus*)transducer;
             
             if (stylus->logical_max_x == 0 || stylus->logical_max_y == 0 || stylus->logical_max_z == 0 || stylus->pressure_physical_max == 0) {
-                IOLog("%s:%s: Divided by zero in checkStylus(). value / (%X, %X, %X, or %X)\n", getName(), name, stylus->logical_max_x, stylus->logical_max_y, stylus->logical_max_z, stylus->pressure_physical_max);
+                invalid_stylus_frames++;
+                IOLogLimited("%s:%s: Divided by zero in checkStylus(). value / (%X, %X, %X, or %X)\n", getName(), name, stylus->logical_max_x, stylus->logical_max_y, stylus->logical_max_z, stylus->pressure_physical_max);
                 continue;
             }
             IOFixed x = ((UInt32)stylus->coordinates.x.value() * 0xFFFF) / stylus->logical_max_x;
@@ -242,12 +243,15 @@ void VoodooI2CTouchscreenHIDEventDriver::forwardReport(VoodooI2CMultitouchEvent
                 timer_source->setTimeoutMS(14);
             }
 
+            contacts.sync();
             multitouch_interface->handleInterruptReport(event, timestamp);
         } else {
             // Process single touch data
             if (!checkStylus(timestamp, event)) {
-                if (!checkFingerTouch(timestamp, event))
+                if (!checkFingerTouch(timestamp, event)) {
+                    contacts.sync();
                     multitouch_interface->handleInterruptReport(event, timestamp);
+                }
             }
         }
     }
@@ -275,9 +279,18 @@ bool VoodooI2CTouchscreenHIDEventDriver::handleStart(IOService* provider) {
     
     active_framebuffer = getFramebuffer();
     
+    // The long press right click counts identical frames, so every frame is needed while a finger is down
+    
+    frame_filter.keepalive_ms = 0;
+    
     return true;
 }
 
+void VoodooI2CTouchscreenHIDEventDriver::publishStatistics() {
+    setProperty("InvalidFingerFrames", invalid_finger_frames, 64);
+    setProperty("InvalidStylusFrames", invalid_stylus_frames, 64);
+}
+
 void VoodooI2CTouchscreenHIDEventDriver::handleStop(IOService* provider) {
     if (timer_source) {
         timer_source->cancelTimeout();
@@ -295,38 +308,27 @@ void VoodooI2CTouchscreenHIDEventDriver::handleStop(IOService* provider) {
 
 void VoodooI2CTouchscreenHIDEventDriver::scrollPosition(AbsoluteTime timestamp, VoodooI2CMultitouchEvent event) {
     if (start_scroll) {
-        int index = 0;
-        VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, event.transducers->getObject(index));
-        if (transducer->type == kDigitiserTransducerStylus) {
-            index = 1;
-            transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, event.transducers->getObject(index));
-        }
-        
-        if (!transducer || transducer->logical_max_x == 0 || transducer->logical_max_y == 0)
+        if (contacts.capacity < 2)
             return;
-
-        IOFixed x = ((UInt32)transducer->coordinates.x.value() * 0xFFFF) / transducer->logical_max_x;
-        IOFixed y = ((UInt32)transducer->coordinates.y.value() * 0xFFFF) / transducer->logical_max_y;
-        
-        index++;
-        transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, event.transducers->getObject(index));
         
-        if (!transducer || transducer->logical_max_x == 0 || transducer->logical_max_y == 0)
+        if (contacts.logical_max_x[0] == 0 || contacts.logical_max_y[0] == 0 || contacts.logical_max_x[1] == 0 || contacts.logical_max_y[1] == 0)
             return;
 
-        IOFixed x2 = ((UInt32)transducer->coordinates.x.value() * 0xFFFF) / transducer->logical_max_x;
-        IOFixed y2 = ((UInt32)transducer->coordinates.y.value() * 0xFFFF) / transducer->logical_max_y;
+        IOFixed x = (contacts.x[0] * 0xFFFF) / contacts.logical_max_x[0];
+        IOFixed y = (contacts.y[0] * 0xFFFF) / contacts.logical_max_y[0];
+        IOFixed x2 = (contacts.x[1] * 0xFFFF) / contacts.logical_max_x[1];
+        IOFixed y2 = (contacts.y[1] * 0xFFFF) / contacts.logical_max_y[1];
         
         IOFixed cursor_x = (x+x2)/2;
         IOFixed cursor_y = (y+y2)/2;
         
         checkRotation(&cursor_x, &cursor_y);
         
-        dispatchDigitizerEventWithTiltOrientation(timestamp, transducer->secondary_id, transducer->type, 0x1, 0x0, cursor_x, cursor_y);
+        dispatchDigitizerEventWithTiltOrientation(timestamp, contacts.secondary_id[1], kDigitiserTransducerFinger, 0x1, 0x0, cursor_x, cursor_y);
         
         last_x = cursor_x;
         last_y = cursor_y;
-        last_id = transducer->secondary_id;
+        last_id = contacts.secondary_id[1];
         
         start_scroll = false;
     }
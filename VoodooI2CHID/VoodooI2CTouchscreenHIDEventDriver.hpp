@@ -57,6 +57,13 @@ class EXPORT VoodooI2CTouchscreenHIDEventDriver : public VoodooI2CMultitouchHIDE
 
     bool checkStylus(AbsoluteTime timestamp, VoodooI2CMultitouchEvent event);
 
+    /* Publishes the number of frames dropped for invalid logical maxima
+     *
+     * @inherit
+     */
+
+    void publishStatistics() override;
+
  private:
     IOWorkLoop *work_loop;
     IOTimerEventSource *timer_source;
@@ -84,6 +91,10 @@ class EXPORT VoodooI2CTouchscreenHIDEventDriver : public VoodooI2CMultitouchHIDE
     UInt16 compare_input_x = 0;
     UInt16 compare_input_y = 0;
     int compare_input_counter = 0;
+
+    // Frames dropped because a transducer reported a logical maximum of zero
+    UInt64 invalid_finger_frames = 0;
+    UInt64 invalid_stylus_frames = 0;
     
     /* The transducer is checked for singletouch finger based operation and the pointer event dispatched. This function
      * also handles a long-press, right-click function.